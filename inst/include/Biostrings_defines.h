@@ -21,6 +21,8 @@
 #include <Rdefines.h>
 #include <R_ext/Rdynload.h>
 #include <limits.h> /* for CHAR_BIT */
+#include <stdio.h> /* for FILE */
+#include <stdint.h> /* for int64_t and uint64_t */
 
 
 /*
@@ -86,6 +88,30 @@ typedef struct mindex_holder {
 	SEXP dups0_low2high;
 } MIndex_holder;
 
+/*
+ * A PackedXStringSet_holder struct holds the sections of the binary image of
+ * a PackedDNAStringSet object (see PackedDNAStringSet_class.c). The image is
+ * either a raw vector or a file mapped in memory. The letters of sequence i
+ * are stored in words[word_start[i]] to words[word_start[i+1] - 1], with 2
+ * bits per letter (32 letters per word) or 4 bits per letter (16 letters per
+ * word), starting with the least significant bits. The letters that cannot
+ * be stored that way (i.e. the non-base letters when 'bits' is 2) are stored
+ * as 0 and described by the runs exc_idx[i] to exc_idx[i+1] - 1 of the
+ * exc_start (0-based), exc_width and exc_code arrays.
+ */
+typedef struct packed_xstringset_holder {
+	int bits;
+	int length;
+	int base_codes[4];
+	const int *width;
+	const int64_t *word_start;
+	const uint64_t *words;
+	const int64_t *exc_idx;
+	const int *exc_start;
+	const int *exc_width;
+	const int *exc_code;
+} PackedXStringSet_holder;
+
 
 /*
  * The BitCol, BitMatrix and HeadTail structs are used for preprocessing
@@ -110,11 +136,15 @@ typedef struct bitmatrix {
 
 typedef struct ppheadtail {
 	int is_init;
+	int simd;  /* instruction set used for the flanks (0 = none) */
 	ByteTrTable byte2offset;
-	BitMatrix head_bmbuf[4], tail_bmbuf[4];
-	BitMatrix nmis_bmbuf;
+	/* 1 BitMatrix per base + 1 for the non-base letters */
+	BitMatrix head_bmbuf[5], tail_bmbuf[5];
+	const BitWord **col_buf;
 	BitMatrix tmp_match_bmbuf;
 	int *tmp_tb_end_buf;
+	int *tmp_colidx_buf;
+	int max_remaining_keys; /* < NBIT_PER_BITWORD */
 } PPHeadTail;
 
 typedef struct headtail {
@@ -125,6 +155,34 @@ typedef struct headtail {
 } HeadTail;
 
 
+/*
+ * The StripedAlignBuffer struct holds the scoring scheme and the work
+ * buffers used by the striped SIMD engine (align_striped.c) that computes
+ * the score-only pairwise alignments when the scoring scheme is integral.
+ * Letters are translated to "codes" (one code per distinct pair of
+ * substitution/fuzzy lookup indices) and 'score' is the ncode x ncode
+ * matrix of substitution scores.
+ */
+typedef struct striped_align_buffer {
+	int simd;  /* instruction set used by the engine (0 = none) */
+	int gapOpening, gapExtension;
+	int byte2code[BYTETRTABLE_LENGTH];
+	int ncode;
+	const int *score;
+	int min_score, max_score;
+	int *rowcode;    /* pattern codes (length: max nchar(pattern)) */
+	int *code2slot;  /* code -> query profile slot (length: ncode) */
+	int *slot2code;
+	int nslot;
+	void *profile, *H1, *H2, *E;  /* 32-byte aligned */
+	/* Work buffers of the inter-sequence ("batch") engine, allocated on
+	   first use for patterns of up to 'batch_maxnchar' letters */
+	int batch_maxnchar;
+	int *batch_colslot;  /* subject letters -> profile slots */
+	void *batch_profile, *batch_H, *batch_D, *batch_openD, *batch_extD;
+} StripedAlignBuffer;
+
+
 /*
  * Match storing modes.
  * np = nb of pattern sequences. ns = nb of subject sequences.
@@ -175,6 +233,59 @@ typedef struct match_buf {
 	IntAEAE *match_widths;  /* can be missing! (i.e. set to NULL) */
 } MatchBuf;
 
+/*
+ * The MatchReporter struct is the context passed to the matchers for
+ * reporting their matches: the buffer where they are stored, the
+ * pattern/subject pair being searched and the shift to add to the starts
+ * of the matches (e.g. the offset of the view being searched).
+ * Matchers reporting to different MatchReporter objects share no state.
+ * A MatchReporter created with _new_MatchReporter() stores its matches in
+ * IntAE buffers and must be used in the main thread only. See below for
+ * the MatchReporter objects that can be used from worker threads.
+ */
+typedef struct match_reporter {
+	MatchBuf match_buf;
+	int PSpair_id;
+	int match_shift;
+	struct plain_match_buf *plain_buf;  /* see below */
+} MatchReporter;
+
+/*
+ * The PlainMatchBuf struct is a match buffer that can be used from worker
+ * threads: it uses only malloc()/realloc() (no R API), and never raises an
+ * error ('failed' is set instead). When the 'plain_buf' field of a
+ * MatchReporter is not NULL, the matches are reported there instead of in
+ * its 'match_buf' field. Only the MATCHES_AS_COUNTS and MATCHES_AS_ENDS
+ * modes are supported. 'match_counts' has 1 elt per PSpair and is not owned
+ * by the buffer (it can be shared by the buffers of several threads as long
+ * as they report matches for different PSpairs). The ends of the matches
+ * are stored in reporting order.
+ */
+typedef struct plain_match_buf {
+	int ms_code;
+	int *match_counts;
+	int *match_ends;
+	int nend;
+	int buflength;
+	int failed;
+} PlainMatchBuf;
+
+
+/*
+ * The BMPattern struct holds a pattern preprocessed for the Boyer-Moore
+ * matcher (see match_pattern_boyermoore.c). It must be zero-initialized
+ * (with 'LCP' set to -1) before its first use and owns malloc()'ed buffers.
+ */
+typedef struct bm_pattern {
+	int buflength;
+	char *seq;
+	int seqlength;
+	int LCP;
+	int j0, shift0;
+	int *VSGSshift_table;
+	int *MWshift_table;
+} BMPattern;
+
 
 /*
  * The MatchPDictBuf struct is used for storing the matches found by the
@@ -194,4 +305,89 @@ typedef struct matchpdict_buf {
 	MatchBuf matches;
 } MatchPDictBuf;
 
+
+/*
+ * The SeqChunk struct is used for streaming the sequences of a set of
+ * FASTA or FASTQ files by chunks of at most 'chunk_size' sequences. The
+ * sequences of the current chunk are stored back-to-back in 'data' and
+ * 'ends' contains their ends in 'data'. 'chunk_hook' is called each time
+ * the chunk is full and once more at the end of the stream.
+ */
+typedef struct seq_chunk {
+	int chunk_size;
+	CharAE *data;
+	IntAE *ends;
+	void (*chunk_hook)(struct seq_chunk *chunk);
+	void *ext;  /* chunk hook extension (optional) */
+} SeqChunk;
+
+
+/*
+ * The BGZFreader struct is used for reading a BGZF file (see BGZF.c). The
+ * BGZF blocks are decompressed by batches, in parallel. The block index
+ * ('coffsets' and 'uoffsets') is only needed for seeking: it's loaded from
+ * the .gzi file if there is one, or built on the first seek otherwise.
+ */
+#define BGZF_MAX_BLOCK_SIZE 65536
+/* Nb of uncompressed bytes per block written by the BGZF writer. Leaves room
+   for the header and footer of the block when the data doesn't compress
+   (same as 'bgzip'). */
+#define BGZF_BLOCK_DATA_SIZE 0xff00
+
+typedef struct bgzf_reader {
+	const char *filepath;
+	FILE *file;
+	int nthreads;
+	int max_batch;		/* max nb of blocks per batch */
+	int batch;		/* nb of blocks to decompress at the next refill */
+	unsigned char *cbuf;	/* max_batch * BGZF_MAX_BLOCK_SIZE bytes */
+	char *ubuf;		/* max_batch * BGZF_MAX_BLOCK_SIZE bytes */
+	int *clens, *ulens;	/* max_batch elts */
+	int ubuf_len, ubuf_pos;
+	int eof;
+	long long int *coffsets, *uoffsets;
+	int nblock;
+} BGZFreader;
+
+/*
+ * The BGZFwriter struct is used for writing a BGZF file (see BGZF.c). The
+ * data is accumulated in 'ubuf' and compressed by batches of blocks, in
+ * parallel.
+ */
+typedef struct bgzf_writer {
+	FILE *file;
+	int level;		/* zlib compression level */
+	int nthreads;
+	int max_batch;		/* max nb of blocks per batch */
+	char *ubuf;		/* max_batch * BGZF_BLOCK_DATA_SIZE bytes */
+	unsigned char *cbuf;	/* max_batch * BGZF_MAX_BLOCK_SIZE bytes */
+	int *clens;		/* max_batch elts */
+	long ubuf_len;
+} BGZFwriter;
+
+
+/*
+ * The BlockReader struct is used for reading a FASTA or FASTQ file by big
+ * blocks (see BlockReader.c). It reads from a "file external pointer"
+ * ('file' and 'bgzf' are NULL), from a plain file opened with fopen()
+ * ('filexp' and 'bgzf' are NULL), or from a BGZF file ('bgzf' is not NULL).
+ */
+#define BLOCKREADER_BUF_SIZE 4194304  /* 4 Mb */
+
+typedef struct block_reader {
+	SEXP filexp;
+	FILE *file;
+	BGZFreader *bgzf;
+	char *buf;      /* BLOCKREADER_BUF_SIZE + 1 bytes (the extra byte is
+			   for a terminating nul) */
+	int nbyte;      /* nb of bytes in 'buf' */
+	int pos;        /* position of the next line in 'buf' */
+	int read_size;
+	int eof;
+} BlockReader;
+
+/* A function that parses the file read by a BlockReader (see
+   _parse_with_BlockReader()). Returns an error message or NULL. */
+typedef const char *(*BlockParser)(BlockReader *reader, void *parser_data);
+
 #endif
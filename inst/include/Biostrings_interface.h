@@ -189,6 +189,26 @@ int get_match_count();
 
 SEXP reported_matches_asSEXP();
 
+/*
+ * Same as above but with an explicit MatchReporter context (see
+ * Biostrings_defines.h) instead of the global one. Matchers reporting to
+ * different MatchReporter objects can run concurrently.
+ */
+
+MatchReporter new_MatchReporter(const char *ms_mode, int nPSpair);
+
+void MatchReporter_set_PSpair(MatchReporter *reporter, int PSpair_id);
+
+void MatchReporter_set_shift(MatchReporter *reporter, int shift);
+
+void MatchReporter_report_match(MatchReporter *reporter, int start, int width);
+
+void MatchReporter_drop_matches(MatchReporter *reporter);
+
+int MatchReporter_get_match_count(const MatchReporter *reporter);
+
+SEXP MatchReporter_matches_asSEXP(const MatchReporter *reporter);
+
 
 /*
  * MIndex abstract accessor functions.
@@ -214,3 +234,12 @@ int match_pattern_boyermoore(
 	int walk_backward
 );
 
+int match_pattern_boyermoore_with_reporter(
+	BMPattern *ppP,
+	const Chars_holder *P,
+	const Chars_holder *S,
+	int nfirstmatches,
+	int walk_backward,
+	MatchReporter *reporter
+);
+
@@ -143,6 +143,41 @@ DEFINE_CCALLABLE_STUB(SEXP, reported_matches_asSEXP,
 	()
 )
 
+DEFINE_CCALLABLE_STUB(MatchReporter, new_MatchReporter,
+	(const char *ms_mode, int nPSpair),
+	(            ms_mode,     nPSpair)
+)
+
+DEFINE_NOVALUE_CCALLABLE_STUB(MatchReporter_set_PSpair,
+	(MatchReporter *reporter, int PSpair_id),
+	(               reporter,     PSpair_id)
+)
+
+DEFINE_NOVALUE_CCALLABLE_STUB(MatchReporter_set_shift,
+	(MatchReporter *reporter, int shift),
+	(               reporter,     shift)
+)
+
+DEFINE_NOVALUE_CCALLABLE_STUB(MatchReporter_report_match,
+	(MatchReporter *reporter, int start, int width),
+	(               reporter,     start,     width)
+)
+
+DEFINE_NOVALUE_CCALLABLE_STUB(MatchReporter_drop_matches,
+	(MatchReporter *reporter),
+	(               reporter)
+)
+
+DEFINE_CCALLABLE_STUB(int, MatchReporter_get_match_count,
+	(const MatchReporter *reporter),
+	(                     reporter)
+)
+
+DEFINE_CCALLABLE_STUB(SEXP, MatchReporter_matches_asSEXP,
+	(const MatchReporter *reporter),
+	(                     reporter)
+)
+
 /*
  * Stubs for callables defined in MIndex_class.c
  */
@@ -176,3 +211,8 @@ DEFINE_CCALLABLE_STUB(int, match_pattern_boyermoore,
 	(                    P,                     S,     nfirstmatches,     walk_backward)
 )
 
+DEFINE_CCALLABLE_STUB(int, match_pattern_boyermoore_with_reporter,
+	(BMPattern *ppP, const Chars_holder *P, const Chars_holder *S, int nfirstmatches, int walk_backward, MatchReporter *reporter),
+	(           ppP,                     P,                     S,     nfirstmatches,     walk_backward,                reporter)
+)
+
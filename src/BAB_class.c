@@ -21,6 +21,41 @@ SEXP IntegerBAB_new(SEXP max_nblock)
 	return ans;
 }
 
+/*
+ * A "mapped" IntegerBAB is an IntegerBAB object whose blocks are not R
+ * integer vectors but are stored contiguously in a read-only memory region
+ * (typically a memory-mapped file, see PDict_file.c). For such an object,
+ * the address of the external pointer is the address of the 1st block, its
+ * "protected" value is the integer vector (nblock, lastblock_nelt,
+ * block_length) and its tag is the external pointer that owns the memory
+ * region (so the region is not released while the object is in use).
+ * Only the last block can be shorter than 'block_length' ints.
+ */
+SEXP _new_mapped_IntegerBAB(SEXP region, const int *block0, int nblock,
+		int lastblock_nelt, int block_length)
+{
+	SEXP prot, xp, classdef, ans;
+
+	PROTECT(prot = NEW_INTEGER(3));
+	INTEGER(prot)[0] = nblock;
+	INTEGER(prot)[1] = lastblock_nelt;
+	INTEGER(prot)[2] = block_length;
+	PROTECT(xp = R_MakeExternalPtr((void *) block0, region, prot));
+	PROTECT(classdef = MAKE_CLASS("IntegerBAB"));
+	PROTECT(ans = NEW_OBJECT(classdef));
+	SET_SLOT(ans, mkChar("xp"), xp);
+	UNPROTECT(4);
+	return ans;
+}
+
+int _IntegerBAB_is_mapped(SEXP x)
+{
+	SEXP xp;
+
+	xp = GET_SLOT(x, install("xp"));
+	return TYPEOF(R_ExternalPtrTag(xp)) == EXTPTRSXP;
+}
+
 int *_get_BAB_nblock_ptr(SEXP x)
 {
 	SEXP xp, prot;
@@ -43,6 +78,37 @@ SEXP _get_BAB_blocks(SEXP x)
 	return R_ExternalPtrTag(xp);
 }
 
+/* Works on a mapped IntegerBAB too */
+int *_get_BAB_block(SEXP x, int b)
+{
+	SEXP xp, prot;
+	int *block0;
+
+	xp = GET_SLOT(x, install("xp"));
+	if (TYPEOF(R_ExternalPtrTag(xp)) != EXTPTRSXP)
+		return INTEGER(VECTOR_ELT(R_ExternalPtrTag(xp), b));
+	/* The address of an external pointer is not serialized */
+	block0 = (int *) R_ExternalPtrAddr(xp);
+	if (block0 == NULL)
+		error("this object was obtained with loadPDict() and then "
+		      "serialized, which is not\n  supported (use savePDict() "
+		      "and loadPDict() instead)");
+	prot = R_ExternalPtrProtected(xp);
+	return block0 + (size_t) b * INTEGER(prot)[2];
+}
+
+/* Length (in ints) of the blocks (only the last block can be shorter if the
+   buffer is mapped) */
+int _get_BAB_block_length(SEXP x)
+{
+	SEXP xp;
+
+	xp = GET_SLOT(x, install("xp"));
+	if (TYPEOF(R_ExternalPtrTag(xp)) != EXTPTRSXP)
+		return LENGTH(VECTOR_ELT(R_ExternalPtrTag(xp), 0));
+	return INTEGER(R_ExternalPtrProtected(xp))[2];
+}
+
 SEXP _IntegerBAB_addblock(SEXP x, int block_length)
 {
 	SEXP xp, blocks, prot, block;
@@ -50,6 +116,8 @@ SEXP _IntegerBAB_addblock(SEXP x, int block_length)
 
 	xp = GET_SLOT(x, install("xp"));
 	blocks = R_ExternalPtrTag(xp);
+	if (TYPEOF(blocks) == EXTPTRSXP)
+		error("_IntegerBAB_addblock(): the buffer is read-only");
 	max_nblock = LENGTH(blocks);
 	prot = R_ExternalPtrProtected(xp);
 	nblock = INTEGER(prot)[0];
@@ -0,0 +1,584 @@
+/****************************************************************************
+ *          Reading and writing BGZF files ((de)compression in parallel)     *
+ ****************************************************************************/
+#include "Biostrings.h"
+#include "S4Vectors_interface.h"
+
+#include <stdio.h>
+#include <string.h>  /* for memcpy(), memmove() */
+#include <sys/stat.h>  /* for stat() */
+#include <zlib.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+/*
+ * A BGZF file (as produced by 'bgzip' or 'samtools faidx') is a series of
+ * gzip members (the BGZF blocks) of at most 64 Kb each. Each block contains
+ * its own compressed size in the 'BC' subfield of its gzip header, so the
+ * blocks can be delimited without decompressing them, and then decompressed
+ * independently of each other.
+ * The BGZF reader reads a batch of blocks from the file, decompresses them
+ * in parallel, and serves the decompressed bytes. The first batch after a
+ * seek contains only 1 block and the size of the batches is doubled up to
+ * 'max_batch': this avoids decompressing many blocks when only a few records
+ * are loaded after a seek (e.g. by read_fasta_blocks()).
+ * Seeking to an uncompressed offset uses the block index: the compressed
+ * and uncompressed offsets of all the blocks. It's loaded from the .gzi
+ * file (as produced by 'bgzip -i' or 'samtools faidx') if there is one, or
+ * built by scanning the block headers otherwise (no decompression).
+ * The BGZF writer accumulates the data to write in a buffer that can hold
+ * a batch of blocks, and compresses the blocks of a full batch in parallel
+ * before writing them to the file.
+ */
+
+#define BATCH_PER_THREAD 8
+
+static unsigned int get_le16(const unsigned char *p)
+{
+	return (unsigned int) p[0] | ((unsigned int) p[1] << 8);
+}
+
+static unsigned int get_le32(const unsigned char *p)
+{
+	return get_le16(p) | (get_le16(p + 2) << 16);
+}
+
+static long long int get_le64(const unsigned char *p)
+{
+	return (long long int) get_le32(p) |
+	       ((long long int) get_le32(p + 4) << 32);
+}
+
+/* Reads the gzip header of the next block and stores the rest of the block
+   (i.e. the deflated data followed by the CRC32 and the ISIZE fields) in
+   'cdata'. Returns 1 if a block was read, 0 at the end of the file, and -1
+   if the block is not a valid BGZF block or on read error. */
+static int read_block(FILE *file, unsigned char *cdata, int *clen)
+{
+	unsigned char header[12], *extra;
+	size_t n;
+	int xlen, i, slen, bsize;
+
+	n = fread(header, sizeof(unsigned char), sizeof(header), file);
+	if (n == 0 && !ferror(file))
+		return 0;
+	if (n != sizeof(header)
+	 || header[0] != 31 || header[1] != 139 || header[2] != 8
+	 || (header[3] & 4) == 0)
+		return -1;
+	xlen = get_le16(header + 10);
+	/* 'cdata' is used as a temporary buffer for the extra field */
+	extra = cdata;
+	if (fread(extra, sizeof(unsigned char), xlen, file) != (size_t) xlen)
+		return -1;
+	bsize = -1;
+	for (i = 0; i + 4 <= xlen; i += 4 + slen) {
+		slen = get_le16(extra + i + 2);
+		if (extra[i] == 'B' && extra[i + 1] == 'C' && slen == 2
+		 && i + 6 <= xlen)
+		{
+			bsize = get_le16(extra + i + 4);
+			break;
+		}
+	}
+	if (bsize == -1)
+		return -1;
+	*clen = bsize + 1 - (int) sizeof(header) - xlen;
+	if (*clen < 8 || *clen > BGZF_MAX_BLOCK_SIZE)
+		return -1;
+	if (fread(cdata, sizeof(unsigned char), *clen, file) != (size_t) *clen)
+		return -1;
+	return 1;
+}
+
+/* Doesn't use the R API. Returns the nb of decompressed bytes or -1 if the
+   block is corrupted. */
+static int inflate_block(const unsigned char *cdata, int clen, char *out)
+{
+	z_stream strm;
+	int ret;
+	unsigned int isize;
+
+	memset(&strm, 0, sizeof(z_stream));
+	if (inflateInit2(&strm, -15) != Z_OK)  /* raw deflate data */
+		return -1;
+	strm.next_in = (Bytef *) cdata;
+	strm.avail_in = clen - 8;
+	strm.next_out = (Bytef *) out;
+	strm.avail_out = BGZF_MAX_BLOCK_SIZE;
+	ret = inflate(&strm, Z_FINISH);
+	inflateEnd(&strm);
+	isize = get_le32(cdata + clen - 4);
+	if (ret != Z_STREAM_END || strm.total_out != isize)
+		return -1;
+	if (crc32(crc32(0L, Z_NULL, 0), (const Bytef *) out, isize)
+	    != get_le32(cdata + clen - 8))
+		return -1;
+	return (int) isize;
+}
+
+/* Returns 1 if the file starts with a BGZF block. */
+static int is_bgzf_file(const char *filepath)
+{
+	FILE *file;
+	unsigned char *cdata;
+	int clen, ret;
+
+	cdata = (unsigned char *) R_alloc(BGZF_MAX_BLOCK_SIZE,
+					  sizeof(unsigned char));
+	file = fopen(filepath, "rb");
+	if (file == NULL)
+		return 0;
+	ret = read_block(file, cdata, &clen);
+	fclose(file);
+	return ret == 1;
+}
+
+/*
+ * Returns NULL if 'filepath' is not a BGZF file. The returned reader must
+ * be closed with _close_BGZFreader(). All the buffers are allocated with
+ * R_alloc().
+ */
+BGZFreader *_open_BGZFreader(const char *filepath, int nthreads)
+{
+	BGZFreader *bgzf;
+
+	if (!is_bgzf_file(filepath))
+		return NULL;
+	bgzf = (BGZFreader *) R_alloc(1, sizeof(BGZFreader));
+	bgzf->filepath = filepath;
+	bgzf->nthreads = nthreads;
+	bgzf->max_batch = nthreads * BATCH_PER_THREAD;
+	bgzf->batch = 1;
+	bgzf->cbuf = (unsigned char *) R_alloc(
+				(long) bgzf->max_batch * BGZF_MAX_BLOCK_SIZE,
+				sizeof(unsigned char));
+	bgzf->ubuf = (char *) R_alloc(
+				(long) bgzf->max_batch * BGZF_MAX_BLOCK_SIZE,
+				sizeof(char));
+	bgzf->clens = (int *) R_alloc(bgzf->max_batch, sizeof(int));
+	bgzf->ulens = (int *) R_alloc(bgzf->max_batch, sizeof(int));
+	bgzf->ubuf_len = bgzf->ubuf_pos = 0;
+	bgzf->eof = 0;
+	bgzf->coffsets = bgzf->uoffsets = NULL;
+	bgzf->nblock = 0;
+	bgzf->file = fopen(filepath, "rb");
+	if (bgzf->file == NULL)
+		error("cannot open file '%s'", filepath);
+	return bgzf;
+}
+
+void _close_BGZFreader(BGZFreader *bgzf)
+{
+	if (bgzf->file != NULL) {
+		fclose(bgzf->file);
+		bgzf->file = NULL;
+	}
+	return;
+}
+
+/* Reads the next batch of blocks and decompresses them in parallel.
+   Returns -1 on read error or if a block is corrupted. */
+static int read_batch(BGZFreader *bgzf)
+{
+	int nblock, ret, k, pos;
+
+	for (nblock = 0; nblock < bgzf->batch; nblock++) {
+		ret = read_block(bgzf->file,
+				 bgzf->cbuf + (long) nblock * BGZF_MAX_BLOCK_SIZE,
+				 bgzf->clens + nblock);
+		if (ret == -1)
+			return -1;
+		if (ret == 0) {
+			bgzf->eof = 1;
+			break;
+		}
+	}
+
+	volatile int failed = 0;
+	#pragma omp parallel for num_threads(bgzf->nthreads) \
+		schedule(dynamic, 1) if (nblock > 1)
+	for (k = 0; k < nblock; k++) {
+		bgzf->ulens[k] = inflate_block(
+				bgzf->cbuf + (long) k * BGZF_MAX_BLOCK_SIZE,
+				bgzf->clens[k],
+				bgzf->ubuf + (long) k * BGZF_MAX_BLOCK_SIZE);
+		if (bgzf->ulens[k] == -1)
+			failed = 1;
+	}
+	if (failed)
+		return -1;
+
+	/* Make the decompressed data contiguous */
+	pos = 0;
+	for (k = 0; k < nblock; k++) {
+		memmove(bgzf->ubuf + pos,
+			bgzf->ubuf + (long) k * BGZF_MAX_BLOCK_SIZE,
+			bgzf->ulens[k]);
+		pos += bgzf->ulens[k];
+	}
+	bgzf->ubuf_len = pos;
+	bgzf->ubuf_pos = 0;
+	if (bgzf->batch < bgzf->max_batch) {
+		bgzf->batch *= 2;
+		if (bgzf->batch > bgzf->max_batch)
+			bgzf->batch = bgzf->max_batch;
+	}
+	return 0;
+}
+
+/* Same contract as fread() except that -1 is returned on error. */
+int _BGZFreader_read(BGZFreader *bgzf, char *buf, int n)
+{
+	int nread, m;
+
+	nread = 0;
+	while (nread < n) {
+		if (bgzf->ubuf_pos == bgzf->ubuf_len) {
+			if (bgzf->eof)
+				break;
+			if (read_batch(bgzf) == -1)
+				return -1;
+			continue;
+		}
+		m = bgzf->ubuf_len - bgzf->ubuf_pos;
+		if (m > n - nread)
+			m = n - nread;
+		memcpy(buf + nread, bgzf->ubuf + bgzf->ubuf_pos, m);
+		bgzf->ubuf_pos += m;
+		nread += m;
+	}
+	return nread;
+}
+
+
+/****************************************************************************
+ * The block index.
+ */
+
+static void alloc_index(BGZFreader *bgzf, int nblock)
+{
+	bgzf->coffsets = (long long int *) R_alloc(nblock,
+						   sizeof(long long int));
+	bgzf->uoffsets = (long long int *) R_alloc(nblock,
+						   sizeof(long long int));
+	bgzf->nblock = nblock;
+	return;
+}
+
+/* Returns 1 if the offsets loaded from the .gzi file are increasing and
+   the last one is the offset of a BGZF block in the file. */
+static int check_gzi_offsets(BGZFreader *bgzf)
+{
+	int i, clen;
+
+	for (i = 1; i < bgzf->nblock; i++)
+		if (bgzf->coffsets[i] <= bgzf->coffsets[i - 1]
+		 || bgzf->uoffsets[i] < bgzf->uoffsets[i - 1])
+			return 0;
+	return fseek64(bgzf->file, bgzf->coffsets[bgzf->nblock - 1],
+		       SEEK_SET) == 0
+	    && read_block(bgzf->file, bgzf->cbuf, &clen) == 1;
+}
+
+/* The .gzi file contains the nb of entries followed by the compressed and
+   uncompressed offsets of all the blocks but the first one. All the numbers
+   are unsigned 64-bit little-endian integers.
+   A .gzi file that is older than the BGZF file, or whose offsets don't
+   match the blocks of the BGZF file, is stale and is ignored (the index is
+   then rebuilt from the BGZF file). */
+static int load_gzi_file(BGZFreader *bgzf)
+{
+	char *gzi_path;
+	struct stat gzi_st, st;
+	FILE *file;
+	unsigned char buf[16];
+	long long int n;
+	int i, ok;
+
+	gzi_path = R_alloc(strlen(bgzf->filepath) + 5, sizeof(char));
+	strcpy(gzi_path, bgzf->filepath);
+	strcat(gzi_path, ".gzi");
+	if (stat(gzi_path, &gzi_st) != 0 || stat(bgzf->filepath, &st) != 0
+	 || gzi_st.st_mtime < st.st_mtime
+	 || gzi_st.st_size < 8 || (gzi_st.st_size - 8) % 16 != 0
+	 || (gzi_st.st_size - 8) / 16 >= INT_MAX)
+		return 0;
+	/* The index is allocated before the file is opened so an allocation
+	   error cannot leave the file open */
+	n = (gzi_st.st_size - 8) / 16;
+	alloc_index(bgzf, (int) n + 1);
+	file = fopen(gzi_path, "rb");
+	if (file == NULL) {
+		bgzf->nblock = 0;
+		return 0;
+	}
+	ok = fread(buf, sizeof(unsigned char), 8, file) == 8
+	  && get_le64(buf) == n;
+	if (ok) {
+		bgzf->coffsets[0] = bgzf->uoffsets[0] = 0LL;
+		for (i = 1; i <= n; i++) {
+			if (fread(buf, sizeof(unsigned char), 16, file) != 16) {
+				ok = 0;
+				break;
+			}
+			bgzf->coffsets[i] = get_le64(buf);
+			bgzf->uoffsets[i] = get_le64(buf + 8);
+		}
+	}
+	fclose(file);
+	if (ok)
+		ok = check_gzi_offsets(bgzf);
+	if (!ok)
+		bgzf->nblock = 0;
+	return ok;
+}
+
+/* Scans the headers of all the blocks. Only the compressed data of each
+   block is read, nothing is decompressed. */
+static int build_index(BGZFreader *bgzf)
+{
+	FILE *file;
+	unsigned char *cdata;
+	LLongAE *coffset_buf, *uoffset_buf;
+	long long int coffset, uoffset;
+	int clen, ret, i;
+
+	/* The offsets are collected with the file of 'bgzf' (repositioned by
+	   the caller) so an allocation error cannot leave another file open */
+	file = bgzf->file;
+	if (fseek64(file, 0, SEEK_SET) != 0)
+		return 0;
+	cdata = bgzf->cbuf;
+	coffset_buf = new_LLongAE(0, 0, 0);
+	uoffset_buf = new_LLongAE(0, 0, 0);
+	coffset = uoffset = 0LL;
+	do {
+		LLongAE_insert_at(coffset_buf, LLongAE_get_nelt(coffset_buf),
+				  coffset);
+		LLongAE_insert_at(uoffset_buf, LLongAE_get_nelt(uoffset_buf),
+				  uoffset);
+		ret = read_block(file, cdata, &clen);
+		if (ret == 1) {
+			coffset = ftell64(file);
+			uoffset += get_le32(cdata + clen - 4);
+		}
+	} while (ret == 1);
+	if (ret == -1)
+		return 0;
+	alloc_index(bgzf, LLongAE_get_nelt(coffset_buf));
+	for (i = 0; i < bgzf->nblock; i++) {
+		bgzf->coffsets[i] = coffset_buf->elts[i];
+		bgzf->uoffsets[i] = uoffset_buf->elts[i];
+	}
+	return 1;
+}
+
+/* Returns 0 if the seek failed. */
+int _BGZFreader_seek(BGZFreader *bgzf, long long int offset)
+{
+	int lo, hi, mid, skip;
+
+	bgzf->batch = 1;
+	bgzf->eof = 0;
+	bgzf->ubuf_len = bgzf->ubuf_pos = 0;
+	if (offset == 0LL)
+		return fseek64(bgzf->file, 0, SEEK_SET) == 0;
+	if (bgzf->nblock == 0 && !load_gzi_file(bgzf) && !build_index(bgzf))
+		return 0;
+	/* Find the last block that starts at or before 'offset' */
+	lo = 0;
+	hi = bgzf->nblock - 1;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (bgzf->uoffsets[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	if (fseek64(bgzf->file, bgzf->coffsets[lo], SEEK_SET) != 0)
+		return 0;
+	skip = (int) (offset - bgzf->uoffsets[lo]);
+	if (skip == 0)
+		return 1;
+	if (read_batch(bgzf) == -1 || skip > bgzf->ubuf_len)
+		return 0;
+	bgzf->ubuf_pos = skip;
+	return 1;
+}
+
+
+/****************************************************************************
+ * Writing BGZF files.
+ */
+
+#define BGZF_HEADER_SIZE 18
+#define BGZF_FOOTER_SIZE 8
+
+/* The empty block that marks the end of a BGZF file */
+static const unsigned char BGZF_EOF_block[28] = {
+	31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0,
+	27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static void put_le16(unsigned char *p, unsigned int x)
+{
+	p[0] = (unsigned char) (x & 0xff);
+	p[1] = (unsigned char) ((x >> 8) & 0xff);
+	return;
+}
+
+static void put_le32(unsigned char *p, unsigned int x)
+{
+	put_le16(p, x & 0xffff);
+	put_le16(p + 2, x >> 16);
+	return;
+}
+
+/* Doesn't use the R API. Returns the size of the compressed block or -1 on
+   error. 'out' must be able to hold BGZF_MAX_BLOCK_SIZE bytes. */
+static int deflate_block(const char *data, int len, int level,
+		unsigned char *out)
+{
+	static const unsigned char header[16] = {
+		31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0
+	};
+	z_stream strm;
+	int ret, clen;
+
+	memset(&strm, 0, sizeof(z_stream));
+	if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK)  /* raw deflate data */
+		return -1;
+	strm.next_in = (Bytef *) data;
+	strm.avail_in = len;
+	strm.next_out = (Bytef *) out + BGZF_HEADER_SIZE;
+	strm.avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE -
+			 BGZF_FOOTER_SIZE;
+	ret = deflate(&strm, Z_FINISH);
+	clen = BGZF_HEADER_SIZE + (int) strm.total_out + BGZF_FOOTER_SIZE;
+	deflateEnd(&strm);
+	if (ret != Z_STREAM_END)
+		return -1;
+	memcpy(out, header, sizeof(header));
+	put_le16(out + 16, clen - 1);
+	put_le32(out + clen - 8,
+		 crc32(crc32(0L, Z_NULL, 0), (const Bytef *) data, len));
+	put_le32(out + clen - 4, len);
+	return clen;
+}
+
+/*
+ * Returns NULL if the file cannot be opened. 'level' is the zlib compression
+ * level (-1 for the default level). The returned writer must be closed with
+ * _close_BGZFwriter(). All the buffers are allocated with R_alloc().
+ */
+BGZFwriter *_open_BGZFwriter(const char *filepath, int append, int level,
+		int nthreads)
+{
+	BGZFwriter *bgzf;
+
+	/* The buffers are allocated before the file is opened so an
+	   allocation error cannot leave the file open */
+	bgzf = (BGZFwriter *) R_alloc(1, sizeof(BGZFwriter));
+	bgzf->level = level;
+	bgzf->nthreads = nthreads;
+	bgzf->max_batch = nthreads * BATCH_PER_THREAD;
+	bgzf->ubuf = (char *) R_alloc(
+				(long) bgzf->max_batch * BGZF_BLOCK_DATA_SIZE,
+				sizeof(char));
+	bgzf->cbuf = (unsigned char *) R_alloc(
+				(long) bgzf->max_batch * BGZF_MAX_BLOCK_SIZE,
+				sizeof(unsigned char));
+	bgzf->clens = (int *) R_alloc(bgzf->max_batch, sizeof(int));
+	bgzf->ubuf_len = 0;
+	bgzf->file = fopen(filepath, append ? "ab" : "wb");
+	if (bgzf->file == NULL)
+		return NULL;
+	return bgzf;
+}
+
+/* Compresses the content of 'ubuf' in parallel and writes it to the file.
+   Returns -1 on error. */
+static int write_batch(BGZFwriter *bgzf)
+{
+	int nblock, k, len;
+
+	nblock = (bgzf->ubuf_len + BGZF_BLOCK_DATA_SIZE - 1) /
+		 BGZF_BLOCK_DATA_SIZE;
+
+	volatile int failed = 0;
+	#pragma omp parallel for num_threads(bgzf->nthreads) \
+		schedule(dynamic, 1) private(len) if (nblock > 1)
+	for (k = 0; k < nblock; k++) {
+		len = bgzf->ubuf_len - k * BGZF_BLOCK_DATA_SIZE;
+		if (len > BGZF_BLOCK_DATA_SIZE)
+			len = BGZF_BLOCK_DATA_SIZE;
+		bgzf->clens[k] = deflate_block(
+				bgzf->ubuf + (long) k * BGZF_BLOCK_DATA_SIZE,
+				len, bgzf->level,
+				bgzf->cbuf + (long) k * BGZF_MAX_BLOCK_SIZE);
+		if (bgzf->clens[k] == -1)
+			failed = 1;
+	}
+	if (failed)
+		return -1;
+
+	for (k = 0; k < nblock; k++) {
+		if (fwrite(bgzf->cbuf + (long) k * BGZF_MAX_BLOCK_SIZE,
+			   sizeof(unsigned char), bgzf->clens[k], bgzf->file)
+		    != (size_t) bgzf->clens[k])
+			return -1;
+	}
+	bgzf->ubuf_len = 0;
+	return 0;
+}
+
+/* Returns -1 on error. */
+int _BGZFwriter_write(BGZFwriter *bgzf, const char *buf, long n)
+{
+	long batch_size, m;
+
+	batch_size = (long) bgzf->max_batch * BGZF_BLOCK_DATA_SIZE;
+	while (n > 0) {
+		if (bgzf->ubuf_len == batch_size && write_batch(bgzf) == -1)
+			return -1;
+		m = batch_size - bgzf->ubuf_len;
+		if (m > n)
+			m = n;
+		memcpy(bgzf->ubuf + bgzf->ubuf_len, buf, m);
+		bgzf->ubuf_len += m;
+		buf += m;
+		n -= m;
+	}
+	return 0;
+}
+
+/* Writes the remaining data and the EOF block, and closes the file.
+   Returns -1 on error. */
+int _close_BGZFwriter(BGZFwriter *bgzf)
+{
+	int ret;
+
+	ret = 0;
+	if (bgzf->ubuf_len != 0)
+		ret = write_batch(bgzf);
+	if (ret == 0 &&
+	    fwrite(BGZF_EOF_block, sizeof(unsigned char),
+		   sizeof(BGZF_EOF_block), bgzf->file)
+	    != sizeof(BGZF_EOF_block))
+		ret = -1;
+	if (fclose(bgzf->file) != 0)
+		ret = -1;
+	bgzf->file = NULL;
+	return ret;
+}
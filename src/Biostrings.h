@@ -54,6 +54,8 @@ int _get_twobit_signature_at(
 	int at_length
 );
 
+int _interrupt_is_pending();
+
 
 /* RoSeqs_utils.c */
 
@@ -167,6 +169,52 @@ XStringSet_holder _get_elt_from_XStringSetList_holder(
 );
 
 
+/* PackedDNAStringSet_class.c */
+
+PackedXStringSet_holder _hold_PackedDNAStringSet(SEXP x);
+
+Chars_holder _get_window_from_PackedXStringSet_holder(
+	const PackedXStringSet_holder *x_holder,
+	int i,
+	int start,
+	int width,
+	char *buf
+);
+
+void _count_letters_in_PackedXStringSet_holder_elt(
+	const PackedXStringSet_holder *x_holder,
+	int i,
+	int *counts
+);
+
+SEXP PackedDNAStringSet_pack(
+	SEXP x,
+	SEXP bits,
+	SEXP base_codes
+);
+
+SEXP PackedDNAStringSet_length(SEXP x);
+
+SEXP PackedDNAStringSet_bits(SEXP x);
+
+SEXP PackedDNAStringSet_width(SEXP x);
+
+SEXP PackedDNAStringSet_extract(
+	SEXP x,
+	SEXP i,
+	SEXP start,
+	SEXP width
+);
+
+SEXP PackedDNAStringSet_write_file(
+	SEXP x,
+	SEXP filepath,
+	SEXP names_blob
+);
+
+SEXP PackedDNAStringSet_load_file(SEXP filepath);
+
+
 /* xscat.c */
 
 SEXP XString_xscat(SEXP args);
@@ -191,7 +239,8 @@ SEXP fasta_index(
 	SEXP nrec,
 	SEXP skip,
 	SEXP seek_first_rec,
-	SEXP lkup
+	SEXP lkup,
+	SEXP nthreads
 );
 
 SEXP read_fasta_blocks(
@@ -200,7 +249,9 @@ SEXP read_fasta_blocks(
 	SEXP nrec_list,
 	SEXP offset_list,
 	SEXP elementType,
-	SEXP lkup
+	SEXP lkup,
+	SEXP nthreads,
+	SEXP warn_invalid
 );
 
 SEXP write_XStringSet_to_fasta(
@@ -210,6 +261,12 @@ SEXP write_XStringSet_to_fasta(
 	SEXP lkup
 );
 
+void _stream_fasta_files(
+	SEXP filexp_list,
+	SEXP lkup,
+	SeqChunk *chunk
+);
+
 
 /* read_fastq_files.c */
 
@@ -228,7 +285,9 @@ SEXP read_fastq_files(
 	SEXP use_names,
 	SEXP elementType,
 	SEXP lkup,
-	SEXP with_qualities
+	SEXP with_qualities,
+	SEXP with_qual_stats,
+	SEXP nthreads
 );
 
 SEXP write_XStringSet_to_fastq(
@@ -238,6 +297,152 @@ SEXP write_XStringSet_to_fastq(
 	SEXP lkup
 );
 
+SEXP write_XStringSet_to_fastq_file(
+	SEXP x,
+	SEXP filepath,
+	SEXP append,
+	SEXP qualities,
+	SEXP lkup,
+	SEXP compression_level,
+	SEXP nthreads
+);
+
+void _stream_fastq_files(
+	SEXP filexp_list,
+	SEXP lkup,
+	SeqChunk *chunk
+);
+
+
+/* fasta_fai.c */
+
+SEXP fasta_fai(
+	SEXP filexp_list,
+	SEXP nthreads
+);
+
+SEXP read_fai_regions(
+	SEXP filepath,
+	SEXP offset,
+	SEXP linebases,
+	SEXP linewidth,
+	SEXP start,
+	SEXP width,
+	SEXP elementType,
+	SEXP lkup
+);
+
+
+/* read_twobit_files.c */
+
+SEXP twobit_index(SEXP filepath);
+
+SEXP read_twobit_regions(
+	SEXP filepath,
+	SEXP offset,
+	SEXP start,
+	SEXP width,
+	SEXP lkup,
+	SEXP with_masks
+);
+
+
+/* SeqChunk_utils.c */
+
+SeqChunk _new_SeqChunk(
+	int chunk_size,
+	void (*chunk_hook)(SeqChunk *chunk),
+	void *ext
+);
+
+int _SeqChunk_get_nseq(const SeqChunk *chunk);
+
+Chars_holder _SeqChunk_get_elt(
+	const SeqChunk *chunk,
+	int i
+);
+
+void _SeqChunk_flush(SeqChunk *chunk);
+
+void _SeqChunk_new_empty_seq(SeqChunk *chunk);
+
+void _SeqChunk_append_seq(
+	SeqChunk *chunk,
+	const Chars_holder *seq_data
+);
+
+
+/* BGZF.c */
+
+BGZFreader *_open_BGZFreader(
+	const char *filepath,
+	int nthreads
+);
+
+void _close_BGZFreader(BGZFreader *bgzf);
+
+int _BGZFreader_read(
+	BGZFreader *bgzf,
+	char *buf,
+	int n
+);
+
+int _BGZFreader_seek(
+	BGZFreader *bgzf,
+	long long int offset
+);
+
+BGZFwriter *_open_BGZFwriter(
+	const char *filepath,
+	int append,
+	int level,
+	int nthreads
+);
+
+int _BGZFwriter_write(
+	BGZFwriter *bgzf,
+	const char *buf,
+	long n
+);
+
+int _close_BGZFwriter(BGZFwriter *bgzf);
+
+
+/* BlockReader.c */
+
+BlockReader _new_filexp_BlockReader(SEXP filexp);
+
+const char *_parse_with_BlockReader(
+	SEXP filexp,
+	long long int offset,
+	int nthreads,
+	BlockParser parse,
+	void *parser_data
+);
+
+void _close_BlockReader(BlockReader *reader);
+
+BlockReader _new_file_BlockReader(
+	FILE *file,
+	char *buf
+);
+
+int _BlockReader_seek(
+	BlockReader *reader,
+	long long int offset
+);
+
+int _BlockReader_gets(
+	BlockReader *reader,
+	Chars_holder *line,
+	int *nbyte_in,
+	int *EOL_in_buf
+);
+
+int _is_plain_file(const char *filepath);
+
+const char **_get_plain_filepaths(SEXP filexp_list);
+
 
 /* letter_frequency.c */
 
@@ -254,6 +459,13 @@ SEXP XStringSet_letter_frequency(
 	SEXP with_other
 );
 
+SEXP PackedDNAStringSet_letter_frequency(
+	SEXP x,
+	SEXP collapse,
+	SEXP codes,
+	SEXP with_other
+);
+
 SEXP XString_letterFrequencyInSlidingView(
 	SEXP x,
 	SEXP view_width,
@@ -492,6 +704,49 @@ SEXP _MatchBuf_as_SEXP(
 	SEXP env
 );
 
+PlainMatchBuf _new_PlainMatchBuf(
+	int ms_code,
+	int *match_counts
+);
+
+void _PlainMatchBuf_report_match(
+	PlainMatchBuf *plain_buf,
+	int PSpair_id,
+	int start,
+	int width
+);
+
+void _free_PlainMatchBuf(PlainMatchBuf *plain_buf);
+
+MatchReporter _new_MatchReporter(
+	const char *ms_mode,
+	int nPSpair
+);
+
+MatchReporter _new_plain_MatchReporter(PlainMatchBuf *plain_buf);
+
+void _MatchReporter_set_PSpair(
+	MatchReporter *reporter,
+	int PSpair_id
+);
+
+void _MatchReporter_set_shift(
+	MatchReporter *reporter,
+	int shift
+);
+
+void _MatchReporter_report_match(
+	MatchReporter *reporter,
+	int start,
+	int width
+);
+
+void _MatchReporter_drop_matches(MatchReporter *reporter);
+
+int _MatchReporter_get_match_count(const MatchReporter *reporter);
+
+SEXP _MatchReporter_matches_asSEXP(const MatchReporter *reporter);
+
 void _init_match_reporting(const char *ms_mode, int nPSpair);
 
 void _set_active_PSpair(int PSpair_id);
@@ -508,6 +763,8 @@ SEXP _reported_matches_asSEXP();
 
 MatchBuf *_get_internal_match_buf();
 
+MatchReporter *_get_internal_match_reporter();
+
 
 /* MIndex_class.c */
 
@@ -613,17 +870,49 @@ int _match_pattern_boyermoore(
 	int walk_backward
 );
 
+int _match_pattern_boyermoore_with_reporter(
+	BMPattern *ppP,
+	const Chars_holder *P,
+	const Chars_holder *S,
+	int nfirstmatches,
+	int walk_backward,
+	MatchReporter *reporter
+);
+
+void _init_BMPattern(
+	BMPattern *ppP,
+	const Chars_holder *P,
+	int walk_backward
+);
+
+void _free_BMPattern(BMPattern *ppP);
+
+int _BMPattern_match(
+	BMPattern *ppP,
+	const Chars_holder *S,
+	int nfirstmatches,
+	int walk_backward,
+	MatchReporter *reporter
+);
+
 
 /* match_pattern_shiftor.c */
 
 SEXP bits_per_long();
 
+void _check_shiftor_args(
+	const Chars_holder *P,
+	int fixedP,
+	int fixedS
+);
+
 void _match_pattern_shiftor(
 	const Chars_holder *P,
 	const Chars_holder *S,
 	int max_nmis,
 	int fixedP,
-	int fixedS
+	int fixedS,
+	MatchReporter *reporter
 );
 
 
@@ -634,7 +923,8 @@ void _match_pattern_indels(
 	const Chars_holder *S,
 	int max_nmis,
 	int fixedP,
-	int fixedS
+	int fixedS,
+	MatchReporter *reporter
 );
 
 
@@ -647,7 +937,9 @@ void _match_pattern_XString(
 	SEXP min_mismatch,
 	SEXP with_indels,
 	SEXP fixed,
-	const char *algo
+	const char *algo,
+	BMPattern *ppP,
+	MatchReporter *reporter
 );
 
 void _match_pattern_XStringViews(
@@ -659,7 +951,9 @@ void _match_pattern_XStringViews(
 	SEXP min_mismatch,
 	SEXP with_indels,
 	SEXP fixed,
-	const char *algo
+	const char *algo,
+	BMPattern *ppP,
+	MatchReporter *reporter
 );
 
 SEXP XString_match_pattern(
@@ -694,7 +988,8 @@ SEXP XStringSet_vmatch_pattern(
 	SEXP with_indels,
 	SEXP fixed,
 	SEXP algorithm,
-	SEXP ms_mode
+	SEXP ms_mode,
+	SEXP nthreads
 );
 
 
@@ -830,10 +1125,18 @@ SEXP _get_PreprocessedTB_low2high(SEXP x);
 
 SEXP _get_Twobit_sign2pos_tag(SEXP x);
 
+SEXP _get_Twobit_hash_table(SEXP x);
+
+SEXP _get_Twobit_hash_filter(SEXP x);
+
 SEXP _get_ACtree2_nodebuf_ptr(SEXP x);
 
 SEXP _get_ACtree2_nodeextbuf_ptr(SEXP x);
 
+SEXP _get_ACtree2_dense_transitions(SEXP x);
+
+SEXP _get_ACtree2_dense_leaf_P_ids(SEXP x);
+
 void _init_ppdups_buf(int length);
 
 void _report_ppdup(
@@ -932,23 +1235,92 @@ void _match_Twobit(
 	TBMatchBuf *tb_matches
 );
 
+int _match_Twobit_packed(
+	SEXP pptb,
+	const PackedXStringSet_holder *S,
+	int i,
+	int fixedS,
+	TBMatchBuf *tb_matches
+);
+
+SEXP build_Twobit_hash(
+	SEXP tb,
+	SEXP pp_exclude,
+	SEXP base_codes
+);
+
+void _match_Twobit_hash(
+	SEXP pptb,
+	const Chars_holder *S,
+	int fixedS,
+	TBMatchBuf *tb_matches
+);
+
 
 /* BAB_class.c */
 
 SEXP IntegerBAB_new(SEXP max_nblock);
 
+SEXP _new_mapped_IntegerBAB(
+	SEXP region,
+	const int *block0,
+	int nblock,
+	int lastblock_nelt,
+	int block_length
+);
+
+int _IntegerBAB_is_mapped(SEXP x);
+
 int *_get_BAB_nblock_ptr(SEXP x);
 
 int *_get_BAB_lastblock_nelt_ptr(SEXP x);
 
 SEXP _get_BAB_blocks(SEXP x);
 
+int *_get_BAB_block(
+	SEXP x,
+	int b
+);
+
+int _get_BAB_block_length(SEXP x);
+
 SEXP _IntegerBAB_addblock(
 	SEXP x,
 	int block_length
 );
 
 
+/* PDict_file.c */
+
+SEXP PDict_write_file(
+	SEXP filepath,
+	SEXP skeleton,
+	SEXP pptbs
+);
+
+FILE *_open_file_for_replacing(
+	const char *path,
+	char **tmppath
+);
+
+void _close_file_for_replacing(
+	FILE *fp,
+	const char *tmppath,
+	const char *path,
+	int ok
+);
+
+void _release_file_region(SEXP region);
+
+SEXP _new_file_region(
+	const char *path,
+	char **addr,
+	int64_t *file_length
+);
+
+SEXP PDict_load_file(SEXP filepath);
+
+
 /* match_pdict_ACtree2.c */
 
 SEXP ACtree2_nodebuf_max_nblock();
@@ -961,6 +1333,12 @@ SEXP ACtree2_print_nodes(SEXP pptb);
 
 SEXP ACtree2_summary(SEXP pptb);
 
+void _get_ACtree2_lastblock_nints(
+	SEXP pptb,
+	int *nodebuf_nint,
+	int *nodeextbuf_nint
+);
+
 SEXP ACtree2_build(
 	SEXP tb,
 	SEXP pp_exclude,
@@ -969,6 +1347,28 @@ SEXP ACtree2_build(
 	SEXP nodeextbuf_ptr
 );
 
+SEXP ACtree2_add_patterns(
+	SEXP pptb,
+	SEXP tb
+);
+
+SEXP ACtree2_drop_patterns(
+	SEXP pptb,
+	SEXP leaf_P_ids
+);
+
+SEXP ACtree2_copy(
+	SEXP pptb,
+	SEXP nodebuf_ptr,
+	SEXP nodeextbuf_ptr
+);
+
+SEXP ACtree2_compact(
+	SEXP pptb,
+	SEXP nodebuf_ptr,
+	SEXP nodeextbuf_ptr
+);
+
 SEXP ACtree2_has_all_flinks(SEXP pptb);
 
 SEXP ACtree2_compute_all_flinks(SEXP pptb);
@@ -977,7 +1377,8 @@ void _match_tbACtree2(
 	SEXP pptb,
 	const Chars_holder *S,
 	int fixedS,
-	TBMatchBuf *tb_matches
+	TBMatchBuf *tb_matches,
+	int nthreads
 );
 
 void _match_pdictACtree2(
@@ -988,7 +1389,18 @@ void _match_pdictACtree2(
 	int min_nmis,
 	int fixedP,
 	int fixedS,
-	MatchPDictBuf *matchpdict_buf
+	MatchPDictBuf *matchpdict_buf,
+	int nthreads
+);
+
+SEXP ACtree2_dense_build(SEXP pptb);
+
+void _match_tbACtree2_dense(
+	SEXP pptb,
+	const Chars_holder *S,
+	int fixedS,
+	TBMatchBuf *tb_matches,
+	int nthreads
 );
 
 
@@ -1003,7 +1415,8 @@ SEXP match_PDict3Parts_XString(
 	SEXP min_mismatch,
 	SEXP fixed,
 	SEXP matches_as,
-	SEXP envir
+	SEXP envir,
+	SEXP nthreads
 );
 
 SEXP match_XStringSet_XString(
@@ -1074,6 +1487,21 @@ SEXP vmatch_XStringSet_XStringSet(
 	SEXP envir
 );
 
+SEXP vcount_PDict3Parts_files(
+	SEXP pptb,
+	SEXP pdict_head,
+	SEXP pdict_tail,
+	SEXP filexp_list,
+	SEXP format,
+	SEXP lkup,
+	SEXP chunk_size,
+	SEXP max_mismatch,
+	SEXP min_mismatch,
+	SEXP fixed,
+	SEXP collapse,
+	SEXP weight
+);
+
 
 /* align_utils.c */
 
@@ -1128,6 +1556,45 @@ SEXP lcsuffix(
 );
 
 
+/* align_striped.c */
+
+StripedAlignBuffer *_new_StripedAlignBuffer(
+	int maxNChar1,
+	float gapOpening,
+	float gapExtension,
+	const double *substitutionArray,
+	const int *substitutionArrayDim,
+	const int *substitutionLookupTable,
+	int substitutionLookupTableLength,
+	const int *fuzzyMatrix,
+	const int *fuzzyMatrixDim,
+	const int *fuzzyLookupTable,
+	int fuzzyLookupTableLength
+);
+
+int _striped_align_score(
+	StripedAlignBuffer *buf,
+	const Chars_holder *string1,
+	const Chars_holder *string2,
+	int localAlignment,
+	int endGap1,
+	int endGap2,
+	double *score
+);
+
+void _batch_align_scores(
+	StripedAlignBuffer *buf,
+	const Chars_holder *patterns,
+	int npattern,
+	const Chars_holder *subject,
+	int localAlignment,
+	int endGap1,
+	int endGap2,
+	double *scores,
+	int *done
+);
+
+
 /* align_pairwiseAlignment.c */
 
 SEXP XStringSet_align_pairwiseAlignment(
@@ -1144,7 +1611,9 @@ SEXP XStringSet_align_pairwiseAlignment(
 	SEXP substitutionLookupTable,
 	SEXP fuzzyMatrix,
 	SEXP fuzzyMatrixDim,
-	SEXP fuzzyLookupTable
+	SEXP fuzzyLookupTable,
+	SEXP band,
+	SEXP maxTraceCells
 );
 
 SEXP XStringSet_align_distance(
@@ -1159,7 +1628,19 @@ SEXP XStringSet_align_distance(
 	SEXP substitutionLookupTable,
 	SEXP fuzzyMatrix,
 	SEXP fuzzyMatrixDim,
-	SEXP fuzzyLookupTable
+	SEXP fuzzyLookupTable,
+	SEXP band,
+	SEXP nthreads
+);
+
+
+/* align_myers.c */
+
+SEXP XStringSet_dist_levenshtein(
+	SEXP x,
+	SEXP lookupTable,
+	SEXP maxDistance,
+	SEXP nthreads
 );
 
 
@@ -0,0 +1,300 @@
+/****************************************************************************
+ *                 Reading a FASTA or FASTQ file by blocks                  *
+ ****************************************************************************/
+#include "Biostrings.h"
+#include "XVector_interface.h"
+
+#include <stdio.h>
+#include <stdlib.h>  /* for malloc() */
+#include <string.h>  /* for memchr() */
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
+
+/*
+ * A BlockReader reads the file by big blocks and finds the lines in the
+ * current block with memchr(). The lines are not copied: they're returned
+ * as pointers into the block buffer, which can be modified in place (e.g. to
+ * translate the letters) until the next line is requested.
+ * The first read is small and the size of the reads is doubled up to
+ * BLOCKREADER_BUF_SIZE: this avoids reading (and inflating) a big block
+ * when only a few records are loaded after a seek (e.g. by
+ * read_fasta_blocks()).
+ *
+ * A BlockReader reads either from a "file external pointer" (with
+ * filexp_read(), works on compressed files), from a plain file opened
+ * with fopen(), or from a BGZF file (see BGZF.c). Only a BlockReader on a
+ * plain file can be used in a worker thread: it doesn't use the R API.
+ */
+
+#define MIN_READ_SIZE 65536
+
+/* Allocated once and reused by all the "file external pointer" readers
+   (they're only used by the main thread). */
+static char *filexp_reader_buf = NULL;
+
+BlockReader _new_filexp_BlockReader(SEXP filexp)
+{
+	BlockReader reader;
+
+	if (filexp_reader_buf == NULL) {
+		filexp_reader_buf = (char *) malloc(BLOCKREADER_BUF_SIZE + 1);
+		if (filexp_reader_buf == NULL)
+			error("cannot allocate memory for the block buffer");
+	}
+	reader.filexp = filexp;
+	reader.file = NULL;
+	reader.bgzf = NULL;
+	reader.buf = filexp_reader_buf;
+	reader.nbyte = reader.pos = 0;
+	reader.read_size = MIN_READ_SIZE;
+	reader.eof = 0;
+	return reader;
+}
+
+/* 'buf' must have room for BLOCKREADER_BUF_SIZE + 1 bytes. */
+BlockReader _new_file_BlockReader(FILE *file, char *buf)
+{
+	BlockReader reader;
+
+	reader.filexp = NULL;
+	reader.file = file;
+	reader.bgzf = NULL;
+	reader.buf = buf;
+	reader.nbyte = reader.pos = 0;
+	reader.read_size = MIN_READ_SIZE;
+	reader.eof = 0;
+	return reader;
+}
+
+/*
+ * Calls 'parse' on a BlockReader that reads 'filexp' with a BGZF reader if
+ * it's a BGZF file, and through the "file external pointer" otherwise. The
+ * BlockReader starts at 'offset' (an uncompressed offset) and is not
+ * synchronized with the "file external pointer" (whose position is not
+ * changed if the file is a BGZF file). So this should only be used when the
+ * position of 'filexp' after the read doesn't matter (e.g. because the
+ * caller seeks it back).
+ * The BGZF file is closed even if an R error is raised while seeking or by
+ * 'parse' (e.g. by the loader hooks).
+ * Returns what 'parse' returns (an error message or NULL).
+ */
+typedef struct bgzf_parse {
+	BlockReader reader;
+	const char *path;
+	long long int offset;
+	BlockParser parse;
+	void *parser_data;
+	const char *errmsg;
+} BGZFparse;
+
+static SEXP seek_and_parse(void *data)
+{
+	BGZFparse *bgzf_parse = (BGZFparse *) data;
+
+	if (!_BlockReader_seek(&(bgzf_parse->reader), bgzf_parse->offset))
+		error("cannot seek to offset %lld in BGZF file '%s'",
+		      bgzf_parse->offset, bgzf_parse->path);
+	bgzf_parse->errmsg = bgzf_parse->parse(&(bgzf_parse->reader),
+					       bgzf_parse->parser_data);
+	return R_NilValue;
+}
+
+static void close_BGZFparse_reader(void *data)
+{
+	_close_BlockReader(&(((BGZFparse *) data)->reader));
+	return;
+}
+
+const char *_parse_with_BlockReader(SEXP filexp, long long int offset,
+		int nthreads, BlockParser parse, void *parser_data)
+{
+	BGZFparse bgzf_parse;
+	SEXP expath;
+
+	bgzf_parse.reader = _new_filexp_BlockReader(filexp);
+	expath = getAttrib(filexp, install("expath"));
+	if (IS_CHARACTER(expath) && LENGTH(expath) == 1)
+		bgzf_parse.reader.bgzf = _open_BGZFreader(
+					CHAR(STRING_ELT(expath, 0)), nthreads);
+	if (bgzf_parse.reader.bgzf == NULL)
+		return parse(&(bgzf_parse.reader), parser_data);
+	bgzf_parse.reader.filexp = NULL;
+	bgzf_parse.path = CHAR(STRING_ELT(expath, 0));
+	bgzf_parse.offset = offset;
+	bgzf_parse.parse = parse;
+	bgzf_parse.parser_data = parser_data;
+	R_ExecWithCleanup(seek_and_parse, &bgzf_parse,
+			  close_BGZFparse_reader, &bgzf_parse);
+	return bgzf_parse.errmsg;
+}
+
+void _close_BlockReader(BlockReader *reader)
+{
+	if (reader->bgzf != NULL)
+		_close_BGZFreader(reader->bgzf);
+	return;
+}
+
+/* Returns 0 if the seek failed. Never fails on a "file external pointer"
+   reader (filexp_seek() raises an error). */
+int _BlockReader_seek(BlockReader *reader, long long int offset)
+{
+	reader->nbyte = reader->pos = 0;
+	reader->read_size = MIN_READ_SIZE;
+	reader->eof = 0;
+	if (reader->bgzf != NULL)
+		return _BGZFreader_seek(reader->bgzf, offset);
+	if (reader->file == NULL) {
+		filexp_seek(reader->filexp, offset, SEEK_SET);
+		return 1;
+	}
+	return fseek64(reader->file, offset, SEEK_SET) == 0;
+}
+
+/* Moves the unread bytes to the beginning of the buffer and appends the
+   next bytes of the file to them. Returns -1 on read error. */
+static int refill(BlockReader *reader)
+{
+	int nbyte, nread;
+
+	nbyte = reader->nbyte - reader->pos;
+	memmove(reader->buf, reader->buf + reader->pos, nbyte);
+	reader->pos = 0;
+	nread = BLOCKREADER_BUF_SIZE - nbyte;
+	if (nread > reader->read_size)
+		nread = reader->read_size;
+	if (reader->bgzf != NULL) {
+		nread = _BGZFreader_read(reader->bgzf, reader->buf + nbyte,
+					 nread);
+	} else if (reader->file == NULL) {
+		nread = filexp_read(reader->filexp, reader->buf + nbyte, nread);
+	} else {
+		nread = fread(reader->buf + nbyte, sizeof(char), nread,
+			      reader->file);
+		if (nread == 0 && ferror(reader->file))
+			nread = -1;
+	}
+	if (nread < 0)
+		return -1;
+	if (nread == 0)
+		reader->eof = 1;
+	reader->nbyte = nbyte + nread;
+	if (reader->read_size < BLOCKREADER_BUF_SIZE)
+		reader->read_size *= 2;
+	return 0;
+}
+
+/*
+ * Same contract as filexp_gets(): returns 1 if a line (or a piece of a line
+ * that doesn't fit in the buffer) was read, 0 if the end of the file was
+ * reached, and -1 on read error. '*EOL_in_buf' is set to 1 if the returned
+ * piece ends a line. The line is returned in 'line' without its trailing
+ * LF or CRLF, and is nul-terminated if '*EOL_in_buf' is 1. '*nbyte_in' is
+ * set to the nb of bytes consumed in the file.
+ */
+int _BlockReader_gets(BlockReader *reader, Chars_holder *line,
+		int *nbyte_in, int *EOL_in_buf)
+{
+	char *start, *eol;
+	int navail, length;
+
+	while (1) {
+		start = reader->buf + reader->pos;
+		navail = reader->nbyte - reader->pos;
+		eol = memchr(start, '\n', navail);
+		if (eol != NULL) {
+			*nbyte_in = eol - start + 1;
+			length = *nbyte_in - 1;
+			break;
+		}
+		if (reader->eof) {
+			/* Last line has no trailing LF */
+			if (navail == 0)
+				return 0;
+			*nbyte_in = length = navail;
+			break;
+		}
+		if (navail == BLOCKREADER_BUF_SIZE) {
+			/* Line is longer than the buffer. We keep a trailing
+			   CR in the buffer in case it's followed by LF. */
+			*nbyte_in = navail;
+			if (start[navail - 1] == '\r')
+				(*nbyte_in)--;
+			*EOL_in_buf = 0;
+			line->ptr = start;
+			line->length = *nbyte_in;
+			reader->pos += *nbyte_in;
+			return 1;
+		}
+		if (refill(reader) == -1)
+			return -1;
+	}
+	if (length != 0 && start[length - 1] == '\r')
+		length--;
+	start[length] = '\0';
+	*EOL_in_buf = 1;
+	line->ptr = start;
+	line->length = length;
+	reader->pos += *nbyte_in;
+	return 1;
+}
+
+/*
+ * Returns 1 if 'filepath' can be opened with fopen() and doesn't start with
+ * the magic number of a gzip, bzip2 or xz file.
+ */
+int _is_plain_file(const char *filepath)
+{
+	static const unsigned char gzip_magic[] = {0x1f, 0x8b},
+				   bzip2_magic[] = {'B', 'Z', 'h'},
+				   xz_magic[] = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+	unsigned char magic[6];
+	FILE *file;
+	size_t n;
+
+	file = fopen(filepath, "rb");
+	if (file == NULL)
+		return 0;
+	n = fread(magic, sizeof(unsigned char), sizeof(magic), file);
+	fclose(file);
+	if (n >= sizeof(gzip_magic)
+	 && memcmp(magic, gzip_magic, sizeof(gzip_magic)) == 0)
+		return 0;
+	if (n >= sizeof(bzip2_magic)
+	 && memcmp(magic, bzip2_magic, sizeof(bzip2_magic)) == 0)
+		return 0;
+	if (n >= sizeof(xz_magic)
+	 && memcmp(magic, xz_magic, sizeof(xz_magic)) == 0)
+		return 0;
+	return 1;
+}
+
+/*
+ * Returns the paths to the files in 'filexp_list' (a list of "file external
+ * pointers" returned by XVector::open_input_files()), or NULL if one of them
+ * is not a plain (i.e. uncompressed) file. Only plain files can be read by
+ * a BlockReader created with _new_file_BlockReader().
+ */
+const char **_get_plain_filepaths(SEXP filexp_list)
+{
+	const char **filepaths;
+	int i;
+	SEXP expath;
+
+	filepaths = (const char **) R_alloc(LENGTH(filexp_list),
+					    sizeof(const char *));
+	for (i = 0; i < LENGTH(filexp_list); i++) {
+		expath = getAttrib(VECTOR_ELT(filexp_list, i),
+				   install("expath"));
+		if (!IS_CHARACTER(expath) || LENGTH(expath) != 1)
+			return NULL;
+		filepaths[i] = CHAR(STRING_ELT(expath, 0));
+		if (!_is_plain_file(filepaths[i]))
+			return NULL;
+	}
+	return filepaths;
+}
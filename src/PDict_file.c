@@ -0,0 +1,388 @@
+/****************************************************************************
+ *          Saving a PDict object to a file that can be mapped back          *
+ *                        in memory (savePDict/loadPDict)                    *
+ ****************************************************************************/
+#include "Biostrings.h"
+
+#include <stdio.h>
+#include <stdlib.h>  /* for malloc() and free() */
+#include <stdint.h>  /* for int64_t */
+#ifdef _WIN32
+#define PDICT_FILE_NO_MMAP
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+/*
+ * File format (version 1)
+ * -----------------------
+ *   1. A PDictFileHeader struct.
+ *   2. 'nbab' PDictFileBAB structs (1 per node buffer).
+ *   3. The "skeleton" i.e. the PDict object without its node buffers,
+ *      serialized with serialize().
+ *   4. The blocks of each node buffer. All the blocks of a buffer are
+ *      stored contiguously, starting at an offset that is a multiple of
+ *      PDICT_FILE_ALIGNMENT. Only the part of the last block that is in
+ *      use is stored.
+ * Integers are stored in native byte order so a file can only be loaded on
+ * a machine with the same endianness as the machine where it was written
+ * (this is checked with the 'byte_order_mark' field).
+ */
+#define PDICT_FILE_MAGIC "BiostringsPDict"  /* 16 bytes with the '\0' */
+#define PDICT_FILE_VERSION 1
+#define PDICT_FILE_BYTE_ORDER_MARK 0x01020304
+#define PDICT_FILE_ALIGNMENT 4096
+
+typedef struct pdict_file_header {
+	char magic[16];
+	int version;
+	int byte_order_mark;
+	int nbab;
+	int pad;
+	int64_t skeleton_offset;
+	int64_t skeleton_length;
+	int64_t file_length;
+} PDictFileHeader;
+
+typedef struct pdict_file_bab {
+	int64_t offset;  /* offset of the 1st block */
+	int nblock;
+	int lastblock_nelt;
+	int block_length;  /* in ints */
+	int lastblock_nint;  /* nb of ints stored for the last block */
+} PDictFileBAB;
+
+static int64_t align_offset(int64_t offset)
+{
+	int64_t rem;
+
+	rem = offset % PDICT_FILE_ALIGNMENT;
+	return rem == 0 ? offset : offset + PDICT_FILE_ALIGNMENT - rem;
+}
+
+static int write_zeros(FILE *fp, int64_t n)
+{
+	static const char zeros[PDICT_FILE_ALIGNMENT];
+
+	for ( ; n > 0; n -= PDICT_FILE_ALIGNMENT)
+		if (fwrite(zeros, 1, n < PDICT_FILE_ALIGNMENT ?
+				     n : PDICT_FILE_ALIGNMENT, fp) == 0)
+			return -1;
+	return 0;
+}
+
+static void set_bab_desc(PDictFileBAB *desc, SEXP bab, int lastblock_nint)
+{
+	desc->nblock = *_get_BAB_nblock_ptr(bab);
+	desc->lastblock_nelt = *_get_BAB_lastblock_nelt_ptr(bab);
+	if (desc->nblock == 0) {
+		desc->block_length = desc->lastblock_nint = 0;
+		return;
+	}
+	desc->block_length = _get_BAB_block_length(bab);
+	desc->lastblock_nint = lastblock_nint;
+	return;
+}
+
+static int64_t get_bab_data_length(const PDictFileBAB *desc)
+{
+	if (desc->nblock == 0)
+		return 0;
+	return ((int64_t) (desc->nblock - 1) * desc->block_length +
+		desc->lastblock_nint) * sizeof(int);
+}
+
+static int write_bab(FILE *fp, SEXP bab, const PDictFileBAB *desc)
+{
+	int b, nint;
+
+	for (b = 0; b < desc->nblock; b++) {
+		nint = b == desc->nblock - 1 ? desc->lastblock_nint :
+					       desc->block_length;
+		if (fwrite(_get_BAB_block(bab, b), sizeof(int), nint, fp)
+		    != (size_t) nint)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * The file is written to '<path>.tmp' which is then renamed to 'path'.
+ * 'path' can be the file that the object being saved was loaded from (e.g.
+ * savePDict(loadPDict(f), f)) so it must not be truncated while the data
+ * is still read from its mapping (this would raise SIGBUS). Renaming a
+ * file over it leaves the mapped file alive until it's unmapped. Also used
+ * by PackedDNAStringSet_class.c.
+ */
+FILE *_open_file_for_replacing(const char *path, char **tmppath)
+{
+	FILE *fp;
+
+	*tmppath = R_alloc(strlen(path) + 5, sizeof(char));
+	sprintf(*tmppath, "%s.tmp", path);
+	fp = fopen(*tmppath, "wb");
+	if (fp == NULL)
+		error("cannot open file '%s' for writing", *tmppath);
+	return fp;
+}
+
+/* 'ok': whether all the writes succeeded */
+void _close_file_for_replacing(FILE *fp, const char *tmppath,
+		const char *path, int ok)
+{
+	if (fclose(fp) != 0)
+		ok = 0;
+#ifdef _WIN32
+	/* rename() cannot overwrite an existing file on Windows (the loaded
+	   objects are not mapped on Windows, see PDICT_FILE_NO_MMAP) */
+	if (ok)
+		remove(path);
+#endif
+	if (ok && rename(tmppath, path) != 0) {
+		remove(tmppath);
+		error("cannot rename file '%s' to '%s'", tmppath, path);
+	}
+	if (!ok) {
+		remove(tmppath);
+		error("error while writing file '%s'", path);
+	}
+	return;
+}
+
+/*
+ * --- .Call ENTRY POINT ---
+ * 'filepath': the (expanded) path to the file to write.
+ * 'skeleton': a raw vector (the serialized PDict object, see savePDict()).
+ * 'pptbs': a list of ACtree2 objects whose node buffers must be written
+ *          to the file.
+ */
+SEXP PDict_write_file(SEXP filepath, SEXP skeleton, SEXP pptbs)
+{
+	const char *path;
+	char *tmppath;
+	PDictFileHeader header;
+	PDictFileBAB *descs;
+	SEXP pptb, *babs;
+	int npptb, nbab, i, k, nodebuf_nint, nodeextbuf_nint, ok;
+	int64_t offset;
+	FILE *fp;
+
+	path = CHAR(STRING_ELT(filepath, 0));
+	npptb = LENGTH(pptbs);
+	nbab = 2 * npptb;
+	babs = (SEXP *) R_alloc((long) nbab + 1, sizeof(SEXP));
+	descs = (PDictFileBAB *) R_alloc((long) nbab + 1, sizeof(PDictFileBAB));
+	memset(descs, 0, (nbab + 1) * sizeof(PDictFileBAB));
+	for (i = 0; i < npptb; i++) {
+		pptb = VECTOR_ELT(pptbs, i);
+		_get_ACtree2_lastblock_nints(pptb,
+				&nodebuf_nint, &nodeextbuf_nint);
+		babs[2 * i] = _get_ACtree2_nodebuf_ptr(pptb);
+		babs[2 * i + 1] = _get_ACtree2_nodeextbuf_ptr(pptb);
+		set_bab_desc(descs + 2 * i, babs[2 * i], nodebuf_nint);
+		set_bab_desc(descs + 2 * i + 1, babs[2 * i + 1],
+			     nodeextbuf_nint);
+	}
+
+	memset(&header, 0, sizeof(PDictFileHeader));
+	strcpy(header.magic, PDICT_FILE_MAGIC);
+	header.version = PDICT_FILE_VERSION;
+	header.byte_order_mark = PDICT_FILE_BYTE_ORDER_MARK;
+	header.nbab = nbab;
+	header.skeleton_offset = sizeof(PDictFileHeader) +
+				 (int64_t) nbab * sizeof(PDictFileBAB);
+	header.skeleton_length = LENGTH(skeleton);
+	offset = header.skeleton_offset + header.skeleton_length;
+	for (k = 0; k < nbab; k++) {
+		offset = align_offset(offset);
+		descs[k].offset = offset;
+		offset += get_bab_data_length(descs + k);
+	}
+	header.file_length = offset;
+
+	fp = _open_file_for_replacing(path, &tmppath);
+	ok = fwrite(&header, sizeof(PDictFileHeader), 1, fp) == 1
+	  && (nbab == 0 ||
+	      fwrite(descs, sizeof(PDictFileBAB), nbab, fp) == (size_t) nbab)
+	  && fwrite(RAW(skeleton), 1, LENGTH(skeleton), fp)
+	     == (size_t) LENGTH(skeleton);
+	offset = header.skeleton_offset + header.skeleton_length;
+	for (k = 0; k < nbab && ok; k++) {
+		ok = write_zeros(fp, descs[k].offset - offset) == 0
+		  && write_bab(fp, babs[k], descs + k) == 0;
+		offset = descs[k].offset + get_bab_data_length(descs + k);
+	}
+	_close_file_for_replacing(fp, tmppath, path, ok);
+	return R_NilValue;
+}
+
+/* The memory region of a loaded file is owned by an external pointer. Its
+   "protected" value is the length of the region (as a double). Also used
+   by PackedDNAStringSet_class.c. */
+void _release_file_region(SEXP region)
+{
+	void *addr;
+
+	addr = R_ExternalPtrAddr(region);
+	if (addr == NULL)
+		return;
+#ifdef PDICT_FILE_NO_MMAP
+	free(addr);
+#else
+	munmap(addr, (size_t) REAL(R_ExternalPtrProtected(region))[0]);
+#endif
+	R_ClearExternalPtr(region);
+	return;
+}
+
+static char *load_file(const char *path, int64_t *file_length)
+{
+	char *addr;
+#ifdef PDICT_FILE_NO_MMAP
+	FILE *fp;
+	long length;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL)
+		error("cannot open file '%s'", path);
+	if (fseek(fp, 0L, SEEK_END) != 0 || (length = ftell(fp)) < 0) {
+		fclose(fp);
+		error("cannot get the size of file '%s'", path);
+	}
+	addr = length == 0 ? NULL : (char *) malloc(length);
+	if (addr != NULL) {
+		rewind(fp);
+		if (fread(addr, 1, length, fp) != (size_t) length) {
+			free(addr);
+			addr = NULL;
+		}
+	}
+	fclose(fp);
+	if (addr == NULL)
+		error("cannot read file '%s'", path);
+	*file_length = length;
+#else
+	int fd;
+	struct stat st;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		error("cannot open file '%s'", path);
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		error("cannot get the size of file '%s' (or file is empty)",
+		      path);
+	}
+	/* Read-only shared mapping: all the processes that load the same
+	   file share the same copy of it in the page cache */
+	addr = (char *) mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED,
+			     fd, 0);
+	close(fd);
+	if (addr == (char *) MAP_FAILED)
+		error("cannot map file '%s' in memory", path);
+	*file_length = st.st_size;
+#endif
+	return addr;
+}
+
+/* Maps the file in memory (read-only) and returns the external pointer that
+   owns the memory region. The region is released when the external pointer
+   is garbage collected. */
+SEXP _new_file_region(const char *path, char **addr, int64_t *file_length)
+{
+	SEXP region, region_length;
+
+	*addr = load_file(path, file_length);
+	PROTECT(region_length = ScalarReal((double) *file_length));
+	PROTECT(region = R_MakeExternalPtr(*addr, R_NilValue, region_length));
+	R_RegisterCFinalizerEx(region, _release_file_region, TRUE);
+	UNPROTECT(2);
+	return region;
+}
+
+/*
+ * --- .Call ENTRY POINT ---
+ * Returns a list with the "skeleton" (raw vector) and "babs" (list of mapped
+ * IntegerBAB objects, 2 per ACtree2 object in the skeleton) elements.
+ */
+SEXP PDict_load_file(SEXP filepath)
+{
+	const char *path;
+	char *addr;
+	int64_t file_length;
+	const PDictFileHeader *header;
+	const PDictFileBAB *descs, *desc;
+	SEXP region, ans, ans_names, ans_elt, bab;
+	int k;
+
+	path = CHAR(STRING_ELT(filepath, 0));
+	PROTECT(region = _new_file_region(path, &addr, &file_length));
+
+	header = (const PDictFileHeader *) addr;
+	if (file_length < (int64_t) sizeof(PDictFileHeader)
+	 || strcmp(header->magic, PDICT_FILE_MAGIC) != 0) {
+		_release_file_region(region);
+		error("'%s' is not a file written by savePDict()", path);
+	}
+	if (header->byte_order_mark != PDICT_FILE_BYTE_ORDER_MARK) {
+		_release_file_region(region);
+		error("file '%s' was written on a machine with a different "
+		      "endianness", path);
+	}
+	if (header->version != PDICT_FILE_VERSION) {
+		_release_file_region(region);
+		error("file '%s' was written with an incompatible version of "
+		      "savePDict() (format\n  version %d, expected version %d)",
+		      path, header->version, PDICT_FILE_VERSION);
+	}
+	if (header->file_length != file_length
+	 || header->nbab < 0
+	 || header->skeleton_offset != (int64_t) sizeof(PDictFileHeader) +
+				       (int64_t) header->nbab *
+				       sizeof(PDictFileBAB)
+	 || header->skeleton_offset + header->skeleton_length > file_length) {
+		_release_file_region(region);
+		error("file '%s' is truncated or corrupted", path);
+	}
+	descs = (const PDictFileBAB *) (addr + sizeof(PDictFileHeader));
+	for (k = 0; k < header->nbab; k++) {
+		desc = descs + k;
+		if (desc->offset % PDICT_FILE_ALIGNMENT != 0
+		 || desc->offset + get_bab_data_length(desc) > file_length) {
+			_release_file_region(region);
+			error("file '%s' is truncated or corrupted", path);
+		}
+	}
+
+	PROTECT(ans = NEW_LIST(2));
+	PROTECT(ans_names = NEW_CHARACTER(2));
+	SET_STRING_ELT(ans_names, 0, mkChar("skeleton"));
+	SET_STRING_ELT(ans_names, 1, mkChar("babs"));
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(1);
+	PROTECT(ans_elt = NEW_RAW(header->skeleton_length));
+	memcpy(RAW(ans_elt), addr + header->skeleton_offset,
+	       header->skeleton_length);
+	SET_ELEMENT(ans, 0, ans_elt);
+	UNPROTECT(1);
+	PROTECT(ans_elt = NEW_LIST(header->nbab));
+	SET_ELEMENT(ans, 1, ans_elt);
+	UNPROTECT(1);
+	for (k = 0; k < header->nbab; k++) {
+		desc = descs + k;
+		PROTECT(bab = _new_mapped_IntegerBAB(region,
+				(const int *) (addr + desc->offset),
+				desc->nblock, desc->lastblock_nelt,
+				desc->block_length));
+		SET_ELEMENT(ans_elt, k, bab);
+		UNPROTECT(1);
+	}
+	UNPROTECT(3);
+	return ans;
+}
+
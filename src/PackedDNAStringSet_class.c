@@ -0,0 +1,494 @@
+/****************************************************************************
+ *              Basic manipulation of PackedDNAStringSet objects             *
+ ****************************************************************************/
+#include "Biostrings.h"
+#include "XVector_interface.h"
+
+#include <stdio.h>
+
+
+/*
+ * Binary image of a PackedDNAStringSet object (version 1)
+ * -------------------------------------------------------
+ *   1. A PackedImageHeader struct.
+ *   2. The sections described by the header, each of them starting at an
+ *      offset that is a multiple of 8: 'width' (int[nseq]), 'exc_start',
+ *      'exc_width', 'exc_code' (int[nexc] each), 'word_start' and
+ *      'exc_idx' (int64_t[nseq + 1] each), and 'words' (uint64_t[nword]).
+ *      See the PackedXStringSet_holder struct for what they contain.
+ * The image is stored in a raw vector or in a file written by
+ * savePackedDNAStringSet(). In the latter case, the serialized names of the
+ * object follow the image in the file, and the file is mapped in memory
+ * (read-only) by loadPackedDNAStringSet() so the sequences are never
+ * loaded or decoded as a whole. Integers are stored in native byte order.
+ */
+#define PACKED_IMAGE_MAGIC "BiostringsPackedDNA"  /* 20 bytes with the '\0' */
+#define PACKED_IMAGE_VERSION 1
+#define PACKED_IMAGE_BYTE_ORDER_MARK 0x01020304
+
+typedef struct packed_image_header {
+	char magic[24];
+	int version;
+	int byte_order_mark;
+	int bits;
+	int nseq;
+	int base_codes[4];
+	int64_t nexc;
+	int64_t nword;
+	int64_t width_offset;
+	int64_t exc_start_offset;
+	int64_t exc_width_offset;
+	int64_t exc_code_offset;
+	int64_t word_start_offset;
+	int64_t exc_idx_offset;
+	int64_t words_offset;
+	int64_t image_length;
+} PackedImageHeader;
+
+static int64_t align8(int64_t offset)
+{
+	return (offset + 7) & ~((int64_t) 7);
+}
+
+static const char *check_header(const PackedImageHeader *header,
+		int64_t length)
+{
+	if (length < (int64_t) sizeof(PackedImageHeader)
+	 || strcmp(header->magic, PACKED_IMAGE_MAGIC) != 0)
+		return "not a PackedDNAStringSet image";
+	if (header->byte_order_mark != PACKED_IMAGE_BYTE_ORDER_MARK)
+		return "PackedDNAStringSet image was written on a machine "
+		       "with a different endianness";
+	if (header->version != PACKED_IMAGE_VERSION)
+		return "PackedDNAStringSet image was written with an "
+		       "incompatible version of Biostrings";
+	if (header->image_length > length)
+		return "PackedDNAStringSet image is truncated";
+	return NULL;
+}
+
+static SEXP image_symbol = NULL;
+
+static const PackedImageHeader *get_header(SEXP x)
+{
+	SEXP image;
+	const PackedImageHeader *header;
+	int64_t length;
+	const char *errmsg;
+
+	INIT_STATIC_SYMBOL(image)
+	image = GET_SLOT(x, image_symbol);
+	if (TYPEOF(image) == RAWSXP) {
+		header = (const PackedImageHeader *) RAW(image);
+		length = XLENGTH(image);
+	} else if (TYPEOF(image) == EXTPTRSXP) {
+		header = (const PackedImageHeader *) R_ExternalPtrAddr(image);
+		if (header == NULL)
+			error("the file mapped by this PackedDNAStringSet "
+			      "object is no longer mapped (this happens when "
+			      "the object is serialized), please reload it "
+			      "with loadPackedDNAStringSet()");
+		length = (int64_t) REAL(R_ExternalPtrProtected(image))[0];
+	} else {
+		error("Biostrings internal error in get_header(): "
+		      "invalid 'image' slot");
+	}
+	errmsg = check_header(header, length);
+	if (errmsg != NULL)
+		error("%s", errmsg);
+	return header;
+}
+
+
+/****************************************************************************
+ * C-level abstract getters.
+ */
+
+PackedXStringSet_holder _hold_PackedDNAStringSet(SEXP x)
+{
+	const PackedImageHeader *header;
+	const char *image;
+	PackedXStringSet_holder x_holder;
+
+	header = get_header(x);
+	image = (const char *) header;
+	x_holder.bits = header->bits;
+	x_holder.length = header->nseq;
+	memcpy(x_holder.base_codes, header->base_codes, sizeof(int) * 4);
+	x_holder.width = (const int *) (image + header->width_offset);
+	x_holder.word_start =
+		(const int64_t *) (image + header->word_start_offset);
+	x_holder.words = (const uint64_t *) (image + header->words_offset);
+	x_holder.exc_idx = (const int64_t *) (image + header->exc_idx_offset);
+	x_holder.exc_start = (const int *) (image + header->exc_start_offset);
+	x_holder.exc_width = (const int *) (image + header->exc_width_offset);
+	x_holder.exc_code = (const int *) (image + header->exc_code_offset);
+	return x_holder;
+}
+
+/*
+ * Decodes the 'width' letters of sequence 'i' that start at (0-based)
+ * position 'start' into 'buf'. Only the words that overlap with the window
+ * are read.
+ */
+Chars_holder _get_window_from_PackedXStringSet_holder(
+		const PackedXStringSet_holder *x_holder,
+		int i, int start, int width, char *buf)
+{
+	Chars_holder ans;
+	const uint64_t *words;
+	int64_t lo, hi, mid, e;
+	int j, n, from, to;
+
+	words = x_holder->words + x_holder->word_start[i];
+	if (x_holder->bits == 2) {
+		for (j = 0, n = start; j < width; j++, n++)
+			buf[j] = (char) x_holder->base_codes[
+				(words[n >> 5] >> ((n & 31) << 1)) & 3];
+	} else {
+		for (j = 0, n = start; j < width; j++, n++)
+			buf[j] = (char)
+				((words[n >> 4] >> ((n & 15) << 2)) & 15);
+	}
+	/* Find the 1st run of exceptions that ends after 'start' */
+	lo = x_holder->exc_idx[i];
+	hi = x_holder->exc_idx[i + 1];
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (x_holder->exc_start[mid] + x_holder->exc_width[mid] <= start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (e = lo; e < x_holder->exc_idx[i + 1]; e++) {
+		from = x_holder->exc_start[e];
+		if (from >= start + width)
+			break;
+		to = from + x_holder->exc_width[e];
+		if (from < start)
+			from = start;
+		if (to > start + width)
+			to = start + width;
+		memset(buf + from - start, x_holder->exc_code[e], to - from);
+	}
+	ans.ptr = buf;
+	ans.length = width;
+	return ans;
+}
+
+static int popcount64(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_popcountll(x);
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int) ((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/*
+ * Adds the nb of occurences of each letter in sequence 'i' to 'counts'
+ * (an array of 256 ints indexed by letter). With 2 bits per letter, each
+ * word is counted with 3 popcounts. The padding of the last word and the
+ * exceptions are stored as 0 so they are subtracted from the count of
+ * code 0.
+ */
+void _count_letters_in_PackedXStringSet_holder_elt(
+		const PackedXStringSet_holder *x_holder, int i, int *counts)
+{
+	const uint64_t *words;
+	const unsigned char *bytes;
+	int64_t nword, k, e;
+	int n[16], c;
+	uint64_t w, lo, hi;
+
+	words = x_holder->words + x_holder->word_start[i];
+	nword = x_holder->word_start[i + 1] - x_holder->word_start[i];
+	memset(n, 0, sizeof(n));
+	if (x_holder->bits == 2) {
+		for (k = 0; k < nword; k++) {
+			w = words[k];
+			lo = w & 0x5555555555555555ULL;
+			hi = (w >> 1) & 0x5555555555555555ULL;
+			n[1] += popcount64(lo & ~hi);
+			n[2] += popcount64(hi & ~lo);
+			n[3] += popcount64(lo & hi);
+		}
+		n[0] = x_holder->width[i] - n[1] - n[2] - n[3];
+		for (c = 0; c < 4; c++)
+			counts[x_holder->base_codes[c]] += n[c];
+		for (e = x_holder->exc_idx[i]; e < x_holder->exc_idx[i + 1]; e++)
+			counts[x_holder->base_codes[0]] -=
+				x_holder->exc_width[e];
+	} else {
+		bytes = (const unsigned char *) words;
+		for (k = 0; k < nword * 8; k++) {
+			n[bytes[k] & 15]++;
+			n[bytes[k] >> 4]++;
+		}
+		for (c = 1; c < 16; c++)
+			counts[c] += n[c];
+	}
+	for (e = x_holder->exc_idx[i]; e < x_holder->exc_idx[i + 1]; e++)
+		counts[x_holder->exc_code[e]] += x_holder->exc_width[e];
+	return;
+}
+
+
+/****************************************************************************
+ * Packing a DNAStringSet object.
+ */
+
+/* Returns -1 if 'c' must be stored as an exception */
+static int encode_letter(int bits, const ByteTrTable *byte2code,
+		unsigned char c)
+{
+	int code;
+
+	if (bits == 2) {
+		code = byte2code->byte2code[c];
+		return code == NA_INTEGER ? -1 : code;
+	}
+	return c == 0 || c >= 16 ? -1 : c;
+}
+
+/*
+ * --- .Call ENTRY POINT ---
+ * 'x': a DNAStringSet object.
+ * 'bits': 2 or 4.
+ * 'base_codes': the internal codes for A, C, G and T.
+ * Returns the binary image as a raw vector.
+ */
+SEXP PackedDNAStringSet_pack(SEXP x, SEXP bits, SEXP base_codes)
+{
+	XStringSet_holder x_holder;
+	Chars_holder x_elt;
+	ByteTrTable byte2code;
+	PackedImageHeader header;
+	int x_length, bits0, lpw, i, j, code, prev, *width, *exc_start,
+	    *exc_width, *exc_code;
+	int64_t nexc, nword, e, *word_start, *exc_idx;
+	uint64_t *words;
+	unsigned char c;
+	char *image;
+	SEXP ans;
+
+	x_length = _get_XStringSet_length(x);
+	x_holder = _hold_XStringSet(x);
+	bits0 = INTEGER(bits)[0];
+	if (bits0 != 2 && bits0 != 4)
+		error("'bits' must be 2 or 4");
+	lpw = 64 / bits0;
+	_init_byte2offset_with_INTEGER(&byte2code, base_codes, 1);
+
+	/* 1st pass: compute the size of the sections */
+	nexc = nword = 0;
+	for (i = 0; i < x_length; i++) {
+		x_elt = _get_elt_from_XStringSet_holder(&x_holder, i);
+		nword += (x_elt.length + lpw - 1) / lpw;
+		prev = -1;
+		for (j = 0; j < x_elt.length; j++) {
+			c = (unsigned char) x_elt.ptr[j];
+			if (encode_letter(bits0, &byte2code, c) >= 0) {
+				prev = -1;
+				continue;
+			}
+			if (c != prev)
+				nexc++;
+			prev = c;
+		}
+	}
+	memset(&header, 0, sizeof(PackedImageHeader));
+	strcpy(header.magic, PACKED_IMAGE_MAGIC);
+	header.version = PACKED_IMAGE_VERSION;
+	header.byte_order_mark = PACKED_IMAGE_BYTE_ORDER_MARK;
+	header.bits = bits0;
+	header.nseq = x_length;
+	for (j = 0; j < 4; j++)
+		header.base_codes[j] = INTEGER(base_codes)[j];
+	header.nexc = nexc;
+	header.nword = nword;
+	header.width_offset = align8(sizeof(PackedImageHeader));
+	header.exc_start_offset = align8(header.width_offset +
+					 (int64_t) x_length * sizeof(int));
+	header.exc_width_offset = align8(header.exc_start_offset +
+					 nexc * sizeof(int));
+	header.exc_code_offset = align8(header.exc_width_offset +
+					nexc * sizeof(int));
+	header.word_start_offset = align8(header.exc_code_offset +
+					  nexc * sizeof(int));
+	header.exc_idx_offset = header.word_start_offset +
+				((int64_t) x_length + 1) * sizeof(int64_t);
+	header.words_offset = header.exc_idx_offset +
+			      ((int64_t) x_length + 1) * sizeof(int64_t);
+	header.image_length = header.words_offset + nword * sizeof(uint64_t);
+
+	/* 2nd pass: fill the sections */
+	PROTECT(ans = allocVector(RAWSXP, (R_xlen_t) header.image_length));
+	image = (char *) RAW(ans);
+	memset(image, 0, header.image_length);
+	memcpy(image, &header, sizeof(PackedImageHeader));
+	width = (int *) (image + header.width_offset);
+	exc_start = (int *) (image + header.exc_start_offset);
+	exc_width = (int *) (image + header.exc_width_offset);
+	exc_code = (int *) (image + header.exc_code_offset);
+	word_start = (int64_t *) (image + header.word_start_offset);
+	exc_idx = (int64_t *) (image + header.exc_idx_offset);
+	nword = e = 0;
+	for (i = 0; i < x_length; i++) {
+		x_elt = _get_elt_from_XStringSet_holder(&x_holder, i);
+		width[i] = x_elt.length;
+		word_start[i] = nword;
+		exc_idx[i] = e;
+		words = (uint64_t *) (image + header.words_offset) + nword;
+		prev = -1;
+		for (j = 0; j < x_elt.length; j++) {
+			c = (unsigned char) x_elt.ptr[j];
+			code = encode_letter(bits0, &byte2code, c);
+			if (code >= 0) {
+				words[j / lpw] |= (uint64_t) code <<
+						  (bits0 * (j % lpw));
+				prev = -1;
+				continue;
+			}
+			if (c != prev) {
+				exc_start[e] = j;
+				exc_width[e] = 0;
+				exc_code[e] = c;
+				e++;
+			}
+			exc_width[e - 1]++;
+			prev = c;
+		}
+		nword += (x_elt.length + lpw - 1) / lpw;
+	}
+	word_start[x_length] = nword;
+	exc_idx[x_length] = e;
+	UNPROTECT(1);
+	return ans;
+}
+
+
+/****************************************************************************
+ * Other .Call entry points.
+ */
+
+/* --- .Call ENTRY POINT --- */
+SEXP PackedDNAStringSet_length(SEXP x)
+{
+	return ScalarInteger(get_header(x)->nseq);
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP PackedDNAStringSet_bits(SEXP x)
+{
+	return ScalarInteger(get_header(x)->bits);
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP PackedDNAStringSet_width(SEXP x)
+{
+	PackedXStringSet_holder x_holder;
+	SEXP ans;
+
+	x_holder = _hold_PackedDNAStringSet(x);
+	PROTECT(ans = NEW_INTEGER(x_holder.length));
+	memcpy(INTEGER(ans), x_holder.width, sizeof(int) * x_holder.length);
+	UNPROTECT(1);
+	return ans;
+}
+
+/*
+ * --- .Call ENTRY POINT ---
+ * 'i', 'start' (1-based) and 'width': integer vectors of the same length
+ * describing valid windows on the sequences of 'x' (this is checked at the
+ * R level).
+ * Returns a DNAStringSet object with 1 element per window.
+ */
+SEXP PackedDNAStringSet_extract(SEXP x, SEXP i, SEXP start, SEXP width)
+{
+	PackedXStringSet_holder x_holder;
+	XVectorList_holder ans_holder;
+	Chars_holder ans_elt_holder;
+	int nwindow, k;
+	SEXP ans;
+
+	x_holder = _hold_PackedDNAStringSet(x);
+	nwindow = LENGTH(width);
+	PROTECT(ans = _alloc_XStringSet("DNAStringSet", width));
+	ans_holder = hold_XVectorList(ans);
+	for (k = 0; k < nwindow; k++) {
+		ans_elt_holder = get_elt_from_XRawList_holder(&ans_holder, k);
+		_get_window_from_PackedXStringSet_holder(&x_holder,
+				INTEGER(i)[k] - 1, INTEGER(start)[k] - 1,
+				INTEGER(width)[k],
+				(char *) ans_elt_holder.ptr);
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/*
+ * --- .Call ENTRY POINT ---
+ * 'names_blob': a raw vector (the serialized names of 'x', or an empty
+ *               raw vector if 'x' has no names).
+ */
+SEXP PackedDNAStringSet_write_file(SEXP x, SEXP filepath, SEXP names_blob)
+{
+	const PackedImageHeader *header;
+	const char *path;
+	char *tmppath;
+	FILE *fp;
+	int ok;
+
+	header = get_header(x);
+	path = CHAR(STRING_ELT(filepath, 0));
+	/* 'header' can point to the mapping of 'path' */
+	fp = _open_file_for_replacing(path, &tmppath);
+	ok = fwrite(header, 1, header->image_length, fp)
+	     == (size_t) header->image_length
+	  && fwrite(RAW(names_blob), 1, LENGTH(names_blob), fp)
+	     == (size_t) LENGTH(names_blob);
+	_close_file_for_replacing(fp, tmppath, path, ok);
+	return R_NilValue;
+}
+
+/*
+ * --- .Call ENTRY POINT ---
+ * Returns a list with the "image" (external pointer to the mapped file)
+ * and "names_blob" (raw vector) elements.
+ */
+SEXP PackedDNAStringSet_load_file(SEXP filepath)
+{
+	const char *path, *errmsg;
+	char *addr;
+	int64_t file_length, names_length;
+	const PackedImageHeader *header;
+	SEXP region, ans, ans_names, ans_elt;
+
+	path = CHAR(STRING_ELT(filepath, 0));
+	PROTECT(region = _new_file_region(path, &addr, &file_length));
+	header = (const PackedImageHeader *) addr;
+	errmsg = check_header(header, file_length);
+	if (errmsg != NULL) {
+		_release_file_region(region);
+		UNPROTECT(1);
+		error("file '%s': %s", path, errmsg);
+	}
+	names_length = file_length - header->image_length;
+
+	PROTECT(ans = NEW_LIST(2));
+	PROTECT(ans_names = NEW_CHARACTER(2));
+	SET_STRING_ELT(ans_names, 0, mkChar("image"));
+	SET_STRING_ELT(ans_names, 1, mkChar("names_blob"));
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(1);
+	SET_ELEMENT(ans, 0, region);
+	PROTECT(ans_elt = allocVector(RAWSXP, (R_xlen_t) names_length));
+	memcpy(RAW(ans_elt), addr + header->image_length, names_length);
+	SET_ELEMENT(ans, 1, ans_elt);
+	UNPROTECT(3);
+	return ans;
+}
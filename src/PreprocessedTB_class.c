@@ -81,6 +81,30 @@ SEXP _get_Twobit_sign2pos_tag(SEXP x)
 }
 
 
+/****************************************************************************
+ * C-level slot getters for Twobit-hash objects.
+ *
+ * Be careful that these functions do NOT duplicate the returned slot.
+ * Thus they cannot be made .Call() entry points!
+ */
+
+static SEXP
+	table_symbol = NULL,
+	filter_symbol = NULL;
+
+SEXP _get_Twobit_hash_table(SEXP x)
+{
+	INIT_STATIC_SYMBOL(table)
+	return GET_SLOT(x, table_symbol);
+}
+
+SEXP _get_Twobit_hash_filter(SEXP x)
+{
+	INIT_STATIC_SYMBOL(filter)
+	return GET_SLOT(x, filter_symbol);
+}
+
+
 /****************************************************************************
  * C-level slot getters for ACtree2 objects.
  *
@@ -105,6 +129,30 @@ SEXP _get_ACtree2_nodeextbuf_ptr(SEXP x)
 }
 
 
+/****************************************************************************
+ * C-level slot getters for ACtree2-dense objects.
+ *
+ * Be careful that these functions do NOT duplicate the returned slot.
+ * Thus they cannot be made .Call() entry points!
+ */
+
+static SEXP
+	transitions_symbol = NULL,
+	leaf_P_ids_symbol = NULL;
+
+SEXP _get_ACtree2_dense_transitions(SEXP x)
+{
+	INIT_STATIC_SYMBOL(transitions)
+	return GET_SLOT(x, transitions_symbol);
+}
+
+SEXP _get_ACtree2_dense_leaf_P_ids(SEXP x)
+{
+	INIT_STATIC_SYMBOL(leaf_P_ids)
+	return GET_SLOT(x, leaf_P_ids_symbol);
+}
+
+
 /****************************************************************************
  * Buffer of duplicates.
  */
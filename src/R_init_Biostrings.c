@@ -36,24 +36,43 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(new_CHARACTER_from_XStringSet, 2),
 	CALLMETHOD_DEF(XStringSet_unlist, 1),
 
+/* PackedDNAStringSet_class.c */
+	CALLMETHOD_DEF(PackedDNAStringSet_pack, 3),
+	CALLMETHOD_DEF(PackedDNAStringSet_length, 1),
+	CALLMETHOD_DEF(PackedDNAStringSet_bits, 1),
+	CALLMETHOD_DEF(PackedDNAStringSet_width, 1),
+	CALLMETHOD_DEF(PackedDNAStringSet_extract, 4),
+	CALLMETHOD_DEF(PackedDNAStringSet_write_file, 3),
+	CALLMETHOD_DEF(PackedDNAStringSet_load_file, 1),
+
 /* xscat.c */
 	CALLMETHOD_DEF(XString_xscat, 1),
 	CALLMETHOD_DEF(XStringSet_xscat, 1),
 
 /* read_fasta_files.c */
 	CALLMETHOD_DEF(read_fasta_files, 7),
-	CALLMETHOD_DEF(fasta_index, 5),
-	CALLMETHOD_DEF(read_fasta_blocks, 6),
+	CALLMETHOD_DEF(fasta_index, 6),
+	CALLMETHOD_DEF(read_fasta_blocks, 8),
 	CALLMETHOD_DEF(write_XStringSet_to_fasta, 4),
 
 /* read_fastq_files.c */
 	CALLMETHOD_DEF(fastq_seqlengths, 4),
-	CALLMETHOD_DEF(read_fastq_files, 8),
+	CALLMETHOD_DEF(read_fastq_files, 10),
 	CALLMETHOD_DEF(write_XStringSet_to_fastq, 4),
+	CALLMETHOD_DEF(write_XStringSet_to_fastq_file, 7),
+
+/* fasta_fai.c */
+	CALLMETHOD_DEF(fasta_fai, 2),
+	CALLMETHOD_DEF(read_fai_regions, 8),
+
+/* read_twobit_files.c */
+	CALLMETHOD_DEF(twobit_index, 1),
+	CALLMETHOD_DEF(read_twobit_regions, 6),
 
 /* letter_frequency.c */
 	CALLMETHOD_DEF(XString_letter_frequency, 3),
 	CALLMETHOD_DEF(XStringSet_letter_frequency, 4),
+	CALLMETHOD_DEF(PackedDNAStringSet_letter_frequency, 4),
 	CALLMETHOD_DEF(XString_letterFrequencyInSlidingView, 5),
 	CALLMETHOD_DEF(XStringSet_letterFrequency, 5),
 	CALLMETHOD_DEF(XString_oligo_frequency, 8),
@@ -97,7 +116,7 @@ static const R_CallMethodDef callMethods[] = {
 /* match_pattern.c */
 	CALLMETHOD_DEF(XString_match_pattern, 8),
 	CALLMETHOD_DEF(XStringViews_match_pattern, 10),
-	CALLMETHOD_DEF(XStringSet_vmatch_pattern, 8),
+	CALLMETHOD_DEF(XStringSet_vmatch_pattern, 9),
 
 /* match_PWM.c */
 	CALLMETHOD_DEF(PWM_score_starting_at, 4),
@@ -110,10 +129,15 @@ static const R_CallMethodDef callMethods[] = {
 
 /* match_pdict_Twobit.c */
 	CALLMETHOD_DEF(build_Twobit, 3),
+	CALLMETHOD_DEF(build_Twobit_hash, 3),
 
 /* BAB_class.c */
 	CALLMETHOD_DEF(IntegerBAB_new, 1),
 
+/* PDict_file.c */
+	CALLMETHOD_DEF(PDict_write_file, 3),
+	CALLMETHOD_DEF(PDict_load_file, 1),
+
 /* match_pdict_ACtree2.c */
 	CALLMETHOD_DEF(ACtree2_nodebuf_max_nblock, 0),
 	CALLMETHOD_DEF(ACtree2_nodeextbuf_max_nblock, 0),
@@ -121,16 +145,22 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(ACtree2_print_nodes, 1),
 	CALLMETHOD_DEF(ACtree2_summary, 1),
 	CALLMETHOD_DEF(ACtree2_build, 5),
+	CALLMETHOD_DEF(ACtree2_add_patterns, 2),
+	CALLMETHOD_DEF(ACtree2_drop_patterns, 2),
+	CALLMETHOD_DEF(ACtree2_copy, 3),
+	CALLMETHOD_DEF(ACtree2_compact, 3),
 	CALLMETHOD_DEF(ACtree2_has_all_flinks, 1),
 	CALLMETHOD_DEF(ACtree2_compute_all_flinks, 1),
+	CALLMETHOD_DEF(ACtree2_dense_build, 1),
 
 /* match_pdict.c */
-	CALLMETHOD_DEF(match_PDict3Parts_XString, 9),
+	CALLMETHOD_DEF(match_PDict3Parts_XString, 10),
 	CALLMETHOD_DEF(match_XStringSet_XString, 9),
 	CALLMETHOD_DEF(match_PDict3Parts_XStringViews, 11),
 	CALLMETHOD_DEF(match_XStringSet_XStringViews, 11),
 	CALLMETHOD_DEF(vmatch_PDict3Parts_XStringSet, 11),
 	CALLMETHOD_DEF(vmatch_XStringSet_XStringSet, 11),
+	CALLMETHOD_DEF(vcount_PDict3Parts_files, 12),
 
 /* align_utils.c */
 	CALLMETHOD_DEF(PairwiseAlignments_nmatch, 4),
@@ -144,8 +174,11 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(lcsuffix, 6),
 
 /* align_pairwiseAlignment.c */
-	CALLMETHOD_DEF(XStringSet_align_pairwiseAlignment, 14),
-	CALLMETHOD_DEF(XStringSet_align_distance, 12),
+	CALLMETHOD_DEF(XStringSet_align_pairwiseAlignment, 16),
+	CALLMETHOD_DEF(XStringSet_align_distance, 14),
+
+/* align_myers.c */
+	CALLMETHOD_DEF(XStringSet_dist_levenshtein, 4),
 
 /* align_needwunsQS.c */
 	CALLMETHOD_DEF(align_needwunsQS, 7),
@@ -195,6 +228,13 @@ void R_init_Biostrings(DllInfo *info)
 	REGISTER_CCALLABLE(_drop_reported_matches);
 	REGISTER_CCALLABLE(_get_match_count);
 	REGISTER_CCALLABLE(_reported_matches_asSEXP);
+	REGISTER_CCALLABLE(_new_MatchReporter);
+	REGISTER_CCALLABLE(_MatchReporter_set_PSpair);
+	REGISTER_CCALLABLE(_MatchReporter_set_shift);
+	REGISTER_CCALLABLE(_MatchReporter_report_match);
+	REGISTER_CCALLABLE(_MatchReporter_drop_matches);
+	REGISTER_CCALLABLE(_MatchReporter_get_match_count);
+	REGISTER_CCALLABLE(_MatchReporter_matches_asSEXP);
 
 /* MIndex_class.c */
 	REGISTER_CCALLABLE(_hold_MIndex);
@@ -204,6 +244,7 @@ void R_init_Biostrings(DllInfo *info)
 
 /* match_pattern_boyermoore.c */
 	REGISTER_CCALLABLE(_match_pattern_boyermoore);
+	REGISTER_CCALLABLE(_match_pattern_boyermoore_with_reporter);
 
 	return;
 }
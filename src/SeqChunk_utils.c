@@ -0,0 +1,74 @@
+/****************************************************************************
+ *          Buffering the records of a FASTA or FASTQ file stream           *
+ ****************************************************************************/
+#include "Biostrings.h"
+#include "S4Vectors_interface.h"
+
+
+/*
+ * The SeqChunk buffer is filled by _stream_fasta_files() and
+ * _stream_fastq_files(). Its 2 buffers are reused from one chunk to the next
+ * so the memory footprint only depends on 'chunk_size' and on the length of
+ * the records, not on the size of the files.
+ */
+
+SeqChunk _new_SeqChunk(int chunk_size,
+		void (*chunk_hook)(SeqChunk *chunk), void *ext)
+{
+	SeqChunk chunk;
+
+	if (chunk_size < 1)
+		error("'chunk_size' must be >= 1");
+	chunk.chunk_size = chunk_size;
+	chunk.data = new_CharAE(0);
+	chunk.ends = new_IntAE(0, 0, 0);
+	chunk.chunk_hook = chunk_hook;
+	chunk.ext = ext;
+	return chunk;
+}
+
+int _SeqChunk_get_nseq(const SeqChunk *chunk)
+{
+	return IntAE_get_nelt(chunk->ends);
+}
+
+Chars_holder _SeqChunk_get_elt(const SeqChunk *chunk, int i)
+{
+	Chars_holder x;
+	int start;
+
+	start = i == 0 ? 0 : chunk->ends->elts[i - 1];
+	x.ptr = chunk->data->elts + start;
+	x.length = chunk->ends->elts[i] - start;
+	return x;
+}
+
+/* Passes the sequences of the chunk to the chunk hook and empties the chunk */
+void _SeqChunk_flush(SeqChunk *chunk)
+{
+	if (_SeqChunk_get_nseq(chunk) != 0)
+		chunk->chunk_hook(chunk);
+	CharAE_set_nelt(chunk->data, 0);
+	IntAE_set_nelt(chunk->ends, 0);
+	return;
+}
+
+void _SeqChunk_new_empty_seq(SeqChunk *chunk)
+{
+	int nseq;
+
+	nseq = _SeqChunk_get_nseq(chunk);
+	if (nseq == chunk->chunk_size) {
+		_SeqChunk_flush(chunk);
+		nseq = 0;
+	}
+	IntAE_insert_at(chunk->ends, nseq, CharAE_get_nelt(chunk->data));
+	return;
+}
+
+void _SeqChunk_append_seq(SeqChunk *chunk, const Chars_holder *seq_data)
+{
+	CharAE_append(chunk->data, seq_data->ptr, seq_data->length);
+	chunk->ends->elts[_SeqChunk_get_nseq(chunk) - 1] += seq_data->length;
+	return;
+}
@@ -0,0 +1,244 @@
+/****************************************************************************
+ *        Bit-parallel Levenshtein distance (Myers 1999, Hyyro 2001)        *
+ *                                                                          *
+ * Computes the unit-cost edit distance between 2 strings with the          *
+ * bit-vector algorithm of Myers, in its "global distance" form (row 0 of   *
+ * the DP matrix is D(0,j) = j). The pattern (the string in the rows of the *
+ * DP matrix) is split into blocks of 64 rows that are processed from top   *
+ * to bottom for each letter of the text, the horizontal delta at the      *
+ * bottom of a block being carried to the top of the next one.             *
+ ****************************************************************************/
+#include "Biostrings.h"
+#include <R_ext/Utils.h>        /* R_CheckUserInterrupt */
+
+#include <stdint.h>
+#include <limits.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+typedef uint64_t MyersWord;
+
+#define NBIT_PER_MYERSWORD 64
+#define MYERSWORD_HIGHBIT (((MyersWord) 1) << (NBIT_PER_MYERSWORD - 1))
+
+typedef struct myers_buf {
+	int nclass;
+	int max_nword;
+	MyersWord *Peq;     /* nclass x max_nword match masks of the pattern */
+	MyersWord *Pv, *Mv; /* vertical deltas (+1 / -1) of the current column */
+	int nword;          /* nb of words used by the current pattern */
+	int nchar;          /* nchar(pattern) */
+} MyersBuf;
+
+static MyersBuf new_MyersBuf(int nclass, int max_nchar)
+{
+	MyersBuf buf;
+
+	buf.nclass = nclass;
+	buf.max_nword = (max_nchar + NBIT_PER_MYERSWORD - 1) / NBIT_PER_MYERSWORD;
+	if (buf.max_nword == 0)
+		buf.max_nword = 1;
+	buf.Peq = (MyersWord *) R_alloc((long) nclass * buf.max_nword,
+					sizeof(MyersWord));
+	buf.Pv = (MyersWord *) R_alloc((long) buf.max_nword, sizeof(MyersWord));
+	buf.Mv = (MyersWord *) R_alloc((long) buf.max_nword, sizeof(MyersWord));
+	buf.nword = buf.nchar = 0;
+	return buf;
+}
+
+/* Letters are translated to equivalence classes by 'byte2class' (which
+   must contain all the letters of the pattern). */
+static void set_pattern(MyersBuf *buf, const Chars_holder *P,
+			const int *byte2class)
+{
+	int i, nword;
+
+	nword = (P->length + NBIT_PER_MYERSWORD - 1) / NBIT_PER_MYERSWORD;
+	memset(buf->Peq, 0, (long) buf->nclass * nword * sizeof(MyersWord));
+	for (i = 0; i < P->length; i++)
+		buf->Peq[byte2class[(unsigned char) P->ptr[i]] * nword +
+			 i / NBIT_PER_MYERSWORD] |=
+			((MyersWord) 1) << (i % NBIT_PER_MYERSWORD);
+	buf->nword = nword;
+	buf->nchar = P->length;
+	return;
+}
+
+/*
+ * Updates the vertical deltas of a block of 64 rows for the next column of
+ * the DP matrix. 'hin' is the horizontal delta (+1, 0 or -1) above the block.
+ * Returns the horizontal delta at the row of the block selected by 'outbit'.
+ */
+static inline int advance_block(MyersWord *Pv, MyersWord *Mv, MyersWord Eq,
+				int hin, MyersWord outbit)
+{
+	MyersWord Xv, Xh, Ph, Mh;
+	int hout;
+
+	Xv = Eq | *Mv;
+	if (hin < 0)
+		Eq |= 1;
+	Xh = (((Eq & *Pv) + *Pv) ^ *Pv) | Eq;
+	Ph = *Mv | ~(Xh | *Pv);
+	Mh = *Pv & Xh;
+	hout = 0;
+	if (Ph & outbit)
+		hout = 1;
+	else if (Mh & outbit)
+		hout = -1;
+	Ph <<= 1;
+	Mh <<= 1;
+	if (hin < 0)
+		Mh |= 1;
+	else if (hin > 0)
+		Ph |= 1;
+	*Pv = Mh | ~(Xv | Ph);
+	*Mv = Ph & Xv;
+	return hout;
+}
+
+/*
+ * Edit distance between the pattern stored in 'buf' and 'T'. Returns -1 as
+ * soon as the distance is known to be > max_dist.
+ */
+static int myers_distance(MyersBuf *buf, const Chars_holder *T,
+			  const int *byte2class, int max_dist)
+{
+	int m, n, nword, last, b, j, hin, score;
+	MyersWord *Pv = buf->Pv, *Mv = buf->Mv, lastbit;
+	const MyersWord *Eq;
+
+	m = buf->nchar;
+	n = T->length;
+	if ((m > n ? m - n : n - m) > max_dist)
+		return -1;
+	if (m == 0)
+		return n;
+	nword = buf->nword;
+	last = nword - 1;
+	lastbit = ((MyersWord) 1) << ((m - 1) % NBIT_PER_MYERSWORD);
+	for (b = 0; b < nword; b++) {
+		Pv[b] = ~((MyersWord) 0);
+		Mv[b] = 0;
+	}
+	score = m;
+	for (j = 0; j < n; j++) {
+		Eq = buf->Peq + byte2class[(unsigned char) T->ptr[j]] * nword;
+		hin = 1;
+		for (b = 0; b < last; b++)
+			hin = advance_block(Pv + b, Mv + b, Eq[b], hin,
+					    MYERSWORD_HIGHBIT);
+		score += advance_block(Pv + last, Mv + last, Eq[last], hin,
+				       lastbit);
+		/* Each remaining column can decrease the score by at most 1 */
+		if (score - (n - j - 1) > max_dist)
+			return -1;
+	}
+	return score;
+}
+
+/* 0-based index of the (i, j) pair (i < j) in a "dist" vector */
+static R_xlen_t get_dist_index(R_xlen_t n, R_xlen_t i, R_xlen_t j)
+{
+	return i * (2 * n - i - 1) / 2 + j - i - 1;
+}
+
+
+/****************************************************************************
+ * --- .Call ENTRY POINT ---
+ * XStringSet_dist_levenshtein() used by stringDist, method = "levenshtein".
+ * 'lookupTable':  translates the letters of 'x' to equivalence classes
+ *                 (integer vector)
+ * 'maxDistance':  distances greater than this are reported as NA
+ *                 (single non-negative integer or NA for no limit)
+ * 'nthreads':     nb of threads to use (ignored if Biostrings was compiled
+ *                 without OpenMP support)
+ * Returns a numeric vector containing the lower triangle of the distance
+ * matrix.
+ */
+SEXP XStringSet_dist_levenshtein(SEXP x, SEXP lookupTable, SEXP maxDistance,
+				 SEXP nthreads)
+{
+	XStringSet_holder X;
+	Chars_holder *strings;
+	MyersBuf *bufs;
+	int x_length, max_nchar, nclass, max_dist, nthreads0, byte2class[256];
+	int i, k, t, c;
+	double *ans_elt;
+	SEXP ans;
+
+	X = _hold_XStringSet(x);
+	x_length = _get_length_from_XStringSet_holder(&X);
+	max_dist = INTEGER(maxDistance)[0];
+	if (max_dist == NA_INTEGER)
+		max_dist = INT_MAX;
+	nthreads0 = INTEGER(nthreads)[0];
+#ifdef _OPENMP
+	if (nthreads0 < 1)
+		nthreads0 = 1;
+#else
+	nthreads0 = 1;
+#endif
+
+	/* Translation table (the threads cannot raise errors, so all the
+	   letters are checked here) */
+	nclass = 1;
+	for (c = 0; c < 256; c++) {
+		byte2class[c] = NA_INTEGER;
+		if (c < LENGTH(lookupTable))
+			byte2class[c] = INTEGER(lookupTable)[c];
+		if (byte2class[c] != NA_INTEGER && byte2class[c] >= nclass)
+			nclass = byte2class[c] + 1;
+	}
+	strings = (Chars_holder *) R_alloc((long) x_length,
+					   sizeof(Chars_holder));
+	max_nchar = 0;
+	for (i = 0; i < x_length; i++) {
+		strings[i] = _get_elt_from_XStringSet_holder(&X, i);
+		for (k = 0; k < strings[i].length; k++) {
+			c = (unsigned char) strings[i].ptr[k];
+			if (byte2class[c] == NA_INTEGER)
+				error("key %d not in lookup table", c);
+		}
+		if (strings[i].length > max_nchar)
+			max_nchar = strings[i].length;
+	}
+
+	bufs = (MyersBuf *) R_alloc((long) nthreads0, sizeof(MyersBuf));
+	for (t = 0; t < nthreads0; t++)
+		bufs[t] = new_MyersBuf(nclass, max_nchar);
+
+	PROTECT(ans = NEW_NUMERIC(((R_xlen_t) x_length * (x_length - 1)) / 2));
+	ans_elt = REAL(ans);
+	volatile int interrupted = 0;
+	#pragma omp parallel for num_threads(nthreads0) schedule(dynamic, 1)
+	for (i = 0; i < x_length - 1; i++) {
+		int thread_num, j, d;
+		MyersBuf *buf;
+#ifdef _OPENMP
+		thread_num = omp_get_thread_num();
+#else
+		thread_num = 0;
+#endif
+		if (interrupted)
+			continue;
+		if (thread_num == 0 && _interrupt_is_pending()) {
+			interrupted = 1;
+			continue;
+		}
+		buf = bufs + thread_num;
+		set_pattern(buf, strings + i, byte2class);
+		for (j = i + 1; j < x_length; j++) {
+			d = myers_distance(buf, strings + j, byte2class,
+					   max_dist);
+			ans_elt[get_dist_index(x_length, i, j)] =
+				d < 0 ? NA_REAL : (double) d;
+		}
+	}
+	UNPROTECT(1);
+	if (interrupted)
+		error("interrupted by the user");
+	return ans;
+}
+
@@ -4,7 +4,11 @@
 #include <R_ext/Utils.h>        /* R_CheckUserInterrupt */
 
 #include <float.h>
+#include <math.h>
 #include <stdlib.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define MAX(x, y) (x > y ? x : y)
 #define MIN(x, y) (x < y ? x : y)
@@ -26,9 +30,13 @@
 
 #define CURR_MATRIX(i, j) (currMatrix[i + nCharString1Plus1 * j])
 #define PREV_MATRIX(i, j) (prevMatrix[i + nCharString1Plus1 * j])
-#define S_TRACE_MATRIX(i, j) (sTraceMatrix[i + nCharString1 * j])
-#define D_TRACE_MATRIX(i, j) (dTraceMatrix[i + nCharString1 * j])
-#define I_TRACE_MATRIX(i, j) (iTraceMatrix[i + nCharString1 * j])
+#define S_TRACE_MATRIX(i, j) (sTraceMatrix[(i - traceRowOffset) + traceNRow * (j - traceColOffset)])
+#define D_TRACE_MATRIX(i, j) (dTraceMatrix[(i - traceRowOffset) + traceNRow * (j - traceColOffset)])
+#define I_TRACE_MATRIX(i, j) (iTraceMatrix[(i - traceRowOffset) + traceNRow * (j - traceColOffset)])
+#define SET_CURR_MATRIX_ROW(i, value) \
+{ \
+	CURR_MATRIX(i, 0) = CURR_MATRIX(i, 1) = CURR_MATRIX(i, 2) = (value); \
+}
 #define FUZZY_MATRIX(i, j) (fuzzyMatrix[i + fuzzyMatrixDim[0] * j])
 #define SUBSTITUTION_ARRAY(i, j, k) (substitutionArray[i + substitutionArrayDim[0] * (j + substitutionArrayDim[1] * k)])
 
@@ -98,6 +106,18 @@ struct AlignBuffer {
 	char *sTraceMatrix;
 	char *iTraceMatrix;
 	char *dTraceMatrix;
+	StripedAlignBuffer *striped;  /* NULL if the striped engine can't be used */
+	/* When nchar(pattern) * nchar(subject) > maxTraceCells, the trace
+	   matrices only hold a block of the DP matrices at a time (traceNRow
+	   rows starting after row traceRowOffset, and the columns starting
+	   after column traceColOffset), and the traceback recomputes the blocks
+	   that the optimal path goes through (see trace_block()). */
+	double maxTraceCells;
+	int blockMode;
+	int blockTraceCells;  /* max nb of cells of a block */
+	int traceRowOffset, traceNRow, traceColOffset;
+	int *currCross, *prevCross;  /* block mode only */
+	int nBandEdgeHits;  /* nb of optimal paths that hit the edge of the band */
 };
 void function2(struct AlignBuffer *);
 
@@ -121,30 +141,448 @@ struct IndelBuffer {
 };
 void function4(struct IndelBuffer *);
 
-/* Traceback through the score matrices */
-static void traceback(const struct AlignBuffer *alignBufferPtr,
-		      char currTraceMatrix,
-		      struct AlignInfo *align1InfoPtr,
-		      struct AlignInfo *align2InfoPtr)
-{
+/*
+ * Structure holding the inputs of a pairwise alignment with traceback, so
+ * that blocks of the trace matrices can be recomputed during the traceback.
+ */
+struct TraceDP {
+	struct AlignInfo *align1InfoPtr;
+	struct AlignInfo *align2InfoPtr;
+	Chars_holder sequence1, sequence2;
+	int scalar1, scalar2;
+	int localAlignment;
+	float gapOpening;
+	float gapExtension;
+	const double *substitutionArray;
+	const int *substitutionArrayDim;
+	const int *substitutionLookupTable;
+	int substitutionLookupTableLength;
+	const int *fuzzyMatrix;
+	const int *fuzzyMatrixDim;
+	const int *fuzzyLookupTable;
+	int fuzzyLookupTableLength;
+	struct AlignBuffer *alignBufferPtr;
+	int banded, bandLo, bandHi;
+	int hitBandEdge;    /* set by traceback() */
+	float *currMatrix;  /* last computed column */
+	int *currCross;     /* last computed column (block mode only) */
+	double maxScore;    /* best local score (forward pass only) */
+};
+
+/* Position of the traceback in the trace matrices (0-based) */
+struct TraceState {
 	int i, j;
-	char prevTraceMatrix = '?';
+	char currTraceMatrix;
+	char prevTraceMatrix;
+};
+
+/*
+ * In block mode, a block is traced back from the trace matrices when it has
+ * at most MIN(maxTraceCells, BLOCK_TRACE_CELLS) cells or is 1 column wide.
+ * Otherwise it is split in 2 halves of columns (see trace_block()).
+ */
+#define BLOCK_TRACE_CELLS 1048576
+
+static int get_block_trace_cells(double maxTraceCells)
+{
+	return (int) MIN(maxTraceCells, (double) BLOCK_TRACE_CELLS);
+}
+
+/*
+ * Limits of the band of diagonals (j - i) allowed for the interior cells of
+ * the DP matrices when the 'band' argument is used. The band is widened to
+ * always contain the 2 corners of the matrices. Returns 0 if the band
+ * contains all the cells anyway. Row 0, column 0, and the cells filled by the
+ * "no end gap" patches are not constrained by the band.
+ */
+static int get_band_limits(int band, int nCharString1, int nCharString2,
+			   int *bandLo, int *bandHi)
+{
+	int diff;
+
+	if (band == NA_INTEGER ||
+	    (double) band >= (double) nCharString1 + nCharString2)
+		return 0;
+	diff = nCharString2 - nCharString1;
+	*bandLo = MIN(0, diff) - band;
+	*bandHi = MAX(0, diff) + band;
+	return *bandLo > 1 - nCharString1 || *bandHi < nCharString2 - 1;
+}
+
+/* Column 0 of the score matrices */
+static void init_first_column(const struct AlignInfo *align1InfoPtr,
+			      const struct AlignInfo *align2InfoPtr,
+			      float gapOpening, float gapExtension,
+			      float *currMatrix)
+{
+	int i;
+	const int nCharString1 = align1InfoPtr->string.length;
+	const int nCharString1Plus1 = nCharString1 + 1;
+
+	CURR_MATRIX(0, 0) = 0.0;
+	CURR_MATRIX(0, 1) = (align2InfoPtr->endGap ? - gapOpening : 0.0);
+	for (i = 1; i <= nCharString1; i++) {
+		CURR_MATRIX(i, 0) = NEGATIVE_INFINITY;
+		CURR_MATRIX(i, 1) = NEGATIVE_INFINITY;
+	}
+	if (align1InfoPtr->endGap) {
+		for (i = 0; i <= nCharString1; i++)
+			CURR_MATRIX(i, 2) = - gapOpening - i * gapExtension;
+	} else {
+		for (i = 0; i <= nCharString1; i++)
+			CURR_MATRIX(i, 2) = 0.0;
+	}
+	return;
+}
+
+/* The cell of column crossCol (in state 0, 1 or 2) that the traceback from
+   a cell of a following column goes through first, or NO_CROSS if the
+   traceback stops or leaves the block before */
+#define NO_CROSS -1
+#define CROSS_CODE(i, k) (3 * (i) + (k))
+#define TRACE_STATE(trace) ((trace) == SUBSTITUTION ? 0 : ((trace) == DELETION ? 1 : 2))
+#define CURR_CROSS(i, k) (currCross[i + nCharString1Plus1 * k])
+#define PREV_CROSS(i, k) (prevCross[i + nCharString1Plus1 * k])
+#define SET_CURR_CROSS_ROW(i, value) \
+{ \
+	CURR_CROSS(i, 0) = CURR_CROSS(i, 1) = CURR_CROSS(i, 2) = (value); \
+}
+#define SET_CURR_CROSS_S(i, trace) \
+{ \
+	CURR_CROSS(i, 0) = ((trace) == TERMINATION || i - 1 < r0) ? NO_CROSS : \
+		(jMinus1 == crossCol ? CROSS_CODE(i - 1, TRACE_STATE(trace)) : \
+				       PREV_CROSS(i - 1, TRACE_STATE(trace))); \
+}
+#define SET_CURR_CROSS_D(i, trace) \
+{ \
+	CURR_CROSS(i, 1) = (trace) == TERMINATION ? NO_CROSS : \
+		(jMinus1 == crossCol ? CROSS_CODE(i, TRACE_STATE(trace)) : \
+				       PREV_CROSS(i, TRACE_STATE(trace))); \
+}
+#define SET_CURR_CROSS_I(i, trace) \
+{ \
+	CURR_CROSS(i, 2) = ((trace) == TERMINATION || i - 1 < r0) ? NO_CROSS : \
+		CURR_CROSS(i - 1, TRACE_STATE(trace)); \
+}
+
+/*
+ * Fill rows r0 to r1 of columns c0 to c1 (1-based) of the score matrices,
+ * and of the trace matrices if 'storeTrace' is TRUE.
+ * On entry, dp->currMatrix must hold rows r0 - 1 to r1 of column c0 - 1
+ * and, unless r0 is 1, 'top' must hold row r0 - 1 of columns c0 - 1 to c1
+ * (3 scores per cell). On return, dp->currMatrix holds column c1.
+ * If 'crossCol' is not 0, rows r0 - 1 to r1 of column crossCol are saved in
+ * 'crossColScores', and dp->currCross gives for each cell of column c1 the
+ * cell of column crossCol that the traceback from this cell goes through.
+ * If 'lastRowScores' is not NULL, row r1 of columns c0 to c1 is saved in it.
+ */
+static void fill_score_block(struct TraceDP *dp, int r0, int r1, int c0, int c1,
+			     const float *top, int storeTrace, int forwardPass,
+			     int crossCol, float *crossColScores,
+			     float *lastRowScores)
+{
+	int i, j, k, iMinus1, jMinus1;
+	struct AlignInfo *align1InfoPtr = dp->align1InfoPtr;
+	struct AlignInfo *align2InfoPtr = dp->align2InfoPtr;
+	struct AlignBuffer *alignBufferPtr = dp->alignBufferPtr;
+	const int nCharString1 = align1InfoPtr->string.length;
+	const int nCharString2 = align2InfoPtr->string.length;
+	const int nCharString1Plus1 = nCharString1 + 1;
+	const int nCharString1Minus1 = nCharString1 - 1;
+	const Chars_holder sequence1 = dp->sequence1, sequence2 = dp->sequence2;
+	const int scalar1 = dp->scalar1, scalar2 = dp->scalar2;
+	const int localAlignment = dp->localAlignment;
+	const float gapOpening = dp->gapOpening;
+	const float gapExtension = dp->gapExtension;
+	const double *substitutionArray = dp->substitutionArray;
+	const int *substitutionArrayDim = dp->substitutionArrayDim;
+	const int *substitutionLookupTable = dp->substitutionLookupTable;
+	const int substitutionLookupTableLength = dp->substitutionLookupTableLength;
+	const int *fuzzyMatrix = dp->fuzzyMatrix;
+	const int *fuzzyMatrixDim = dp->fuzzyMatrixDim;
+	const int *fuzzyLookupTable = dp->fuzzyLookupTable;
+	const int fuzzyLookupTableLength = dp->fuzzyLookupTableLength;
+	char *sTraceMatrix = alignBufferPtr->sTraceMatrix;
+	char *iTraceMatrix = alignBufferPtr->iTraceMatrix;
+	char *dTraceMatrix = alignBufferPtr->dTraceMatrix;
+	const int traceRowOffset = alignBufferPtr->traceRowOffset;
+	const int traceNRow = alignBufferPtr->traceNRow;
+	const int traceColOffset = alignBufferPtr->traceColOffset;
+	const int banded = dp->banded, bandLo = dp->bandLo, bandHi = dp->bandHi;
+	int iFirst = 1, iLast = nCharString1, iEnd, trackCross;
+	char sTrace, dTrace, iTrace;
+
+	int lookupValue = 0, element1, element2, stringElt1, stringElt2, fuzzy, iElt, jElt;
+	const int noEndGap1 = !align1InfoPtr->endGap;
+	const int noEndGap2 = !align2InfoPtr->endGap;
+	const float gapOpeningPlusExtension = gapOpening + gapExtension;
+	const float endGapAddend = (align2InfoPtr->endGap ? - gapExtension : 0.0);
+	float *tempMatrix, substitutionValue;
+	float *currMatrix = dp->currMatrix;
+	float *prevMatrix = (currMatrix == alignBufferPtr->currMatrix ?
+			     alignBufferPtr->prevMatrix : alignBufferPtr->currMatrix);
+	int *tempCross;
+	int *currCross = alignBufferPtr->currCross;
+	int *prevCross = alignBufferPtr->prevCross;
+	double maxScore = dp->maxScore;
+
+	for (j = c0, jMinus1 = c0 - 1, jElt = nCharString2 - c0; j <= c1; j++, jMinus1++, jElt--) {
+		tempMatrix = prevMatrix;
+		prevMatrix = currMatrix;
+		currMatrix = tempMatrix;
+		trackCross = crossCol != 0 && j > crossCol;
+		if (trackCross) {
+			tempCross = prevCross;
+			prevCross = currCross;
+			currCross = tempCross;
+		}
+
+		if (r0 == 1) {
+			CURR_MATRIX(0, 0) = NEGATIVE_INFINITY;
+			CURR_MATRIX(0, 1) = PREV_MATRIX(0, 1) + endGapAddend;
+			CURR_MATRIX(0, 2) = NEGATIVE_INFINITY;
+		} else {
+			for (k = 0; k < 3; k++)
+				CURR_MATRIX(r0 - 1, k) = top[3 * (j - c0 + 1) + k];
+		}
+
+		SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align2InfoPtr->string.ptr[jElt]);
+		stringElt2 = lookupValue;
+		SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence2.ptr[scalar2 ? 0 : jElt]);
+		element2 = lookupValue;
+		iFirst = r0;
+		iLast = r1;
+		if (banded) {
+			iFirst = MAX(1, j - bandHi);
+			iLast = MIN(nCharString1, j - bandLo);
+			if (iFirst - 1 >= r0 && iFirst - 1 <= r1) {
+				SET_CURR_MATRIX_ROW(iFirst - 1, NEGATIVE_INFINITY);
+				if (trackCross)
+					SET_CURR_CROSS_ROW(iFirst - 1, NO_CROSS);
+			}
+			iFirst = MAX(iFirst, r0);
+		}
+		iEnd = MIN(iLast, r1);
+		if (localAlignment) {
+			for (i = iFirst, iMinus1 = iFirst - 1, iElt = nCharString1 - iFirst; i <= iEnd; i++, iMinus1++, iElt--) {
+				SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align1InfoPtr->string.ptr[iElt]);
+				stringElt1 = lookupValue;
+				SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence1.ptr[scalar1 ? 0 : iElt]);
+				element1 = lookupValue;
+				fuzzy = FUZZY_MATRIX(stringElt1, stringElt2);
+				substitutionValue = (float) SUBSTITUTION_ARRAY(element1, element2, fuzzy);
+
+				/* Step 3c:  Generate (0) substitution, (1) deletion, and (2) insertion scores
+				 *           and traceback values
+				 */
+				if (PREV_MATRIX(iMinus1, 0) >= MAX(PREV_MATRIX(iMinus1, 1), PREV_MATRIX(iMinus1, 2))) {
+					sTrace = SUBSTITUTION;
+					CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 0) + substitutionValue;
+				} else if (PREV_MATRIX(iMinus1, 1) >= PREV_MATRIX(iMinus1, 2)) {
+					sTrace = DELETION;
+					CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 1) + substitutionValue;
+				} else {
+					sTrace = INSERTION;
+					CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 2) + substitutionValue;
+				}
+				if (PREV_MATRIX(i, 1) > (MAX(PREV_MATRIX(i, 0), PREV_MATRIX(i, 2)) - gapOpening)) {
+					dTrace = DELETION;
+					CURR_MATRIX(i, 1) = PREV_MATRIX(i, 1) - gapExtension;
+				} else if (PREV_MATRIX(i, 0) >= PREV_MATRIX(i, 2)) {
+					dTrace = SUBSTITUTION;
+					CURR_MATRIX(i, 1) = PREV_MATRIX(i, 0) - gapOpeningPlusExtension;
+				} else {
+					dTrace = INSERTION;
+					CURR_MATRIX(i, 1) = PREV_MATRIX(i, 2) - gapOpeningPlusExtension;
+				}
+				if (CURR_MATRIX(iMinus1, 2) > (MAX(CURR_MATRIX(iMinus1, 0), CURR_MATRIX(iMinus1, 1)) - gapOpening)) {
+					iTrace = INSERTION;
+					CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 2) - gapExtension;
+				} else if (CURR_MATRIX(iMinus1, 0) >= CURR_MATRIX(iMinus1, 1)) {
+					iTrace = SUBSTITUTION;
+					CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 0) - gapOpeningPlusExtension;
+				} else {
+					iTrace = DELETION;
+					CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 1) - gapOpeningPlusExtension;
+				}
+
+				CURR_MATRIX(i, 0) = MAX(0.0, CURR_MATRIX(i, 0));
+				if (CURR_MATRIX(i, 0) == 0.0)
+					sTrace = TERMINATION;
+				CURR_MATRIX(i, 1) = MAX(0.0, CURR_MATRIX(i, 1));
+				if (CURR_MATRIX(i, 1) == 0.0)
+					dTrace = TERMINATION;
+				CURR_MATRIX(i, 2) = MAX(0.0, CURR_MATRIX(i, 2));
+				if (CURR_MATRIX(i, 2) == 0.0)
+					iTrace = TERMINATION;
+				if (storeTrace) {
+					S_TRACE_MATRIX(iMinus1, jMinus1) = sTrace;
+					D_TRACE_MATRIX(iMinus1, jMinus1) = dTrace;
+					I_TRACE_MATRIX(iMinus1, jMinus1) = iTrace;
+				}
+				if (trackCross) {
+					SET_CURR_CROSS_S(i, sTrace);
+					SET_CURR_CROSS_D(i, dTrace);
+					SET_CURR_CROSS_I(i, iTrace);
+				}
+
+				/* Step 3d:  Get the optimal score for local alignments */
+				if (forwardPass && CURR_MATRIX(i, 0) >= maxScore) {
+					align1InfoPtr->startRange = iElt + 1;
+					align2InfoPtr->startRange = jElt + 1;
+					maxScore = CURR_MATRIX(i, 0);
+				}
+			}
+		} else {
+			for (i = iFirst, iMinus1 = iFirst - 1, iElt = nCharString1 - iFirst; i <= iEnd; i++, iMinus1++, iElt--) {
+				SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align1InfoPtr->string.ptr[iElt]);
+				stringElt1 = lookupValue;
+				SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence1.ptr[scalar1 ? 0 : iElt]);
+				element1 = lookupValue;
+				fuzzy = FUZZY_MATRIX(stringElt1, stringElt2);
+				substitutionValue = (float) SUBSTITUTION_ARRAY(element1, element2, fuzzy);
+
+				/* Step 3c:  Generate (0) substitution, (1) deletion, and (2) insertion scores
+				 *           and traceback values
+				 */
+				if (PREV_MATRIX(iMinus1, 0) >= MAX(PREV_MATRIX(iMinus1, 1), PREV_MATRIX(iMinus1, 2))) {
+					sTrace = SUBSTITUTION;
+					CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 0) + substitutionValue;
+				} else if (PREV_MATRIX(iMinus1, 1) >= PREV_MATRIX(iMinus1, 2)) {
+					sTrace = DELETION;
+					CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 1) + substitutionValue;
+				} else {
+					sTrace = INSERTION;
+					CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 2) + substitutionValue;
+				}
+				if (PREV_MATRIX(i, 1) > (MAX(PREV_MATRIX(i, 0), PREV_MATRIX(i, 2)) - gapOpening)) {
+					dTrace = DELETION;
+					CURR_MATRIX(i, 1) = PREV_MATRIX(i, 1) - gapExtension;
+				} else if (PREV_MATRIX(i, 0) >= PREV_MATRIX(i, 2)) {
+					dTrace = SUBSTITUTION;
+					CURR_MATRIX(i, 1) = PREV_MATRIX(i, 0) - gapOpeningPlusExtension;
+				} else {
+					dTrace = INSERTION;
+					CURR_MATRIX(i, 1) = PREV_MATRIX(i, 2) - gapOpeningPlusExtension;
+				}
+				if (CURR_MATRIX(iMinus1, 2) > (MAX(CURR_MATRIX(iMinus1, 0), CURR_MATRIX(iMinus1, 1)) - gapOpening)) {
+					iTrace = INSERTION;
+					CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 2) - gapExtension;
+				} else if (CURR_MATRIX(iMinus1, 0) >= CURR_MATRIX(iMinus1, 1)) {
+					iTrace = SUBSTITUTION;
+					CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 0) - gapOpeningPlusExtension;
+				} else {
+					iTrace = DELETION;
+					CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 1) - gapOpeningPlusExtension;
+				}
+				if (storeTrace) {
+					S_TRACE_MATRIX(iMinus1, jMinus1) = sTrace;
+					D_TRACE_MATRIX(iMinus1, jMinus1) = dTrace;
+					I_TRACE_MATRIX(iMinus1, jMinus1) = iTrace;
+				}
+				if (trackCross) {
+					SET_CURR_CROSS_S(i, sTrace);
+					SET_CURR_CROSS_D(i, dTrace);
+					SET_CURR_CROSS_I(i, iTrace);
+				}
+			}
+		}
+		if (iLast < nCharString1 && iLast + 1 >= r0 && iLast + 1 <= r1) {
+			SET_CURR_MATRIX_ROW(iLast + 1, NEGATIVE_INFINITY);
+			if (trackCross)
+				SET_CURR_CROSS_ROW(iLast + 1, NO_CROSS);
+		}
+
+		/* Row nCharString1 of the previous column must be in the band */
+		if (noEndGap2 && r1 == nCharString1 &&
+		    (!banded || jMinus1 == 0 || jMinus1 - bandLo >= nCharString1)) {
+			if (PREV_MATRIX(nCharString1, 1) >= MAX(PREV_MATRIX(nCharString1, 0), PREV_MATRIX(nCharString1, 2))) {
+				dTrace = DELETION;
+				CURR_MATRIX(nCharString1, 1) = PREV_MATRIX(nCharString1, 1);
+			} else if (PREV_MATRIX(nCharString1, 0) >= PREV_MATRIX(nCharString1, 2)) {
+				dTrace = SUBSTITUTION;
+				CURR_MATRIX(nCharString1, 1) = PREV_MATRIX(nCharString1, 0);
+			} else {
+				dTrace = INSERTION;
+				CURR_MATRIX(nCharString1, 1) = PREV_MATRIX(nCharString1, 2);
+			}
+			if (storeTrace)
+				D_TRACE_MATRIX(nCharString1Minus1, jMinus1) = dTrace;
+			if (trackCross)
+				SET_CURR_CROSS_D(nCharString1, dTrace);
+		}
+		if (noEndGap1 && j == nCharString2) {
+			for (i = r0; i < iFirst; i++) {
+				SET_CURR_MATRIX_ROW(i, NEGATIVE_INFINITY);
+				if (trackCross)
+					SET_CURR_CROSS_ROW(i, NO_CROSS);
+			}
+			for (i = r0, iMinus1 = r0 - 1; i <= r1; i++, iMinus1++) {
+				if (CURR_MATRIX(iMinus1, 2) >= MAX(CURR_MATRIX(iMinus1, 0), CURR_MATRIX(iMinus1, 1))) {
+					iTrace = INSERTION;
+					CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 2);
+				} else if (CURR_MATRIX(iMinus1, 0) >= CURR_MATRIX(iMinus1, 1)) {
+					iTrace = SUBSTITUTION;
+					CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 0);
+				} else {
+					iTrace = DELETION;
+					CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 1);
+				}
+				if (storeTrace)
+					I_TRACE_MATRIX(iMinus1, jMinus1) = iTrace;
+				if (trackCross)
+					SET_CURR_CROSS_I(i, iTrace);
+			}
+		}
+
+		if (j == crossCol)
+			for (i = r0 - 1; i <= r1; i++)
+				for (k = 0; k < 3; k++)
+					crossColScores[3 * (i - r0 + 1) + k] = CURR_MATRIX(i, k);
+		if (lastRowScores != NULL)
+			for (k = 0; k < 3; k++)
+				lastRowScores[3 * (j - c0) + k] = CURR_MATRIX(r1, k);
+	}
+
+	dp->currMatrix = currMatrix;
+	dp->currCross = currCross;
+	alignBufferPtr->currCross = currCross;
+	alignBufferPtr->prevCross = prevCross;
+	dp->maxScore = maxScore;
+	return;
+}
+
+/* Walk the optimal path back through the trace matrices until it stops or
+   leaves the block of cells (iMin, jMin) and above */
+static void trace_cells(struct TraceDP *dp, struct TraceState *ts,
+			int iMin, int jMin)
+{
+	struct AlignInfo *align1InfoPtr = dp->align1InfoPtr;
+	struct AlignInfo *align2InfoPtr = dp->align2InfoPtr;
+	const struct AlignBuffer *alignBufferPtr = dp->alignBufferPtr;
 	const char *sTraceMatrix = alignBufferPtr->sTraceMatrix;
 	const char *iTraceMatrix = alignBufferPtr->iTraceMatrix;
 	const char *dTraceMatrix = alignBufferPtr->dTraceMatrix;
+	const int traceRowOffset = alignBufferPtr->traceRowOffset;
+	const int traceNRow = alignBufferPtr->traceNRow;
+	const int traceColOffset = alignBufferPtr->traceColOffset;
 	const int nCharString1 = align1InfoPtr->string.length;
 	const int nCharString2 = align2InfoPtr->string.length;
 	const int nCharString1Minus1 = nCharString1 - 1;
 	const int nCharString2Minus1 = nCharString2 - 1;
-
-	//Rprintf("align1InfoPtr:\n");
-	//print_AlignInfo(align1InfoPtr);
-	//Rprintf("align2InfoPtr:\n");
-	//print_AlignInfo(align2InfoPtr);
-
-	i = nCharString1 - align1InfoPtr->startRange;
-	j = nCharString2 - align2InfoPtr->startRange;
-	while (currTraceMatrix != TERMINATION && i >= 0 && j >= 0) {
+	const int noEndGap1 = !align1InfoPtr->endGap;
+	const int noEndGap2 = !align2InfoPtr->endGap;
+	int i = ts->i, j = ts->j;
+	char currTraceMatrix = ts->currTraceMatrix;
+	char prevTraceMatrix = ts->prevTraceMatrix;
+
+	while (currTraceMatrix != TERMINATION && i >= iMin && j >= jMin) {
+		/* The cells filled by the "no end gap" patches are not constrained
+		   by the band */
+		if (dp->banded && (j - i == dp->bandLo || j - i == dp->bandHi)
+		 && !(noEndGap1 && currTraceMatrix == INSERTION && j == nCharString2Minus1)
+		 && !(noEndGap2 && currTraceMatrix == DELETION && i == nCharString1Minus1))
+			dp->hitBandEdge = 1;
 		switch (currTraceMatrix) {
 		case INSERTION:
 			if (I_TRACE_MATRIX(i, j) != TERMINATION) {
@@ -203,6 +641,134 @@ static void traceback(const struct AlignBuffer *alignBufferPtr,
 		}
 	}
 
+	ts->i = i;
+	ts->j = j;
+	ts->currTraceMatrix = currTraceMatrix;
+	ts->prevTraceMatrix = prevTraceMatrix;
+	return;
+}
+
+/* Copy rows r0 - 1 to r1 of a column (3 scores per cell) to dp->currMatrix */
+static void load_score_column(struct TraceDP *dp, const float *scores,
+			      int r0, int r1)
+{
+	int i, k;
+	float *currMatrix = dp->currMatrix;
+	const int nCharString1Plus1 = dp->align1InfoPtr->string.length + 1;
+
+	for (i = r0 - 1; i <= r1; i++)
+		for (k = 0; k < 3; k++)
+			CURR_MATRIX(i, k) = scores[3 * (i - r0 + 1) + k];
+	return;
+}
+
+/*
+ * Trace back the optimal path from cell (r1, c1) of the DP matrices (1-based)
+ * through the block of rows r0 to r1 and columns c0 to c1, until it stops or
+ * leaves the block. 'top' holds row r0 - 1 of columns c0 - 1 to c1 (unused
+ * if r0 is 1) and 'left' rows r0 - 1 to r1 of column c0 - 1 (3 scores per
+ * cell).
+ * A block that is too big for the trace matrices is split in 2 halves of
+ * columns. A forward pass over the whole block finds the cell (row iCross)
+ * where the path enters the left half. The right half is then traced back
+ * from rows iCross to r1 only, and the left half from rows r0 to iCross
+ * only, so the 2 halves have half the cells of the block in total and the
+ * recursion computes the DP matrices ~3 times at most. Since the trace
+ * values are computed exactly like in the forward pass, the path is the
+ * same as with the full trace matrices.
+ */
+static void trace_block(struct TraceDP *dp, struct TraceState *ts,
+			int r0, int r1, int c0, int c1,
+			const float *top, const float *left)
+{
+	struct AlignBuffer *alignBufferPtr = dp->alignBufferPtr;
+	const int nCharString1Plus1 = dp->align1InfoPtr->string.length + 1;
+	const int nrow = r1 - r0 + 1, ncol = c1 - c0 + 1;
+	int mid, cross, iCross;
+	const float *midTop, *rightTop;
+	float *midScores, *rowScores;
+	const void *vmax;
+
+	if (ncol == 1 || (double) nrow * ncol <= alignBufferPtr->blockTraceCells) {
+		alignBufferPtr->traceRowOffset = r0 - 1;
+		alignBufferPtr->traceNRow = nrow;
+		alignBufferPtr->traceColOffset = c0 - 1;
+		load_score_column(dp, left, r0, r1);
+		fill_score_block(dp, r0, r1, c0, c1, top, 1, 0, 0, NULL, NULL);
+		trace_cells(dp, ts, r0 - 1, c0 - 1);
+		return;
+	}
+	mid = c0 + ncol / 2 - 1;
+	midTop = r0 == 1 ? NULL : top + 3 * (mid - c0 + 1);
+	vmax = vmaxget();
+	midScores = (float *) R_alloc(3 * ((long) nrow + 1), sizeof(float));
+	load_score_column(dp, left, r0, r1);
+	fill_score_block(dp, r0, r1, c0, c1, top, 0, 0, mid, midScores, NULL);
+	cross = dp->currCross[r1 + nCharString1Plus1 * TRACE_STATE(ts->currTraceMatrix)];
+	if (cross == NO_CROSS) {
+		/* The path stops or leaves the block through the top */
+		trace_block(dp, ts, r0, r1, mid + 1, c1, midTop, midScores);
+		vmaxset(vmax);
+		return;
+	}
+	iCross = cross / 3;
+	if (iCross == r0) {
+		rightTop = midTop;
+	} else {
+		/* Row iCross - 1 of the right half */
+		rowScores = (float *) R_alloc(3 * ((long) c1 - mid + 1), sizeof(float));
+		memcpy(rowScores, midScores + 3 * (iCross - r0),
+		       3 * sizeof(float));
+		load_score_column(dp, midScores, r0, iCross - 1);
+		fill_score_block(dp, r0, iCross - 1, mid + 1, c1, midTop,
+				 0, 0, 0, NULL, rowScores + 3);
+		rightTop = rowScores;
+	}
+	trace_block(dp, ts, iCross, r1, mid + 1, c1,
+		    rightTop, midScores + 3 * (iCross - r0));
+	vmaxset(vmax);
+	trace_block(dp, ts, r0, iCross, c0, mid, top, left);
+	return;
+}
+
+/* Traceback through the score matrices */
+static void traceback(struct TraceDP *dp,
+		      char currTraceMatrix,
+		      struct AlignInfo *align1InfoPtr,
+		      struct AlignInfo *align2InfoPtr)
+{
+	int i, j, k;
+	struct TraceState ts;
+	const int nCharString1 = align1InfoPtr->string.length;
+	const int nCharString2 = align2InfoPtr->string.length;
+	const int nCharString1Plus1 = nCharString1 + 1;
+
+	//Rprintf("align1InfoPtr:\n");
+	//print_AlignInfo(align1InfoPtr);
+	//Rprintf("align2InfoPtr:\n");
+	//print_AlignInfo(align2InfoPtr);
+
+	ts.i = nCharString1 - align1InfoPtr->startRange;
+	ts.j = nCharString2 - align2InfoPtr->startRange;
+	ts.currTraceMatrix = currTraceMatrix;
+	ts.prevTraceMatrix = '?';
+	if (!dp->alignBufferPtr->blockMode) {
+		trace_cells(dp, &ts, 0, 0);
+	} else if (currTraceMatrix != TERMINATION) {
+		/* The path starts at cell (ts.i + 1, ts.j + 1) of the DP
+		   matrices */
+		const void *vmax = vmaxget();
+		float *currMatrix = dp->currMatrix;
+		float *left = (float *) R_alloc(3 * ((long) ts.i + 2), sizeof(float));
+		init_first_column(align1InfoPtr, align2InfoPtr,
+				  dp->gapOpening, dp->gapExtension, currMatrix);
+		for (i = 0; i <= ts.i + 1; i++)
+			for (k = 0; k < 3; k++)
+				left[3 * i + k] = CURR_MATRIX(i, k);
+		trace_block(dp, &ts, 1, ts.i + 1, 1, ts.j + 1, NULL, left);
+		vmaxset(vmax);
+	}
+
 	const int offset1 = align1InfoPtr->startRange - 1;
 	if (offset1 > 0 && align1InfoPtr->lengthIndel > 0) {
 		for (i = 0; i < align1InfoPtr->lengthIndel; i++)
@@ -233,15 +799,16 @@ static double pairwiseAlignment(
 		const int *fuzzyMatrixDim,
 		const int *fuzzyLookupTable,
 		const int fuzzyLookupTableLength,
+		const int band,
 		struct AlignBuffer *alignBufferPtr)
 {
-	int i, j, iMinus1, jMinus1;
+	int i, j, iMinus1;
+	int banded, bandLo = 0, bandHi = 0, iFirst, iLast;
 
 	/* Step 1:  Get information on input XString objects */
 	const int nCharString1 = align1InfoPtr->string.length;
 	const int nCharString2 = align2InfoPtr->string.length;
 	const int nCharString1Plus1 = nCharString1 + 1;
-	const int nCharString1Minus1 = nCharString1 - 1;
 	const int nCharString2Minus1 = nCharString2 - 1;
 
 	align1InfoPtr->startRange = -1;
@@ -262,24 +829,26 @@ static double pairwiseAlignment(
 		align2InfoPtr->lengthIndel = 0;
 		return zeroCharScore;
 	}
+	banded = get_band_limits(band, nCharString1, nCharString2,
+				 &bandLo, &bandHi);
+	iFirst = 1;
+	iLast = nCharString1;
+	if (scoreOnly && !banded && alignBufferPtr->striped != NULL) {
+		double stripedScore;
+		if (_striped_align_score(alignBufferPtr->striped,
+				&(align1InfoPtr->string), &(align2InfoPtr->string),
+				localAlignment,
+				align1InfoPtr->endGap, align2InfoPtr->endGap,
+				&stripedScore))
+			return stripedScore;
+	}
 
 	/* Step 2:  Create objects for scores values */
 	/* Rows of currMatrix and prevMatrix = (0) substitution, (1) deletion, and (2) insertion */
 	float *currMatrix = alignBufferPtr->currMatrix;
 	float *prevMatrix = alignBufferPtr->prevMatrix;
-	CURR_MATRIX(0, 0) = 0.0;
-	CURR_MATRIX(0, 1) = (align2InfoPtr->endGap ? - gapOpening : 0.0);
-	for (i = 1, iMinus1 = 0; i <= nCharString1; i++, iMinus1++) {
-		CURR_MATRIX(i, 0) = NEGATIVE_INFINITY;
-		CURR_MATRIX(i, 1) = NEGATIVE_INFINITY;
-	}
-	if (align1InfoPtr->endGap) {
-		for (i = 0; i <= nCharString1; i++)
-			CURR_MATRIX(i, 2) = - gapOpening - i * gapExtension;
-	} else {
-		for (i = 0; i <= nCharString1; i++)
-			CURR_MATRIX(i, 2) = 0.0;
-	}
+	init_first_column(align1InfoPtr, align2InfoPtr,
+			  gapOpening, gapExtension, currMatrix);
 
 	/* Step 3:  Perform main alignment operations */
 	Chars_holder sequence1, sequence2;
@@ -317,8 +886,14 @@ static double pairwiseAlignment(
 			stringElt2 = lookupValue;
 			SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence2.ptr[scalar2 ? 0 : jElt]);
 			element2 = lookupValue;
+			if (banded) {
+				iFirst = MAX(1, j - bandHi);
+				iLast = MIN(nCharString1, j - bandLo);
+				if (iFirst > 1)
+					SET_CURR_MATRIX_ROW(iFirst - 1, NEGATIVE_INFINITY);
+			}
 			if (localAlignment) {
-				for (i = 1, iMinus1 = 0, iElt = nCharString1Minus1; i <= nCharString1; i++, iMinus1++, iElt--) {
+				for (i = iFirst, iMinus1 = iFirst - 1, iElt = nCharString1 - iFirst; i <= iLast; i++, iMinus1++, iElt--) {
 					SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align1InfoPtr->string.ptr[iElt]);
 					stringElt1 = lookupValue;
 					SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence1.ptr[scalar1 ? 0 : iElt]);
@@ -339,8 +914,10 @@ static double pairwiseAlignment(
 
 					maxScore = MAX(CURR_MATRIX(i, 0), maxScore);
 				}
+				if (iLast < nCharString1)
+					SET_CURR_MATRIX_ROW(iLast + 1, NEGATIVE_INFINITY);
 			} else {
-				for (i = 1, iMinus1 = 0, iElt = nCharString1Minus1; i <= nCharString1; i++, iMinus1++, iElt--) {
+				for (i = iFirst, iMinus1 = iFirst - 1, iElt = nCharString1 - iFirst; i <= iLast; i++, iMinus1++, iElt--) {
 					SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align1InfoPtr->string.ptr[iElt]);
 					stringElt1 = lookupValue;
 					SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence1.ptr[scalar1 ? 0 : iElt]);
@@ -358,11 +935,15 @@ static double pairwiseAlignment(
 						MAX(MAX(CURR_MATRIX(iMinus1, 0), CURR_MATRIX(iMinus1, 1)) - gapOpeningPlusExtension,
 						    CURR_MATRIX(iMinus1, 2) - gapExtension);
 				}
-				if (noEndGap2) {
+				if (iLast < nCharString1)
+					SET_CURR_MATRIX_ROW(iLast + 1, NEGATIVE_INFINITY);
+				if (noEndGap2 && (!banded || j == 1 || j - 1 - bandLo >= nCharString1)) {
 					CURR_MATRIX(nCharString1, 1) =
 						MAX(PREV_MATRIX(nCharString1, 0), MAX(PREV_MATRIX(nCharString1, 1), PREV_MATRIX(nCharString1, 2)));
 				}
 				if (noEndGap1 && j == nCharString2) {
+					for (i = 1; i < iFirst; i++)
+						SET_CURR_MATRIX_ROW(i, NEGATIVE_INFINITY);
 					for (i = 1, iMinus1 = 0; i <= nCharString1; i++, iMinus1++) {
 						CURR_MATRIX(i, 2) =
 							MAX(MAX(CURR_MATRIX(iMinus1, 0), CURR_MATRIX(iMinus1, 1)), CURR_MATRIX(iMinus1, 2));
@@ -378,12 +959,7 @@ static double pairwiseAlignment(
 				    CURR_MATRIX(nCharString1, 2)));
 		}
 	} else {
-		/* Step 3a:  Create objects for traceback values */
-		char *sTraceMatrix = alignBufferPtr->sTraceMatrix;
-		char *iTraceMatrix = alignBufferPtr->iTraceMatrix;
-		char *dTraceMatrix = alignBufferPtr->dTraceMatrix;
-
-		/* Step 3b:  Prepare the alignment info object for alignment */
+		/* Step 3a:  Prepare the alignment info object for alignment */
 		const int alignmentBufferSize = nCharString1Plus1;
 
 		align1InfoPtr->lengthMismatch = 0;
@@ -397,151 +973,45 @@ static double pairwiseAlignment(
 		memset(align2InfoPtr->startIndel, 0, alignmentBufferSize * sizeof(int));
 		memset(align1InfoPtr->widthIndel, 0, alignmentBufferSize * sizeof(int));
 		memset(align2InfoPtr->widthIndel, 0, alignmentBufferSize * sizeof(int));
-		for (j = 1, jMinus1 = 0, jElt = nCharString2Minus1; j <= nCharString2; j++, jMinus1++, jElt--) {
-			tempMatrix = prevMatrix;
-			prevMatrix = currMatrix;
-			currMatrix = tempMatrix;
 
-			CURR_MATRIX(0, 0) = NEGATIVE_INFINITY;
-			CURR_MATRIX(0, 1) = PREV_MATRIX(0, 1) + endGapAddend;
-			CURR_MATRIX(0, 2) = NEGATIVE_INFINITY;
-
-			SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align2InfoPtr->string.ptr[jElt]);
-			stringElt2 = lookupValue;
-			SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence2.ptr[scalar2 ? 0 : jElt]);
-			element2 = lookupValue;
-			if (localAlignment) {
-				for (i = 1, iMinus1 = 0, iElt = nCharString1Minus1; i <= nCharString1; i++, iMinus1++, iElt--) {
-					SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align1InfoPtr->string.ptr[iElt]);
-					stringElt1 = lookupValue;
-					SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence1.ptr[scalar1 ? 0 : iElt]);
-					element1 = lookupValue;
-					fuzzy = FUZZY_MATRIX(stringElt1, stringElt2);
-					substitutionValue = (float) SUBSTITUTION_ARRAY(element1, element2, fuzzy);
-
-					/* Step 3c:  Generate (0) substitution, (1) deletion, and (2) insertion scores
-					 *           and traceback values
-					 */
-					if (PREV_MATRIX(iMinus1, 0) >= MAX(PREV_MATRIX(iMinus1, 1), PREV_MATRIX(iMinus1, 2))) {
-						S_TRACE_MATRIX(iMinus1, jMinus1) = SUBSTITUTION;
-						CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 0) + substitutionValue;
-					} else if (PREV_MATRIX(iMinus1, 1) >= PREV_MATRIX(iMinus1, 2)) {
-						S_TRACE_MATRIX(iMinus1, jMinus1) = DELETION;
-						CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 1) + substitutionValue;
-					} else {
-						S_TRACE_MATRIX(iMinus1, jMinus1) = INSERTION;
-						CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 2) + substitutionValue;
-					}
-					if (PREV_MATRIX(i, 1) > (MAX(PREV_MATRIX(i, 0), PREV_MATRIX(i, 2)) - gapOpening)) {
-						D_TRACE_MATRIX(iMinus1, jMinus1) = DELETION;
-						CURR_MATRIX(i, 1) = PREV_MATRIX(i, 1) - gapExtension;
-					} else if (PREV_MATRIX(i, 0) >= PREV_MATRIX(i, 2)) {
-						D_TRACE_MATRIX(iMinus1, jMinus1) = SUBSTITUTION;
-						CURR_MATRIX(i, 1) = PREV_MATRIX(i, 0) - gapOpeningPlusExtension;
-					} else {
-						D_TRACE_MATRIX(iMinus1, jMinus1) = INSERTION;
-						CURR_MATRIX(i, 1) = PREV_MATRIX(i, 2) - gapOpeningPlusExtension;
-					}
-					if (CURR_MATRIX(iMinus1, 2) > (MAX(CURR_MATRIX(iMinus1, 0), CURR_MATRIX(iMinus1, 1)) - gapOpening)) {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = INSERTION;
-						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 2) - gapExtension;
-					} else if (CURR_MATRIX(iMinus1, 0) >= CURR_MATRIX(iMinus1, 1)) {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = SUBSTITUTION;
-						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 0) - gapOpeningPlusExtension;
-					} else {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = DELETION;
-						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 1) - gapOpeningPlusExtension;
-					}
-
-					CURR_MATRIX(i, 0) = MAX(0.0, CURR_MATRIX(i, 0));
-					if (CURR_MATRIX(i, 0) == 0.0)
-						S_TRACE_MATRIX(iMinus1, jMinus1) = TERMINATION;
-					CURR_MATRIX(i, 1) = MAX(0.0, CURR_MATRIX(i, 1));
-					if (CURR_MATRIX(i, 1) == 0.0)
-						D_TRACE_MATRIX(iMinus1, jMinus1) = TERMINATION;
-					CURR_MATRIX(i, 2) = MAX(0.0, CURR_MATRIX(i, 2));
-					if (CURR_MATRIX(i, 2) == 0.0)
-						I_TRACE_MATRIX(iMinus1, jMinus1) = TERMINATION;
-
-					/* Step 3d:  Get the optimal score for local alignments */
-					if (CURR_MATRIX(i, 0) >= maxScore) {
-						align1InfoPtr->startRange = iElt + 1;
-						align2InfoPtr->startRange = jElt + 1;
-						maxScore = CURR_MATRIX(i, 0);
-					}
-				}
-			} else {
-				for (i = 1, iMinus1 = 0, iElt = nCharString1Minus1; i <= nCharString1; i++, iMinus1++, iElt--) {
-					SET_LOOKUP_VALUE(fuzzyLookupTable, fuzzyLookupTableLength, align1InfoPtr->string.ptr[iElt]);
-					stringElt1 = lookupValue;
-					SET_LOOKUP_VALUE(substitutionLookupTable, substitutionLookupTableLength, sequence1.ptr[scalar1 ? 0 : iElt]);
-					element1 = lookupValue;
-					fuzzy = FUZZY_MATRIX(stringElt1, stringElt2);
-					substitutionValue = (float) SUBSTITUTION_ARRAY(element1, element2, fuzzy);
-
-					/* Step 3c:  Generate (0) substitution, (1) deletion, and (2) insertion scores
-					 *           and traceback values
-					 */
-					if (PREV_MATRIX(iMinus1, 0) >= MAX(PREV_MATRIX(iMinus1, 1), PREV_MATRIX(iMinus1, 2))) {
-						S_TRACE_MATRIX(iMinus1, jMinus1) = SUBSTITUTION;
-						CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 0) + substitutionValue;
-					} else if (PREV_MATRIX(iMinus1, 1) >= PREV_MATRIX(iMinus1, 2)) {
-						S_TRACE_MATRIX(iMinus1, jMinus1) = DELETION;
-						CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 1) + substitutionValue;
-					} else {
-						S_TRACE_MATRIX(iMinus1, jMinus1) = INSERTION;
-						CURR_MATRIX(i, 0) = PREV_MATRIX(iMinus1, 2) + substitutionValue;
-					}
-					if (PREV_MATRIX(i, 1) > (MAX(PREV_MATRIX(i, 0), PREV_MATRIX(i, 2)) - gapOpening)) {
-						D_TRACE_MATRIX(iMinus1, jMinus1) = DELETION;
-						CURR_MATRIX(i, 1) = PREV_MATRIX(i, 1) - gapExtension;
-					} else if (PREV_MATRIX(i, 0) >= PREV_MATRIX(i, 2)) {
-						D_TRACE_MATRIX(iMinus1, jMinus1) = SUBSTITUTION;
-						CURR_MATRIX(i, 1) = PREV_MATRIX(i, 0) - gapOpeningPlusExtension;
-					} else {
-						D_TRACE_MATRIX(iMinus1, jMinus1) = INSERTION;
-						CURR_MATRIX(i, 1) = PREV_MATRIX(i, 2) - gapOpeningPlusExtension;
-					}
-					if (CURR_MATRIX(iMinus1, 2) > (MAX(CURR_MATRIX(iMinus1, 0), CURR_MATRIX(iMinus1, 1)) - gapOpening)) {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = INSERTION;
-						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 2) - gapExtension;
-					} else if (CURR_MATRIX(iMinus1, 0) >= CURR_MATRIX(iMinus1, 1)) {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = SUBSTITUTION;
-						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 0) - gapOpeningPlusExtension;
-					} else {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = DELETION;
-						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 1) - gapOpeningPlusExtension;
-					}
-				}
-			}
-
-			if (noEndGap2) {
-				if (PREV_MATRIX(nCharString1, 1) >= MAX(PREV_MATRIX(nCharString1, 0), PREV_MATRIX(nCharString1, 2))) {
-					D_TRACE_MATRIX(nCharString1Minus1, jMinus1) = DELETION;
-					CURR_MATRIX(nCharString1, 1) = PREV_MATRIX(nCharString1, 1);
-				} else if (PREV_MATRIX(nCharString1, 0) >= PREV_MATRIX(nCharString1, 2)) {
-					D_TRACE_MATRIX(nCharString1Minus1, jMinus1) = SUBSTITUTION;
-					CURR_MATRIX(nCharString1, 1) = PREV_MATRIX(nCharString1, 0);
-				} else {
-					D_TRACE_MATRIX(nCharString1Minus1, jMinus1) = INSERTION;
-					CURR_MATRIX(nCharString1, 1) = PREV_MATRIX(nCharString1, 2);
-				}
-			}
-			if (noEndGap1 && j == nCharString2) {
-				for (i = 1, iMinus1 = 0; i <= nCharString1; i++, iMinus1++) {
-					if (CURR_MATRIX(iMinus1, 2) >= MAX(CURR_MATRIX(iMinus1, 0), CURR_MATRIX(iMinus1, 1))) {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = INSERTION;
-						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 2);
-					} else if (CURR_MATRIX(iMinus1, 0) >= CURR_MATRIX(iMinus1, 1)) {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = SUBSTITUTION;
-						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 0);
-					} else {
-						I_TRACE_MATRIX(iMinus1, jMinus1) = DELETION;
-						CURR_MATRIX(i, 2) = CURR_MATRIX(iMinus1, 1);
-					}
-				}
-			}
-		}
+		/* Step 3b:  Fill the score and trace matrices */
+		struct TraceDP dp;
+		dp.align1InfoPtr = align1InfoPtr;
+		dp.align2InfoPtr = align2InfoPtr;
+		dp.sequence1 = sequence1;
+		dp.sequence2 = sequence2;
+		dp.scalar1 = scalar1;
+		dp.scalar2 = scalar2;
+		dp.localAlignment = localAlignment;
+		dp.gapOpening = gapOpening;
+		dp.gapExtension = gapExtension;
+		dp.substitutionArray = substitutionArray;
+		dp.substitutionArrayDim = substitutionArrayDim;
+		dp.substitutionLookupTable = substitutionLookupTable;
+		dp.substitutionLookupTableLength = substitutionLookupTableLength;
+		dp.fuzzyMatrix = fuzzyMatrix;
+		dp.fuzzyMatrixDim = fuzzyMatrixDim;
+		dp.fuzzyLookupTable = fuzzyLookupTable;
+		dp.fuzzyLookupTableLength = fuzzyLookupTableLength;
+		dp.alignBufferPtr = alignBufferPtr;
+		dp.banded = banded;
+		dp.bandLo = bandLo;
+		dp.bandHi = bandHi;
+		dp.hitBandEdge = 0;
+		dp.currMatrix = currMatrix;
+		dp.currCross = alignBufferPtr->currCross;
+		dp.maxScore = maxScore;
+		/* In block mode, the forward pass only computes the score and
+		   the traceback recomputes the trace matrices by blocks */
+		alignBufferPtr->blockMode = (double) nCharString1 * nCharString2 >
+					    alignBufferPtr->maxTraceCells;
+		alignBufferPtr->traceRowOffset = 0;
+		alignBufferPtr->traceNRow = nCharString1;
+		alignBufferPtr->traceColOffset = 0;
+		fill_score_block(&dp, 1, nCharString1, 1, nCharString2, NULL,
+				 !alignBufferPtr->blockMode, 1, 0, NULL, NULL);
+		currMatrix = dp.currMatrix;
+		maxScore = dp.maxScore;
 
 		char currTraceMatrix = '?';
 		if (localAlignment) {
@@ -567,8 +1037,10 @@ static double pairwiseAlignment(
 		}
 
 		/* Step 4:  Traceback through the score matrices */
-		traceback(alignBufferPtr, currTraceMatrix,
+		traceback(&dp, currTraceMatrix,
 			  align1InfoPtr, align2InfoPtr);
+		if (dp.hitBandEdge)
+			alignBufferPtr->nBandEdgeHits++;
 	}
 
 	return (double) maxScore;
@@ -611,6 +1083,13 @@ static double pairwiseAlignment(
  * 'fuzzyLookupTable':         lookup table for translating XString bytes to
  *                             fuzzy indices
  *                             (integer vector)
+ * 'band':                     half-width of the band of diagonals around
+ *                             the main diagonal(s) of the DP matrices
+ *                             (single non-negative integer or NA for no band)
+ * 'maxTraceCells':            max nb of cells of the trace matrices; above
+ *                             that, the alignments are traced back from
+ *                             recomputed blocks of columns
+ *                             (single positive double)
  *
  * OUTPUT
  * If scoreOnly = TRUE, returns either a vector of scores
@@ -632,8 +1111,11 @@ SEXP XStringSet_align_pairwiseAlignment(
 		SEXP substitutionLookupTable,
 		SEXP fuzzyMatrix,
 		SEXP fuzzyMatrixDim,
-		SEXP fuzzyLookupTable)
+		SEXP fuzzyLookupTable,
+		SEXP band,
+		SEXP maxTraceCells)
 {
+	const int bandValue = INTEGER(band)[0];
 	const int scoreOnlyValue = LOGICAL(scoreOnly)[0];
 	const int useQualityValue = LOGICAL(useQuality)[0];
 	const int localAlignment = (INTEGER(typeCode)[0] == LOCAL_ALIGNMENT);
@@ -683,30 +1165,46 @@ SEXP XStringSet_align_pairwiseAlignment(
 
 	/* Create the alignment buffer object */
 	struct AlignBuffer alignBuffer;
-	int nCharString1 = 0, nCharString2 = 0, nCharProduct = 0;
-	reset_ovflow_flag();
-	if (multipleSubjects) {
-		for (i = 0; i < numberOfStrings; i++) {
-			int nchar1 = _get_elt_from_XStringSet_holder(&pattern_holder, i).length;
-			int nchar2 = _get_elt_from_XStringSet_holder(&subject_holder, i).length;
-			nCharString1 = MAX(nCharString1, nchar1);
-			nCharString2 = MAX(nCharString2, nchar2);
-			nCharProduct = MAX(nCharProduct,
-					   safe_int_mult(nchar1, nchar2));
-		}
-	} else {
-		for (i = 0; i < numberOfStrings; i++) {
-			nCharString1 = MAX(nCharString1, _get_elt_from_XStringSet_holder(&pattern_holder, i).length);
+	int nCharString1 = 0, nCharString2 = 0, nTraceCells = 0, blockMode = 0;
+	alignBuffer.maxTraceCells = MIN(REAL(maxTraceCells)[0], (double) INT_MAX);
+	alignBuffer.blockTraceCells = get_block_trace_cells(alignBuffer.maxTraceCells);
+	alignBuffer.nBandEdgeHits = 0;
+	for (i = 0; i < numberOfStrings; i++) {
+		int nchar1 = _get_elt_from_XStringSet_holder(&pattern_holder, i).length;
+		int nchar2 = multipleSubjects ?
+			     _get_elt_from_XStringSet_holder(&subject_holder, i).length :
+			     align2Info.string.length;
+		nCharString1 = MAX(nCharString1, nchar1);
+		nCharString2 = MAX(nCharString2, nchar2);
+		if (!scoreOnlyValue) {
+			if ((double) nchar1 * nchar2 <= alignBuffer.maxTraceCells) {
+				nTraceCells = MAX(nTraceCells, nchar1 * nchar2);
+			} else {
+				/* A block is at most 1 column wide or has at most
+				   blockTraceCells cells */
+				blockMode = 1;
+				nTraceCells = MAX(nTraceCells, nchar1);
+				nTraceCells = MAX(nTraceCells, alignBuffer.blockTraceCells);
+			}
 		}
-		nCharString2 = align2Info.string.length;
-		nCharProduct = safe_int_mult(nCharString1, nCharString2);
 	}
-	if (get_ovflow_flag())
-		error("max(nchar(pattern) * nchar(subject)) is too big "
-		      "(must be <= %d)", INT_MAX);
 	const int alignmentBufferSize = nCharString1 + 1;
 	alignBuffer.currMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
 	alignBuffer.prevMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
+	alignBuffer.striped = NULL;
+	if (scoreOnlyValue && !useQualityValue)
+		alignBuffer.striped = _new_StripedAlignBuffer(
+					nCharString1,
+					gapOpeningValue,
+					gapExtensionValue,
+					REAL(substitutionArray),
+					INTEGER(substitutionArrayDim),
+					INTEGER(substitutionLookupTable),
+					LENGTH(substitutionLookupTable),
+					INTEGER(fuzzyMatrix),
+					INTEGER(fuzzyMatrixDim),
+					INTEGER(fuzzyLookupTable),
+					LENGTH(fuzzyLookupTable));
 
 	struct MismatchBuffer mismatchBuffer;
 	struct IndelBuffer indel1Buffer;
@@ -719,9 +1217,15 @@ SEXP XStringSet_align_pairwiseAlignment(
 		align2Info.startIndel = (int *) R_alloc((long) alignmentBufferSize, sizeof(int));
 		align1Info.widthIndel = (int *) R_alloc((long) alignmentBufferSize, sizeof(int));
 		align2Info.widthIndel = (int *) R_alloc((long) alignmentBufferSize, sizeof(int));
-		alignBuffer.sTraceMatrix = (char *) R_alloc((long) nCharProduct, sizeof(char));
-		alignBuffer.iTraceMatrix = (char *) R_alloc((long) nCharProduct, sizeof(char));
-		alignBuffer.dTraceMatrix = (char *) R_alloc((long) nCharProduct, sizeof(char));
+		alignBuffer.sTraceMatrix = (char *) R_alloc((long) nTraceCells, sizeof(char));
+		alignBuffer.iTraceMatrix = (char *) R_alloc((long) nTraceCells, sizeof(char));
+		alignBuffer.dTraceMatrix = (char *) R_alloc((long) nTraceCells, sizeof(char));
+		alignBuffer.currCross = NULL;
+		alignBuffer.prevCross = NULL;
+		if (blockMode) {
+			alignBuffer.currCross = (int *) R_alloc((long) 3 * alignmentBufferSize, sizeof(int));
+			alignBuffer.prevCross = (int *) R_alloc((long) 3 * alignmentBufferSize, sizeof(int));
+		}
 
 		mismatchBufferSize = MIN(MAX_BUF_SIZE, alignmentBufferSize + numberOfStrings * (alignmentBufferSize/4));
 		mismatchBuffer.pattern = (int *) R_alloc((long) mismatchBufferSize, sizeof(int));
@@ -743,8 +1247,25 @@ SEXP XStringSet_align_pairwiseAlignment(
 	double *score;
 	if (scoreOnlyValue) {
 		PROTECT(output = NEW_NUMERIC(numberOfStrings));
+		/* Many patterns against a single subject: align them by batches,
+		   one pattern per SIMD lane */
+		int *batchDone = NULL;
+		if (!multipleSubjects && alignBuffer.striped != NULL &&
+		    bandValue == NA_INTEGER && numberOfStrings > 1) {
+			Chars_holder *patterns = (Chars_holder *)
+				R_alloc((long) numberOfStrings, sizeof(Chars_holder));
+			for (i = 0; i < numberOfStrings; i++)
+				patterns[i] = _get_elt_from_XStringSet_holder(&pattern_holder, i);
+			batchDone = (int *) R_alloc((long) numberOfStrings, sizeof(int));
+			_batch_align_scores(alignBuffer.striped, patterns, numberOfStrings,
+					&(align2Info.string), localAlignment,
+					align1Info.endGap, align2Info.endGap,
+					REAL(output), batchDone);
+		}
 		for (i = 0, score = REAL(output); i < numberOfStrings; i++, score++) {
 	        R_CheckUserInterrupt();
+			if (batchDone != NULL && batchDone[i])
+				continue;
 			align1Info.string = _get_elt_from_XStringSet_holder(&pattern_holder, i);
 			if (useQualityValue) {
 				align1Info.quality = _get_elt_from_XStringSet_holder(&patternQuality_holder, quality1Element);
@@ -773,6 +1294,7 @@ SEXP XStringSet_align_pairwiseAlignment(
 					INTEGER(fuzzyMatrixDim),
 					INTEGER(fuzzyLookupTable),
 					LENGTH(fuzzyLookupTable),
+					bandValue,
 					&alignBuffer);
 		}
 		UNPROTECT(1);
@@ -857,6 +1379,7 @@ SEXP XStringSet_align_pairwiseAlignment(
 					INTEGER(fuzzyMatrixDim),
 					INTEGER(fuzzyLookupTable),
 					LENGTH(fuzzyLookupTable),
+					bandValue,
 					&alignBuffer);
 			*align1MismatchEnds = align1Info.lengthMismatch + align1MismatchPrevEnd;
 			*align2MismatchEnds = align2Info.lengthMismatch + align2MismatchPrevEnd;
@@ -1032,11 +1555,36 @@ SEXP XStringSet_align_pairwiseAlignment(
 		UNPROTECT(30);
 	}
 
+	if (alignBuffer.nBandEdgeHits > 0)
+		warning("the optimal path of %d alignment(s) touches the edge of "
+			"the band, so a better alignment could exist outside of "
+			"the band; consider increasing 'band'",
+			alignBuffer.nBandEdgeHits);
 	return output;
 }
 
 
 
+/* Pairs of strings are dispatched to the threads by square tiles of the
+   upper triangle of the distance matrix. */
+#define DIST_TILE_SIZE 64
+
+static void check_lookup_keys(const Chars_holder *x,
+		const int *lookupTable, int lookupTableLength)
+{
+	int k, lookupValue;
+
+	for (k = 0; k < x->length; k++)
+		SET_LOOKUP_VALUE(lookupTable, lookupTableLength, x->ptr[k]);
+	return;
+}
+
+/* 0-based index of the (i, j) pair (i < j) in a "dist" vector */
+static R_xlen_t get_dist_index(R_xlen_t n, R_xlen_t i, R_xlen_t j)
+{
+	return i * (2 * n - i - 1) / 2 + j - i - 1;
+}
+
 /*
  * INPUTS
  * 'string':                   XStringSet object for strings
@@ -1068,9 +1616,16 @@ SEXP XStringSet_align_pairwiseAlignment(
  * 'fuzzyLookupTable':         lookup table for translating XString bytes to
  *                             fuzzy indices
  *                             (integer vector)
+ * 'band':                     half-width of the band of diagonals around
+ *                             the main diagonal(s) of the DP matrices
+ *                             (single non-negative integer or NA for no band)
+ * 'nthreads':                 nb of threads to use
+ *                             (single positive integer; ignored if Biostrings
+ *                              was compiled without OpenMP support)
  *
  * OUTPUT
  * Return a numeric vector containing the lower triangle of the score matrix.
+ * The scores don't depend on the number of threads.
  */
 
 SEXP XStringSet_align_distance(
@@ -1085,7 +1640,9 @@ SEXP XStringSet_align_distance(
 		SEXP substitutionLookupTable,
 		SEXP fuzzyMatrix,
 		SEXP fuzzyMatrixDim,
-		SEXP fuzzyLookupTable)
+		SEXP fuzzyLookupTable,
+		SEXP band,
+		SEXP nthreads)
 {
 	int scoreOnlyValue = 1;
 	int useQualityValue = LOGICAL(useQuality)[0];
@@ -1096,11 +1653,9 @@ SEXP XStringSet_align_distance(
 		gapExtensionValue = POSITIVE_INFINITY;
 	}
 	int localAlignment = (INTEGER(typeCode)[0] == LOCAL_ALIGNMENT);
-
-	/* Create the alignment info objects */
-	struct AlignInfo align1Info, align2Info;
-	align1Info.endGap = (INTEGER(typeCode)[0] == GLOBAL_ALIGNMENT);
-	align2Info.endGap = (INTEGER(typeCode)[0] == GLOBAL_ALIGNMENT);
+	int endGap = (INTEGER(typeCode)[0] == GLOBAL_ALIGNMENT);
+	int bandValue = INTEGER(band)[0];
+	int nthreadsValue = INTEGER(nthreads)[0];
 
 	int numberOfStrings = _get_XStringSet_length(string);
 	int lengthOfStringQualitySet = 0;
@@ -1116,36 +1671,57 @@ SEXP XStringSet_align_distance(
 
 	SEXP output;
 
-	int i, j, iQualityElement = 0, jQualityElement = 0;
+	int i, j, t, nonEmpty;
 	int qualityIncrement = ((lengthOfStringQualitySet < numberOfStrings) ? 0 : 1);
 
-	/* Create the alignment buffer object */
-	struct AlignBuffer alignBuffer;
+	/* Extract the strings once for all, and check them against the lookup
+	   tables (the threads cannot raise errors). Only strings that get aligned
+	   to a non-empty string are checked, like in pairwiseAlignment(). */
+	Chars_holder *strings, *qualities = NULL;
 	int nCharString = 0;
-	for (i = 0; i < numberOfStrings; i++) {
-		nCharString = MAX(nCharString, _get_elt_from_XStringSet_holder(&string_holder, i).length);
+	strings = (Chars_holder *) R_alloc((long) numberOfStrings, sizeof(Chars_holder));
+	if (useQualityValue)
+		qualities = (Chars_holder *) R_alloc((long) numberOfStrings, sizeof(Chars_holder));
+	for (i = nonEmpty = 0; i < numberOfStrings; i++) {
+		strings[i] = _get_elt_from_XStringSet_holder(&string_holder, i);
+		if (useQualityValue)
+			qualities[i] = _get_elt_from_XStringSet_holder(&stringQuality_holder,
+					qualityIncrement * i);
+		nCharString = MAX(nCharString, strings[i].length);
+		if (strings[i].length > 0)
+			nonEmpty++;
 	}
-	int alignmentBufferSize = nCharString + 1;
-	alignBuffer.currMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
-	alignBuffer.prevMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
-
-	double *score;
-	PROTECT(output = NEW_NUMERIC((numberOfStrings * (numberOfStrings - 1)) / 2));
-	score = REAL(output);
-	if (!useQualityValue) {
+	if (nonEmpty >= 2) {
 		for (i = 0; i < numberOfStrings; i++) {
-	        R_CheckUserInterrupt();
-			align1Info.string = _get_elt_from_XStringSet_holder(&string_holder, i);
-			for (j = i + 1; j < numberOfStrings; j++) {
-				align2Info.string = _get_elt_from_XStringSet_holder(&string_holder, j);
-				*score = pairwiseAlignment(
-						&align1Info,
-						&align2Info,
-						localAlignment,
-						scoreOnlyValue,
+			if (strings[i].length == 0)
+				continue;
+			check_lookup_keys(strings + i, INTEGER(fuzzyLookupTable),
+					  LENGTH(fuzzyLookupTable));
+			check_lookup_keys(useQualityValue ? qualities + i : strings + i,
+					  INTEGER(substitutionLookupTable),
+					  LENGTH(substitutionLookupTable));
+		}
+	}
+
+	/* Create one alignment buffer object per thread */
+#ifdef _OPENMP
+	if (nthreadsValue < 1)
+		nthreadsValue = 1;
+#else
+	nthreadsValue = 1;
+#endif
+	struct AlignBuffer *alignBuffers;
+	int alignmentBufferSize = nCharString + 1;
+	alignBuffers = (struct AlignBuffer *) R_alloc((long) nthreadsValue, sizeof(struct AlignBuffer));
+	for (t = 0; t < nthreadsValue; t++) {
+		alignBuffers[t].currMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
+		alignBuffers[t].prevMatrix = (float *) R_alloc((long) 3 * alignmentBufferSize, sizeof(float));
+		alignBuffers[t].striped = NULL;
+		if (!useQualityValue)
+			alignBuffers[t].striped = _new_StripedAlignBuffer(
+						nCharString,
 						gapOpeningValue,
 						gapExtensionValue,
-						useQualityValue,
 						REAL(substitutionArray),
 						INTEGER(substitutionArrayDim),
 						INTEGER(substitutionLookupTable),
@@ -1153,23 +1729,64 @@ SEXP XStringSet_align_distance(
 						INTEGER(fuzzyMatrix),
 						INTEGER(fuzzyMatrixDim),
 						INTEGER(fuzzyLookupTable),
-						LENGTH(fuzzyLookupTable),
-						&alignBuffer);
-				score++;
-			}
+						LENGTH(fuzzyLookupTable));
+	}
+
+	/* Enumerate the tiles of the upper triangle */
+	int nTilesPerSide = (numberOfStrings + DIST_TILE_SIZE - 1) / DIST_TILE_SIZE;
+	int nTiles = nTilesPerSide * (nTilesPerSide + 1) / 2;
+	int *tileRow, *tileCol;
+	tileRow = (int *) R_alloc((long) nTiles, sizeof(int));
+	tileCol = (int *) R_alloc((long) nTiles, sizeof(int));
+	for (i = t = 0; i < nTilesPerSide; i++) {
+		for (j = i; j < nTilesPerSide; j++, t++) {
+			tileRow[t] = i;
+			tileCol[t] = j;
 		}
-	} else {
-		for (i = 0; i < numberOfStrings; i++) {
-	        R_CheckUserInterrupt();
-			align1Info.string = _get_elt_from_XStringSet_holder(&string_holder, i);
-			align1Info.quality = _get_elt_from_XStringSet_holder(&stringQuality_holder, iQualityElement);
-			jQualityElement = iQualityElement + qualityIncrement;
-			iQualityElement += qualityIncrement;
-			for (j = i + 1; j < numberOfStrings; j++) {
-				align2Info.string = _get_elt_from_XStringSet_holder(&string_holder, j);
-				align2Info.quality = _get_elt_from_XStringSet_holder(&stringQuality_holder, jQualityElement);
-				jQualityElement += qualityIncrement;
-				*score = pairwiseAlignment(
+	}
+
+	/* The threads must not call the R API */
+	const double *substitutionArrayPtr = REAL(substitutionArray);
+	const int *substitutionArrayDimPtr = INTEGER(substitutionArrayDim);
+	const int *substitutionLookupTablePtr = INTEGER(substitutionLookupTable);
+	const int substitutionLookupTableLength = LENGTH(substitutionLookupTable);
+	const int *fuzzyMatrixPtr = INTEGER(fuzzyMatrix);
+	const int *fuzzyMatrixDimPtr = INTEGER(fuzzyMatrixDim);
+	const int *fuzzyLookupTablePtr = INTEGER(fuzzyLookupTable);
+	const int fuzzyLookupTableLength = LENGTH(fuzzyLookupTable);
+
+	double *score;
+	PROTECT(output = NEW_NUMERIC(((R_xlen_t) numberOfStrings * (numberOfStrings - 1)) / 2));
+	score = REAL(output);
+	volatile int interrupted = 0;
+	#pragma omp parallel for num_threads(nthreadsValue) schedule(dynamic, 1)
+	for (t = 0; t < nTiles; t++) {
+		int threadNum, i, j, iEnd, jEnd;
+		struct AlignInfo align1Info, align2Info;
+#ifdef _OPENMP
+		threadNum = omp_get_thread_num();
+#else
+		threadNum = 0;
+#endif
+		if (interrupted)
+			continue;
+		if (threadNum == 0 && _interrupt_is_pending()) {
+			interrupted = 1;
+			continue;
+		}
+		align1Info.endGap = endGap;
+		align2Info.endGap = endGap;
+		iEnd = MIN((tileRow[t] + 1) * DIST_TILE_SIZE, numberOfStrings);
+		jEnd = MIN((tileCol[t] + 1) * DIST_TILE_SIZE, numberOfStrings);
+		for (i = tileRow[t] * DIST_TILE_SIZE; i < iEnd; i++) {
+			align1Info.string = strings[i];
+			if (useQualityValue)
+				align1Info.quality = qualities[i];
+			for (j = MAX(tileCol[t] * DIST_TILE_SIZE, i + 1); j < jEnd; j++) {
+				align2Info.string = strings[j];
+				if (useQualityValue)
+					align2Info.quality = qualities[j];
+				score[get_dist_index(numberOfStrings, i, j)] = pairwiseAlignment(
 						&align1Info,
 						&align2Info,
 						localAlignment,
@@ -1177,20 +1794,22 @@ SEXP XStringSet_align_distance(
 						gapOpeningValue,
 						gapExtensionValue,
 						useQualityValue,
-						REAL(substitutionArray),
-						INTEGER(substitutionArrayDim),
-						INTEGER(substitutionLookupTable),
-						LENGTH(substitutionLookupTable),
-						INTEGER(fuzzyMatrix),
-						INTEGER(fuzzyMatrixDim),
-						INTEGER(fuzzyLookupTable),
-						LENGTH(fuzzyLookupTable),
-						&alignBuffer);
-				score++;
+						substitutionArrayPtr,
+						substitutionArrayDimPtr,
+						substitutionLookupTablePtr,
+						substitutionLookupTableLength,
+						fuzzyMatrixPtr,
+						fuzzyMatrixDimPtr,
+						fuzzyLookupTablePtr,
+						fuzzyLookupTableLength,
+						bandValue,
+						alignBuffers + threadNum);
 			}
 		}
 	}
 	UNPROTECT(1);
+	if (interrupted)
+		error("interrupted by the user");
 
 	return output;
 }
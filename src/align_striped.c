@@ -0,0 +1,762 @@
+/****************************************************************************
+ *                 Striped SIMD engine for score-only alignments            *
+ *                                                                          *
+ * Reference:                                                               *
+ *   M. Farrar, Striped Smith-Waterman speeds database searches six times  *
+ *   over other SIMD implementations. Bioinformatics 23(2):156-161, 2007.   *
+ *                                                                          *
+ * The engine is used by the scoreOnly branch of pairwiseAlignment()       *
+ * (align_pairwiseAlignment.c) when no quality scores are involved and the  *
+ * substitution scores and gap penalties are all integers. Because the     *
+ * scores computed by the scalar engine are then exactly representable as  *
+ * floats, both engines return the same scores (bit for bit).              *
+ *                                                                          *
+ * The SSE2 kernels are always available on x86 platforms. The AVX2        *
+ * kernels are compiled with the appropriate target attribute and selected  *
+ * at run time if the CPU supports them. Local alignments are tried with   *
+ * 8-bit, then 16-bit, then 32-bit lanes (each width is abandoned as soon  *
+ * as the lanes saturate). The other alignment types use the narrowest     *
+ * width that can hold all the scores that can possibly be reached.        *
+ ****************************************************************************/
+#include "Biostrings.h"
+
+#include <math.h>  /* for floor() */
+
+/* Scores must be exactly representable by floats, like in the scalar
+   engine. */
+#define MAX_STRIPED_SCORE (1 << 23)
+
+/* Don't use more than 256 MB for the query profile */
+#define MAX_STRIPED_PROFILE_SIZE ((size_t) 1 << 28)
+
+#define SIMD_NONE 0
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+ && defined(__SSE2__)
+#define HAVE_SSE2_KERNELS 1
+#include <emmintrin.h>
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+/* The AVX2 kernels are disabled on Windows where gcc doesn't guarantee the
+   32-byte alignment of the stack. */
+#if !defined(_WIN32) && (defined(__clang__) || __GNUC__ >= 5)
+#define HAVE_AVX2_KERNELS 1
+#include <immintrin.h>
+#endif
+#endif
+
+
+#ifdef HAVE_SSE2_KERNELS
+
+/****************************************************************************
+ * SSE2 vector helpers
+ */
+
+#define SSE2_MAX_EMUL(a, b, cmpgt) \
+	_mm_or_si128(_mm_and_si128(cmpgt(a, b), a), \
+		     _mm_andnot_si128(cmpgt(a, b), b))
+
+static inline __m128i sse2_i8_set1(int x) { return _mm_set1_epi8((char) x); }
+static inline __m128i sse2_i8_adds(__m128i a, __m128i b)
+	{ return _mm_adds_epi8(a, b); }
+static inline __m128i sse2_i8_subs(__m128i a, __m128i b)
+	{ return _mm_subs_epi8(a, b); }
+static inline __m128i sse2_i8_max(__m128i a, __m128i b)
+{
+#if defined(__SSE4_1__)
+	return _mm_max_epi8(a, b);
+#else
+	return SSE2_MAX_EMUL(a, b, _mm_cmpgt_epi8);
+#endif
+}
+static inline int sse2_i8_gt_any(__m128i a, __m128i b)
+	{ return _mm_movemask_epi8(_mm_cmpgt_epi8(a, b)); }
+static inline __m128i sse2_i8_shift_in(__m128i a, int x)
+{
+	return _mm_or_si128(_mm_slli_si128(a, 1), _mm_cvtsi32_si128(x & 0xFF));
+}
+static inline void sse2_i8_store(signed char *p, __m128i a)
+	{ _mm_storeu_si128((__m128i *) p, a); }
+
+static inline __m128i sse2_i16_set1(int x) { return _mm_set1_epi16((short) x); }
+static inline __m128i sse2_i16_adds(__m128i a, __m128i b)
+	{ return _mm_adds_epi16(a, b); }
+static inline __m128i sse2_i16_subs(__m128i a, __m128i b)
+	{ return _mm_subs_epi16(a, b); }
+static inline __m128i sse2_i16_max(__m128i a, __m128i b)
+	{ return _mm_max_epi16(a, b); }
+static inline int sse2_i16_gt_any(__m128i a, __m128i b)
+	{ return _mm_movemask_epi8(_mm_cmpgt_epi16(a, b)); }
+static inline __m128i sse2_i16_shift_in(__m128i a, int x)
+{
+	return _mm_or_si128(_mm_slli_si128(a, 2), _mm_cvtsi32_si128(x & 0xFFFF));
+}
+static inline void sse2_i16_store(short *p, __m128i a)
+	{ _mm_storeu_si128((__m128i *) p, a); }
+
+/* No saturation needed with 32-bit lanes: the caller makes sure that all
+   the scores fit. */
+static inline __m128i sse2_i32_set1(int x) { return _mm_set1_epi32(x); }
+static inline __m128i sse2_i32_adds(__m128i a, __m128i b)
+	{ return _mm_add_epi32(a, b); }
+static inline __m128i sse2_i32_subs(__m128i a, __m128i b)
+	{ return _mm_sub_epi32(a, b); }
+static inline __m128i sse2_i32_max(__m128i a, __m128i b)
+{
+#if defined(__SSE4_1__)
+	return _mm_max_epi32(a, b);
+#else
+	return SSE2_MAX_EMUL(a, b, _mm_cmpgt_epi32);
+#endif
+}
+static inline int sse2_i32_gt_any(__m128i a, __m128i b)
+	{ return _mm_movemask_epi8(_mm_cmpgt_epi32(a, b)); }
+static inline __m128i sse2_i32_shift_in(__m128i a, int x)
+{
+	return _mm_or_si128(_mm_slli_si128(a, 4), _mm_cvtsi32_si128(x));
+}
+static inline void sse2_i32_store(int *p, __m128i a)
+	{ _mm_storeu_si128((__m128i *) p, a); }
+
+
+/****************************************************************************
+ * SSE2 kernels
+ */
+
+#define STRIPED_TARGET
+#define STRIPED_VEC __m128i
+
+#define STRIPED_PREFIX sse2_i8
+#define STRIPED_ELT signed char
+#define STRIPED_NLANE 16
+#define STRIPED_MIN SCHAR_MIN
+#define STRIPED_MAX SCHAR_MAX
+#include "align_striped_kernel.h"
+#undef STRIPED_PREFIX
+#undef STRIPED_ELT
+#undef STRIPED_NLANE
+#undef STRIPED_MIN
+#undef STRIPED_MAX
+
+#define STRIPED_PREFIX sse2_i16
+#define STRIPED_ELT short
+#define STRIPED_NLANE 8
+#define STRIPED_MIN SHRT_MIN
+#define STRIPED_MAX SHRT_MAX
+#include "align_striped_kernel.h"
+#undef STRIPED_PREFIX
+#undef STRIPED_ELT
+#undef STRIPED_NLANE
+#undef STRIPED_MIN
+#undef STRIPED_MAX
+
+#define STRIPED_PREFIX sse2_i32
+#define STRIPED_ELT int
+#define STRIPED_NLANE 4
+#define STRIPED_MIN (INT_MIN / 2)
+#define STRIPED_MAX INT_MAX
+#include "align_striped_kernel.h"
+#undef STRIPED_PREFIX
+#undef STRIPED_ELT
+#undef STRIPED_NLANE
+#undef STRIPED_MIN
+#undef STRIPED_MAX
+
+#undef STRIPED_TARGET
+#undef STRIPED_VEC
+
+#endif /* HAVE_SSE2_KERNELS */
+
+
+#ifdef HAVE_AVX2_KERNELS
+
+/****************************************************************************
+ * AVX2 vector helpers
+ */
+
+#define AVX2 __attribute__((target("avx2")))
+
+/* Shift 'a' by 'nbyte' bytes towards the high lanes, across the two 128-bit
+   halves. */
+#define AVX2_SLLI(a, nbyte) \
+	_mm256_alignr_epi8(a, _mm256_permute2x128_si256(a, a, 0x08), 16 - (nbyte))
+
+AVX2 static inline __m256i avx2_i8_set1(int x)
+	{ return _mm256_set1_epi8((char) x); }
+AVX2 static inline __m256i avx2_i8_adds(__m256i a, __m256i b)
+	{ return _mm256_adds_epi8(a, b); }
+AVX2 static inline __m256i avx2_i8_subs(__m256i a, __m256i b)
+	{ return _mm256_subs_epi8(a, b); }
+AVX2 static inline __m256i avx2_i8_max(__m256i a, __m256i b)
+	{ return _mm256_max_epi8(a, b); }
+AVX2 static inline int avx2_i8_gt_any(__m256i a, __m256i b)
+	{ return _mm256_movemask_epi8(_mm256_cmpgt_epi8(a, b)); }
+AVX2 static inline __m256i avx2_i8_shift_in(__m256i a, int x)
+{
+	return _mm256_or_si256(AVX2_SLLI(a, 1),
+			       _mm256_setr_epi32(x & 0xFF, 0, 0, 0, 0, 0, 0, 0));
+}
+AVX2 static inline void avx2_i8_store(signed char *p, __m256i a)
+	{ _mm256_storeu_si256((__m256i *) p, a); }
+
+AVX2 static inline __m256i avx2_i16_set1(int x)
+	{ return _mm256_set1_epi16((short) x); }
+AVX2 static inline __m256i avx2_i16_adds(__m256i a, __m256i b)
+	{ return _mm256_adds_epi16(a, b); }
+AVX2 static inline __m256i avx2_i16_subs(__m256i a, __m256i b)
+	{ return _mm256_subs_epi16(a, b); }
+AVX2 static inline __m256i avx2_i16_max(__m256i a, __m256i b)
+	{ return _mm256_max_epi16(a, b); }
+AVX2 static inline int avx2_i16_gt_any(__m256i a, __m256i b)
+	{ return _mm256_movemask_epi8(_mm256_cmpgt_epi16(a, b)); }
+AVX2 static inline __m256i avx2_i16_shift_in(__m256i a, int x)
+{
+	return _mm256_or_si256(AVX2_SLLI(a, 2),
+			       _mm256_setr_epi32(x & 0xFFFF, 0, 0, 0, 0, 0, 0, 0));
+}
+AVX2 static inline void avx2_i16_store(short *p, __m256i a)
+	{ _mm256_storeu_si256((__m256i *) p, a); }
+
+AVX2 static inline __m256i avx2_i32_set1(int x)
+	{ return _mm256_set1_epi32(x); }
+AVX2 static inline __m256i avx2_i32_adds(__m256i a, __m256i b)
+	{ return _mm256_add_epi32(a, b); }
+AVX2 static inline __m256i avx2_i32_subs(__m256i a, __m256i b)
+	{ return _mm256_sub_epi32(a, b); }
+AVX2 static inline __m256i avx2_i32_max(__m256i a, __m256i b)
+	{ return _mm256_max_epi32(a, b); }
+AVX2 static inline int avx2_i32_gt_any(__m256i a, __m256i b)
+	{ return _mm256_movemask_epi8(_mm256_cmpgt_epi32(a, b)); }
+AVX2 static inline __m256i avx2_i32_shift_in(__m256i a, int x)
+{
+	return _mm256_or_si256(AVX2_SLLI(a, 4),
+			       _mm256_setr_epi32(x, 0, 0, 0, 0, 0, 0, 0));
+}
+AVX2 static inline void avx2_i32_store(int *p, __m256i a)
+	{ _mm256_storeu_si256((__m256i *) p, a); }
+
+
+/****************************************************************************
+ * AVX2 kernels
+ */
+
+#define STRIPED_TARGET AVX2
+#define STRIPED_VEC __m256i
+
+#define STRIPED_PREFIX avx2_i8
+#define STRIPED_ELT signed char
+#define STRIPED_NLANE 32
+#define STRIPED_MIN SCHAR_MIN
+#define STRIPED_MAX SCHAR_MAX
+#include "align_striped_kernel.h"
+#undef STRIPED_PREFIX
+#undef STRIPED_ELT
+#undef STRIPED_NLANE
+#undef STRIPED_MIN
+#undef STRIPED_MAX
+
+#define STRIPED_PREFIX avx2_i16
+#define STRIPED_ELT short
+#define STRIPED_NLANE 16
+#define STRIPED_MIN SHRT_MIN
+#define STRIPED_MAX SHRT_MAX
+#include "align_striped_kernel.h"
+#undef STRIPED_PREFIX
+#undef STRIPED_ELT
+#undef STRIPED_NLANE
+#undef STRIPED_MIN
+#undef STRIPED_MAX
+
+#define STRIPED_PREFIX avx2_i32
+#define STRIPED_ELT int
+#define STRIPED_NLANE 8
+#define STRIPED_MIN (INT_MIN / 2)
+#define STRIPED_MAX INT_MAX
+#include "align_striped_kernel.h"
+#undef STRIPED_PREFIX
+#undef STRIPED_ELT
+#undef STRIPED_NLANE
+#undef STRIPED_MIN
+#undef STRIPED_MAX
+
+#undef STRIPED_TARGET
+#undef STRIPED_VEC
+
+#endif /* HAVE_AVX2_KERNELS */
+
+
+/****************************************************************************
+ * Initialization of the StripedAlignBuffer struct
+ */
+
+static int is_striped_integer(double x)
+{
+	return x == floor(x) && x > - MAX_STRIPED_SCORE && x < MAX_STRIPED_SCORE;
+}
+
+static int get_simd_support()
+{
+#ifdef HAVE_AVX2_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return SIMD_AVX2;
+#endif
+#ifdef HAVE_SSE2_KERNELS
+	return SIMD_SSE2;
+#else
+	return SIMD_NONE;
+#endif
+}
+
+static void *alloc_aligned(size_t size)
+{
+	char *p;
+
+	p = (char *) R_alloc(size + 32, sizeof(char));
+	return (void *) (p + (32 - ((size_t) p % 32)) % 32);
+}
+
+/*
+ * Returns NULL if the striped engine cannot be used for the given scoring
+ * scheme (in which case the scalar engine must be used).
+ * The arguments are those passed to pairwiseAlignment() in
+ * align_pairwiseAlignment.c, 'maxNChar1' being the length of the longest
+ * pattern.
+ */
+StripedAlignBuffer *_new_StripedAlignBuffer(
+		int maxNChar1,
+		float gapOpening,
+		float gapExtension,
+		const double *substitutionArray,
+		const int *substitutionArrayDim,
+		const int *substitutionLookupTable,
+		int substitutionLookupTableLength,
+		const int *fuzzyMatrix,
+		const int *fuzzyMatrixDim,
+		const int *fuzzyLookupTable,
+		int fuzzyLookupTableLength)
+{
+	StripedAlignBuffer *buf;
+	int simd, b, c1, c2, ncode, *score, code2key[BYTETRTABLE_LENGTH];
+	int key, subst1, subst2, fuzzy;
+	size_t nelt;
+	double value;
+
+	simd = get_simd_support();
+	if (simd == SIMD_NONE || maxNChar1 < 1
+	 || !is_striped_integer(gapOpening) || !is_striped_integer(gapExtension))
+		return NULL;
+	buf = (StripedAlignBuffer *) R_alloc(1, sizeof(StripedAlignBuffer));
+	buf->simd = simd;
+	buf->gapOpening = (int) gapOpening;
+	buf->gapExtension = (int) gapExtension;
+
+	/* Letters with the same substitution and fuzzy indices get the same
+	   code. Letters not in the lookup tables get NA. */
+	ncode = 0;
+	for (b = 0; b < BYTETRTABLE_LENGTH; b++) {
+		buf->byte2code[b] = NA_INTEGER;
+		if (b >= substitutionLookupTableLength
+		 || b >= fuzzyLookupTableLength
+		 || substitutionLookupTable[b] == NA_INTEGER
+		 || fuzzyLookupTable[b] == NA_INTEGER)
+			continue;
+		key = substitutionLookupTable[b] * fuzzyMatrixDim[0] +
+		      fuzzyLookupTable[b];
+		for (c1 = 0; c1 < ncode; c1++)
+			if (code2key[c1] == key)
+				break;
+		if (c1 == ncode)
+			code2key[ncode++] = key;
+		buf->byte2code[b] = c1;
+	}
+	if (ncode == 0)
+		return NULL;
+	buf->ncode = ncode;
+
+	/* Substitution scores, as computed by pairwiseAlignment() (i.e. after
+	   coercion to float) */
+	score = (int *) R_alloc((long) ncode * ncode, sizeof(int));
+	buf->min_score = buf->max_score = 0;
+	for (c1 = 0; c1 < ncode; c1++) {
+		subst1 = code2key[c1] / fuzzyMatrixDim[0];
+		for (c2 = 0; c2 < ncode; c2++) {
+			subst2 = code2key[c2] / fuzzyMatrixDim[0];
+			fuzzy = fuzzyMatrix[code2key[c1] % fuzzyMatrixDim[0] +
+				fuzzyMatrixDim[0] * (code2key[c2] % fuzzyMatrixDim[0])];
+			value = (float) substitutionArray[subst1 +
+				substitutionArrayDim[0] *
+				(subst2 + substitutionArrayDim[1] * fuzzy)];
+			if (!is_striped_integer(value))
+				return NULL;
+			score[c1 * ncode + c2] = (int) value;
+			if (value < buf->min_score)
+				buf->min_score = (int) value;
+			if (value > buf->max_score)
+				buf->max_score = (int) value;
+		}
+	}
+	buf->score = score;
+
+	/* Work buffers, big enough for the widest vectors (32 bytes) holding the
+	   narrowest lanes (8 bits) and for 32-bit lanes */
+	nelt = (size_t) maxNChar1 + 32;
+	if (nelt * ncode * sizeof(int) > MAX_STRIPED_PROFILE_SIZE)
+		return NULL;
+	buf->rowcode = (int *) R_alloc((long) maxNChar1, sizeof(int));
+	buf->code2slot = (int *) R_alloc((long) ncode, sizeof(int));
+	buf->slot2code = (int *) R_alloc((long) ncode, sizeof(int));
+	for (c1 = 0; c1 < ncode; c1++)
+		buf->code2slot[c1] = -1;
+	buf->nslot = 0;
+	buf->profile = alloc_aligned(nelt * ncode * sizeof(int));
+	buf->H1 = alloc_aligned(nelt * sizeof(int));
+	buf->H2 = alloc_aligned(nelt * sizeof(int));
+	buf->E = alloc_aligned(nelt * sizeof(int));
+	return buf;
+}
+
+
+/****************************************************************************
+ * _striped_align_score()
+ */
+
+static int get_striped_code(const StripedAlignBuffer *buf, char c)
+{
+	int code;
+
+	code = buf->byte2code[(unsigned char) c];
+	if (code == NA_INTEGER)
+		error("key %d not in lookup table", (int) (unsigned char) c);
+	return code;
+}
+
+/*
+ * Lower and upper bounds for the scores that can be reached by a
+ * non-local alignment of 'n1' + 'npad' rows against 'n2' columns.
+ * Every cell can be reached by a path made of gaps only, and only the
+ * substitutions contribute positive scores.
+ */
+static void get_score_bounds(const StripedAlignBuffer *buf,
+		int n1, int n2, int npad, double *lower, double *upper)
+{
+	double go, ge, max_abs;
+
+	go = buf->gapOpening;
+	ge = buf->gapExtension;
+	max_abs = buf->max_score > - buf->min_score ?
+		  buf->max_score : - buf->min_score;
+	*lower = - (3.0 * go + (double) (n1 + npad + n2 + 2) * ge +
+		    2.0 * (max_abs + go + ge)) - (go + ge);
+	*upper = (buf->max_score > 0 ? buf->max_score : 0) *
+		 (double) (n1 < n2 ? n1 : n2);
+	return;
+}
+
+#define FITS(lower, upper, max) ((lower) > - (double) (max) \
+			      && (upper) < (double) (max))
+
+/*
+ * Returns 1 if the score was computed, or 0 if the scalar engine must be
+ * used (i.e. if the scores cannot be guaranteed to fit in 32 bits).
+ * 'string1' and 'string2' must be non-empty.
+ */
+int _striped_align_score(StripedAlignBuffer *buf,
+		const Chars_holder *string1, const Chars_holder *string2,
+		int localAlignment, int endGap1, int endGap2, double *score)
+{
+	int n1, n2, r, j, code, slot, ret, iscore;
+	double lower, upper, max_abs;
+
+	n1 = string1->length;
+	n2 = string2->length;
+
+	/* Translate the pattern (last letter first, like the scalar engine
+	   does) and the subject */
+	for (r = 0; r < n1; r++)
+		buf->rowcode[r] = get_striped_code(buf, string1->ptr[n1 - 1 - r]);
+	for (slot = 0; slot < buf->nslot; slot++)
+		buf->code2slot[buf->slot2code[slot]] = -1;
+	buf->nslot = 0;
+	for (j = 0; j < n2; j++) {
+		code = get_striped_code(buf, string2->ptr[j]);
+		if (buf->code2slot[code] == -1) {
+			buf->code2slot[code] = buf->nslot;
+			buf->slot2code[buf->nslot++] = code;
+		}
+	}
+
+	get_score_bounds(buf, n1, n2, 32, &lower, &upper);
+	if (!FITS(lower, upper, MAX_STRIPED_SCORE))
+		return 0;
+	max_abs = buf->max_score > - buf->min_score ?
+		  buf->max_score : - buf->min_score;
+	max_abs += buf->gapOpening + buf->gapExtension;
+	ret = -1;
+	switch (buf->simd) {
+#ifdef HAVE_AVX2_KERNELS
+	    case SIMD_AVX2:
+		if (localAlignment) {
+			if (max_abs < SCHAR_MAX)
+				ret = avx2_i8_score(buf, string1, string2,
+					localAlignment, endGap1, endGap2, &iscore);
+			if (ret != 0 && max_abs < SHRT_MAX)
+				ret = avx2_i16_score(buf, string1, string2,
+					localAlignment, endGap1, endGap2, &iscore);
+		} else if (FITS(lower, upper, SHRT_MAX)) {
+			ret = avx2_i16_score(buf, string1, string2,
+				localAlignment, endGap1, endGap2, &iscore);
+		}
+		if (ret != 0)
+			ret = avx2_i32_score(buf, string1, string2,
+				localAlignment, endGap1, endGap2, &iscore);
+		break;
+#endif
+#ifdef HAVE_SSE2_KERNELS
+	    case SIMD_SSE2:
+		if (localAlignment) {
+			if (max_abs < SCHAR_MAX)
+				ret = sse2_i8_score(buf, string1, string2,
+					localAlignment, endGap1, endGap2, &iscore);
+			if (ret != 0 && max_abs < SHRT_MAX)
+				ret = sse2_i16_score(buf, string1, string2,
+					localAlignment, endGap1, endGap2, &iscore);
+		} else if (FITS(lower, upper, SHRT_MAX)) {
+			ret = sse2_i16_score(buf, string1, string2,
+				localAlignment, endGap1, endGap2, &iscore);
+		}
+		if (ret != 0)
+			ret = sse2_i32_score(buf, string1, string2,
+				localAlignment, endGap1, endGap2, &iscore);
+		break;
+#endif
+	    default:
+		return 0;
+	}
+	*score = (double) iscore;
+	return 1;
+}
+
+
+/****************************************************************************
+ * _batch_align_scores()
+ *
+ * Inter-sequence engine for many patterns against a single subject: the
+ * patterns are sorted by length and aligned by batches of similar length,
+ * one pattern per lane. Each batch costs as much as a single alignment of
+ * its longest pattern, so batches where too many lanes would only hold
+ * padding rows are left to the per-pattern engines.
+ */
+
+/* Patterns longer than this are better handled by the striped engine */
+#define MAX_BATCH_NCHAR 2048
+
+typedef struct batch_elt {
+	int length;
+	int index;
+} BatchElt;
+
+static int cmp_BatchElt(const void *p1, const void *p2)
+{
+	const BatchElt *e1 = (const BatchElt *) p1, *e2 = (const BatchElt *) p2;
+
+	if (e1->length != e2->length)
+		return e1->length - e2->length;
+	return e1->index - e2->index;
+}
+
+static int get_batch_nlane(const StripedAlignBuffer *buf, int width)
+{
+	return (buf->simd == SIMD_AVX2 ? 256 : 128) / width;
+}
+
+static int batch_kernel(const StripedAlignBuffer *buf, int width,
+		const Chars_holder *patterns, int npattern, int n2,
+		int localAlignment, int endGap1, int endGap2, int *scores)
+{
+	const int *colslot = buf->batch_colslot;
+
+	switch (buf->simd) {
+#ifdef HAVE_AVX2_KERNELS
+	    case SIMD_AVX2:
+		if (width == 8)
+			return avx2_i8_batch_score(buf, patterns, npattern,
+				colslot, n2, localAlignment, endGap1, endGap2,
+				scores);
+		if (width == 16)
+			return avx2_i16_batch_score(buf, patterns, npattern,
+				colslot, n2, localAlignment, endGap1, endGap2,
+				scores);
+		return avx2_i32_batch_score(buf, patterns, npattern,
+				colslot, n2, localAlignment, endGap1, endGap2,
+				scores);
+#endif
+#ifdef HAVE_SSE2_KERNELS
+	    case SIMD_SSE2:
+		if (width == 8)
+			return sse2_i8_batch_score(buf, patterns, npattern,
+				colslot, n2, localAlignment, endGap1, endGap2,
+				scores);
+		if (width == 16)
+			return sse2_i16_batch_score(buf, patterns, npattern,
+				colslot, n2, localAlignment, endGap1, endGap2,
+				scores);
+		return sse2_i32_batch_score(buf, patterns, npattern,
+				colslot, n2, localAlignment, endGap1, endGap2,
+				scores);
+#endif
+	    default:
+		return -1;
+	}
+}
+
+/* Allocates the work buffers for patterns of up to 'maxnchar' letters and
+   translates the subject. Returns 0 if the profile would be too big. */
+static int init_batch_buffers(StripedAlignBuffer *buf, int maxnchar,
+		const Chars_holder *subject)
+{
+	int j, code, slot;
+	size_t nvec;
+
+	for (slot = 0; slot < buf->nslot; slot++)
+		buf->code2slot[buf->slot2code[slot]] = -1;
+	buf->nslot = 0;
+	buf->batch_colslot = (int *) R_alloc((long) subject->length,
+					     sizeof(int));
+	for (j = 0; j < subject->length; j++) {
+		code = get_striped_code(buf, subject->ptr[j]);
+		if (buf->code2slot[code] == -1) {
+			buf->code2slot[code] = buf->nslot;
+			buf->slot2code[buf->nslot++] = code;
+		}
+		buf->batch_colslot[j] = buf->code2slot[code];
+	}
+	nvec = (size_t) maxnchar + 1;
+	if (nvec * buf->nslot * 32 > MAX_STRIPED_PROFILE_SIZE)
+		return 0;
+	buf->batch_maxnchar = maxnchar;
+	buf->batch_profile = alloc_aligned(nvec * buf->nslot * 32);
+	buf->batch_H = alloc_aligned(nvec * 32);
+	buf->batch_D = alloc_aligned(nvec * 32);
+	buf->batch_openD = alloc_aligned(nvec * 32);
+	buf->batch_extD = alloc_aligned(nvec * 32);
+	return 1;
+}
+
+/*
+ * Aligns a batch of patterns (at most 'get_batch_nlane(buf, 8)' patterns)
+ * with lanes of 'width' bits, falling back to wider lanes if they saturate.
+ * Returns 1 if the scores were computed.
+ */
+static int align_batch(const StripedAlignBuffer *buf, int width,
+		const Chars_holder *patterns, int npattern, int n2,
+		int localAlignment, int endGap1, int endGap2, int *scores)
+{
+	int k, nlane, ret;
+
+	for ( ; width <= 32; width *= 2) {
+		nlane = get_batch_nlane(buf, width);
+		ret = 0;
+		for (k = 0; k < npattern && ret == 0; k += nlane)
+			ret = batch_kernel(buf, width, patterns + k,
+				npattern - k < nlane ? npattern - k : nlane,
+				n2, localAlignment, endGap1, endGap2,
+				scores + k);
+		if (ret == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Computes the scores of the alignments of 'patterns' against 'subject',
+ * as _striped_align_score() would. Only the scores for which 'done' is set
+ * to 1 are computed, the other ones must be computed by the caller.
+ */
+void _batch_align_scores(StripedAlignBuffer *buf,
+		const Chars_holder *patterns, int npattern,
+		const Chars_holder *subject,
+		int localAlignment, int endGap1, int endGap2,
+		double *scores, int *done)
+{
+	BatchElt *order;
+	Chars_holder *batch;
+	int *iscores, nbatch, maxnchar, width, w, nlane, b, k, n, r, sum;
+	double lower, upper, max_abs;
+
+	for (k = 0; k < npattern; k++)
+		done[k] = 0;
+	if (buf->simd == SIMD_NONE || subject->length == 0)
+		return;
+	max_abs = buf->max_score > - buf->min_score ?
+		  buf->max_score : - buf->min_score;
+	max_abs += buf->gapOpening + buf->gapExtension;
+	if (localAlignment && max_abs < SCHAR_MAX)
+		width = 8;
+	else if (max_abs < SHRT_MAX)
+		width = 16;
+	else
+		width = 32;
+	nlane = get_batch_nlane(buf, width);
+
+	/* Sort the non-empty patterns by length */
+	order = (BatchElt *) R_alloc((long) npattern, sizeof(BatchElt));
+	n = 0;
+	for (k = 0; k < npattern; k++) {
+		if (patterns[k].length == 0)
+			continue;
+		order[n].length = patterns[k].length;
+		order[n].index = k;
+		n++;
+	}
+	if (n < nlane)
+		return;
+	qsort(order, n, sizeof(BatchElt), cmp_BatchElt);
+
+	/* Only full batches, with at least half of the DP cells in use */
+	maxnchar = 0;
+	nbatch = 0;
+	for (b = 0; b + nlane <= n; b += nlane) {
+		if (order[b + nlane - 1].length > MAX_BATCH_NCHAR)
+			break;
+		sum = 0;
+		for (k = b; k < b + nlane; k++)
+			sum += order[k].length;
+		if (2 * sum < nlane * order[b + nlane - 1].length)
+			continue;
+		memmove(order + nbatch * nlane, order + b,
+			nlane * sizeof(BatchElt));
+		maxnchar = order[nbatch * nlane + nlane - 1].length;
+		nbatch++;
+	}
+	if (nbatch == 0 || !init_batch_buffers(buf, maxnchar, subject))
+		return;
+
+	batch = (Chars_holder *) R_alloc((long) nlane, sizeof(Chars_holder));
+	iscores = (int *) R_alloc((long) nlane, sizeof(int));
+	for (b = 0; b < nbatch; b++) {
+		for (k = 0; k < nlane; k++) {
+			batch[k] = patterns[order[b * nlane + k].index];
+			for (r = 0; r < batch[k].length; r++)
+				get_striped_code(buf, batch[k].ptr[r]);
+		}
+		get_score_bounds(buf, batch[nlane - 1].length,
+				 subject->length, 0, &lower, &upper);
+		if (!FITS(lower, upper, MAX_STRIPED_SCORE))
+			continue;
+		w = width;
+		if (!localAlignment && !FITS(lower, upper, SHRT_MAX))
+			w = 32;
+		if (!align_batch(buf, w, batch, nlane, subject->length,
+				 localAlignment, endGap1, endGap2, iscores))
+			continue;
+		for (k = 0; k < nlane; k++) {
+			scores[order[b * nlane + k].index] = (double) iscores[k];
+			done[order[b * nlane + k].index] = 1;
+		}
+	}
+	return;
+}
@@ -0,0 +1,308 @@
+/****************************************************************************
+ *              Striped score-only kernel (Farrar, 2007)                    *
+ *                                                                          *
+ * This file is NOT a standalone compilation unit: it is included by        *
+ * align_striped.c once per instruction set and lane width, after          *
+ * defining:                                                                *
+ *   STRIPED_PREFIX  prefix of the vector helpers (e.g. sse2_i16) and of    *
+ *                   the generated kernel (e.g. sse2_i16_score)             *
+ *   STRIPED_VEC     vector type                                            *
+ *   STRIPED_ELT     lane type                                              *
+ *   STRIPED_NLANE   nb of lanes per vector                                 *
+ *   STRIPED_MIN     value used as -Inf in the lanes                        *
+ *   STRIPED_MAX     largest value representable without saturation        *
+ *   STRIPED_TARGET  function attribute (empty or target("..."))            *
+ *                                                                          *
+ * The kernel computes exactly the same recurrences as the scoreOnly        *
+ * branch of pairwiseAlignment() in align_pairwiseAlignment.c, with the     *
+ * rows (pattern letters) striped across the lanes:                         *
+ *   S(i,j) = H(i-1,j-1) + sub(i,j)   (clamped at 0 for local alignments)   *
+ *   D(i,j) = max(H(i,j-1) - (gapOpening + gapExtension),                   *
+ *                D(i,j-1) - gapExtension)                                  *
+ *   I(i,j) = max(H(i-1,j) - (gapOpening + gapExtension),                   *
+ *                I(i-1,j) - gapExtension)                                  *
+ *   H(i,j) = max(S(i,j), D(i,j), I(i,j))                                   *
+ * D is kept in the 'E' buffer and I is computed by the "lazy-F" loop.      *
+ *                                                                          *
+ * The inter-sequence kernel computes the same recurrences for up to        *
+ * STRIPED_NLANE patterns at once (one pattern per lane) against the same   *
+ * subject.                                                                 *
+ ****************************************************************************/
+
+#define STRIPED_CAT2(a, b) a ## _ ## b
+#define STRIPED_CAT(a, b) STRIPED_CAT2(a, b)
+#define VOP(op) STRIPED_CAT(STRIPED_PREFIX, op)
+
+/*
+ * Returns 0 on success or -1 if a local alignment score saturated the lanes
+ * (in which case the caller retries with wider lanes).
+ */
+STRIPED_TARGET
+static int VOP(score)(const StripedAlignBuffer *buf,
+		const Chars_holder *string1, const Chars_holder *string2,
+		int localAlignment, int endGap1, int endGap2, int *score)
+{
+	const int n1 = string1->length, n2 = string2->length;
+	const int segLen = (n1 + STRIPED_NLANE - 1) / STRIPED_NLANE;
+	const int go = buf->gapOpening, ge = buf->gapExtension;
+	const int patchLastRow = !localAlignment && !endGap2;
+	/* position of row n1 in the striped buffers */
+	const int lastIdx = ((n1 - 1) % segLen) * STRIPED_NLANE +
+			    (n1 - 1) / segLen;
+	int s, seg, k, r, i, j, c2, pad, maxScore;
+	const int *score_col;
+	STRIPED_VEC *profile, *pvHStore, *pvHLoad, *pvE, *pvTmp, *vP;
+	STRIPED_VEC vH, vE, vF, vMaxS, vZero, vGapO, vGapE, vOpen;
+	STRIPED_ELT *elt, lanes[STRIPED_NLANE];
+
+	profile = (STRIPED_VEC *) buf->profile;
+	pvHStore = (STRIPED_VEC *) buf->H1;
+	pvHLoad = (STRIPED_VEC *) buf->H2;
+	pvE = (STRIPED_VEC *) buf->E;
+
+	/* Step 1: Build the query profile (one striped column of substitution
+	   scores per letter of the subject). The padding rows get a penalty
+	   that prevents them from producing a better local score. */
+	pad = - (buf->max_score > - buf->min_score ?
+		 buf->max_score : - buf->min_score) - go - ge;
+	if (pad < STRIPED_MIN)
+		pad = STRIPED_MIN;
+	for (s = 0; s < buf->nslot; s++) {
+		score_col = buf->score + buf->slot2code[s];
+		elt = (STRIPED_ELT *) (profile + s * segLen);
+		for (seg = 0; seg < segLen; seg++) {
+			for (k = 0; k < STRIPED_NLANE; k++) {
+				r = k * segLen + seg;
+				*(elt++) = (STRIPED_ELT) (r < n1 ?
+					score_col[buf->rowcode[r] * buf->ncode] : pad);
+			}
+		}
+	}
+
+	/* Step 2: Column 0, i.e. H(i,0) = I(i,0) and D(i,1) = I(i,0) - gapOpening
+	   - gapExtension. */
+	for (seg = 0; seg < segLen; seg++) {
+		for (k = 0; k < STRIPED_NLANE; k++) {
+			i = k * segLen + seg + 1;
+			r = endGap1 ? - go - i * ge : 0;
+			((STRIPED_ELT *) pvHStore)[seg * STRIPED_NLANE + k] =
+				(STRIPED_ELT) r;
+			((STRIPED_ELT *) pvE)[seg * STRIPED_NLANE + k] =
+				(STRIPED_ELT) (r - go - ge);
+		}
+	}
+	if (patchLastRow)
+		((STRIPED_ELT *) pvE)[lastIdx] =
+			((STRIPED_ELT *) pvHStore)[lastIdx];
+
+	/* Step 3: Walk the subject */
+	vZero = VOP(set1)(0);
+	vGapO = VOP(set1)(go + ge);
+	vGapE = VOP(set1)(ge);
+	vOpen = VOP(set1)(go);
+	vMaxS = vZero;
+	for (j = 1; j <= n2; j++) {
+		c2 = buf->byte2code[(unsigned char) string2->ptr[n2 - j]];
+		vP = profile + buf->code2slot[c2] * segLen;
+		/* H(0,j-1) goes to the 1st lane, I(1,j) = D(0,j) - gapOpening -
+		   gapExtension */
+		vH = VOP(shift_in)(pvHStore[segLen - 1],
+			j == 1 || !endGap2 ? 0 : - go - (j - 1) * ge);
+		vF = VOP(shift_in)(VOP(set1)(STRIPED_MIN),
+			(endGap2 ? - go - j * ge : 0) - go - ge);
+		pvTmp = pvHLoad;
+		pvHLoad = pvHStore;
+		pvHStore = pvTmp;
+		for (seg = 0; seg < segLen; seg++) {
+			vH = VOP(adds)(vH, vP[seg]);
+			if (localAlignment) {
+				vH = VOP(max)(vH, vZero);
+				vMaxS = VOP(max)(vMaxS, vH);
+			}
+			vE = pvE[seg];
+			vH = VOP(max)(vH, vE);
+			vH = VOP(max)(vH, vF);
+			pvHStore[seg] = vH;
+			vH = VOP(subs)(vH, vGapO);
+			vE = VOP(subs)(vE, vGapE);
+			pvE[seg] = VOP(max)(vE, vH);
+			vF = VOP(subs)(vF, vGapE);
+			vF = VOP(max)(vF, vH);
+			vH = pvHLoad[seg];
+		}
+		/* Lazy-F loop: propagate I across the lanes until it can no longer
+		   improve H, i.e. until I(i-1,j) - gapExtension <= H(i-1,j) -
+		   gapOpening - gapExtension everywhere */
+		vF = VOP(shift_in)(vF, STRIPED_MIN);
+		seg = 0;
+		vH = pvHStore[0];
+		while (VOP(gt_any)(vF, VOP(subs)(vH, vOpen))) {
+			vH = VOP(max)(vH, vF);
+			pvHStore[seg] = vH;
+			vH = VOP(subs)(vH, vGapO);
+			pvE[seg] = VOP(max)(pvE[seg], vH);
+			vF = VOP(subs)(vF, vGapE);
+			if (++seg >= segLen) {
+				vF = VOP(shift_in)(vF, STRIPED_MIN);
+				seg = 0;
+			}
+			vH = pvHStore[seg];
+		}
+		/* No end gap penalty for the subject: D(n1,j+1) = H(n1,j) */
+		if (patchLastRow)
+			((STRIPED_ELT *) pvE)[lastIdx] =
+				((STRIPED_ELT *) pvHStore)[lastIdx];
+	}
+
+	/* Step 4: Extract the score */
+	if (localAlignment) {
+		VOP(store)(lanes, vMaxS);
+		maxScore = 0;
+		for (k = 0; k < STRIPED_NLANE; k++)
+			if (lanes[k] > maxScore)
+				maxScore = lanes[k];
+		if (maxScore >= STRIPED_MAX)
+			return -1;
+	} else if (endGap1) {
+		maxScore = ((STRIPED_ELT *) pvHStore)[lastIdx];
+	} else {
+		/* No end gap penalty for the pattern: the best H(i,n2) over all
+		   the rows (and D(0,n2)) */
+		maxScore = endGap2 ? - go - n2 * ge : 0;
+		elt = (STRIPED_ELT *) pvHStore;
+		for (seg = 0; seg < segLen; seg++) {
+			for (k = 0; k < STRIPED_NLANE; k++) {
+				if (k * segLen + seg < n1 &&
+				    elt[seg * STRIPED_NLANE + k] > maxScore)
+					maxScore = elt[seg * STRIPED_NLANE + k];
+			}
+		}
+	}
+	*score = maxScore;
+	return 0;
+}
+
+/*
+ * Inter-sequence kernel: lane k holds the DP matrix of patterns[k] against
+ * 'subject' (translated to query profile slots by the caller). The rows
+ * below the last row of a pattern get a penalty like the padding rows of
+ * the striped kernel, and don't contribute to the scores. Returns 0 on
+ * success or -1 if a local alignment score saturated the lanes.
+ */
+STRIPED_TARGET
+static int VOP(batch_score)(const StripedAlignBuffer *buf,
+		const Chars_holder *patterns, int npattern,
+		const int *colslot, int n2,
+		int localAlignment, int endGap1, int endGap2, int *scores)
+{
+	const int go = buf->gapOpening, ge = buf->gapExtension;
+	int n1, maxN1, s, i, j, k, pad, h;
+	const int *score_col;
+	STRIPED_VEC *profile, *pvH, *pvD, *pvOpenD, *pvExtD, *vP;
+	STRIPED_VEC vH, vD, vI, vS, vDiag, vTmp, vMaxS, vZero, vGapO, vGapE, vMin;
+	STRIPED_ELT *elt, lanes[STRIPED_NLANE];
+
+	profile = (STRIPED_VEC *) buf->batch_profile;
+	pvH = (STRIPED_VEC *) buf->batch_H;
+	pvD = (STRIPED_VEC *) buf->batch_D;
+	pvOpenD = (STRIPED_VEC *) buf->batch_openD;
+	pvExtD = (STRIPED_VEC *) buf->batch_extD;
+	maxN1 = 0;
+	for (k = 0; k < npattern; k++)
+		if (patterns[k].length > maxN1)
+			maxN1 = patterns[k].length;
+
+	/* Step 1: Build the profile (one vector of substitution scores per
+	   row and per letter of the subject) */
+	pad = - (buf->max_score > - buf->min_score ?
+		 buf->max_score : - buf->min_score) - go - ge;
+	if (pad < STRIPED_MIN)
+		pad = STRIPED_MIN;
+	for (s = 0; s < buf->nslot; s++) {
+		score_col = buf->score + buf->slot2code[s];
+		for (i = 0; i < maxN1; i++) {
+			elt = (STRIPED_ELT *) (profile + s * maxN1 + i);
+			for (k = 0; k < STRIPED_NLANE; k++)
+				elt[k] = (STRIPED_ELT) (k < npattern &&
+					i < patterns[k].length ?
+					score_col[buf->byte2code[(unsigned char)
+						  patterns[k].ptr[i]] * buf->ncode] :
+					pad);
+		}
+	}
+
+	/* Step 2: Column 0, and the gap penalties for D. No end gap penalty
+	   for the subject means D(n1,j) = H(n1,j-1) on the last row of each
+	   pattern. */
+	for (i = 0; i <= maxN1; i++) {
+		h = (i == 0 || !endGap1) ? 0 : - go - i * ge;
+		pvH[i] = VOP(set1)(h);
+		pvD[i] = VOP(set1)(STRIPED_MIN);
+		pvOpenD[i] = VOP(set1)(go + ge);
+		pvExtD[i] = VOP(set1)(ge);
+		if (endGap2 || localAlignment || i == 0)
+			continue;
+		for (k = 0; k < npattern; k++) {
+			if (patterns[k].length != i)
+				continue;
+			((STRIPED_ELT *) (pvOpenD + i))[k] = 0;
+			((STRIPED_ELT *) (pvExtD + i))[k] = 0;
+		}
+	}
+
+	/* Step 3: Walk the subject */
+	vZero = VOP(set1)(0);
+	vGapO = VOP(set1)(go + ge);
+	vGapE = VOP(set1)(ge);
+	vMin = VOP(set1)(STRIPED_MIN);
+	vMaxS = vZero;
+	for (j = 1; j <= n2; j++) {
+		vP = profile + colslot[j - 1] * maxN1;
+		vDiag = pvH[0];
+		vH = VOP(set1)(endGap2 ? - go - j * ge : 0);
+		pvH[0] = vH;
+		vI = vMin;
+		for (i = 1; i <= maxN1; i++) {
+			vS = VOP(adds)(vDiag, vP[i - 1]);
+			if (localAlignment) {
+				vS = VOP(max)(vS, vZero);
+				vMaxS = VOP(max)(vMaxS, vS);
+			}
+			vTmp = pvH[i];
+			vD = VOP(max)(VOP(subs)(vTmp, pvOpenD[i]),
+				      VOP(subs)(pvD[i], pvExtD[i]));
+			vI = VOP(max)(VOP(subs)(vH, vGapO),
+				      VOP(subs)(vI, vGapE));
+			vH = VOP(max)(vS, VOP(max)(vD, vI));
+			pvD[i] = vD;
+			pvH[i] = vH;
+			vDiag = vTmp;
+		}
+	}
+
+	/* Step 4: Extract the scores */
+	if (localAlignment)
+		VOP(store)(lanes, vMaxS);
+	for (k = 0; k < npattern; k++) {
+		n1 = patterns[k].length;
+		if (localAlignment) {
+			if (lanes[k] >= STRIPED_MAX)
+				return -1;
+			scores[k] = lanes[k];
+		} else if (endGap1) {
+			scores[k] = ((STRIPED_ELT *) (pvH + n1))[k];
+		} else {
+			/* No end gap penalty for the pattern: the best H(i,n2)
+			   over all the rows (including row 0) */
+			scores[k] = ((STRIPED_ELT *) pvH)[k];
+			for (i = 1; i <= n1; i++)
+				if (((STRIPED_ELT *) (pvH + i))[k] > scores[k])
+					scores[k] = ((STRIPED_ELT *) (pvH + i))[k];
+		}
+	}
+	return 0;
+}
+
+#undef VOP
+#undef STRIPED_CAT
+#undef STRIPED_CAT2
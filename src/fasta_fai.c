@@ -0,0 +1,417 @@
+/****************************************************************************
+ *            Indexed FASTA files (samtools-compatible .fai index)           *
+ ****************************************************************************/
+#include "Biostrings.h"
+#include "XVector_interface.h"
+#include "S4Vectors_interface.h"
+
+#include <stdio.h>
+#include <string.h>  /* for memchr() */
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
+
+/*
+ * The .fai index has 1 line per FASTA record with 5 tab-separated fields:
+ *   NAME       first word of the description line
+ *   LENGTH     nb of letters in the sequence
+ *   OFFSET     offset of the first letter of the sequence in the file
+ *   LINEBASES  nb of letters per line
+ *   LINEWIDTH  nb of bytes per line (including the LF or CRLF)
+ * All the lines of a record but the last one must have the same length
+ * (like with samtools faidx). This allows the offset of any letter in the
+ * file to be computed directly.
+ */
+
+static char errmsg_buf[200];
+
+
+/****************************************************************************
+ * fasta_fai()
+ */
+
+typedef struct fai_buf {
+	CharAEAE *name_buf;
+	LLongAE *length_buf;
+	LLongAE *offset_buf;
+	IntAE *linebases_buf;
+	IntAE *linewidth_buf;
+} FAIbuf;
+
+typedef struct fai_record {
+	long long int length;
+	int linebases, linewidth;
+	int last_line_seen;  /* no more letters allowed in the record */
+} FAIrecord;
+
+static void append_name(CharAEAE *name_buf, const Chars_holder *desc)
+{
+	int n;
+	CharAE *name;
+
+	for (n = 0; n < desc->length; n++)
+		if (desc->ptr[n] == ' ' || desc->ptr[n] == '\t')
+			break;
+	name = new_CharAE(n);
+	CharAE_set_nelt(name, n);
+	memcpy(name->elts, desc->ptr, n);
+	CharAEAE_insert_at(name_buf, CharAEAE_get_nelt(name_buf), name);
+	return;
+}
+
+static void flush_record(FAIbuf *fai_buf, const FAIrecord *rec)
+{
+	int i = LLongAE_get_nelt(fai_buf->length_buf);
+
+	LLongAE_insert_at(fai_buf->length_buf, i, rec->length);
+	IntAE_insert_at(fai_buf->linebases_buf, i, rec->linebases);
+	IntAE_insert_at(fai_buf->linewidth_buf, i, rec->linewidth);
+	return;
+}
+
+/* Returns 0 if the line breaks the "same line length" rule. */
+static int add_seq_line(FAIrecord *rec, int nbase, int nbyte)
+{
+	if (rec->last_line_seen)
+		return 0;
+	if (rec->length == 0) {
+		rec->linebases = nbase;
+		rec->linewidth = nbyte;
+	} else if (nbase > rec->linebases) {
+		return 0;
+	} else if (nbase < rec->linebases || nbyte != rec->linewidth) {
+		rec->last_line_seen = 1;
+	}
+	rec->length += nbase;
+	return 1;
+}
+
+static const char *parse_FAI_file(BlockReader *reader, FAIbuf *fai_buf)
+{
+	int lineno, EOL_in_buf, EOL_in_prev_buf, ret_code, nbyte_in,
+	    in_rec, nbase, nbyte;
+	FAIrecord rec;
+	Chars_holder data;
+	long long int offset;
+
+	lineno = 0;
+	EOL_in_buf = 1;
+	in_rec = 0;
+	offset = 0LL;
+	nbase = nbyte = 0;
+	while (1) {
+		if (EOL_in_buf)
+			lineno++;
+		EOL_in_prev_buf = EOL_in_buf;
+		ret_code = _BlockReader_gets(reader, &data,
+					     &nbyte_in, &EOL_in_buf);
+		if (ret_code == 0)
+			break;
+		if (ret_code == -1) {
+			snprintf(errmsg_buf, sizeof(errmsg_buf),
+				 "read error while reading characters "
+				 "from line %d", lineno);
+			return errmsg_buf;
+		}
+		offset += nbyte_in;
+		if (EOL_in_prev_buf && data.length != 0 && data.ptr[0] == '>') {
+			if (!EOL_in_buf) {
+				snprintf(errmsg_buf, sizeof(errmsg_buf),
+					 "cannot read line %d, "
+					 "line is too long", lineno);
+				return errmsg_buf;
+			}
+			if (in_rec)
+				flush_record(fai_buf, &rec);
+			data.ptr++;
+			data.length--;
+			append_name(fai_buf->name_buf, &data);
+			LLongAE_insert_at(fai_buf->offset_buf,
+				LLongAE_get_nelt(fai_buf->offset_buf), offset);
+			rec.length = 0LL;
+			rec.linebases = rec.linewidth = 0;
+			rec.last_line_seen = 0;
+			in_rec = 1;
+			continue;
+		}
+		if (!in_rec) {
+			/* Like parse_FASTA_file(), we ignore empty lines and
+			   comment lines before the 1st record */
+			if (EOL_in_prev_buf && (data.length == 0
+					     || data.ptr[0] == ';'))
+				continue;
+			snprintf(errmsg_buf, sizeof(errmsg_buf),
+				 "\">\" expected at beginning of line %d",
+				 lineno);
+			return errmsg_buf;
+		}
+		/* A sequence line can be longer than the BlockReader buffer
+		   (e.g. when a chromosome is on a single line) */
+		nbase += data.length;
+		nbyte += nbyte_in;
+		if (!EOL_in_buf)
+			continue;
+		if (nbase == 0) {
+			/* Empty lines are only allowed at the end of a
+			   record */
+			rec.last_line_seen = 1;
+		} else if (!add_seq_line(&rec, nbase, nbyte)) {
+			snprintf(errmsg_buf, sizeof(errmsg_buf),
+				 "line %d: all the lines of a record but the "
+				 "last one must have the same length", lineno);
+			return errmsg_buf;
+		}
+		nbase = nbyte = 0;
+	}
+	if (in_rec)
+		flush_record(fai_buf, &rec);
+	return NULL;
+}
+
+static const char *parse_FAI_file_with_buf(BlockReader *reader,
+		void *parser_data)
+{
+	return parse_FAI_file(reader, (FAIbuf *) parser_data);
+}
+
+static SEXP new_NUMERIC_from_LLongAE(const LLongAE *ae)
+{
+	SEXP ans;
+	int i;
+
+	PROTECT(ans = NEW_NUMERIC(LLongAE_get_nelt(ae)));
+	for (i = 0; i < LENGTH(ans); i++)
+		REAL(ans)[i] = (double) ae->elts[i];
+	UNPROTECT(1);
+	return ans;
+}
+
+static SEXP make_fai_data_frame(const FAIbuf *fai_buf)
+{
+	static const char *colnames[] = {"name", "length", "offset",
+					 "linebases", "linewidth"};
+	SEXP df, names, tmp;
+	int j;
+
+	PROTECT(df = NEW_LIST(5));
+	PROTECT(names = NEW_CHARACTER(5));
+	for (j = 0; j < 5; j++) {
+		PROTECT(tmp = mkChar(colnames[j]));
+		SET_STRING_ELT(names, j, tmp);
+		UNPROTECT(1);
+	}
+	SET_NAMES(df, names);
+	UNPROTECT(1);
+	SET_ELEMENT(df, 0, new_CHARACTER_from_CharAEAE(fai_buf->name_buf));
+	SET_ELEMENT(df, 1, new_NUMERIC_from_LLongAE(fai_buf->length_buf));
+	SET_ELEMENT(df, 2, new_NUMERIC_from_LLongAE(fai_buf->offset_buf));
+	SET_ELEMENT(df, 3, new_INTEGER_from_IntAE(fai_buf->linebases_buf));
+	SET_ELEMENT(df, 4, new_INTEGER_from_IntAE(fai_buf->linewidth_buf));
+	/* list_as_data_frame() performs IN-PLACE coercion */
+	list_as_data_frame(df, IntAE_get_nelt(fai_buf->linebases_buf));
+	UNPROTECT(1);
+	return df;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   filexp_list: A list of 1 "file external pointer" (see
+ *                XVector::open_input_files()).
+ *   nthreads:    The nb of threads to use for decompressing a BGZF file.
+ * Returns the .fai index as a data frame.
+ */
+SEXP fasta_fai(SEXP filexp_list, SEXP nthreads)
+{
+	FAIbuf fai_buf;
+	const char *errmsg;
+	int nthreads0;
+
+	nthreads0 = INTEGER(nthreads)[0];
+#ifdef _OPENMP
+	if (nthreads0 < 1)
+		nthreads0 = 1;
+#else
+	nthreads0 = 1;
+#endif
+	fai_buf.name_buf = new_CharAEAE(0, 0);
+	fai_buf.length_buf = new_LLongAE(0, 0, 0);
+	fai_buf.offset_buf = new_LLongAE(0, 0, 0);
+	fai_buf.linebases_buf = new_IntAE(0, 0, 0);
+	fai_buf.linewidth_buf = new_IntAE(0, 0, 0);
+	errmsg = _parse_with_BlockReader(VECTOR_ELT(filexp_list, 0), 0LL,
+					 nthreads0, parse_FAI_file_with_buf,
+					 &fai_buf);
+	if (errmsg != NULL)
+		error("indexing FASTA file %s: %s",
+		      CHAR(STRING_ELT(GET_NAMES(filexp_list), 0)), errmsg);
+	return make_fai_data_frame(&fai_buf);
+}
+
+
+/****************************************************************************
+ * read_fai_regions()
+ */
+
+#define FAI_CHUNK_SIZE 1048576
+
+typedef struct fai_file {
+	FILE *file;
+	BGZFreader *bgzf;
+} FAIfile;
+
+static int FAIfile_read(FAIfile *fai_file, long long int offset,
+		char *buf, int n)
+{
+	if (fai_file->bgzf != NULL) {
+		if (!_BGZFreader_seek(fai_file->bgzf, offset))
+			return -1;
+		return _BGZFreader_read(fai_file->bgzf, buf, n);
+	}
+	if (fseek64(fai_file->file, offset, SEEK_SET) != 0)
+		return -1;
+	return fread(buf, sizeof(char), n, fai_file->file);
+}
+
+/*
+ * Copies the letters of region [start, start + width) of a record to 'dest'
+ * (translated with 'byte2code'). Only the bytes between the first and last
+ * letters of the region are read, and the line terminators are skipped.
+ */
+static const char *read_region(FAIfile *fai_file, char *chunk,
+		long long int offset, int linebases, int linewidth,
+		long long int start, int width,
+		const ByteTrTable *byte2code, char *dest)
+{
+	long long int pos0, pos1, off0, nbyte;
+	int col, n, i, k, run, code;
+
+	if (width == 0)
+		return NULL;
+	pos0 = start - 1;
+	pos1 = pos0 + width - 1;
+	off0 = offset + (pos0 / linebases) * linewidth + pos0 % linebases;
+	nbyte = offset + (pos1 / linebases) * linewidth + pos1 % linebases
+		- off0 + 1;
+	col = pos0 % linebases;
+	while (nbyte > 0) {
+		n = nbyte < FAI_CHUNK_SIZE ? (int) nbyte : FAI_CHUNK_SIZE;
+		if (FAIfile_read(fai_file, off0, chunk, n) != n) {
+			snprintf(errmsg_buf, sizeof(errmsg_buf),
+				 "cannot read %d bytes at offset %lld (is "
+				 "the .fai index up to date?)", n, off0);
+			return errmsg_buf;
+		}
+		off0 += n;
+		nbyte -= n;
+		for (i = 0; i < n; i += run) {
+			if (col >= linebases) {
+				/* Skip the line terminator */
+				run = linewidth - col;
+				if (run > n - i)
+					run = n - i;
+				col += run;
+				if (col == linewidth)
+					col = 0;
+				continue;
+			}
+			run = linebases - col;
+			if (run > n - i)
+				run = n - i;
+			col += run;
+			if (byte2code == NULL) {
+				memcpy(dest, chunk + i, run);
+				dest += run;
+				continue;
+			}
+			for (k = i; k < i + run; k++) {
+				code = byte2code->byte2code[(unsigned char)
+							    chunk[k]];
+				if (code == NA_INTEGER) {
+					snprintf(errmsg_buf,
+						 sizeof(errmsg_buf),
+						 "invalid one-letter sequence "
+						 "code '%c' at offset %lld",
+						 chunk[k],
+						 off0 - n + k);
+					return errmsg_buf;
+				}
+				*(dest++) = (char) code;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   filepath:    The path to an uncompressed or BGZF FASTA file.
+ *   offset, linebases, linewidth: The OFFSET, LINEBASES and LINEWIDTH
+ *                fields of the .fai index for each region (numeric, integer
+ *                and integer vectors).
+ *   start:       The 1-based start of each region in its record (numeric).
+ *   width:       The width of each region (integer).
+ *   elementType, lkup: See read_fasta_files().
+ * The regions must be within the bounds of their record.
+ */
+SEXP read_fai_regions(SEXP filepath, SEXP offset, SEXP linebases,
+		SEXP linewidth, SEXP start, SEXP width,
+		SEXP elementType, SEXP lkup)
+{
+	const char *path, *errmsg;
+	FAIfile fai_file;
+	ByteTrTable byte2code0, *byte2code;
+	XVectorList_holder ans_holder;
+	Chars_holder ans_elt_holder;
+	char *chunk;
+	int nregion, i;
+	SEXP ans;
+
+	path = CHAR(STRING_ELT(filepath, 0));
+	nregion = LENGTH(width);
+	byte2code = NULL;
+	if (lkup != R_NilValue) {
+		_init_ByteTrTable_with_lkup(&byte2code0, lkup);
+		byte2code = &byte2code0;
+	}
+	PROTECT(ans = _alloc_XStringSet(CHAR(STRING_ELT(elementType, 0)),
+					width));
+	ans_holder = hold_XVectorList(ans);
+	chunk = R_alloc(FAI_CHUNK_SIZE, sizeof(char));
+	fai_file.file = NULL;
+	fai_file.bgzf = _open_BGZFreader(path, 1);
+	if (fai_file.bgzf == NULL) {
+		if (!_is_plain_file(path)) {
+			UNPROTECT(1);
+			error("file %s is compressed but not in the BGZF "
+			      "format (use bgzip to compress it)", path);
+		}
+		fai_file.file = fopen(path, "rb");
+		if (fai_file.file == NULL) {
+			UNPROTECT(1);
+			error("cannot open file %s", path);
+		}
+	}
+	errmsg = NULL;
+	for (i = 0; i < nregion && errmsg == NULL; i++) {
+		ans_elt_holder = get_elt_from_XRawList_holder(&ans_holder, i);
+		/* ans_elt_holder.ptr is a (const char *) so we need to cast
+		   it to (char *) in order to write to it */
+		errmsg = read_region(&fai_file, chunk,
+				(long long int) REAL(offset)[i],
+				INTEGER(linebases)[i], INTEGER(linewidth)[i],
+				(long long int) REAL(start)[i],
+				INTEGER(width)[i],
+				byte2code, (char *) ans_elt_holder.ptr);
+	}
+	if (fai_file.bgzf != NULL)
+		_close_BGZFreader(fai_file.bgzf);
+	else
+		fclose(fai_file.file);
+	UNPROTECT(1);
+	if (errmsg != NULL)
+		error("reading FASTA file %s: %s", path, errmsg);
+	return ans;
+}
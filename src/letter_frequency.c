@@ -500,6 +500,52 @@ SEXP XStringSet_letter_frequency(SEXP x, SEXP collapse,
 	return ans;
 }
 
+/* Same as XStringSet_letter_frequency() but 'x' is a PackedDNAStringSet
+   object. The letters are counted directly on the packed words (see
+   _count_letters_in_PackedXStringSet_holder_elt()). */
+SEXP PackedDNAStringSet_letter_frequency(SEXP x, SEXP collapse,
+		SEXP codes, SEXP with_other)
+{
+	SEXP ans;
+	int ans_width, x_length, nrow, *ans_row, i, c, offset;
+	int counts[BYTETRTABLE_LENGTH];
+	PackedXStringSet_holder x_holder;
+
+	ans_width = get_ans_width(codes, LOGICAL(with_other)[0]);
+	x_holder = _hold_PackedDNAStringSet(x);
+	x_length = x_holder.length;
+	if (LOGICAL(collapse)[0]) {
+		PROTECT(ans = NEW_INTEGER(ans_width));
+		nrow = 1;
+	} else {
+		PROTECT(ans = allocMatrix(INTSXP, x_length, ans_width));
+		nrow = x_length;
+	}
+	ans_row = INTEGER(ans);
+	memset(ans_row, 0, LENGTH(ans) * sizeof(int));
+	for (i = 0; i < x_length; i++) {
+		memset(counts, 0, sizeof(counts));
+		_count_letters_in_PackedXStringSet_holder_elt(&x_holder, i,
+							      counts);
+		for (c = 0; c < BYTETRTABLE_LENGTH; c++) {
+			if (counts[c] == 0)
+				continue;
+			offset = c;
+			if (codes != R_NilValue) {
+				offset = byte2offset.byte2code[offset];
+				if (offset == NA_INTEGER)
+					continue;
+			}
+			ans_row[offset * nrow] += counts[c];
+		}
+		if (nrow != 1)
+			ans_row++;
+	}
+	set_names(ans, codes, LOGICAL(with_other)[0], LOGICAL(collapse)[0], 1);
+	UNPROTECT(1);
+	return ans;
+}
+
 /* Author: HJ
  * Tests, for the specified codes, the virtual XStringSet formed by "sliding
  * a window of length k" along a whole XString.
@@ -63,6 +63,56 @@ const BytewiseOpTable *_select_bytewise_match_table(int fixedP, int fixedS)
  * can disable this by passing 'P->length' to the 'max_nmis' arg.
  */
 
+/* Nb of nonzero bytes in 'x'. The nonzero bytes are first collapsed into
+   their lowest bit, then these bits are summed into the highest byte by the
+   multiplication. */
+static int nnonzero_bytes(uint64_t x)
+{
+	x |= x >> 4;
+	x |= x >> 2;
+	x |= x >> 1;
+	x &= 0x0101010101010101ULL;
+	return (int) ((x * 0x0101010101010101ULL) >> 56);
+}
+
+/* Used when the letters match iff they are equal (fixedP and fixedS). Like
+   in the general case, the letters of 'P' that fall outside of 'S' are
+   mismatches. The letters in 'S' are compared 8 at a time by XORing them
+   (as 64-bit words) with the letters in 'P'. */
+static int nmismatch_at_Pshift_fixed(const Chars_holder *P,
+		const Chars_holder *S, int Pshift, int max_nmis)
+{
+	int nmis, i, i1, i2;
+	const char *p, *s;
+	uint64_t x, y;
+
+	i1 = Pshift < 0 ? -Pshift : 0;
+	if (i1 > P->length)
+		i1 = P->length;
+	i2 = S->length - Pshift;
+	if (i2 > P->length)
+		i2 = P->length;
+	if (i2 < i1)
+		i2 = i1;
+	nmis = P->length - (i2 - i1);
+	if (nmis > max_nmis)
+		return max_nmis + 1;
+	p = P->ptr + i1;
+	s = S->ptr + Pshift + i1;
+	for (i = i1; i + 8 <= i2; i += 8, p += 8, s += 8) {
+		memcpy(&x, p, sizeof(uint64_t));
+		memcpy(&y, s, sizeof(uint64_t));
+		nmis += nnonzero_bytes(x ^ y);
+		if (nmis > max_nmis)
+			return max_nmis + 1;
+	}
+	for ( ; i < i2; i++, p++, s++) {
+		if (*p != *s && nmis++ >= max_nmis)
+			break;
+	}
+	return nmis;
+}
+
 int _nmismatch_at_Pshift(const Chars_holder *P,
 		const Chars_holder *S, int Pshift,
 		int max_nmis, const BytewiseOpTable *bytewise_match_table)
@@ -71,6 +121,8 @@ int _nmismatch_at_Pshift(const Chars_holder *P,
 	const char *p, *s;
 	unsigned char x, y;
 
+	if (bytewise_match_table == &fixedPfixedS_match_table)
+		return nmismatch_at_Pshift_fixed(P, S, Pshift, max_nmis);
 	nmis = 0;
 	for (i = 0, j = Pshift, p = P->ptr, s = S->ptr + Pshift;
 	     i < P->length;
@@ -6,6 +6,10 @@
 #include "XVector_interface.h"
 #include "IRanges_interface.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 
 /****************************************************************************
  * A memcmp-based implementation of the "naive" method for exact matching.
@@ -27,7 +31,8 @@
  * - To use as a reference when comparing performance.
  */
 
-static void match_naive_exact(const Chars_holder *P, const Chars_holder *S)
+static void match_naive_exact(const Chars_holder *P, const Chars_holder *S,
+		MatchReporter *reporter)
 {
 	const char *p, *s;
 	int plen, slen, start, n2;
@@ -40,7 +45,7 @@ static void match_naive_exact(const Chars_holder *P, const Chars_holder *S)
 	slen = S->length;
 	for (start = 1, n2 = plen; n2 <= slen; start++, n2++, s++) {
 		if (memcmp(p, s, plen) == 0)
-			_report_match(start, P->length);
+			_MatchReporter_report_match(reporter, start, P->length);
 	}
 	return;
 }
@@ -51,7 +56,8 @@ static void match_naive_exact(const Chars_holder *P, const Chars_holder *S)
  */
 
 static void match_naive_inexact(const Chars_holder *P, const Chars_holder *S,
-		int max_nmis, int min_nmis, int fixedP, int fixedS)
+		int max_nmis, int min_nmis, int fixedP, int fixedS,
+		MatchReporter *reporter)
 {
 	int Pshift, // position of pattern left-most char relative to the subject
 	    n2, // 1 + position of pattern right-most char relative to the subject
@@ -70,7 +76,8 @@ static void match_naive_inexact(const Chars_holder *P, const Chars_holder *S,
 		nmis = _nmismatch_at_Pshift(P, S, Pshift, max_nmis,
 					    bytewise_match_table);
 		if (nmis <= max_nmis && nmis >= min_nmis)
-			_report_match(Pshift + 1, P->length);
+			_MatchReporter_report_match(reporter,
+					Pshift + 1, P->length);
 	}
 	return;
 }
@@ -80,44 +87,87 @@ static void match_naive_inexact(const Chars_holder *P, const Chars_holder *S,
  * _match_pattern_XString() and _match_pattern_XStringViews()
  */
 
-void _match_pattern_XString(const Chars_holder *P, const Chars_holder *S,
-		SEXP max_mismatch, SEXP min_mismatch,
-		SEXP with_indels, SEXP fixed,
-		const char *algo)
+/*
+ * Returns 1 if match_pattern() is going to search 'P' in 'S' with the
+ * Boyer-Moore matcher, in which case 'P' must have been preprocessed into
+ * the 'ppP' passed to match_pattern().
+ */
+static int uses_boyermoore(const Chars_holder *P, const Chars_holder *S,
+		int max_nmis, int min_nmis, const char *algo)
 {
-	int max_nmis, min_nmis, fixedP, fixedS;
+	if (max_nmis < P->length - S->length
+	 || min_nmis > P->length)
+		return 0;
+	return P->length > max_nmis && strcmp(algo, "boyer-moore") == 0;
+}
 
-	max_nmis = INTEGER(max_mismatch)[0];
-	min_nmis = INTEGER(min_mismatch)[0];
+/*
+ * Uses the preprocessed pattern 'ppP' (see _init_BMPattern()) if 'algo' is
+ * "boyer-moore".
+ * Raises no error and doesn't use the R API if 'algo' is not "indels" and
+ * the pattern has been validated with check_pattern_for_threads().
+ */
+static void match_pattern(const Chars_holder *P, const Chars_holder *S,
+		int max_nmis, int min_nmis, int fixedP, int fixedS,
+		const char *algo, BMPattern *ppP, MatchReporter *reporter)
+{
 	if (max_nmis < P->length - S->length
 	 || min_nmis > P->length)
 		return;
-	fixedP = LOGICAL(fixed)[0];
-	fixedS = LOGICAL(fixed)[1];
 	if (P->length <= max_nmis || strcmp(algo, "naive-inexact") == 0)
-		match_naive_inexact(P, S, max_nmis, min_nmis, fixedP, fixedS);
+		match_naive_inexact(P, S, max_nmis, min_nmis, fixedP, fixedS,
+				    reporter);
 	else if (strcmp(algo, "naive-exact") == 0)
-		match_naive_exact(P, S);
+		match_naive_exact(P, S, reporter);
 	else if (strcmp(algo, "boyer-moore") == 0)
-		_match_pattern_boyermoore(P, S, -1, 0);
+		_BMPattern_match(ppP, S, -1, 0, reporter);
 	else if (strcmp(algo, "shift-or") == 0)
-		_match_pattern_shiftor(P, S, max_nmis, fixedP, fixedS);
+		_match_pattern_shiftor(P, S, max_nmis, fixedP, fixedS,
+				       reporter);
 	else if (strcmp(algo, "indels") == 0)
-		_match_pattern_indels(P, S, max_nmis, fixedP, fixedS);
+		_match_pattern_indels(P, S, max_nmis, fixedP, fixedS,
+				      reporter);
 	else
 		error("\"%s\": unknown algorithm", algo);
 	return;
 }
 
+/*
+ * 'ppP' is a caller-owned BMPattern (see match_pattern_boyermoore.c) where
+ * 'P' gets preprocessed if it's searched with the Boyer-Moore matcher. The
+ * caller must release it with _free_BMPattern() when done.
+ */
+void _match_pattern_XString(const Chars_holder *P, const Chars_holder *S,
+		SEXP max_mismatch, SEXP min_mismatch,
+		SEXP with_indels, SEXP fixed,
+		const char *algo, BMPattern *ppP, MatchReporter *reporter)
+{
+	int max_nmis, min_nmis;
+
+	max_nmis = INTEGER(max_mismatch)[0];
+	min_nmis = INTEGER(min_mismatch)[0];
+	if (uses_boyermoore(P, S, max_nmis, min_nmis, algo))
+		_init_BMPattern(ppP, P, 0);
+	match_pattern(P, S, max_nmis, min_nmis,
+		LOGICAL(fixed)[0], LOGICAL(fixed)[1],
+		algo, ppP, reporter);
+	return;
+}
+
+/* 'P' is preprocessed only once for all the views */
 void _match_pattern_XStringViews(const Chars_holder *P,
 		const Chars_holder *S, SEXP views_start, SEXP views_width,
 		SEXP max_mismatch, SEXP min_mismatch,
 		SEXP with_indels, SEXP fixed,
-		const char *algo)
+		const char *algo, BMPattern *ppP, MatchReporter *reporter)
 {
 	Chars_holder S_view;
-	int nviews, v, *view_start, *view_width, view_offset;
+	int nviews, v, *view_start, *view_width, view_offset,
+	    max_nmis, min_nmis, ppP_is_ready;
 
+	max_nmis = INTEGER(max_mismatch)[0];
+	min_nmis = INTEGER(min_mismatch)[0];
+	ppP_is_ready = 0;
 	nviews = LENGTH(views_start);
 	for (v = 0,
 	     view_start = INTEGER(views_start),
@@ -126,14 +176,21 @@ void _match_pattern_XStringViews(const Chars_holder *P,
 	     v++, view_start++, view_width++)
 	{
 		view_offset = *view_start - 1;
-		if (view_offset < 0 || view_offset + *view_width > S->length)
+		if (view_offset < 0 || view_offset + *view_width > S->length) {
+			_free_BMPattern(ppP);
 			error("'subject' has \"out of limits\" views");
+		}
 		S_view.ptr = S->ptr + view_offset;
 		S_view.length = *view_width;
-		_set_match_shift(view_offset);
-		_match_pattern_XString(P, &S_view,
-			max_mismatch, min_mismatch, with_indels, fixed,
-			algo);
+		if (!ppP_is_ready
+		 && uses_boyermoore(P, &S_view, max_nmis, min_nmis, algo)) {
+			_init_BMPattern(ppP, P, 0);
+			ppP_is_ready = 1;
+		}
+		_MatchReporter_set_shift(reporter, view_offset);
+		match_pattern(P, &S_view, max_nmis, min_nmis,
+			LOGICAL(fixed)[0], LOGICAL(fixed)[1],
+			algo, ppP, reporter);
 	}
 	return;
 }
@@ -165,17 +222,20 @@ SEXP XString_match_pattern(SEXP pattern, SEXP subject,
 	Chars_holder P, S;
 	const char *algo;
 	int is_count_only;
+	BMPattern ppP = {0, NULL, 0, -1, 0, 0, NULL, NULL};
+	MatchReporter reporter;
 
 	P = hold_XRaw(pattern);
 	S = hold_XRaw(subject);
 	algo = CHAR(STRING_ELT(algorithm, 0));
 	is_count_only = LOGICAL(count_only)[0];
-	_init_match_reporting(is_count_only ?
+	reporter = _new_MatchReporter(is_count_only ?
 		"MATCHES_AS_COUNTS" : "MATCHES_AS_RANGES", 1);
 	_match_pattern_XString(&P, &S,
 		max_mismatch, min_mismatch, with_indels, fixed,
-		algo);
-	return _reported_matches_asSEXP();
+		algo, &ppP, &reporter);
+	_free_BMPattern(&ppP);
+	return _MatchReporter_matches_asSEXP(&reporter);
 }
 
 /* --- .Call ENTRY POINT ---
@@ -192,46 +252,252 @@ SEXP XStringViews_match_pattern(SEXP pattern,
 	Chars_holder P, S;
 	const char *algo;
 	int is_count_only;
+	BMPattern ppP = {0, NULL, 0, -1, 0, 0, NULL, NULL};
+	MatchReporter reporter;
 
 	P = hold_XRaw(pattern);
 	S = hold_XRaw(subject);
 	algo = CHAR(STRING_ELT(algorithm, 0));
 	is_count_only = LOGICAL(count_only)[0];
-	_init_match_reporting(is_count_only ?
+	reporter = _new_MatchReporter(is_count_only ?
 		"MATCHES_AS_COUNTS" : "MATCHES_AS_RANGES", 1);
 	_match_pattern_XStringViews(&P,
 		&S, views_start, views_width,
 		max_mismatch, min_mismatch, with_indels, fixed,
-		algo);
-	return _reported_matches_asSEXP();
+		algo, &ppP, &reporter);
+	_free_BMPattern(&ppP);
+	return _MatchReporter_matches_asSEXP(&reporter);
+}
+
+/*
+ * Returns 1 if the matches of 'P' can be searched by worker threads with
+ * match_pattern(). Raises the errors that the matchers would raise on the
+ * first subject.
+ */
+static int check_pattern_for_threads(const Chars_holder *P,
+		int max_nmis, int fixedP, int fixedS, const char *algo)
+{
+	if (P->length <= 0)
+		return 0;
+	if (P->length <= max_nmis || strcmp(algo, "naive-inexact") == 0
+	 || strcmp(algo, "naive-exact") == 0
+	 || strcmp(algo, "boyer-moore") == 0)
+		return 1;
+	if (strcmp(algo, "shift-or") == 0) {
+		_check_shiftor_args(P, fixedP, fixedS);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * The copies of the preprocessed pattern used by the worker threads. If
+ * _init_BMPattern() raises an error, the copies that were already
+ * initialized are released by free_unfinished_BMPattern_copies().
+ */
+typedef struct bmpattern_copies {
+	const Chars_holder *P;
+	BMPattern *ppPs;
+	int ncopy;
+	int ninit;
+} BMPatternCopies;
+
+static SEXP init_BMPattern_copies(void *data)
+{
+	BMPatternCopies *copies = (BMPatternCopies *) data;
+
+	for (copies->ninit = 0; copies->ninit < copies->ncopy; copies->ninit++)
+		_init_BMPattern(copies->ppPs + copies->ninit, copies->P, 0);
+	return R_NilValue;
+}
+
+static void free_unfinished_BMPattern_copies(void *data)
+{
+	BMPatternCopies *copies = (BMPatternCopies *) data;
+	int t;
+
+	if (copies->ninit == copies->ncopy)
+		return;
+	for (t = 0; t < copies->ninit; t++)
+		_free_BMPattern(copies->ppPs + t);
+	return;
+}
+
+/*
+ * Each thread reports its matches to its own PlainMatchBuf. The counts go
+ * directly to 'match_counts' (1 elt per subject). In MATCHES_AS_ENDS mode,
+ * the ends of the matches in subject j are stored contiguously in the
+ * buffer of thread 'subject_thread[j]' starting at 'subject_offset[j]'.
+ */
+static SEXP vmatch_pattern_in_threads(const Chars_holder *P,
+		const XStringSet_holder *S, int S_length,
+		int max_nmis, int min_nmis, int fixedP, int fixedS,
+		const char *algo, int ms_code, int nthreads)
+{
+	int *match_counts, *subject_thread, *subject_offset, *nsubject_done;
+	int j, t, failed, count, is_bm;
+	Chars_holder *subjects;
+	PlainMatchBuf *plain_bufs;
+	MatchReporter *reporters;
+	BMPattern *ppPs;
+	BMPatternCopies copies;
+	SEXP ans, ans_elt;
+
+	subjects = (Chars_holder *) R_alloc((long) S_length,
+					    sizeof(Chars_holder));
+	for (j = 0; j < S_length; j++)
+		subjects[j] = _get_elt_from_XStringSet_holder(S, j);
+	if (ms_code == MATCHES_AS_COUNTS) {
+		PROTECT(ans = NEW_INTEGER(S_length));
+		match_counts = INTEGER(ans);
+	} else {
+		match_counts = (int *) R_alloc((long) S_length, sizeof(int));
+	}
+	memset(match_counts, 0, sizeof(int) * S_length);
+	subject_thread = (int *) R_alloc((long) S_length, sizeof(int));
+	subject_offset = (int *) R_alloc((long) S_length, sizeof(int));
+	nsubject_done = (int *) R_alloc((long) nthreads, sizeof(int));
+	plain_bufs = (PlainMatchBuf *) R_alloc((long) nthreads,
+					       sizeof(PlainMatchBuf));
+	reporters = (MatchReporter *) R_alloc((long) nthreads,
+					      sizeof(MatchReporter));
+	ppPs = (BMPattern *) R_alloc((long) nthreads, sizeof(BMPattern));
+	is_bm = P->length > max_nmis && strcmp(algo, "boyer-moore") == 0;
+	for (t = 0; t < nthreads; t++) {
+		nsubject_done[t] = 0;
+		plain_bufs[t] = _new_PlainMatchBuf(ms_code, match_counts);
+		reporters[t] = _new_plain_MatchReporter(plain_bufs + t);
+		memset(ppPs + t, 0, sizeof(BMPattern));
+		ppPs[t].LCP = -1;
+	}
+	/* Each thread gets its own copy of the preprocessed pattern because
+	   _BMPattern_match() fills the shift tables lazily */
+	if (is_bm) {
+		copies.P = P;
+		copies.ppPs = ppPs;
+		copies.ncopy = nthreads;
+		copies.ninit = 0;
+		R_ExecWithCleanup(init_BMPattern_copies, &copies,
+				  free_unfinished_BMPattern_copies, &copies);
+	}
+
+	volatile int interrupted = 0;
+	#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1)
+	for (j = 0; j < S_length; j++) {
+		int thread_num;
+#ifdef _OPENMP
+		thread_num = omp_get_thread_num();
+#else
+		thread_num = 0;
+#endif
+		if (interrupted)
+			continue;
+		if (thread_num == 0 && nsubject_done[0]++ % 256 == 0
+		 && _interrupt_is_pending()) {
+			interrupted = 1;
+			continue;
+		}
+		subject_thread[j] = thread_num;
+		subject_offset[j] = plain_bufs[thread_num].nend;
+		_MatchReporter_set_PSpair(reporters + thread_num, j);
+		match_pattern(P, subjects + j,
+			max_nmis, min_nmis, fixedP, fixedS,
+			algo, is_bm ? ppPs + thread_num : NULL,
+			reporters + thread_num);
+	}
+
+	failed = 0;
+	for (t = 0; t < nthreads; t++) {
+		_free_BMPattern(ppPs + t);
+		if (plain_bufs[t].failed)
+			failed = 1;
+	}
+	if (interrupted || failed) {
+		for (t = 0; t < nthreads; t++)
+			_free_PlainMatchBuf(plain_bufs + t);
+		if (ms_code == MATCHES_AS_COUNTS)
+			UNPROTECT(1);
+		if (interrupted)
+			error("interrupted by the user");
+		error("can't allocate memory for the matches");
+	}
+	if (ms_code == MATCHES_AS_COUNTS) {
+		UNPROTECT(1);
+		return ans;
+	}
+
+	/* Build the list of match ends (NULL elts for subjects with no
+	   match) in subject order */
+	PROTECT(ans = NEW_LIST(S_length));
+	for (j = 0; j < S_length; j++) {
+		count = match_counts[j];
+		if (count == 0)
+			continue;
+		PROTECT(ans_elt = NEW_INTEGER(count));
+		memcpy(INTEGER(ans_elt),
+		       plain_bufs[subject_thread[j]].match_ends +
+				subject_offset[j],
+		       sizeof(int) * count);
+		SET_VECTOR_ELT(ans, j, ans_elt);
+		UNPROTECT(1);
+	}
+	for (t = 0; t < nthreads; t++)
+		_free_PlainMatchBuf(plain_bufs + t);
+	UNPROTECT(1);
+	return ans;
 }
 
 /* --- .Call ENTRY POINT ---
  * Arguments are the same as for XString_match_pattern() except for:
- *   subject: XStringSet object.
+ *   subject: XStringSet object;
+ *   ms_mode: "MATCHES_AS_COUNTS" or "MATCHES_AS_ENDS";
+ *   nthreads: nb of threads to use (ignored if Biostrings was compiled
+ *             without OpenMP support). The subjects are distributed across
+ *             the threads. Only the "indels" algo doesn't support this.
  */
 SEXP XStringSet_vmatch_pattern(SEXP pattern, SEXP subject,
 		SEXP max_mismatch, SEXP min_mismatch,
 		SEXP with_indels, SEXP fixed,
-		SEXP algorithm, SEXP ms_mode)
+		SEXP algorithm, SEXP ms_mode, SEXP nthreads)
 {
 	Chars_holder P, S_elt;
 	XStringSet_holder S;
-	int S_length, j;
+	int S_length, j, ms_code, nthreads0;
 	const char *algo;
+	BMPattern ppP = {0, NULL, 0, -1, 0, 0, NULL, NULL};
+	MatchReporter reporter;
 
 	P = hold_XRaw(pattern);
 	S = _hold_XStringSet(subject);
 	S_length = _get_XStringSet_length(subject);
 	algo = CHAR(STRING_ELT(algorithm, 0));
-	_init_match_reporting(CHAR(STRING_ELT(ms_mode, 0)), S_length);
+	ms_code = _get_match_storing_code(CHAR(STRING_ELT(ms_mode, 0)));
+	nthreads0 = INTEGER(nthreads)[0];
+#ifdef _OPENMP
+	if (nthreads0 < 1)
+		nthreads0 = 1;
+#else
+	nthreads0 = 1;
+#endif
+	if (nthreads0 > S_length)
+		nthreads0 = S_length;
+	if (nthreads0 > 1
+	 && (ms_code == MATCHES_AS_COUNTS || ms_code == MATCHES_AS_ENDS)
+	 && check_pattern_for_threads(&P, INTEGER(max_mismatch)[0],
+			LOGICAL(fixed)[0], LOGICAL(fixed)[1], algo))
+		return vmatch_pattern_in_threads(&P, &S, S_length,
+			INTEGER(max_mismatch)[0], INTEGER(min_mismatch)[0],
+			LOGICAL(fixed)[0], LOGICAL(fixed)[1],
+			algo, ms_code, nthreads0);
+	reporter = _new_MatchReporter(CHAR(STRING_ELT(ms_mode, 0)), S_length);
 	for (j = 0; j < S_length; j++) {
 		S_elt = _get_elt_from_XStringSet_holder(&S, j);
-		_set_active_PSpair(j);
+		_MatchReporter_set_PSpair(&reporter, j);
 		_match_pattern_XString(&P, &S_elt,
 			max_mismatch, min_mismatch, with_indels, fixed,
-			algo);
+			algo, &ppP, &reporter);
 	}
-	return _MatchBuf_as_SEXP(_get_internal_match_buf(), R_NilValue);
+	_free_BMPattern(&ppP);
+	return _MatchBuf_as_SEXP(&(reporter.match_buf), R_NilValue);
 }
 
@@ -17,19 +17,25 @@
 
 
 /****************************************************************************
- * The 'ppP' (Preprocessed Pattern) struct holds a copy of the current
- * pattern (eventually reverted if init_ppP_seq() was called with
- * walk_backward = 1) + the results of some preprocessing operations on it.
+ * A 'ppP' (Preprocessed Pattern, see the BMPattern struct in
+ * Biostrings_defines.h) holds a copy of the current pattern (eventually
+ * reverted if init_ppP_seq() was called with walk_backward = 1) + the
+ * results of some preprocessing operations on it.
  * IMPORTANT: All members in 'ppP' that point to dynamically allocated
  * memory must be *persistent* buffers so they must point to user-controlled
  * memory (i.e. memory that is not reclaimed by R at the end of the .Call()
  * call). Hence the use of malloc()/free() instead of Salloc() for memory
- * allocation.
+ * allocation. This also allows a ppP to be used from a worker thread
+ * (once it has been initialized by _init_BMPattern() in the main thread).
+ * The ppP is owned by the caller, which must release it with
+ * _free_BMPattern() when done. Only _match_pattern_boyermoore() still uses
+ * an internal ppP (and is therefore not re-entrant).
  * Members of 'ppP' are:
  *   buflength: the size of the buffer pointed by the 'seq' member, which, in
  *              the current implemenation, is also the length of the longest
- *              pattern seen so far (i.e. since the beginning of the current
- *              R session);
+ *              pattern seen so far by this ppP (for the internal ppP used by
+ *              _match_pattern_boyermoore(), since the beginning of the
+ *              current R session);
  *   seq: the letters of the current pattern (eventually in reverse order
  *              if init_ppP_seq() was called with walk_backward = 1);
  *   seqlength: the length of the current pattern (must be <= 'buflength');
@@ -38,44 +44,41 @@
  *   VSGSshift_table: see "The Very Strong Good Suffix shifts" section below;
  *   MWshift_table: see "The Matching Window shifts" section below.
  */
-static struct {
-	int buflength;
-	char *seq;
-	int seqlength;
-	int LCP;
-	int j0, shift0;
-	int *VSGSshift_table;
-	int *MWshift_table;
-} ppP = {0, NULL, 0, -1, 0, 0, NULL, NULL};
+static BMPattern internal_ppP = {0, NULL, 0, -1, 0, 0, NULL, NULL};
 
 /* The 'LCP' member:
- *     -1: init_ppP_seq() changed the value of ppP.buflength.
- *   >= 0: init_ppP_seq() didn't change the value of ppP.buflength.
+ *     -1: init_ppP_seq() changed the value of ppP->buflength.
+ *   >= 0: init_ppP_seq() didn't change the value of ppP->buflength.
  *         The non-negative integer is the length of the Longest Common
  *         Prefix between old and new current pattern (LCP will always be <=
- *         min(P->length, ppP.seqlength)).
+ *         min(P->length, ppP->seqlength)).
  */
-static void init_ppP_seq(const Chars_holder *P, int walk_backward)
+static void init_ppP_seq(BMPattern *ppP, const Chars_holder *P,
+		int walk_backward)
 {
 	int LCP, j1, j2;
 	char c;
 
 	if (P->length == 0) { /* should never happen but safer anyway... */
-		ppP.LCP = 0;
+		ppP->LCP = 0;
 		return;
 	}
-	if (P->length > 20000)
+	if (P->length > 20000) {
+		_free_BMPattern(ppP);
 		error("pattern is too long");
-	if (P->length > ppP.buflength) {
+	}
+	if (P->length > ppP->buflength) {
 		/* We need to extend the size of 'ppP'. In that case, we
 		   don't need to compute the LCP and we set it to -1. */
-		if (ppP.seq != NULL)
-			free(ppP.seq);
-		ppP.buflength = 0;
-		ppP.seq = (char *) malloc(P->length * sizeof(char));
-		if (ppP.seq == NULL)
+		if (ppP->seq != NULL)
+			free(ppP->seq);
+		ppP->buflength = 0;
+		ppP->seq = (char *) malloc(P->length * sizeof(char));
+		if (ppP->seq == NULL) {
+			_free_BMPattern(ppP);
 			error("can't allocate memory for ppP.seq");
-		ppP.buflength = P->length;
+		}
+		ppP->buflength = P->length;
 		LCP = -1;
 	} else {
 		/* We don't need to extend the size of 'ppP'. In that case,
@@ -84,13 +87,13 @@ static void init_ppP_seq(const Chars_holder *P, int walk_backward)
 	}
 	for (j1 = 0, j2 = P->length - 1; j1 < P->length; j1++, j2--) {
 		c = P->ptr[walk_backward ? j2 : j1];
-		if (LCP != -1 && j1 < ppP.seqlength && c == ppP.seq[j1])
+		if (LCP != -1 && j1 < ppP->seqlength && c == ppP->seq[j1])
 			LCP++;
 		else
-			ppP.seq[j1] = c;
+			ppP->seq[j1] = c;
 	}
-	ppP.seqlength = P->length;
-	ppP.LCP = LCP;
+	ppP->seqlength = P->length;
+	ppP->LCP = LCP;
 	return;
 }
 
@@ -123,24 +126,24 @@ static void init_ppP_seq(const Chars_holder *P, int walk_backward)
  *   (e) VSGSshift(P[0], 0) = shift0
  */
 
-static void init_ppP_j0shift0()
+static void init_ppP_j0shift0(BMPattern *ppP)
 {
 	int j0, shift0, length, j;
 
 	length = 1;
-	j0 = ppP.seqlength - 1;
+	j0 = ppP->seqlength - 1;
 	for (j = j0 - 1; j >= 1; j--) {
-		if (memcmp(ppP.seq + j, ppP.seq + j0, length) == 0) {
+		if (memcmp(ppP->seq + j, ppP->seq + j0, length) == 0) {
 			length++;
 			j0--;
 		}
 	}
-	for (shift0 = j0 - j; shift0 < ppP.seqlength; shift0++, length--) {
-		if (memcmp(ppP.seq, ppP.seq + shift0, length) == 0)
+	for (shift0 = j0 - j; shift0 < ppP->seqlength; shift0++, length--) {
+		if (memcmp(ppP->seq, ppP->seq + shift0, length) == 0)
 			break;
 	}
-	ppP.j0 = j0;
-	ppP.shift0 = shift0;
+	ppP->j0 = j0;
+	ppP->shift0 = shift0;
 	/*Rprintf("j0=%d shift0=%d\n", j0, shift0);*/
 }
 
@@ -149,72 +152,74 @@ static void init_ppP_j0shift0()
  * The Very Strong Good Suffix shifts
  * ==================================
  *
- * ppP.VSGSshift_table is a 256 x ppP.buflength matrix.
+ * ppP->VSGSshift_table is a 256 x ppP->buflength matrix.
  * Its layout is (only the values marked with an "x" will be potentially
  * used):
  *
  *           0 1 2 3 4 5 j
  *         0 x x x x - -
  *         1 x x x x - - 
- *         2 x x x x - -    ppP.seqlength = 4 <= ppP.buflength = 6
+ *         2 x x x x - -    ppP->seqlength = 4 <= ppP->buflength = 6
  *         .............
  *       256 x x x x - -
  *         c
  *
- * The "x" region is defined by 0 <= j < ppP.seqlength
+ * The "x" region is defined by 0 <= j < ppP->seqlength
  */
 
-#define VSGS_SHIFT(c, j) (ppP.VSGSshift_table[ppP.buflength * ((unsigned char) (c)) + (j)])
+#define VSGS_SHIFT(c, j) (ppP->VSGSshift_table[ppP->buflength * ((unsigned char) (c)) + (j)])
 
-static int get_VSGSshift(char c, int j)
+static int get_VSGSshift(BMPattern *ppP, char c, int j)
 {
 	int shift, k, k1, k2, length;
 	const char *tmp;
 
-	if (j < ppP.j0)
-		return ppP.shift0;
+	if (j < ppP->j0)
+		return ppP->shift0;
 	shift = VSGS_SHIFT(c, j);
 	if (shift != 0)
 		return shift;
-	for (shift = 1; shift < ppP.seqlength; shift++) {
+	for (shift = 1; shift < ppP->seqlength; shift++) {
 		if (shift <= j) {
 			k = j - shift;
-			if (ppP.seq[k] != c)
+			if (ppP->seq[k] != c)
 				continue;
 			k1 = k + 1;
 		} else {
 			k1 = 0;
 		}
-		k2 = ppP.seqlength - shift;
+		k2 = ppP->seqlength - shift;
 		if (k1 == k2)
 			break;
 		length = k2 - k1;
-		tmp = ppP.seq + k1;
+		tmp = ppP->seq + k1;
 		if (memcmp(tmp, tmp + shift, length) == 0)
 			break;
 	}
-	/* shift is ppP.seqlength when the "for" loop is not interrupted by "break" */
+	/* shift is ppP->seqlength when the "for" loop is not interrupted by "break" */
 	/*Rprintf("VSGSshift(c=%c, j=%d) = %d\n", c, j, shift);*/
 	return VSGS_SHIFT(c, j) = shift;
 }
 
-static void init_ppP_VSGSshift_table()
+static void init_ppP_VSGSshift_table(BMPattern *ppP)
 {
 	int u, j;
 	char c;
 
-	if (ppP.LCP == -1 && ppP.VSGSshift_table != NULL) {
-		free(ppP.VSGSshift_table);
-		ppP.VSGSshift_table = NULL;
+	if (ppP->LCP == -1 && ppP->VSGSshift_table != NULL) {
+		free(ppP->VSGSshift_table);
+		ppP->VSGSshift_table = NULL;
 	}
-	if (ppP.buflength != 0 && ppP.VSGSshift_table == NULL) {
-		ppP.VSGSshift_table = (int *)
-			malloc(256 * ppP.buflength * sizeof(int));
-		if (ppP.VSGSshift_table == NULL)
+	if (ppP->buflength != 0 && ppP->VSGSshift_table == NULL) {
+		ppP->VSGSshift_table = (int *)
+			malloc(256 * ppP->buflength * sizeof(int));
+		if (ppP->VSGSshift_table == NULL) {
+			_free_BMPattern(ppP);
 			error("can't allocate memory for ppP.VSGSshift_table");
+		}
 	}
 	for (u = 0; u < 256; u++) {
-		for (j = 0; j < ppP.seqlength; j++) {
+		for (j = 0; j < ppP->seqlength; j++) {
 			c = (char) u;
 			VSGS_SHIFT(c, j) = 0;
 		}
@@ -283,25 +288,25 @@ static void init_ppP_VSGSshift_table()
  * practise, very few of them are actually needed compared to the total
  * number of possible MWshift(j1, j2) values.
  *
- * ppP.MWshift_table is a 2-dim array with nrow = ncol = ppP.buflength.
- * The layout of ppP.MWshift_table is (only the values marked with an "x"
+ * ppP->MWshift_table is a 2-dim array with nrow = ncol = ppP->buflength.
+ * The layout of ppP->MWshift_table is (only the values marked with an "x"
  * will be potentially used):
  *
  *           1 2 3 4 5 6 j2
  *         0 x x x x - -
  *         1 - x x x - - 
- *         2 - - x x - -    ppP.seqlength = 4 <= ppP.buflength = 6
+ *         2 - - x x - -    ppP->seqlength = 4 <= ppP->buflength = 6
  *         3 - - - x - -
  *         4 - - - - - -
  *         5 - - - - - -
  *        j1
  *
- * The "x" region is defined by 0 <= j1 < j2 <= ppP.seqlength
+ * The "x" region is defined by 0 <= j1 < j2 <= ppP->seqlength
  */
 
-#define MWSHIFT(j1, j2) (ppP.MWshift_table[ppP.buflength * (j1) + (j2) - 1])
+#define MWSHIFT(j1, j2) (ppP->MWshift_table[ppP->buflength * (j1) + (j2) - 1])
 
-static int get_MWshift(int j1, int j2)
+static int get_MWshift(BMPattern *ppP, int j1, int j2)
 {
 	int shift, k1, k2, length;
 	const char *tmp;
@@ -313,7 +318,7 @@ static int get_MWshift(int j1, int j2)
 		if (shift < j1) k1 = j1 - shift; else k1 = 0;
 		k2 = j2 - shift;
 		length = k2 - k1;
-		tmp = ppP.seq + k1;
+		tmp = ppP->seq + k1;
 		if (memcmp(tmp, tmp + shift, length) == 0)
 			break;
 	}
@@ -321,23 +326,25 @@ static int get_MWshift(int j1, int j2)
 	return MWSHIFT(j1, j2) = shift;
 }
 
-static void init_ppP_MWshift_table()
+static void init_ppP_MWshift_table(BMPattern *ppP)
 {
 	int j1, j2 = 1;
 
-	if (ppP.LCP == -1 && ppP.MWshift_table != NULL) {
-		free(ppP.MWshift_table);
-		ppP.MWshift_table = NULL;
+	if (ppP->LCP == -1 && ppP->MWshift_table != NULL) {
+		free(ppP->MWshift_table);
+		ppP->MWshift_table = NULL;
 	}
-	if (ppP.buflength != 0 && ppP.MWshift_table == NULL) {
-		ppP.MWshift_table = (int *)
-			malloc(ppP.buflength * ppP.buflength * sizeof(int));
-		if (ppP.MWshift_table == NULL)
+	if (ppP->buflength != 0 && ppP->MWshift_table == NULL) {
+		ppP->MWshift_table = (int *)
+			malloc(ppP->buflength * ppP->buflength * sizeof(int));
+		if (ppP->MWshift_table == NULL) {
+			_free_BMPattern(ppP);
 			error("can't allocate memory for ppP.MWshift_table");
+		}
 	}
-	if (ppP.LCP != -1)
-		j2 = ppP.LCP + 1;
-	for ( ; j2 <= ppP.seqlength; j2++) {
+	if (ppP->LCP != -1)
+		j2 = ppP->LCP + 1;
+	for ( ; j2 <= ppP->seqlength; j2++) {
 		for (j1 = 0; j1 < j2; j1++) {
 			MWSHIFT(j1, j2) = 0;
 		}
@@ -376,38 +383,69 @@ static void init_ppP_MWshift_table()
 	} \
 }
 
-/* Return 1-based end of last match or -1 if no match */
-int _match_pattern_boyermoore(const Chars_holder *P, const Chars_holder *S,
-		int nfirstmatches, int walk_backward)
+/*
+ * Preprocesses pattern 'P' into 'ppP'. The Very Strong Good Suffix and
+ * Matching Window shifts are computed lazily by _BMPattern_match() but their
+ * tables are allocated here so _BMPattern_match() never allocates memory
+ * and never raises an error. If an error is raised, 'ppP' is released
+ * first so the caller doesn't leak its buffers.
+ */
+void _init_BMPattern(BMPattern *ppP, const Chars_holder *P, int walk_backward)
+{
+	if (P->length <= 0)
+		error("empty pattern");
+	init_ppP_seq(ppP, P, walk_backward);
+	init_ppP_j0shift0(ppP);
+	init_ppP_VSGSshift_table(ppP);
+	if (ppP->seqlength <= MWSHIFT_NPMAX)
+		init_ppP_MWshift_table(ppP);
+	return;
+}
+
+void _free_BMPattern(BMPattern *ppP)
+{
+	if (ppP->seq != NULL)
+		free(ppP->seq);
+	if (ppP->VSGSshift_table != NULL)
+		free(ppP->VSGSshift_table);
+	if (ppP->MWshift_table != NULL)
+		free(ppP->MWshift_table);
+	ppP->buflength = ppP->seqlength = 0;
+	ppP->seq = NULL;
+	ppP->VSGSshift_table = ppP->MWshift_table = NULL;
+	ppP->LCP = -1;
+	return;
+}
+
+/*
+ * Searches the pattern preprocessed by _init_BMPattern() in 'S'. Must be
+ * called with the same 'walk_backward' value as _init_BMPattern().
+ * Return 1-based end of last match or -1 if no match.
+ */
+int _BMPattern_match(BMPattern *ppP, const Chars_holder *S,
+		int nfirstmatches, int walk_backward, MatchReporter *reporter)
 {
 	int nmatches, last_match_end, n, i1, i2, j1, j2, shift, shift1,
 	    i, j, match_start;
-	char ppP_rmc, c; /* ppP_rmc is 'ppP.seq' right-most char */
+	char ppP_rmc, c; /* ppP_rmc is 'ppP->seq' right-most char */
 
-	if (P->length <= 0)
-		error("empty pattern");
 	nmatches = 0;
 	last_match_end = -1;
-	init_ppP_seq(P, walk_backward);
-	init_ppP_j0shift0();
-	init_ppP_VSGSshift_table();
-	if (ppP.seqlength <= MWSHIFT_NPMAX)
-		init_ppP_MWshift_table();
-	n = ppP.seqlength - 1;
-	ppP_rmc = ppP.seq[n];
+	n = ppP->seqlength - 1;
+	ppP_rmc = ppP->seq[n];
 	j2 = 0;
 	while (n < S->length) {
 		if (j2 == 0) {
 			/* No Matching Window yet, we need to find one */
 			c = GET_S_LETTER(S, n, walk_backward);
 			if (c != ppP_rmc) {
-				shift = get_VSGSshift(c, ppP.seqlength - 1);
+				shift = get_VSGSshift(ppP, c, ppP->seqlength - 1);
 				n += shift;
 				continue;
 			}
 			i1 = n;
 			i2 = i1 + 1;
-			j2 = ppP.seqlength;
+			j2 = ppP->seqlength;
 			j1 = j2 - 1;
 			/* Now we have a Matching Window (1-letter suffix) */
 		}
@@ -415,46 +453,47 @@ int _match_pattern_boyermoore(const Chars_holder *P, const Chars_holder *S,
 		if (j1 > 0) {
 			/* ... to the left */
 			for (i = i1-1, j = j1-1; j >= 0; i--, j--)
-				if ((c = GET_S_LETTER(S, i, walk_backward)) != ppP.seq[j])
+				if ((c = GET_S_LETTER(S, i, walk_backward)) != ppP->seq[j])
 					break;
 			i1 = i + 1;
 			j1 = j + 1;
 		}
-		if (j2 < ppP.seqlength) {
+		if (j2 < ppP->seqlength) {
 			/* ... to the right */
-			for ( ; j2 < ppP.seqlength; i2++, j2++)
-				if (GET_S_LETTER(S, i2, walk_backward) != ppP.seq[j2])
+			for ( ; j2 < ppP->seqlength; i2++, j2++)
+				if (GET_S_LETTER(S, i2, walk_backward) != ppP->seq[j2])
 					break;
 		}
-		if (j2 == ppP.seqlength) { /* the Matching Window is a suffix */
+		if (j2 == ppP->seqlength) { /* the Matching Window is a suffix */
 			if (j1 == 0) {
 				/* we have a full match! */
 				if (walk_backward) {
 					last_match_end = S->length - i1;
-					match_start = last_match_end - ppP.seqlength + 1;
+					match_start = last_match_end - ppP->seqlength + 1;
 				} else {
 					match_start = i1 + 1;
-					last_match_end = i1 + ppP.seqlength;
+					last_match_end = i1 + ppP->seqlength;
 				}
-				_report_match(match_start, ppP.seqlength);
+				_MatchReporter_report_match(reporter,
+						match_start, ppP->seqlength);
 				nmatches++;
 				if (nfirstmatches >= 0 && nmatches >= nfirstmatches)
 					break;
-				shift = ppP.shift0;
+				shift = ppP->shift0;
 			} else {
-				shift = get_VSGSshift(c, j1 - 1);
+				shift = get_VSGSshift(ppP, c, j1 - 1);
 			}
 		} else {
-			shift = get_MWshift(j1, j2);
+			shift = get_MWshift(ppP, j1, j2);
 			c = GET_S_LETTER(S, n, walk_backward);
 			if (c != ppP_rmc) {
-				shift1 = get_VSGSshift(c, ppP.seqlength - 1);
+				shift1 = get_VSGSshift(ppP, c, ppP->seqlength - 1);
 				if (shift1 > shift)
 					shift = shift1;
 			}
 		}
 		n += shift;
-		if (ppP.seqlength <= MWSHIFT_NPMAX) {
+		if (ppP->seqlength <= MWSHIFT_NPMAX) {
 			ADJUST_MW(i1, j1, shift)
 			ADJUST_MW(i2, j2, shift)
 		} else {
@@ -464,3 +503,27 @@ int _match_pattern_boyermoore(const Chars_holder *P, const Chars_holder *S,
 	return last_match_end;
 }
 
+
+/*
+ * 'ppP' is owned by the caller. It can be reused from one call to the next
+ * (the preprocessing of 'P' is cheaper when the previous pattern shares a
+ * prefix with it) and must be released with _free_BMPattern() when done.
+ */
+int _match_pattern_boyermoore_with_reporter(BMPattern *ppP,
+		const Chars_holder *P, const Chars_holder *S,
+		int nfirstmatches, int walk_backward, MatchReporter *reporter)
+{
+	_init_BMPattern(ppP, P, walk_backward);
+	return _BMPattern_match(ppP, S, nfirstmatches, walk_backward,
+				reporter);
+}
+
+/* Same as above but uses the internal ppP and reports the matches thru the
+   internal MatchReporter (see match_reporting.c). Not re-entrant. */
+int _match_pattern_boyermoore(const Chars_holder *P, const Chars_holder *S,
+		int nfirstmatches, int walk_backward)
+{
+	return _match_pattern_boyermoore_with_reporter(&internal_ppP, P, S,
+			nfirstmatches, walk_backward,
+			_get_internal_match_reporter());
+}
@@ -15,7 +15,8 @@ static void test_match_pattern_indels(const char *p, const char *s,
 	P.length = strlen(P.ptr);
 	S.ptr = s;
 	S.length = strlen(S.ptr);
-	_match_pattern_indels(&P, &S, max_nmis, 1, 1);
+	_match_pattern_indels(&P, &S, max_nmis, 1, 1,
+			      _get_internal_match_reporter());
 	return;
 }
 
@@ -31,45 +32,48 @@ static void test_match_pattern_indels(const char *p, const char *s,
  * hold it until it is replaced by a better one or until it's guaranteed to be 
  * a best local match (then it's reported as a match).
  */
-static int provisory_match_start, provisory_match_end, provisory_match_width,
-	   provisory_match_nedit;
+typedef struct provisory_match {
+	int start, end, width, nedit;
+} ProvisoryMatch;
 
-static void report_provisory_match(int start, int width, int nedit)
+static void report_provisory_match(ProvisoryMatch *pm,
+		int start, int width, int nedit, MatchReporter *reporter)
 {
 	int end;
 
 	end = start + width - 1;
-	if (provisory_match_nedit != -1) {
+	if (pm->nedit != -1) {
 		// Given how we walk on S, 'start' is always guaranteed to be >
-		// 'provisory_match_start'.
-		if (end > provisory_match_end)
-			_report_match(provisory_match_start, provisory_match_width);
-		else if (nedit > provisory_match_nedit)
+		// 'pm->start'.
+		if (end > pm->end)
+			_MatchReporter_report_match(reporter,
+					pm->start, pm->width);
+		else if (nedit > pm->nedit)
 			return;
 	}
-	provisory_match_start = start;
-	provisory_match_end = end;
-	provisory_match_width = width;
-	provisory_match_nedit = nedit;
+	pm->start = start;
+	pm->end = end;
+	pm->width = width;
+	pm->nedit = nedit;
 	return;
 }
 
-static ByteTrTable byte2offset;
-
 void _match_pattern_indels(const Chars_holder *P, const Chars_holder *S,
-		int max_nmis, int fixedP, int fixedS)
+		int max_nmis, int fixedP, int fixedS, MatchReporter *reporter)
 {
 	int i0, j0, max_nmis1, nedit1, width1;
 	char c0;
 	const BytewiseOpTable *bytewise_match_table;
 	Chars_holder P1;
+	ByteTrTable byte2offset;
+	ProvisoryMatch pm;
 
 	if (P->length <= 0)
 		error("empty pattern");
 	bytewise_match_table = _select_bytewise_match_table(fixedP, fixedS);
 	_init_byte2offset_with_Chars_holder(&byte2offset, P,
 					     bytewise_match_table);
-	provisory_match_nedit = -1; // means no provisory match yet
+	pm.nedit = -1; // means no provisory match yet
 	j0 = 0;
 	while (j0 < S->length) {
 		while (1) {
@@ -94,14 +98,15 @@ void _match_pattern_indels(const Chars_holder *P, const Chars_holder *S,
 							bytewise_match_table);
 			}
 			if (nedit1 <= max_nmis1) {
-				report_provisory_match(j0 + 1, width1 + 1, nedit1 + i0);
+				report_provisory_match(&pm, j0 + 1, width1 + 1,
+						nedit1 + i0, reporter);
 			}
 		}
 		j0++;
 	}
 	done:
-	if (provisory_match_nedit != -1)
-		_report_match(provisory_match_start, provisory_match_width);
+	if (pm.nedit != -1)
+		_MatchReporter_report_match(reporter, pm.start, pm.width);
 	return;
 }
 
@@ -84,6 +84,10 @@
 typedef unsigned long ShiftOrWord_t;
 int shiftor_maxbits = sizeof(ShiftOrWord_t) * CHAR_BIT;
 
+/* PMmask_length is max_nmis + 1 and the shift-or algo is only used when
+   max_nmis < P->length <= shiftor_maxbits */
+#define MAX_PMMASK_LENGTH (sizeof(ShiftOrWord_t) * CHAR_BIT)
+
 /****************************************************************************/
 
 SEXP bits_per_long()
@@ -135,8 +139,8 @@ static void update_PMmasks(
 		ShiftOrWord_t *PMmask,
 		ShiftOrWord_t pmask)
 {
-	static ShiftOrWord_t PMmaskA, PMmaskB;
-	static int e;
+	ShiftOrWord_t PMmaskA, PMmaskB;
+	int e;
 
 	PMmaskA = PMmask[0] >> 1;
 	PMmask[0] = PMmaskA | pmask;
@@ -160,9 +164,8 @@ static int next_match(
 		int PMmask_length, /* PMmask_length = kerr+1 */
 		ShiftOrWord_t *PMmask)
 {
-	static ShiftOrWord_t pmask;
-	static int nncode;
-	static int e;
+	ShiftOrWord_t pmask;
+	int nncode, e;
 
 	while (*Lpos < S->length) {
 		if (*Rpos < S->length) {
@@ -184,16 +187,14 @@ static int next_match(
 }
 
 static void shiftor(const Chars_holder *P, const Chars_holder *S,
-		int PMmask_length, int is_fixed)
+		int PMmask_length, int is_fixed, MatchReporter *reporter)
 {
-	ShiftOrWord_t *PMmask, pmaskmap[256];
+	ShiftOrWord_t PMmask[MAX_PMMASK_LENGTH], pmaskmap[256];
 	int i, e, Lpos, Rpos, ret;
 
 	if (P->length <= 0)
 		error("empty pattern");
 	set_pmaskmap(is_fixed, 256, pmaskmap, P);
-	PMmask = (ShiftOrWord_t *)
-			R_alloc(PMmask_length, sizeof(ShiftOrWord_t));
 	PMmask[0] = 1UL;
 	for (i = 1; i < P->length; i++) {
 		PMmask[0] <<= 1;
@@ -215,19 +216,24 @@ static void shiftor(const Chars_holder *P, const Chars_holder *S,
 		if (ret == -1) {
 			break;
 		}
-		_report_match(Lpos, P->length);
+		_MatchReporter_report_match(reporter, Lpos, P->length);
 	}
-	/* No need to free PMmask, R does that for us */
 	return;
 }
 
-void _match_pattern_shiftor(const Chars_holder *P, const Chars_holder *S,
-		int max_nmis, int fixedP, int fixedS)
+void _check_shiftor_args(const Chars_holder *P, int fixedP, int fixedS)
 {
 	if (P->length > shiftor_maxbits)
 		error("pattern is too long");
 	if (fixedP != fixedS)
 		error("fixedP != fixedS not supported by shift-or algo");
-	shiftor(P, S, max_nmis + 1, fixedP);
+	return;
+}
+
+void _match_pattern_shiftor(const Chars_holder *P, const Chars_holder *S,
+		int max_nmis, int fixedP, int fixedS, MatchReporter *reporter)
+{
+	_check_shiftor_args(P, fixedP, fixedS);
+	shiftor(P, S, max_nmis + 1, fixedP, reporter);
 }
 
@@ -37,9 +37,11 @@ static MatchPDictBuf new_MatchPDictBuf_from_PDict3Parts(SEXP matches_as,
 				head_widths, tail_widths);
 }
 
+/* 'nthreads' is only used for walking a long subject along an ACtree2 (or
+   ACtree2-dense) */
 static void match_pdict(SEXP pptb, HeadTail *headtail, const Chars_holder *S,
 		SEXP max_mismatch, SEXP min_mismatch, SEXP fixed,
-		MatchPDictBuf *matchpdict_buf)
+		MatchPDictBuf *matchpdict_buf, int nthreads)
 {
 	int max_nmis, min_nmis, fixedP, fixedS;
 	SEXP low2high;
@@ -51,21 +53,28 @@ static void match_pdict(SEXP pptb, HeadTail *headtail, const Chars_holder *S,
 	fixedP = LOGICAL(fixed)[0];
 	fixedS = LOGICAL(fixed)[1];
 	type = get_classname(pptb);
-/*
-	if (strcmp(type, "ACtree2") == 0) {
+	/* When IUPAC ambiguity codes in the subject are treated as
+	 * ambiguities, the heads and tails are matched during the walk
+	 * along the ACtree2 (see walk_pdict_nonfixed_subject()), unless
+	 * the subject is walked in threads */
+	if (!fixedS && headtail->max_HTwidth != 0
+	 && strcmp(type, "ACtree2") == 0) {
 		_match_pdictACtree2(pptb, headtail, S,
 			max_nmis, min_nmis, fixedP, fixedS,
-			matchpdict_buf);
+			matchpdict_buf, nthreads);
 		return;
 	}
-*/
 	low2high = _get_PreprocessedTB_low2high(pptb);
 	tb_matches = &(matchpdict_buf->tb_matches);
 
 	if (strcmp(type, "Twobit") == 0)
 		_match_Twobit(pptb, S, fixedS, tb_matches);
+	else if (strcmp(type, "Twobit-hash") == 0)
+		_match_Twobit_hash(pptb, S, fixedS, tb_matches);
 	else if (strcmp(type, "ACtree2") == 0)
-		_match_tbACtree2(pptb, S, fixedS, tb_matches);
+		_match_tbACtree2(pptb, S, fixedS, tb_matches, nthreads);
+	else if (strcmp(type, "ACtree2-dense") == 0)
+		_match_tbACtree2_dense(pptb, S, fixedS, tb_matches, nthreads);
 	else
 		error("%s: unsupported Trusted Band type in 'pdict'", type);
 	/* Call _match_pdict_all_flanks() even if 'headtail' is empty
@@ -78,6 +87,93 @@ static void match_pdict(SEXP pptb, HeadTail *headtail, const Chars_holder *S,
 
 
 
+/****************************************************************************
+ * Helper functions for walking the subject of
+ * vmatch_PDict3Parts_XStringSet() (an XStringSet or PackedDNAStringSet
+ * object).
+ */
+
+typedef struct vsubject {
+	int is_packed;
+	XStringSet_holder S;
+	PackedXStringSet_holder packed_S;
+	char *buf;  /* for decoding the packed sequences (allocated lazily) */
+} VSubject;
+
+static VSubject hold_vsubject(SEXP subject)
+{
+	VSubject vsubject;
+
+	vsubject.is_packed =
+		strcmp(get_classname(subject), "PackedDNAStringSet") == 0;
+	if (vsubject.is_packed)
+		vsubject.packed_S = _hold_PackedDNAStringSet(subject);
+	else
+		vsubject.S = _hold_XStringSet(subject);
+	vsubject.buf = NULL;
+	return vsubject;
+}
+
+static int get_vsubject_length(const VSubject *vsubject)
+{
+	if (vsubject->is_packed)
+		return vsubject->packed_S.length;
+	return _get_length_from_XStringSet_holder(&(vsubject->S));
+}
+
+/* When the subject is packed with 2 bits per letter, the Trusted Band is
+   a Twobit object and the head and tail are empty, the sequence is walked
+   without being decoded. Otherwise it's decoded in 'vsubject->buf'. */
+static void match_pdict_vsubject_elt(SEXP pptb, HeadTail *headtail,
+		VSubject *vsubject, int j,
+		SEXP max_mismatch, SEXP min_mismatch, SEXP fixed,
+		MatchPDictBuf *matchpdict_buf)
+{
+	const PackedXStringSet_holder *packed_S;
+	Chars_holder S_elt;
+	int max_width, i;
+
+	if (!vsubject->is_packed) {
+		S_elt = _get_elt_from_XStringSet_holder(&(vsubject->S), j);
+		match_pdict(pptb, headtail, &S_elt,
+			    max_mismatch, min_mismatch, fixed,
+			    matchpdict_buf, 1);
+		return;
+	}
+	packed_S = &(vsubject->packed_S);
+	if (headtail->max_HTwidth == 0
+	 && strcmp(get_classname(pptb), "Twobit") == 0
+	 && _match_Twobit_packed(pptb, packed_S, j, LOGICAL(fixed)[1],
+				 &(matchpdict_buf->tb_matches)) == 0)
+	{
+		/* The letters of the subject are not accessed when
+		   'headtail' is empty */
+		S_elt.ptr = NULL;
+		S_elt.length = packed_S->width[j];
+		_match_pdict_all_flanks(_get_PreprocessedTB_low2high(pptb),
+			headtail, &S_elt,
+			INTEGER(max_mismatch)[0], INTEGER(min_mismatch)[0],
+			LOGICAL(fixed)[0], LOGICAL(fixed)[1],
+			matchpdict_buf);
+		return;
+	}
+	if (vsubject->buf == NULL) {
+		max_width = 0;
+		for (i = 0; i < packed_S->length; i++)
+			if (packed_S->width[i] > max_width)
+				max_width = packed_S->width[i];
+		vsubject->buf = R_alloc((long) max_width + 1, sizeof(char));
+	}
+	S_elt = _get_window_from_PackedXStringSet_holder(packed_S,
+			j, 0, packed_S->width[j], vsubject->buf);
+	match_pdict(pptb, headtail, &S_elt,
+		    max_mismatch, min_mismatch, fixed,
+		    matchpdict_buf, 1);
+	return;
+}
+
+
+
 /****************************************************************************
  * Helper functions for the vcount_*_XStringSet all() functions.
  */
@@ -146,19 +242,30 @@ static void update_vcount_collapsed_ans(SEXP ans,
  *     - fixed: logical vector of length 2;
  *     - matches_as: "MATCHES_AS_NULL", "MATCHES_AS_WHICH",
  *         "MATCHES_AS_COUNTS" or "MATCHES_AS_ENDS";
- *     - envir: NULL or environment to be populated with the matches.
+ *     - envir: NULL or environment to be populated with the matches;
+ *   o match_PDict3Parts_XString() only:
+ *     - nthreads: nb of threads used to walk the subject (ignored if
+ *         Biostrings was compiled without OpenMP support).
  */
 
 /* --- .Call ENTRY POINT --- */
 SEXP match_PDict3Parts_XString(SEXP pptb, SEXP pdict_head, SEXP pdict_tail,
 		SEXP subject,
 		SEXP max_mismatch, SEXP min_mismatch, SEXP fixed,
-		SEXP matches_as, SEXP envir)
+		SEXP matches_as, SEXP envir, SEXP nthreads)
 {
 	HeadTail headtail;
 	Chars_holder S;
 	MatchPDictBuf matchpdict_buf;
-
+	int nthreads0;
+
+	nthreads0 = INTEGER(nthreads)[0];
+#ifdef _OPENMP
+	if (nthreads0 < 1)
+		nthreads0 = 1;
+#else
+	nthreads0 = 1;
+#endif
 	headtail = _new_HeadTail(pdict_head, pdict_tail, pptb,
 				max_mismatch, fixed, 1);
 	S = hold_XRaw(subject);
@@ -166,7 +273,7 @@ SEXP match_PDict3Parts_XString(SEXP pptb, SEXP pdict_head, SEXP pdict_tail,
 				pptb, pdict_head, pdict_tail);
 	match_pdict(pptb, &headtail,
 		&S, max_mismatch, min_mismatch, fixed,
-		&matchpdict_buf);
+		&matchpdict_buf, nthreads0);
 	return _MatchBuf_as_SEXP(&(matchpdict_buf.matches), envir);
 }
 
@@ -181,21 +288,24 @@ SEXP match_XStringSet_XString(SEXP pattern,
 	int P_length, i;
 	Chars_holder S, P_elt;
 	const char *algo, *ms_mode;
+	BMPattern ppP = {0, NULL, 0, -1, 0, 0, NULL, NULL};
+	MatchReporter reporter;
 
 	P = _hold_XStringSet(pattern);
 	P_length = _get_length_from_XStringSet_holder(&P);
 	S = hold_XRaw(subject);
 	algo = CHAR(STRING_ELT(algorithm, 0));
 	ms_mode = CHAR(STRING_ELT(matches_as, 0));
-	_init_match_reporting(ms_mode, P_length);
+	reporter = _new_MatchReporter(ms_mode, P_length);
 	for (i = 0; i < P_length; i++) {
 		P_elt = _get_elt_from_XStringSet_holder(&P, i);
-		_set_active_PSpair(i);
+		_MatchReporter_set_PSpair(&reporter, i);
 		_match_pattern_XString(&P_elt, &S,
 			max_mismatch, min_mismatch, with_indels, fixed,
-			algo);
+			algo, &ppP, &reporter);
 	}
-	return _MatchBuf_as_SEXP(_get_internal_match_buf(), envir);
+	_free_BMPattern(&ppP);
+	return _MatchBuf_as_SEXP(&(reporter.match_buf), envir);
 }
 
 
@@ -256,7 +366,7 @@ SEXP match_PDict3Parts_XStringViews(SEXP pptb, SEXP pdict_head, SEXP pdict_tail,
 		S_view.length = *view_width;
 		match_pdict(pptb, &headtail, &S_view,
 			    max_mismatch, min_mismatch, fixed,
-			    &matchpdict_buf);
+			    &matchpdict_buf, 1);
 		_MatchPDictBuf_append_and_flush(&global_match_buf,
 			&matchpdict_buf, view_offset);
 	}
@@ -274,22 +384,25 @@ SEXP match_XStringSet_XStringViews(SEXP pattern,
 	int P_length, i;
 	Chars_holder S, P_elt;
 	const char *algo, *ms_mode;
+	BMPattern ppP = {0, NULL, 0, -1, 0, 0, NULL, NULL};
+	MatchReporter reporter;
 
 	P = _hold_XStringSet(pattern);
 	P_length = _get_length_from_XStringSet_holder(&P);
 	S = hold_XRaw(subject);
 	algo = CHAR(STRING_ELT(algorithm, 0));
 	ms_mode = CHAR(STRING_ELT(matches_as, 0));
-	_init_match_reporting(ms_mode, P_length);
+	reporter = _new_MatchReporter(ms_mode, P_length);
 	for (i = 0; i < P_length; i++) {
 		P_elt = _get_elt_from_XStringSet_holder(&P, i);
-		_set_active_PSpair(i);
+		_MatchReporter_set_PSpair(&reporter, i);
 		_match_pattern_XStringViews(&P_elt,
 			&S, views_start, views_width,
 			max_mismatch, min_mismatch, with_indels, fixed,
-			algo);
+			algo, &ppP, &reporter);
 	}
-	return _MatchBuf_as_SEXP(_get_internal_match_buf(), envir);
+	_free_BMPattern(&ppP);
+	return _MatchBuf_as_SEXP(&(reporter.match_buf), envir);
 }
 
 
@@ -305,7 +418,8 @@ SEXP match_XStringSet_XStringViews(SEXP pattern,
  *   o vmatch_XStringSet_XStringSet() only:
  *     - pattern: non-preprocessed pattern dict (XStringSet);
  *   o common arguments:
- *     - subject: reference sequences (XStringSet);
+ *     - subject: reference sequences (XStringSet, or PackedDNAStringSet
+ *         for vmatch_PDict3Parts_XStringSet());
  *     - max_mismatch: max.mismatch (max nb of mismatches *outside* the TB);
  *     - min_mismatch: min.mismatch (min nb of mismatches *outside* the TB);
  *     - fixed: logical vector of length 2;
@@ -323,16 +437,14 @@ static SEXP vwhich_PDict3Parts_XStringSet(SEXP pptb, HeadTail *headtail,
 		MatchPDictBuf *matchpdict_buf)
 {
 	int S_length, j;
-	XStringSet_holder S;
+	VSubject S;
 	SEXP ans, ans_elt;
-	Chars_holder S_elt;
 
-	S = _hold_XStringSet(subject);
-	S_length = _get_length_from_XStringSet_holder(&S);
+	S = hold_vsubject(subject);
+	S_length = get_vsubject_length(&S);
 	PROTECT(ans = NEW_LIST(S_length));
 	for (j = 0; j < S_length; j++) {
-		S_elt = _get_elt_from_XStringSet_holder(&S, j);
-		match_pdict(pptb, headtail, &S_elt,
+		match_pdict_vsubject_elt(pptb, headtail, &S, j,
 			    max_mismatch, min_mismatch, fixed,
 			    matchpdict_buf);
 		PROTECT(ans_elt = _MatchBuf_which_asINTEGER(
@@ -356,6 +468,8 @@ static SEXP vwhich_XStringSet_XStringSet(SEXP pattern,
 	Chars_holder P_elt, S_elt;
 	const char *algo;
 	IntAEAE *ans_buf;
+	BMPattern ppP = {0, NULL, 0, -1, 0, 0, NULL, NULL};
+	MatchReporter reporter;
 
 	P = _hold_XStringSet(pattern);
 	P_length = _get_length_from_XStringSet_holder(&P);
@@ -365,21 +479,22 @@ static SEXP vwhich_XStringSet_XStringSet(SEXP pattern,
 	ans_buf = new_IntAEAE(S_length, S_length);
 	for (j = 0; j < S_length; j++)
 		IntAE_set_nelt(ans_buf->elts[j], 0);
-	_init_match_reporting("MATCHES_AS_COUNTS", 1);
+	reporter = _new_MatchReporter("MATCHES_AS_COUNTS", 1);
 	for (i = 0; i < P_length; i++) {
 		P_elt = _get_elt_from_XStringSet_holder(&P, i);
 		for (j = 0; j < S_length; j++) {
 			S_elt = _get_elt_from_XStringSet_holder(&S, j);
 			_match_pattern_XString(&P_elt, &S_elt,
 				max_mismatch, min_mismatch, with_indels, fixed,
-				algo);
-			if (_get_match_count() != 0)
+				algo, &ppP, &reporter);
+			if (_MatchReporter_get_match_count(&reporter) != 0)
 				IntAE_insert_at(ans_buf->elts[j],
 					IntAE_get_nelt(ans_buf->elts[j]),
 					i + 1);
-			_drop_reported_matches();
+			_MatchReporter_drop_matches(&reporter);
 		}
 	}
+	_free_BMPattern(&ppP);
 	return new_LIST_from_IntAEAE(ans_buf, 0);
 }
 
@@ -390,14 +505,13 @@ static SEXP vcount_PDict3Parts_XStringSet(SEXP pptb, HeadTail *headtail,
 		MatchPDictBuf *matchpdict_buf)
 {
 	int tb_length, S_length, collapse0, i, j, match_count, *ans_col;
-	XStringSet_holder S;
+	VSubject S;
 	SEXP ans;
-	Chars_holder S_elt;
 	const IntAE *count_buf;
 
 	tb_length = _get_PreprocessedTB_length(pptb);
-	S = _hold_XStringSet(subject);
-	S_length = _get_length_from_XStringSet_holder(&S);
+	S = hold_vsubject(subject);
+	S_length = get_vsubject_length(&S);
 	collapse0 = INTEGER(collapse)[0];
 	if (collapse0 == 0) {
 		PROTECT(ans = allocMatrix(INTSXP, tb_length, S_length));
@@ -407,8 +521,7 @@ static SEXP vcount_PDict3Parts_XStringSet(SEXP pptb, HeadTail *headtail,
 					collapse0, weight));
 	}
 	for (j = 0; j < S_length; j++) {
-		S_elt = _get_elt_from_XStringSet_holder(&S, j);
-		match_pdict(pptb, headtail, &S_elt,
+		match_pdict_vsubject_elt(pptb, headtail, &S, j,
 			max_mismatch, min_mismatch, fixed,
 			matchpdict_buf);
 		count_buf = matchpdict_buf->matches.match_counts;
@@ -442,6 +555,8 @@ static SEXP vcount_XStringSet_XStringSet(SEXP pattern,
 	const char *algo;
 	SEXP ans;
 	Chars_holder P_elt, S_elt;
+	BMPattern ppP = {0, NULL, 0, -1, 0, 0, NULL, NULL};
+	MatchReporter reporter;
 
 	P = _hold_XStringSet(pattern);
 	P_length = _get_length_from_XStringSet_holder(&P);
@@ -454,7 +569,7 @@ static SEXP vcount_XStringSet_XStringSet(SEXP pattern,
 	else
 		PROTECT(ans = init_vcount_collapsed_ans(P_length, S_length,
 					collapse0, weight));
-	_init_match_reporting("MATCHES_AS_COUNTS", 1);
+	reporter = _new_MatchReporter("MATCHES_AS_COUNTS", 1);
 	for (i = 0; i < P_length; i++) {
 		P_elt = _get_elt_from_XStringSet_holder(&P, i);
 		if (collapse0 == 0)
@@ -463,8 +578,8 @@ static SEXP vcount_XStringSet_XStringSet(SEXP pattern,
 			S_elt = _get_elt_from_XStringSet_holder(&S, j);
 			_match_pattern_XString(&P_elt, &S_elt,
 				max_mismatch, min_mismatch, with_indels, fixed,
-				algo);
-			match_count = _get_match_count();
+				algo, &ppP, &reporter);
+			match_count = _MatchReporter_get_match_count(&reporter);
 			if (collapse0 == 0) {
 				*ans_elt = match_count;
 				ans_elt += P_length;
@@ -473,9 +588,10 @@ static SEXP vcount_XStringSet_XStringSet(SEXP pattern,
 					match_count, i, j,
 					collapse0, weight);
 			}
-			_drop_reported_matches();
+			_MatchReporter_drop_matches(&reporter);
 		}
 	}
+	_free_BMPattern(&ppP);
 	UNPROTECT(1);
 	return ans;
 }
@@ -549,3 +665,143 @@ SEXP vmatch_XStringSet_XStringSet(SEXP pattern,
 	return R_NilValue;
 }
 
+
+/****************************************************************************
+ * .Call entry point: vcount_PDict3Parts_files()
+ *
+ * Like vmatch_PDict3Parts_XStringSet() with 'matches_as' set to
+ * "MATCHES_AS_COUNTS" except that the subject sequences are streamed from
+ * a set of FASTA or FASTQ files by chunks of at most 'chunk_size' records.
+ * The files are never loaded in memory: each chunk is matched against
+ * 'pptb' as soon as it's full, then its buffer is reused for the next
+ * chunk. Only 'collapse' = 1 or 2 is supported (the full matrix of match
+ * counts would grow with the nb of records), and 'weight' must be of
+ * length 1 when 'collapse' is 1.
+ * Arguments:
+ *   - filexp_list: list of external pointers as returned by
+ *       XVector::open_input_files();
+ *   - format: "fasta" or "fastq";
+ *   - lkup: lookup table used for encoding the letters of the records;
+ *   - chunk_size: max nb of records per chunk;
+ *   - the other arguments are the same as for
+ *       vmatch_PDict3Parts_XStringSet().
+ */
+
+typedef struct vcount_stream {
+	SEXP pptb;
+	HeadTail *headtail;
+	SEXP max_mismatch, min_mismatch, fixed;
+	int collapse;
+	SEXP weight;
+	MatchPDictBuf *matchpdict_buf;
+	SEXP ans;               /* used when 'collapse' is 1 */
+	IntAE *int_counts;      /* used when 'collapse' is 2 */
+	DoubleAE *double_counts;
+} VcountStream;
+
+static void vcount_chunk_hook(SeqChunk *chunk)
+{
+	VcountStream *stream;
+	int tb_length, nseq, i, j, match_count, int_count;
+	double double_count;
+	Chars_holder S_elt;
+	const IntAE *count_buf;
+
+	R_CheckUserInterrupt();
+	stream = chunk->ext;
+	tb_length = _get_PreprocessedTB_length(stream->pptb);
+	nseq = _SeqChunk_get_nseq(chunk);
+	for (j = 0; j < nseq; j++) {
+		S_elt = _SeqChunk_get_elt(chunk, j);
+		match_pdict(stream->pptb, stream->headtail, &S_elt,
+			stream->max_mismatch, stream->min_mismatch,
+			stream->fixed,
+			stream->matchpdict_buf, 1);
+		count_buf = stream->matchpdict_buf->matches.match_counts;
+		if (stream->collapse == 1) {
+			/* 'weight' is recycled along the records */
+			for (i = 0; i < tb_length; i++) {
+				match_count = count_buf->elts[i];
+				update_vcount_collapsed_ans(stream->ans,
+					match_count, i, 0,
+					1, stream->weight);
+			}
+		} else if (IS_INTEGER(stream->weight)) {
+			int_count = 0;
+			for (i = 0; i < tb_length; i++)
+				int_count += count_buf->elts[i] *
+					     INTEGER(stream->weight)[i];
+			IntAE_insert_at(stream->int_counts,
+				IntAE_get_nelt(stream->int_counts),
+				int_count);
+		} else {
+			double_count = 0.00;
+			for (i = 0; i < tb_length; i++)
+				double_count += count_buf->elts[i] *
+						REAL(stream->weight)[i];
+			DoubleAE_insert_at(stream->double_counts,
+				DoubleAE_get_nelt(stream->double_counts),
+				double_count);
+		}
+		_MatchPDictBuf_flush(stream->matchpdict_buf);
+	}
+	return;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP vcount_PDict3Parts_files(SEXP pptb, SEXP pdict_head, SEXP pdict_tail,
+		SEXP filexp_list, SEXP format, SEXP lkup, SEXP chunk_size,
+		SEXP max_mismatch, SEXP min_mismatch, SEXP fixed,
+		SEXP collapse, SEXP weight)
+{
+	HeadTail headtail;
+	MatchPDictBuf matchpdict_buf;
+	VcountStream stream;
+	SeqChunk chunk;
+	const char *format0;
+	SEXP matches_as;
+
+	stream.collapse = INTEGER(collapse)[0];
+	if (stream.collapse != 1 && stream.collapse != 2)
+		error("'collapse' must be 1 or 2");
+	if (stream.collapse == 1 && LENGTH(weight) != 1)
+		error("'weight' must be of length 1 when 'collapse' is 1");
+	format0 = CHAR(STRING_ELT(format, 0));
+	headtail = _new_HeadTail(pdict_head, pdict_tail, pptb,
+				max_mismatch, fixed, 1);
+	PROTECT(matches_as = mkString("MATCHES_AS_COUNTS"));
+	matchpdict_buf = new_MatchPDictBuf_from_PDict3Parts(matches_as,
+				pptb, pdict_head, pdict_tail);
+	stream.pptb = pptb;
+	stream.headtail = &headtail;
+	stream.max_mismatch = max_mismatch;
+	stream.min_mismatch = min_mismatch;
+	stream.fixed = fixed;
+	stream.weight = weight;
+	stream.matchpdict_buf = &matchpdict_buf;
+	if (stream.collapse == 1) {
+		PROTECT(stream.ans = init_vcount_collapsed_ans(
+					_get_PreprocessedTB_length(pptb), 0,
+					1, weight));
+	} else {
+		stream.int_counts = new_IntAE(0, 0, 0);
+		stream.double_counts = new_DoubleAE(0, 0, 0.00);
+	}
+	chunk = _new_SeqChunk(INTEGER(chunk_size)[0],
+			      &vcount_chunk_hook, &stream);
+	if (strcmp(format0, "fasta") == 0)
+		_stream_fasta_files(filexp_list, lkup, &chunk);
+	else if (strcmp(format0, "fastq") == 0)
+		_stream_fastq_files(filexp_list, lkup, &chunk);
+	else
+		error("invalid 'format' value: \"%s\"", format0);
+	if (stream.collapse == 1) {
+		UNPROTECT(2);
+		return stream.ans;
+	}
+	UNPROTECT(1);
+	if (IS_INTEGER(weight))
+		return new_INTEGER_from_IntAE(stream.int_counts);
+	return new_NUMERIC_from_DoubleAE(stream.double_counts);
+}
+
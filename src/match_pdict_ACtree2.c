@@ -9,6 +9,9 @@
 
 #include <stdlib.h> /* for div() */
 #include <limits.h> /* for UINT_MAX */
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 /*
@@ -29,10 +32,10 @@
  * need to be reallocated).
  * Two separate buffers are used to store the nodes: one for the 2-int parts
  * of the nodes (every node has one, whether it's extended or not) and one for
- * the 5-int extensions. Since the number of nodes doesn't change during the
- * life of the tree, the first buffer will grow only while we are building the
- * tree (preprocessing) and then it will not change anymore (i.e. when the tree
- * is used to walk along a subject). However, since failure/shortcut links are
+ * the 5-int extensions. Since the number of nodes doesn't change when the
+ * tree is used to walk along a subject, the first buffer will grow only while
+ * we are building the tree (preprocessing) or adding patterns to it (see
+ * section L) and then it will not change anymore. However, since failure/shortcut links are
  * not precomputed, some nodes will need to be extended (and therefore the
  * second buffer will grow) in order to store the links that are computed
  * on-the-fly.
@@ -239,15 +242,13 @@ static unsigned int get_ACnodeBuf_nelt(const ACnodeBuf *buf)
 static ACnodeBuf new_ACnodeBuf(SEXP bab)
 {
 	ACnodeBuf buf;
-	SEXP bab_blocks;
 	int nblock, b;
 
 	buf.bab = bab;
 	nblock = *(buf.nblock = _get_BAB_nblock_ptr(bab));
 	buf.lastblock_nelt = _get_BAB_lastblock_nelt_ptr(bab);
-	bab_blocks = _get_BAB_blocks(bab);
 	for (b = 0; b < nblock; b++)
-		buf.block[b] = (ACnode *) INTEGER(VECTOR_ELT(bab_blocks, b));
+		buf.block[b] = (ACnode *) _get_BAB_block(bab, b);
 	return buf;
 }
 
@@ -263,6 +264,23 @@ static void extend_ACnodeBuf(ACnodeBuf *buf)
 	return;
 }
 
+/* 'dest' must be empty */
+static void copy_ACnodeBuf(ACnodeBuf *dest, const ACnodeBuf *src)
+{
+	int nblock, b;
+	unsigned int nelt;
+
+	nblock = *(src->nblock);
+	for (b = 0; b < nblock; b++) {
+		extend_ACnodeBuf(dest);
+		nelt = b == nblock - 1 ? (unsigned int) *(src->lastblock_nelt)
+				       : ACNODEBUF_MAX_NELT_PER_BLOCK;
+		memcpy(dest->block[b], src->block[b], sizeof(ACnode) * nelt);
+	}
+	*(dest->lastblock_nelt) = *(src->lastblock_nelt);
+	return;
+}
+
 static unsigned int new_nid(ACnodeBuf *buf)
 {
 	unsigned int nid;
@@ -342,15 +360,13 @@ static unsigned int get_ACnodeextBuf_nelt(ACnodeextBuf *buf)
 static ACnodeextBuf new_ACnodeextBuf(SEXP bab)
 {
 	ACnodeextBuf buf;
-	SEXP bab_blocks;
 	int nblock, b;
 
 	buf.bab = bab;
 	nblock = *(buf.nblock = _get_BAB_nblock_ptr(bab));
 	buf.lastblock_nelt = _get_BAB_lastblock_nelt_ptr(bab);
-	bab_blocks = _get_BAB_blocks(bab);
 	for (b = 0; b < nblock; b++)
-		buf.block[b] = (ACnodeext *) INTEGER(VECTOR_ELT(bab_blocks, b));
+		buf.block[b] = (ACnodeext *) _get_BAB_block(bab, b);
 	return buf;
 }
 
@@ -366,6 +382,23 @@ static void extend_ACnodeextBuf(ACnodeextBuf *buf)
 	return;
 }
 
+/* 'dest' must be empty */
+static void copy_ACnodeextBuf(ACnodeextBuf *dest, const ACnodeextBuf *src)
+{
+	int nblock, b;
+	unsigned int nelt;
+
+	nblock = *(src->nblock);
+	for (b = 0; b < nblock; b++) {
+		extend_ACnodeextBuf(dest);
+		nelt = b == nblock - 1 ? (unsigned int) *(src->lastblock_nelt)
+				       : ACNODEEXTBUF_MAX_NELT_PER_BLOCK;
+		memcpy(dest->block[b], src->block[b], sizeof(ACnodeext) * nelt);
+	}
+	*(dest->lastblock_nelt) = *(src->lastblock_nelt);
+	return;
+}
+
 static unsigned int new_eid(ACnodeextBuf *buf)
 {
 	unsigned int eid;
@@ -397,6 +430,8 @@ static unsigned int new_eid(ACnodeextBuf *buf)
 /*
  * Always set 'max_nodeextbuf_nelt' to 0U (no max) and 'dont_extend_nodes' to
  * 0 during preprocessing.
+ * 'readonly' is set when the node buffers are mapped (see loadPDict()). Then
+ * all the nodes have a failure link and transition() doesn't set any link.
  */
 typedef struct actree {
 	int depth;  /* this is the depth of all leaf nodes */
@@ -405,6 +440,7 @@ typedef struct actree {
 	ByteTrTable char2linktag;
 	unsigned int max_nodeextbuf_nelt;  /* 0U means "no max" */
 	int dont_extend_nodes;  /* always at 0 during preprocessing */
+	int readonly;
 } ACtree;
 
 #define GET_NODEEXT(tree, eid) get_nodeext_from_buf(&((tree)->nodeextbuf), eid)
@@ -454,6 +490,9 @@ static void extend_ACnode(ACtree *tree, ACnode *node)
 #define GET_NODE(tree, nid) get_node_from_buf(&((tree)->nodebuf), nid)
 #define IS_ROOTNODE(tree, node) _IS_ROOTNODE(&((tree)->nodebuf), node)
 #define IS_LEAFNODE(node) ((node)->attribs & ISLEAF_BIT)
+/* the nodes removed by ACtree2_drop_patterns() are turned into "dead" leaf
+   nodes with a P_id of 0 and no extension */
+#define IS_DEADNODE(node) ((node)->attribs == ISLEAF_BIT)
 #define NODE_DEPTH(tree, node) \
 		(IS_LEAFNODE(node) ? TREE_DEPTH(tree) : _NODE_DEPTH(node))
 #define CHAR2LINKTAG(tree, c) ((tree)->char2linktag.byte2code[(unsigned char) (c)])
@@ -595,6 +634,7 @@ static ACtree new_ACtree(int tb_length, int tb_width, SEXP base_codes,
 	_init_byte2offset_with_INTEGER(&(tree.char2linktag), base_codes, 1);
 	tree.max_nodeextbuf_nelt = 0U;
 	tree.dont_extend_nodes = 0;
+	tree.readonly = 0;
 	NEW_NODE(&tree, 0);  /* create the root node */
 	return tree;
 }
@@ -651,6 +691,7 @@ static ACtree pptb_asACtree(SEXP pptb)
 	tree.max_nodeextbuf_nelt = max_nelt;
 	nelt = get_ACnodeextBuf_nelt(&(tree.nodeextbuf));
 	tree.dont_extend_nodes = max_nelt != 0U && nelt >= max_nelt;
+	tree.readonly = _IntegerBAB_is_mapped(_get_ACtree2_nodebuf_ptr(pptb));
 	return tree;
 }
 
@@ -725,7 +766,7 @@ SEXP ACtree2_summary(SEXP pptb)
 		node = get_node_from_buf(nodebuf, nid);
 		nlink = get_ACnode_nlink(&tree, node);
 		nlink_table[nlink]++;
-		if (IS_LEAFNODE(node))
+		if (IS_LEAFNODE(node) && !IS_DEADNODE(node))
 			nleaves++;
 	}
 	for (nlink = 0; nlink < MAX_CHILDREN_PER_NODE+2; nlink++)
@@ -741,12 +782,36 @@ SEXP ACtree2_summary(SEXP pptb)
 	return R_NilValue;
 }
 
+/* Used by savePDict(). Nb of ints used in the last block of the 2 node
+   buffers (the other blocks are full). */
+void _get_ACtree2_lastblock_nints(SEXP pptb,
+		int *nodebuf_nint, int *nodeextbuf_nint)
+{
+	ACtree tree;
+
+	tree = pptb_asACtree(pptb);
+	*nodebuf_nint = *(tree.nodebuf.lastblock_nelt) * INTS_PER_NODE;
+	*nodeextbuf_nint = *(tree.nodeextbuf.lastblock_nelt) *
+			   INTS_PER_NODEEXT;
+	return;
+}
+
 
 
 /****************************************************************************
  *                             G. PREPROCESSING                             *
  ****************************************************************************/
 
+/* A link from a node at depth 'depth' is a real link (i.e. not a shortcut
+   link) iff it points to a live node at depth 'depth' + 1. */
+static int is_child(ACtree *tree, unsigned int nid, int depth)
+{
+	const ACnode *node;
+
+	node = GET_NODE(tree, nid);
+	return !IS_DEADNODE(node) && NODE_DEPTH(tree, node) == depth + 1;
+}
+
 static void add_pattern(ACtree *tree, const Chars_holder *P, int P_offset)
 {
 	int P_id, depth, dmax, linktag;
@@ -762,6 +827,11 @@ static void add_pattern(ACtree *tree, const Chars_holder *P, int P_offset)
 			error("non base DNA letter found in Trusted Band "
 			      "for pattern %d", P_id);
 		nid2 = GET_NODE_LINK(tree, node1, linktag);
+		/* when patterns are added to a tree that has already been
+		   walked (see ACtree2_add_patterns()), the link can be a
+		   shortcut */
+		if (nid2 != NOT_AN_ID && !is_child(tree, nid2, depth))
+			nid2 = NOT_AN_ID;
 		if (depth < dmax) {
 			if (nid2 != NOT_AN_ID)
 				continue;
@@ -864,6 +934,23 @@ SEXP ACtree2_build(SEXP tb, SEXP pp_exclude, SEXP base_codes,
 static unsigned int compute_flink(ACtree *tree,
 		const ACnode *node, const char *node_path);
 
+/* Same as transition() but follows the failure links instead of setting
+   shortcut links. All the nodes must have a failure link. */
+static unsigned int readonly_transition(ACtree *tree,
+		ACnode *node, int linktag)
+{
+	unsigned int link;
+
+	if (linktag == NA_INTEGER)
+		return 0U;
+	while ((link = GET_NODE_LINK(tree, node, linktag)) == NOT_AN_ID) {
+		if (IS_ROOTNODE(tree, node))
+			return 0U;
+		node = GET_NODE(tree, GET_NODE_FLINK(tree, node));
+	}
+	return link;
+}
+
 /*
  * 'node_path' will only be used to compute failure links so it's safe to not
  * provide it (i.e. NULL) if all the nodes already have one.
@@ -873,6 +960,8 @@ static unsigned int transition(ACtree *tree,
 {
 	unsigned int link, flink;
 
+	if (tree->readonly)
+		return readonly_transition(tree, node, linktag);
 	if (linktag == NA_INTEGER)
 		return 0U;
 	link = GET_NODE_LINK(tree, node, linktag);
@@ -919,6 +1008,8 @@ static int has_all_flinks(ACtree *tree)
 	nnodes = TREE_SIZE(tree);
 	for (nid = 1U; nid < nnodes; nid++) {
 		node = GET_NODE(tree, nid);
+		if (IS_DEADNODE(node))
+			continue;
 		flink = GET_NODE_FLINK(tree, node);
 		if (flink == NOT_AN_ID)
 			return 0;
@@ -959,7 +1050,7 @@ static void compute_all_flinks(ACtree *tree, const XStringSet_holder *tb)
 	nnodes = TREE_SIZE(tree);
 	for (nid = 1U; nid < nnodes; nid++) {
 		node = GET_NODE(tree, nid);
-		if (!IS_LEAFNODE(node))
+		if (!IS_LEAFNODE(node) || IS_DEADNODE(node))
 			continue;
 		P_offset = NODE_P_ID(node) - 1;
 		P = _get_elt_from_XStringSet_holder(tb, P_offset);
@@ -1020,103 +1111,385 @@ static void walk_tb_subject(ACtree *tree, const Chars_holder *S,
 	return;
 }
 
-/* 1st helper function for walk_tb_nonfixed_subject() */
-#define	NODE_SUBSET_MAXSIZE	5000000 /* 5 million node pointers */
-static ACnode *node_subset[NODE_SUBSET_MAXSIZE];
-static int node_subset_size = 0;
+/*
+ * Multithreaded version of walk_tb_subject()
+ * ------------------------------------------
+ * The subject is split into tiles that are walked in parallel. Each tile is
+ * walked from the root node starting TREE_DEPTH(tree) - 1 letters before the
+ * tile (or at the beginning of the subject) so the node reached at the 1st
+ * position of the tile is the same as with a walk along the full subject.
+ * Only the matches ending in the tile are reported (so the matches ending in
+ * the overlap with the previous tile are not reported twice).
+ * The walk must not modify the tree (the threads share it) so all the
+ * failure links must be computed before (see compute_all_flinks()) and
+ * readonly_transition() doesn't set shortcut links.
+ * The matches of each tile are stored in a malloc()'ed buffer and then
+ * copied to 'tb_matches' by the main thread in subject order, so the result
+ * is identical to what walk_tb_subject() reports.
+ * walk_tiles_in_threads() is the driver shared by all the automata (ACtree2
+ * along a fixed or non-fixed subject, ACtree2-dense): it only differs in the
+ * TileWalker function called on each tile.
+ */
+#define	MIN_TILE_LENGTH	1048576 /* 1 Mb */
+
+typedef struct tile_matches {
+	int *P_ids;
+	int *ends;
+	int nelt;
+	int buflength;
+	int failed;  /* set when the buffers could not be extended */
+	int too_many_nodes;  /* see walk_tb_nonfixed_subject_tile() */
+} TileMatches;
+
+static void report_tile_match(TileMatches *tile_matches, int P_id, int end)
+{
+	int new_buflength, *new_P_ids, *new_ends;
 
-static void split_and_move_pointers(ACtree *tree, unsigned char c)
+	if (tile_matches->failed)
+		return;
+	if (tile_matches->nelt == tile_matches->buflength) {
+		new_buflength = tile_matches->buflength == 0 ?
+				4096 : 2 * tile_matches->buflength;
+		new_P_ids = (int *) realloc(tile_matches->P_ids,
+					    new_buflength * sizeof(int));
+		if (new_P_ids != NULL)
+			tile_matches->P_ids = new_P_ids;
+		new_ends = (int *) realloc(tile_matches->ends,
+					   new_buflength * sizeof(int));
+		if (new_ends != NULL)
+			tile_matches->ends = new_ends;
+		if (new_P_ids == NULL || new_ends == NULL) {
+			tile_matches->failed = 1;
+			return;
+		}
+		tile_matches->buflength = new_buflength;
+	}
+	tile_matches->P_ids[tile_matches->nelt] = P_id;
+	tile_matches->ends[tile_matches->nelt] = end;
+	tile_matches->nelt++;
+	return;
+}
+
+/* A TileWalker walks the 'tile_start'..'tile_end' tile of 'S' (1-based
+   positions) along 'automaton' and stores the matches ending in the tile in
+   'tile_matches'. It's called by worker threads so it must not use the R
+   API and must not modify 'automaton'. */
+typedef void (*TileWalker)(void *automaton, const Chars_holder *S,
+		int tile_start, int tile_end, TileMatches *tile_matches);
+
+static void walk_tb_subject_tile(void *automaton, const Chars_holder *S,
+		int tile_start, int tile_end, TileMatches *tile_matches)
 {
-	int node_subset_size0, i, is_first, j, linktag;
-	ACnode *node0, *node1, *node2;
-	unsigned char base;
+	ACtree *tree = (ACtree *) automaton;
+	ACnode *node;
+	int n, linktag;
+	const char *node_path;
 	unsigned int nid;
 
-	node0 = GET_NODE(tree, 0U);
-	node_subset_size0 = node_subset_size;
-	for (i = 0; i < node_subset_size0; i++) {
-		node1 = node_subset[i];
-		is_first = 1;
-		for (j = 0, base = 1; j < 4; j++, base *= 2) {
-			if ((c & base) == 0)
-				continue;
-			linktag = CHAR2LINKTAG(tree, base);
-			nid = transition(tree, node1, NULL, linktag);
-			//Rprintf("%d --[%d]--> %d\n", node1 - node0, base, nid);
-			node2 = GET_NODE(tree, nid);
-			if (is_first) {
-				node_subset[i] = node2;
-				is_first = 0;
-			} else {
-				if (node_subset_size >= NODE_SUBSET_MAXSIZE) {
-					node_subset_size = 0;
-					error("too many IUPAC ambiguity "
-					      "letters in 'subject'");
-				}
-				node_subset[node_subset_size++] = node2;
-			}
-		}
+	n = tile_start - TREE_DEPTH(tree) + 1;
+	if (n < 1)
+		n = 1;
+	node = GET_NODE(tree, 0U);
+	node_path = S->ptr + n - 1;
+	for ( ; n <= tile_end; n++) {
+		linktag = CHAR2LINKTAG(tree, *node_path);
+		nid = readonly_transition(tree, node, linktag);
+		node = GET_NODE(tree, nid);
+		node_path++;
+		if (n >= tile_start && IS_LEAFNODE(node))
+			report_tile_match(tile_matches,
+					  NODE_P_ID(node) - 1, n);
 	}
 	return;
 }
 
-/* 2nd helper function for walk_tb_nonfixed_subject() */
-static int compar_node_pointers_for_sort(const void *p1, const void *p2)
+typedef struct tiled_walk {
+	TileMatches *tiles;
+	int ntile;
+	TBMatchBuf *tb_matches;
+} TiledWalk;
+
+/* Copies the matches of the tiles to 'tb_matches' (in tile order) */
+static SEXP report_tile_matches(void *data)
 {
-	return *((const ACnode * const *) p1) - *((const ACnode * const *) p2);
+	const TiledWalk *walk = (const TiledWalk *) data;
+	const TileMatches *tile_matches;
+	int t, k;
+
+	for (t = 0; t < walk->ntile; t++) {
+		tile_matches = walk->tiles + t;
+		if (tile_matches->too_many_nodes)
+			error("too many IUPAC ambiguity letters in 'subject'");
+		if (tile_matches->failed)
+			error("can't allocate memory for the matches");
+		for (k = 0; k < tile_matches->nelt; k++)
+			_TBMatchBuf_report_match(walk->tb_matches,
+				tile_matches->P_ids[k], tile_matches->ends[k]);
+	}
+	return R_NilValue;
 }
-static void sort_node_pointer_array(ACnode **x, int nelt)
+
+static void free_tile_matches(void *data)
 {
-	qsort(x, nelt, sizeof(ACnode *), compar_node_pointers_for_sort);
+	const TiledWalk *walk = (const TiledWalk *) data;
+	int t;
+
+	for (t = 0; t < walk->ntile; t++) {
+		free(walk->tiles[t].P_ids);
+		free(walk->tiles[t].ends);
+	}
 	return;
 }
-static void merge_pointers(ACtree *tree, int n)
+
+/* Returns the nb of tiles to use for walking a subject of length 'S_length'
+   with 'nthreads' threads (<= 1 means "walk the subject serially"). */
+static int get_ntile(int S_length, int nthreads)
 {
-	int i1, i2;
-	ACnode *node0, *node1, *node2;
+	int ntile;
+
+	if (nthreads <= 1)
+		return 1;
+	/* A few tiles per thread for a better load balancing */
+	ntile = S_length / MIN_TILE_LENGTH;
+	if (ntile > 4 * nthreads)
+		ntile = 4 * nthreads;
+	return ntile;
+}
 
-	node0 = GET_NODE(tree, 0U);
-/*
-	Rprintf("n=%d nodes before merging: ", n);
-	for (i1 = 0; i1 < node_subset_size; i1++) {
-		node1 = node_subset[i1];
-		Rprintf(" %d", node1 - node0);
-	}
-	Rprintf("\n");
-*/
-	sort_node_pointer_array(node_subset, node_subset_size);
-	i1 = 0;
-	node1 = node_subset[i1];
-	for (i2 = 1; i2 < node_subset_size; i2++) {
-		node2 = node_subset[i2];
-		if (node2 == node1)
+/* Does report matches. The tile buffers are freed even if an error is
+   raised while the matches are copied to 'tb_matches'. */
+static void walk_tiles_in_threads(TileWalker walk_tile, void *automaton,
+		const Chars_holder *S, TBMatchBuf *tb_matches,
+		int ntile, int nthreads)
+{
+	TiledWalk walk;
+	int tile_length, t;
+
+	walk.tiles = (TileMatches *) R_alloc((long) ntile,
+					     sizeof(TileMatches));
+	memset(walk.tiles, 0, ntile * sizeof(TileMatches));
+	walk.ntile = ntile;
+	walk.tb_matches = tb_matches;
+	tile_length = S->length / ntile;
+
+	volatile int interrupted = 0;
+	#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1)
+	for (t = 0; t < ntile; t++) {
+		int thread_num, tile_start, tile_end;
+#ifdef _OPENMP
+		thread_num = omp_get_thread_num();
+#else
+		thread_num = 0;
+#endif
+		if (interrupted)
+			continue;
+		if (thread_num == 0 && _interrupt_is_pending()) {
+			interrupted = 1;
 			continue;
-		i1++;
-		node1 = node_subset[i1] = node2;
+		}
+		tile_start = t * tile_length + 1;
+		tile_end = t == ntile - 1 ? S->length : tile_start +
+						tile_length - 1;
+		walk_tile(automaton, S, tile_start, tile_end, walk.tiles + t);
 	}
-	node_subset_size = i1 + 1;
+	if (interrupted) {
+		free_tile_matches(&walk);
+		error("interrupted by the user");
+	}
+	R_ExecWithCleanup(report_tile_matches, &walk,
+			  free_tile_matches, &walk);
+	return;
+}
+
+#define	NODE_SUBSET_MAXSIZE	5000000 /* 5 million nids */
+
 /*
-	Rprintf("n=%d nodes after merging: ", n);
-	for (i1 = 0; i1 < node_subset_size; i1++) {
-		node1 = node_subset[i1];
-		Rprintf(" %d", node1 - node0);
+ * Node sets
+ * ---------
+ * When the subject contains IUPAC ambiguity letters, all the paths that are
+ * compatible with the letters seen so far must be followed, so the current
+ * position in the tree is a set of nodes. A NodeSet stores the nids of the
+ * current set and of the next set, which is built by moving each node of
+ * the current set along the bases of the current letter. The duplicates are
+ * skipped as the next set is built, thanks to a bitmap with 1 bit per node
+ * of the tree: a nid is added only if its bit is not set, and the bits of
+ * the next set are cleared once it's complete. So the cost of a move is
+ * linear in the size of the sets (no sorting). The bitmap is only
+ * allocated when the set has more than 1 node (i.e. after the 1st
+ * ambiguity letter).
+ * The buffers are grown on demand, up to NODE_SUBSET_MAXSIZE nids. A
+ * NodeSet used by the main thread ('use_R_alloc' set) has R_alloc()'ed
+ * buffers, so nothing leaks if an error is raised during the walk (the
+ * walker releases them with vmaxset() when it's done). A NodeSet used by a
+ * worker thread has malloc()'ed buffers that must be freed with
+ * free_NodeSet(). A NodeSet_move() that would exceed NODE_SUBSET_MAXSIZE,
+ * or that fails to allocate memory, sets the 'failed' flag instead of
+ * raising an error.
+ * All the nodes in the tree must have a failure link.
+ */
+typedef struct node_set {
+	unsigned int *nids, *next_nids;
+	int size, buflength;
+	unsigned char *bitmap;  /* 1 bit per node */
+	unsigned int nnodes;
+	int use_R_alloc;
+	int failed;  /* 1: too many nodes, 2: out of memory */
+} NodeSet;
+
+static void *alloc_NodeSet_buf(const NodeSet *node_set, int n, int size)
+{
+	if (node_set->use_R_alloc)
+		return R_alloc((long) n, size);
+	return malloc((size_t) n * size);
+}
+
+static void init_NodeSet(NodeSet *node_set, unsigned int nnodes,
+		int use_R_alloc)
+{
+	node_set->buflength = 64;
+	node_set->use_R_alloc = use_R_alloc;
+	node_set->nids = (unsigned int *) alloc_NodeSet_buf(node_set,
+				node_set->buflength, sizeof(unsigned int));
+	node_set->next_nids = (unsigned int *) alloc_NodeSet_buf(node_set,
+				node_set->buflength, sizeof(unsigned int));
+	node_set->bitmap = NULL;
+	node_set->nnodes = nnodes;
+	node_set->failed = 0;
+	if (node_set->nids == NULL || node_set->next_nids == NULL) {
+		node_set->failed = 2;
+		return;
 	}
-	Rprintf("\n");
-*/
+	node_set->nids[0] = 0U;
+	node_set->size = 1;
 	return;
 }
 
-static void report_matches(TBMatchBuf *tb_matches, int n)
+/* No-op for a NodeSet with R_alloc()'ed buffers */
+static void free_NodeSet(NodeSet *node_set)
 {
-	int i;
-	ACnode *node;
+	if (node_set->use_R_alloc)
+		return;
+	free(node_set->nids);
+	free(node_set->next_nids);
+	free(node_set->bitmap);
+	return;
+}
 
-	for (i = 0; i < node_subset_size; i++) {
-		node = node_subset[i];
-		if (IS_LEAFNODE(node))
-			_TBMatchBuf_report_match(tb_matches,
-					NODE_P_ID(node) - 1, n);
+/* Main thread only */
+static void check_NodeSet(const NodeSet *node_set)
+{
+	if (node_set->failed == 0)
+		return;
+	if (node_set->failed == 1)
+		error("too many IUPAC ambiguity letters in 'subject'");
+	error("Biostrings internal error: failed to allocate memory "
+	      "for the set of current nodes");
+}
+
+/* Resets 'node_set' to the root node */
+static void reset_NodeSet(NodeSet *node_set)
+{
+	node_set->nids[0] = 0U;
+	node_set->size = 1;
+	return;
+}
+
+static unsigned int *realloc_nids(NodeSet *node_set, unsigned int *nids,
+		int new_buflength)
+{
+	unsigned int *new_nids;
+
+	if (!node_set->use_R_alloc)
+		return (unsigned int *) realloc(nids,
+				new_buflength * sizeof(unsigned int));
+	new_nids = (unsigned int *) R_alloc((long) new_buflength,
+					    sizeof(unsigned int));
+	memcpy(new_nids, nids, node_set->buflength * sizeof(unsigned int));
+	return new_nids;
+}
+
+static int grow_NodeSet(NodeSet *node_set)
+{
+	int new_buflength;
+	unsigned int *new_nids;
+
+	if (node_set->buflength >= NODE_SUBSET_MAXSIZE) {
+		node_set->failed = 1;
+		return -1;
 	}
+	new_buflength = 2 * node_set->buflength;
+	if (new_buflength > NODE_SUBSET_MAXSIZE)
+		new_buflength = NODE_SUBSET_MAXSIZE;
+	new_nids = realloc_nids(node_set, node_set->nids, new_buflength);
+	if (new_nids == NULL) {
+		node_set->failed = 2;
+		return -1;
+	}
+	node_set->nids = new_nids;
+	new_nids = realloc_nids(node_set, node_set->next_nids, new_buflength);
+	if (new_nids == NULL) {
+		node_set->failed = 2;
+		return -1;
+	}
+	node_set->next_nids = new_nids;
+	node_set->buflength = new_buflength;
+	return 0;
+}
+
+/* 'c' must be an IUPAC code (i.e. >= 1 and < 16) */
+static void NodeSet_move(ACtree *tree, NodeSet *node_set, unsigned char c)
+{
+	int next_size, i, j, linktag;
+	unsigned int nid, *tmp;
+	unsigned char base, *byte, bit;
+
+	if (node_set->size == 1 && (c & (c - 1)) == 0) {
+		/* No ambiguity */
+		linktag = CHAR2LINKTAG(tree, c);
+		node_set->nids[0] = transition(tree,
+				GET_NODE(tree, node_set->nids[0]), NULL, linktag);
+		return;
+	}
+	if (node_set->bitmap == NULL) {
+		node_set->bitmap = (unsigned char *) alloc_NodeSet_buf(node_set,
+				node_set->nnodes / 8U + 1U,
+				sizeof(unsigned char));
+		if (node_set->bitmap == NULL) {
+			node_set->failed = 2;
+			return;
+		}
+		memset(node_set->bitmap, 0, node_set->nnodes / 8U + 1U);
+	}
+	next_size = 0;
+	for (i = 0; i < node_set->size; i++) {
+		for (j = 0, base = 1; j < 4; j++, base *= 2) {
+			if ((c & base) == 0)
+				continue;
+			linktag = CHAR2LINKTAG(tree, base);
+			nid = transition(tree,
+				GET_NODE(tree, node_set->nids[i]), NULL, linktag);
+			byte = node_set->bitmap + nid / 8U;
+			bit = (unsigned char) (1U << (nid % 8U));
+			if (*byte & bit)
+				continue;
+			if (next_size == node_set->buflength
+			 && grow_NodeSet(node_set) != 0)
+				break;
+			*byte |= bit;
+			node_set->next_nids[next_size++] = nid;
+		}
+		if (node_set->failed)
+			break;
+	}
+	/* Clear the bits of the next set */
+	for (i = 0; i < next_size; i++) {
+		nid = node_set->next_nids[i];
+		node_set->bitmap[nid / 8U] = 0;
+	}
+	tmp = node_set->nids;
+	node_set->nids = node_set->next_nids;
+	node_set->next_nids = tmp;
+	node_set->size = next_size;
 	return;
 }
 
@@ -1124,59 +1497,130 @@ static void report_matches(TBMatchBuf *tb_matches, int n)
 static void walk_tb_nonfixed_subject(ACtree *tree, const Chars_holder *S,
 		TBMatchBuf *tb_matches)
 {
-	int max_size, n;
-	const unsigned char *c;
-
-	if (node_subset_size != 0)
-		error("Biostrings internal error in "
-		      "walk_tb_nonfixed_subject(): node_subset_size != 0... "
-		      "PLEASE REPORT THIS! THANKS.\n");
-	node_subset_size = max_size = 1;
-	node_subset[0] = GET_NODE(tree, 0U);
-	for (n = 1, c = (unsigned char *) S->ptr; n <= S->length; n++, c++) {
-		if (*c >= 16) {
-			/* '*c' is not an IUPAC (base or extended) code */
-			node_subset[0] = GET_NODE(tree, 0U);
-			node_subset_size = 1;
+	const void *vmax;
+	NodeSet node_set;
+	ACnode *node;
+	int n, i;
+	unsigned char c;
+
+	vmax = vmaxget();
+	init_NodeSet(&node_set, TREE_SIZE(tree), 1);
+	for (n = 1; n <= S->length; n++) {
+		c = (unsigned char) S->ptr[n - 1];
+		if (c == 0 || c >= 16) {
+			/* 'c' is not an IUPAC (base or extended) code */
+			reset_NodeSet(&node_set);
 			continue;
 		}
-		split_and_move_pointers(tree, *c);
-		merge_pointers(tree, n);
+		NodeSet_move(tree, &node_set, c);
+		check_NodeSet(&node_set);
+		for (i = 0; i < node_set.size; i++) {
+			node = GET_NODE(tree, node_set.nids[i]);
+			if (IS_LEAFNODE(node))
+				_TBMatchBuf_report_match(tb_matches,
+						NODE_P_ID(node) - 1, n);
+		}
+	}
+	vmaxset(vmax);
+	return;
+}
+
 /*
-		if (node_subset_size > max_size) {
-			max_size = node_subset_size;
-			Rprintf("walk_tb_nonfixed_subject(): "
-				"n=%d max_size=%d\n",
-				n, max_size);
+ * Multithreaded version of walk_tb_nonfixed_subject()
+ * ---------------------------------------------------
+ * Same tiling as for walk_tb_subject_tile(). The set of nodes reached at
+ * a given position only depends on the TREE_DEPTH(tree) letters that end at
+ * this position, so walking a tile from the root node TREE_DEPTH(tree) - 1
+ * letters before it gives the same sets as a walk along the full subject.
+ * Each thread uses its own NodeSet. 'tree' must be read-only.
+ */
+static void walk_tb_nonfixed_subject_tile(void *automaton,
+		const Chars_holder *S, int tile_start, int tile_end,
+		TileMatches *tile_matches)
+{
+	ACtree *tree = (ACtree *) automaton;
+	NodeSet node_set;
+	ACnode *node;
+	int n, i;
+	unsigned char c;
+
+	init_NodeSet(&node_set, TREE_SIZE(tree), 0);
+	n = tile_start - TREE_DEPTH(tree) + 1;
+	if (n < 1)
+		n = 1;
+	for ( ; n <= tile_end && !node_set.failed; n++) {
+		c = (unsigned char) S->ptr[n - 1];
+		if (c == 0 || c >= 16) {
+			reset_NodeSet(&node_set);
+			continue;
+		}
+		NodeSet_move(tree, &node_set, c);
+		if (node_set.failed || n < tile_start)
+			continue;
+		for (i = 0; i < node_set.size; i++) {
+			node = GET_NODE(tree, node_set.nids[i]);
+			if (IS_LEAFNODE(node))
+				report_tile_match(tile_matches,
+						  NODE_P_ID(node) - 1, n);
 		}
-*/
-		report_matches(tb_matches, n);
 	}
-	node_subset_size = 0;
+	if (node_set.failed == 1)
+		tile_matches->too_many_nodes = 1;
+	else if (node_set.failed)
+		tile_matches->failed = 1;
+	free_NodeSet(&node_set);
 	return;
 }
 
-/* Entry point for the MATCH FINDING section */
+/* Does report matches */
+static void walk_tb_nonfixed_subject_in_threads(ACtree *tree,
+		const Chars_holder *S, TBMatchBuf *tb_matches,
+		int ntile, int nthreads)
+{
+	ACtree readonly_tree;
+
+	/* All the nodes have a failure link so the threads can walk the tree
+	   without setting shortcut links */
+	readonly_tree = *tree;
+	readonly_tree.readonly = 1;
+	walk_tiles_in_threads(walk_tb_nonfixed_subject_tile, &readonly_tree,
+			      S, tb_matches, ntile, nthreads);
+	return;
+}
+
+/* Entry point for the MATCH FINDING section.
+   'nthreads' is only used for a subject of at least 2 * MIN_TILE_LENGTH
+   letters. */
 void _match_tbACtree2(SEXP pptb, const Chars_holder *S, int fixedS,
-		TBMatchBuf *tb_matches)
+		TBMatchBuf *tb_matches, int nthreads)
 {
 	ACtree tree;
 	SEXP tb;
 	XStringSet_holder tb_holder;
+	int ntile;
 
 	tree = pptb_asACtree(pptb);
-	if (fixedS) {
+	ntile = get_ntile(S->length, nthreads);
+	if (fixedS && ntile <= 1) {
 		walk_tb_subject(&tree, S, tb_matches);
 		return;
 	}
 	if (!has_all_flinks(&tree)) {
 		tb = _get_PreprocessedTB_tb(pptb);
 		tb_holder = _hold_XStringSet(tb);
-		//Rprintf("computing all flinks... ");
 		compute_all_flinks(&tree, &tb_holder);
-		//Rprintf("OK\n");
 	}
-	walk_tb_nonfixed_subject(&tree, S, tb_matches);
+	if (fixedS) {
+		walk_tiles_in_threads(walk_tb_subject_tile, &tree,
+				      S, tb_matches, ntile, nthreads);
+		return;
+	}
+	if (ntile <= 1) {
+		walk_tb_nonfixed_subject(&tree, S, tb_matches);
+		return;
+	}
+	walk_tb_nonfixed_subject_in_threads(&tree, S, tb_matches,
+					    ntile, nthreads);
 	return;
 }
 
@@ -1221,30 +1665,778 @@ static void walk_pdict_nonfixed_subject(ACtree *tree,
 		int max_nmis, int min_nmis, int fixedP, int fixedS,
 		MatchPDictBuf *matchpdict_buf)
 {
-	error("walk_pdict_nonfixed_subject(): implement me");
+	const void *vmax;
+	NodeSet node_set;
+	ACnode *node;
+	int n, i;
+	unsigned char c;
+
+	vmax = vmaxget();
+	init_NodeSet(&node_set, TREE_SIZE(tree), 1);
+	for (n = 1; n <= S->length; n++) {
+		c = (unsigned char) S->ptr[n - 1];
+		if (c == 0 || c >= 16) {
+			/* 'c' is not an IUPAC (base or extended) code */
+			reset_NodeSet(&node_set);
+			continue;
+		}
+		NodeSet_move(tree, &node_set, c);
+		check_NodeSet(&node_set);
+		for (i = 0; i < node_set.size; i++) {
+			node = GET_NODE(tree, node_set.nids[i]);
+			if (IS_LEAFNODE(node))
+				_match_pdict_flanks_at(NODE_P_ID(node) - 1,
+					low2high, headtail, S, n,
+					max_nmis, min_nmis, fixedP, fixedS,
+					matchpdict_buf);
+		}
+	}
+	vmaxset(vmax);
 	return;
 }
 
+/* 'nthreads' is used like in _match_tbACtree2(). The heads and tails can
+   only be matched by the main thread (they are reported to R buffers), so
+   when a non-fixed subject is walked in threads, only the Trusted Bands
+   are matched during the walk and the heads and tails are matched
+   afterwards by _match_pdict_all_flanks(). This reports the same matches
+   as walk_pdict_nonfixed_subject(). */
 void _match_pdictACtree2(SEXP pptb, HeadTail *headtail,
 		const Chars_holder *S,
 		int max_nmis, int min_nmis, int fixedP, int fixedS,
-		MatchPDictBuf *matchpdict_buf)
+		MatchPDictBuf *matchpdict_buf, int nthreads)
 {
 	ACtree tree;
-	SEXP low2high;
+	SEXP low2high, tb;
+	XStringSet_holder tb_holder;
+	int ntile;
 
 	tree = pptb_asACtree(pptb);
 	low2high = _get_PreprocessedTB_low2high(pptb);
-	if (fixedS)
+	if (fixedS) {
 		walk_pdict_subject(&tree,
 			low2high, headtail, S,
 			max_nmis, min_nmis, fixedP, fixedS,
 			matchpdict_buf);
-	else
-		walk_pdict_nonfixed_subject(&tree,
-			low2high, headtail, S,
+		return;
+	}
+	if (!has_all_flinks(&tree)) {
+		tb = _get_PreprocessedTB_tb(pptb);
+		tb_holder = _hold_XStringSet(tb);
+		compute_all_flinks(&tree, &tb_holder);
+	}
+	ntile = get_ntile(S->length, nthreads);
+	if (ntile > 1) {
+		walk_tb_nonfixed_subject_in_threads(&tree, S,
+			&(matchpdict_buf->tb_matches), ntile, nthreads);
+		_match_pdict_all_flanks(low2high, headtail, S,
 			max_nmis, min_nmis, fixedP, fixedS,
 			matchpdict_buf);
+		return;
+	}
+	walk_pdict_nonfixed_subject(&tree,
+		low2high, headtail, S,
+		max_nmis, min_nmis, fixedP, fixedS,
+		matchpdict_buf);
+	return;
+}
+
+
+
+
+/****************************************************************************
+ *               K. DENSE TRANSITION TABLE ("ACtree2-dense")                *
+ ****************************************************************************/
+
+/*
+ * The "ACtree2-dense" PreprocessedTB object stores the Aho-Corasick
+ * automaton of an ACtree2 as a fully materialized DFA: the states are the
+ * nodes of the tree renumbered in breadth-first order and, for each state,
+ * the 4 transitions (1 per base, in the order of the 'base_codes' slot) are
+ * stored contiguously in the 'transitions' slot. So walking the subject
+ * costs a single table lookup per letter (no failure link to follow and no
+ * branching on the node representation).
+ * Because all the leaf nodes have the same depth (TREE_DEPTH), they end up
+ * at the end of the breadth-first order. The 'leaf_P_ids' slot contains the
+ * P_id of the leaves (in state order) so state 's' is a leaf iff
+ * 's >= first_leaf' where 'first_leaf' is
+ * 'nnodes - length(leaf_P_ids)'.
+ * Like the node buffers of an ACtree2, the 2 slots are R integer vectors so
+ * the object can be serialized.
+ */
+
+/* The table is 16 bytes per state so this is 256 MB */
+#define MAX_DENSE_NNODES 16777216  /* = 2^24 */
+
+typedef struct acdfa {
+	int tb_width;
+	int nnodes;
+	int first_leaf;
+	const int *transitions;
+	const int *leaf_P_ids;
+	ByteTrTable char2linktag;
+} ACdfa;
+
+#define DFA_TRANSITION(dfa, state, linktag) \
+	((dfa)->transitions[((state) << 2) + (linktag)])
+
+static ACdfa pptb_asACdfa(SEXP pptb)
+{
+	ACdfa dfa;
+	SEXP transitions, leaf_P_ids, base_codes;
+
+	transitions = _get_ACtree2_dense_transitions(pptb);
+	leaf_P_ids = _get_ACtree2_dense_leaf_P_ids(pptb);
+	dfa.tb_width = _get_PreprocessedTB_width(pptb);
+	dfa.nnodes = LENGTH(transitions) / MAX_CHILDREN_PER_NODE;
+	dfa.first_leaf = dfa.nnodes - LENGTH(leaf_P_ids);
+	dfa.transitions = INTEGER(transitions);
+	dfa.leaf_P_ids = INTEGER(leaf_P_ids);
+	base_codes = _get_PreprocessedTB_base_codes(pptb);
+	if (LENGTH(base_codes) != MAX_CHILDREN_PER_NODE)
+		error("Biostrings internal error in pptb_asACdfa(): "
+		      "LENGTH(base_codes) != MAX_CHILDREN_PER_NODE");
+	_init_byte2offset_with_INTEGER(&(dfa.char2linktag), base_codes, 1);
+	return dfa;
+}
+
+/*
+ * --- .Call ENTRY POINT ---
+ * Builds the dense transition table from ACtree2 object 'pptb'. Only the
+ * parent-child links of the tree are used (the shortcut links set by
+ * transition() are ignored) and the failure links are computed along the
+ * way (in breadth-first order, the failure state of a state, and therefore
+ * its row in the table, is always known before the state itself). The tree
+ * is not modified.
+ * Returns a named list with the "transitions" and "leaf_P_ids" elements.
+ */
+SEXP ACtree2_dense_build(SEXP pptb)
+{
+	ACtree tree;
+	unsigned int nnodes, nid, child_nid;
+	unsigned int *queue;
+	int *flinks, *trans, *leaf_P_ids;
+	int depth, nleaves, state, child_state, linktag, tail;
+	ACnode *node;
+	SEXP ans, ans_names, ans_elt;
+
+	tree = pptb_asACtree(pptb);
+	nnodes = TREE_SIZE(&tree);
+	if (nnodes > MAX_DENSE_NNODES)
+		error("the Aho-Corasick tree has too many nodes (%u) to be "
+		      "turned into a dense\n  transition table (max is %d), "
+		      "please use the \"ACtree2\" algorithm instead",
+		      nnodes, MAX_DENSE_NNODES);
+	queue = (unsigned int *) R_alloc((long) nnodes, sizeof(unsigned int));
+	flinks = (int *) R_alloc((long) nnodes, sizeof(int));
+
+	PROTECT(ans = NEW_LIST(2));
+	PROTECT(ans_names = NEW_CHARACTER(2));
+	SET_STRING_ELT(ans_names, 0, mkChar("transitions"));
+	SET_STRING_ELT(ans_names, 1, mkChar("leaf_P_ids"));
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(1);
+	PROTECT(ans_elt = NEW_INTEGER((int) nnodes * MAX_CHILDREN_PER_NODE));
+	SET_ELEMENT(ans, 0, ans_elt);
+	UNPROTECT(1);
+	trans = INTEGER(ans_elt);
+
+	queue[0] = 0U;
+	flinks[0] = 0;
+	tail = 1;
+	nleaves = 0;
+	for (state = 0; state < tail; state++) {
+		node = GET_NODE(&tree, queue[state]);
+		if (IS_LEAFNODE(node)) {
+			nleaves++;
+			depth = TREE_DEPTH(&tree);
+		} else {
+			depth = _NODE_DEPTH(node);
+		}
+		for (linktag = 0; linktag < MAX_CHILDREN_PER_NODE; linktag++) {
+			child_nid = GET_NODE_LINK(&tree, node, linktag);
+			if (child_nid == NOT_AN_ID
+			 || NODE_DEPTH(&tree, GET_NODE(&tree, child_nid))
+			    != depth + 1)
+			{
+				/* no child (or a shortcut link) */
+				trans[(state << 2) + linktag] = state == 0 ? 0 :
+				    trans[(flinks[state] << 2) + linktag];
+				continue;
+			}
+			child_state = tail++;
+			queue[child_state] = child_nid;
+			flinks[child_state] = state == 0 ? 0 :
+				trans[(flinks[state] << 2) + linktag];
+			trans[(state << 2) + linktag] = child_state;
+		}
+	}
+	if (tail != (int) nnodes)
+		error("Biostrings internal error in ACtree2_dense_build(): "
+		      "some nodes are not reachable from the root node");
+
+	PROTECT(ans_elt = NEW_INTEGER(nleaves));
+	SET_ELEMENT(ans, 1, ans_elt);
+	UNPROTECT(1);
+	leaf_P_ids = INTEGER(ans_elt);
+	for (state = tail - nleaves; state < tail; state++) {
+		nid = queue[state];
+		node = GET_NODE(&tree, nid);
+		if (!IS_LEAFNODE(node))
+			error("Biostrings internal error in "
+			      "ACtree2_dense_build(): leaf nodes are not "
+			      "at the end of the breadth-first order");
+		*(leaf_P_ids++) = NODE_P_ID(node);
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Does report matches */
+static void walk_tb_subject_dense(const ACdfa *dfa, const Chars_holder *S,
+		TBMatchBuf *tb_matches)
+{
+	int n, linktag, state;
+	const char *s;
+
+	state = 0;
+	for (n = 1, s = S->ptr; n <= S->length; n++, s++) {
+		linktag = CHAR2LINKTAG(dfa, *s);
+		state = linktag == NA_INTEGER ? 0 :
+			DFA_TRANSITION(dfa, state, linktag);
+		if (state >= dfa->first_leaf)
+			_TBMatchBuf_report_match(tb_matches,
+				dfa->leaf_P_ids[state - dfa->first_leaf] - 1,
+				n);
+	}
 	return;
 }
 
+/* Same as walk_tb_subject_tile(). The table is never modified so the
+   threads can share it as is. */
+static void walk_tb_subject_dense_tile(void *automaton,
+		const Chars_holder *S, int tile_start, int tile_end,
+		TileMatches *tile_matches)
+{
+	const ACdfa *dfa = (const ACdfa *) automaton;
+	int n, linktag, state;
+	const char *s;
+
+	n = tile_start - dfa->tb_width + 1;
+	if (n < 1)
+		n = 1;
+	state = 0;
+	for (s = S->ptr + n - 1; n <= tile_end; n++, s++) {
+		linktag = CHAR2LINKTAG(dfa, *s);
+		state = linktag == NA_INTEGER ? 0 :
+			DFA_TRANSITION(dfa, state, linktag);
+		if (n >= tile_start && state >= dfa->first_leaf)
+			report_tile_match(tile_matches,
+				dfa->leaf_P_ids[state - dfa->first_leaf] - 1,
+				n);
+	}
+	return;
+}
+
+/*
+ * Same as walk_tb_nonfixed_subject() but the subset of current states is
+ * deduplicated with a table of "last seen" positions (1 int per state)
+ * instead of a bitmap.
+ */
+static void walk_tb_nonfixed_subject_dense(const ACdfa *dfa,
+		const Chars_holder *S, TBMatchBuf *tb_matches)
+{
+	int *subset, *new_subset, *tmp, *last_seen;
+	int subset_size, new_size, n, i, j, linktag, state;
+	unsigned char c, base;
+
+	subset = (int *) R_alloc((long) dfa->nnodes, sizeof(int));
+	new_subset = (int *) R_alloc((long) dfa->nnodes, sizeof(int));
+	last_seen = (int *) R_alloc((long) dfa->nnodes, sizeof(int));
+	memset(last_seen, 0, dfa->nnodes * sizeof(int));
+	subset[0] = 0;
+	subset_size = 1;
+	for (n = 1; n <= S->length; n++) {
+		c = (unsigned char) S->ptr[n - 1];
+		if (c >= 16) {
+			/* 'c' is not an IUPAC (base or extended) code */
+			subset[0] = 0;
+			subset_size = 1;
+			continue;
+		}
+		new_size = 0;
+		for (i = 0; i < subset_size; i++) {
+			for (j = 0, base = 1; j < 4; j++, base *= 2) {
+				if ((c & base) == 0)
+					continue;
+				linktag = CHAR2LINKTAG(dfa, base);
+				state = linktag == NA_INTEGER ? 0 :
+					DFA_TRANSITION(dfa, subset[i], linktag);
+				if (last_seen[state] == n)
+					continue;
+				last_seen[state] = n;
+				new_subset[new_size++] = state;
+				if (state >= dfa->first_leaf)
+					_TBMatchBuf_report_match(tb_matches,
+					    dfa->leaf_P_ids[state -
+							    dfa->first_leaf] - 1,
+					    n);
+			}
+		}
+		tmp = subset;
+		subset = new_subset;
+		new_subset = tmp;
+		subset_size = new_size;
+	}
+	return;
+}
+
+/* Entry point for the DENSE TRANSITION TABLE section.
+   'nthreads' is used like in _match_tbACtree2(). */
+void _match_tbACtree2_dense(SEXP pptb, const Chars_holder *S, int fixedS,
+		TBMatchBuf *tb_matches, int nthreads)
+{
+	ACdfa dfa;
+	int ntile;
+
+	dfa = pptb_asACdfa(pptb);
+	if (!fixedS) {
+		walk_tb_nonfixed_subject_dense(&dfa, S, tb_matches);
+		return;
+	}
+	ntile = get_ntile(S->length, nthreads);
+	if (ntile <= 1) {
+		walk_tb_subject_dense(&dfa, S, tb_matches);
+		return;
+	}
+	walk_tiles_in_threads(walk_tb_subject_dense_tile, &dfa,
+			      S, tb_matches, ntile, nthreads);
+	return;
+}
+
+
+
+
+/****************************************************************************
+ *                         L. INCREMENTAL UPDATES                           *
+ ****************************************************************************/
+
+/*
+ * Patterns can be added to (or dropped from) an existing tree. The new nodes
+ * are appended to the node buffers (which are grown as needed) and the
+ * dropped nodes are unlinked from the tree and turned into dead nodes.
+ * Adding or dropping patterns can change some of the failure links and
+ * shortcut links that were set by transition(). ACtree2_drop_patterns()
+ * fixes them in a single pass over the nodes. ACtree2_add_patterns() only
+ * removes the links that can be affected by the new nodes when the tree has
+ * all its failure links (see below), and removes all of them otherwise.
+ */
+
+static void check_ACtree_is_writable(const ACtree *tree)
+{
+	if (tree->readonly)
+		error("cannot modify the Aho-Corasick tree of a PDict object "
+		      "loaded with\n  loadPDict() (its node buffers are "
+		      "mapped read-only)");
+	return;
+}
+
+static void remove_link(ACtree *tree, ACnode *node, int linktag)
+{
+	ACnodeext *nodeext;
+
+	if (IS_EXTENDEDNODE(node)) {
+		nodeext = GET_NODEEXT(tree, node->nid_or_eid);
+		nodeext->link_nid[linktag] = NOT_AN_ID;
+		return;
+	}
+	/* cannot be a leaf node */
+	node->attribs &= ~((MAX_CHILDREN_PER_NODE - 1) << LINKTAG_BITSHIFT);
+	node->nid_or_eid = NOT_AN_ID;
+	return;
+}
+
+static void remove_shortcuts(ACtree *tree, ACnode *node)
+{
+	unsigned int link;
+	int depth, linktag;
+
+	depth = NODE_DEPTH(tree, node);
+	for (linktag = 0; linktag < MAX_CHILDREN_PER_NODE; linktag++) {
+		link = GET_NODE_LINK(tree, node, linktag);
+		if (link != NOT_AN_ID && !is_child(tree, link, depth))
+			remove_link(tree, node, linktag);
+	}
+	return;
+}
+
+static void reset_links(ACtree *tree)
+{
+	unsigned int nnodes, nid;
+	ACnode *node;
+
+	nnodes = TREE_SIZE(tree);
+	for (nid = 0U; nid < nnodes; nid++) {
+		node = GET_NODE(tree, nid);
+		if (IS_DEADNODE(node))
+			continue;
+		remove_shortcuts(tree, node);
+		if (IS_EXTENDEDNODE(node))
+			SET_NODE_FLINK(tree, node, NOT_AN_ID);
+	}
+	return;
+}
+
+/*
+ * When the tree has all its failure links, the only links that can be
+ * affected by a new node v are the ones that end up at v or below. If s is
+ * the parent of the top new node on the path to v, and c the letter that
+ * leads from s to that node, then they belong to the nodes u that have s as
+ * a suffix: the shortcut link from u for c, and the failure and shortcut
+ * links of all the nodes below the child of u for c. The nodes that have s
+ * as a suffix are the nodes that have s on their failure link chain so we
+ * compute, for each node, the set of letters c for which a node on its
+ * chain is such an s (we store it as a 4-bit mask).
+ * Returns the masks of the proper chains (i.e. without the node itself).
+ */
+static unsigned char *get_chain_masks(ACtree *tree, unsigned int nnodes0,
+		const XStringSet_holder *tb, int tb_length)
+{
+	unsigned char *masks;
+	unsigned int *chain, nid, nid1, nid2, flink;
+	const ACnode *node;
+	Chars_holder P;
+	int i, depth, linktag, n;
+	unsigned char mask;
+
+	masks = (unsigned char *) R_alloc((long) nnodes0,
+					  sizeof(unsigned char));
+	memset(masks, 0, nnodes0);
+	/* the letters that lead to a new node */
+	for (i = 0; i < tb_length; i++) {
+		P = _get_elt_from_XStringSet_holder(tb, i);
+		for (depth = 0, nid1 = 0U; depth < P.length; depth++) {
+			linktag = CHAR2LINKTAG(tree, P.ptr[depth]);
+			nid2 = GET_NODE_LINK(tree, GET_NODE(tree, nid1),
+					     linktag);
+			if (nid2 >= nnodes0) {
+				masks[nid1] |= 1 << linktag;
+				break;
+			}
+			nid1 = nid2;
+		}
+	}
+	/* the masks of the full chains (bit 4 is set once computed) */
+	chain = (unsigned int *) R_alloc((long) TREE_DEPTH(tree) + 1,
+					 sizeof(unsigned int));
+	for (nid = 0U; nid < nnodes0; nid++) {
+		n = 0;
+		for (nid1 = nid; !(masks[nid1] & 0x10); nid1 = flink) {
+			chain[n++] = nid1;
+			if (nid1 == 0U)
+				break;
+			node = GET_NODE(tree, nid1);
+			if (IS_DEADNODE(node))
+				break;
+			flink = GET_NODE_FLINK(tree, node);
+		}
+		mask = masks[nid1] & 0x10 ? masks[nid1] & 0x0f : 0;
+		while (n--) {
+			nid1 = chain[n];
+			mask |= masks[nid1] & 0x0f;
+			masks[nid1] = 0x10 | mask;
+		}
+	}
+	/* the masks of the proper chains */
+	for (nid = 1U; nid < nnodes0; nid++) {
+		node = GET_NODE(tree, nid);
+		if (IS_DEADNODE(node))
+			continue;
+		flink = GET_NODE_FLINK(tree, node);
+		masks[nid] = (masks[nid] & 0x0f) | (masks[flink] << 4);
+	}
+	masks[0] &= 0x0f;
+	for (nid = 0U; nid < nnodes0; nid++)
+		masks[nid] >>= 4;
+	return masks;
+}
+
+/* Removes the failure and shortcut links of the (old) nodes below 'nid' and
+   collects the P_ids of the leaf nodes. */
+static void invalidate_subtree(ACtree *tree, unsigned int nid,
+		unsigned int nnodes0, IntAE *P_ids)
+{
+	ACnode *node;
+	unsigned int link;
+	int depth, linktag;
+
+	node = GET_NODE(tree, nid);
+	if (GET_NODE_FLINK(tree, node) == NOT_AN_ID)
+		return;  /* already invalidated */
+	SET_NODE_FLINK(tree, node, NOT_AN_ID);
+	if (IS_LEAFNODE(node)) {
+		IntAE_insert_at(P_ids, IntAE_get_nelt(P_ids), NODE_P_ID(node));
+		remove_shortcuts(tree, node);
+		return;
+	}
+	depth = _NODE_DEPTH(node);
+	for (linktag = 0; linktag < MAX_CHILDREN_PER_NODE; linktag++) {
+		link = GET_NODE_LINK(tree, node, linktag);
+		if (link == NOT_AN_ID)
+			continue;
+		if (!is_child(tree, link, depth))
+			remove_link(tree, node, linktag);
+		else if (link < nnodes0)
+			invalidate_subtree(tree, link, nnodes0, P_ids);
+	}
+	return;
+}
+
+static void invalidate_links(ACtree *tree, unsigned int nnodes0,
+		const unsigned char *masks, IntAE *P_ids)
+{
+	unsigned int nid, link;
+	ACnode *node;
+	int depth, linktag;
+
+	for (nid = 1U; nid < nnodes0; nid++) {
+		if (masks[nid] == 0)
+			continue;
+		node = GET_NODE(tree, nid);
+		if (GET_NODE_FLINK(tree, node) == NOT_AN_ID)
+			continue;  /* dead or already invalidated */
+		depth = NODE_DEPTH(tree, node);
+		for (linktag = 0;
+		     linktag < MAX_CHILDREN_PER_NODE;
+		     linktag++)
+		{
+			if (!(masks[nid] & (1 << linktag)))
+				continue;
+			link = GET_NODE_LINK(tree, node, linktag);
+			if (link == NOT_AN_ID)
+				continue;
+			if (!is_child(tree, link, depth))
+				remove_link(tree, node, linktag);
+			else if (link < nnodes0)
+				invalidate_subtree(tree, link, nnodes0, P_ids);
+		}
+	}
+	return;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Adds the patterns in 'tb' (a rectangular DNAStringSet object with the
+ * width of the Trusted Band of 'pptb') to the tree of 'pptb'. They get the
+ * P_ids that follow the P_ids of the patterns in
+ * '_get_PreprocessedTB_tb(pptb)'.
+ * Returns the "high2low" vector of the new patterns.
+ */
+SEXP ACtree2_add_patterns(SEXP pptb, SEXP tb)
+{
+	ACtree tree;
+	int tb_length0, tb_length, all_flinks, i, P_id;
+	unsigned int nnodes0;
+	XStringSet_holder tb_holder0, tb_holder;
+	Chars_holder P;
+	const unsigned char *masks;
+	IntAE *P_ids;
+	SEXP high2low, ans;
+
+	tree = pptb_asACtree(pptb);
+	check_ACtree_is_writable(&tree);
+	tb_length0 = _get_XStringSet_length(_get_PreprocessedTB_tb(pptb));
+	tb_length = _get_XStringSet_length(tb);
+	if (tb_length > MAX_P_ID - tb_length0)
+		error("too many patterns");
+	tb_holder = _hold_XStringSet(tb);
+	for (i = 0; i < tb_length; i++) {
+		P = _get_elt_from_XStringSet_holder(&tb_holder, i);
+		if (P.length != TREE_DEPTH(&tree))
+			error("element %d in the Trusted Band of the new "
+			      "patterns has a different\n  length than the "
+			      "Trusted Band of the PDict object", i + 1);
+	}
+	all_flinks = has_all_flinks(&tree);
+	if (!all_flinks)
+		reset_links(&tree);
+	nnodes0 = TREE_SIZE(&tree);
+	_init_ppdups_buf(tb_length0 + tb_length);
+	for (i = 0; i < tb_length; i++) {
+		P = _get_elt_from_XStringSet_holder(&tb_holder, i);
+		add_pattern(&tree, &P, tb_length0 + i);
+	}
+	if (all_flinks) {
+		masks = get_chain_masks(&tree, nnodes0, &tb_holder, tb_length);
+		P_ids = new_IntAE(0, 0, 0);
+		invalidate_links(&tree, nnodes0, masks, P_ids);
+		/* set the failure links again */
+		tb_holder0 = _hold_XStringSet(_get_PreprocessedTB_tb(pptb));
+		for (i = 0; i < IntAE_get_nelt(P_ids); i++) {
+			P_id = P_ids->elts[i];
+			P = P_id <= tb_length0 ?
+			    _get_elt_from_XStringSet_holder(&tb_holder0,
+							    P_id - 1) :
+			    _get_elt_from_XStringSet_holder(&tb_holder,
+							    P_id - 1 - tb_length0);
+			compute_flinks_along_pattern(&tree, &P);
+		}
+		for (i = 0; i < tb_length; i++) {
+			P = _get_elt_from_XStringSet_holder(&tb_holder, i);
+			compute_flinks_along_pattern(&tree, &P);
+		}
+	}
+	PROTECT(high2low = _get_ppdups_buf_asINTEGER());
+	PROTECT(ans = NEW_INTEGER(tb_length));
+	memcpy(INTEGER(ans), INTEGER(high2low) + tb_length0,
+	       sizeof(int) * tb_length);
+	UNPROTECT(2);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT ---
+ * 'leaf_P_ids': an integer vector of the length of
+ * '_get_PreprocessedTB_tb(pptb)' that maps the P_id of each leaf node to its
+ * new P_id, or to NA if the leaf node must be removed.
+ * The removed leaf nodes, and the nodes that don't lead to a leaf node
+ * anymore, are unlinked from the tree and turned into dead nodes. Their
+ * slots in the node buffers are only reclaimed by ACtree2_compact().
+ * Removing nodes cannot make a suffix of a node longer so the new failure
+ * link of a node is the first live node on its old failure link chain. The
+ * shortcut links to a dead node are removed.
+ */
+SEXP ACtree2_drop_patterns(SEXP pptb, SEXP leaf_P_ids)
+{
+	ACtree tree;
+	unsigned int nnodes, nid, link, flink;
+	unsigned char *is_alive;
+	ACnode *node;
+	int depth, linktag, P_id;
+
+	tree = pptb_asACtree(pptb);
+	check_ACtree_is_writable(&tree);
+	if (LENGTH(leaf_P_ids) !=
+	    _get_XStringSet_length(_get_PreprocessedTB_tb(pptb)))
+		error("Biostrings internal error in ACtree2_drop_patterns(): "
+		      "'leaf_P_ids' has an invalid length");
+	nnodes = TREE_SIZE(&tree);
+	is_alive = (unsigned char *) R_alloc((long) nnodes,
+					     sizeof(unsigned char));
+	/* the nodes are created after their parent so the children of a
+	   node are visited before the node itself */
+	for (nid = nnodes - 1U; nid >= 1U; nid--) {
+		node = GET_NODE(&tree, nid);
+		is_alive[nid] = 0;
+		if (IS_DEADNODE(node))
+			continue;
+		if (IS_LEAFNODE(node)) {
+			P_id = INTEGER(leaf_P_ids)[NODE_P_ID(node) - 1];
+			is_alive[nid] = P_id != NA_INTEGER;
+			continue;
+		}
+		depth = _NODE_DEPTH(node);
+		for (linktag = 0; linktag < MAX_CHILDREN_PER_NODE; linktag++) {
+			link = GET_NODE_LINK(&tree, node, linktag);
+			if (link != NOT_AN_ID && is_child(&tree, link, depth)
+			 && is_alive[link])
+			{
+				is_alive[nid] = 1;
+				break;
+			}
+		}
+	}
+	is_alive[0] = 1;
+	/* fix the links of the live nodes */
+	for (nid = 0U; nid < nnodes; nid++) {
+		if (!is_alive[nid])
+			continue;
+		node = GET_NODE(&tree, nid);
+		for (linktag = 0; linktag < MAX_CHILDREN_PER_NODE; linktag++) {
+			link = GET_NODE_LINK(&tree, node, linktag);
+			if (link != NOT_AN_ID && !is_alive[link])
+				remove_link(&tree, node, linktag);
+		}
+		flink = GET_NODE_FLINK(&tree, node);
+		if (flink == NOT_AN_ID || is_alive[flink])
+			continue;
+		do {
+			flink = GET_NODE_FLINK(&tree, GET_NODE(&tree, flink));
+		} while (flink != NOT_AN_ID && !is_alive[flink]);
+		SET_NODE_FLINK(&tree, node, flink);
+	}
+	/* turn the other nodes into dead nodes and set the new P_ids */
+	for (nid = 1U; nid < nnodes; nid++) {
+		node = GET_NODE(&tree, nid);
+		if (!is_alive[nid]) {
+			node->attribs = ISLEAF_BIT;
+			node->nid_or_eid = NOT_AN_ID;
+		} else if (IS_LEAFNODE(node)) {
+			P_id = INTEGER(leaf_P_ids)[NODE_P_ID(node) - 1];
+			node->attribs = (node->attribs & ISEXTENDED_BIT)
+					| ISLEAF_BIT | P_id;
+		}
+	}
+	return R_NilValue;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Copies the node buffers of the tree of 'pptb' as-is (i.e. with the dead
+ * nodes, the failure links and the shortcut links) to the (empty) node
+ * buffers 'nodebuf_ptr' and 'nodeextbuf_ptr'.
+ */
+SEXP ACtree2_copy(SEXP pptb, SEXP nodebuf_ptr, SEXP nodeextbuf_ptr)
+{
+	ACtree tree;
+	ACnodeBuf nodebuf;
+	ACnodeextBuf nodeextbuf;
+
+	tree = pptb_asACtree(pptb);
+	nodebuf = new_ACnodeBuf(nodebuf_ptr);
+	copy_ACnodeBuf(&nodebuf, &(tree.nodebuf));
+	nodeextbuf = new_ACnodeextBuf(nodeextbuf_ptr);
+	copy_ACnodeextBuf(&nodeextbuf, &(tree.nodeextbuf));
+	return R_NilValue;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Copies the live nodes of the tree of 'pptb' to the (empty) node buffers
+ * 'nodebuf_ptr' and 'nodeextbuf_ptr', in breadth-first order. The failure
+ * links and shortcut links are not copied.
+ */
+SEXP ACtree2_compact(SEXP pptb, SEXP nodebuf_ptr, SEXP nodeextbuf_ptr)
+{
+	ACtree tree, tree2;
+	unsigned int nnodes, nid2, link, link2;
+	unsigned int *queue;
+	ACnode *node, *node2;
+	int depth, linktag;
+
+	tree = pptb_asACtree(pptb);
+	tree2 = new_ACtree(_get_XStringSet_length(_get_PreprocessedTB_tb(pptb)),
+			   TREE_DEPTH(&tree),
+			   _get_PreprocessedTB_base_codes(pptb),
+			   nodebuf_ptr, nodeextbuf_ptr);
+	nnodes = TREE_SIZE(&tree);
+	/* 'queue[nid2]' is the nid in 'tree' of node 'nid2' in 'tree2' */
+	queue = (unsigned int *) R_alloc((long) nnodes, sizeof(unsigned int));
+	queue[0] = 0U;
+	for (nid2 = 0U; nid2 < TREE_SIZE(&tree2); nid2++) {
+		node = GET_NODE(&tree, queue[nid2]);
+		if (IS_LEAFNODE(node))
+			continue;
+		depth = _NODE_DEPTH(node);
+		for (linktag = 0; linktag < MAX_CHILDREN_PER_NODE; linktag++) {
+			link = GET_NODE_LINK(&tree, node, linktag);
+			if (link == NOT_AN_ID || !is_child(&tree, link, depth))
+				continue;
+			if (IS_LEAFNODE(GET_NODE(&tree, link)))
+				link2 = NEW_LEAFNODE(&tree2,
+					NODE_P_ID(GET_NODE(&tree, link)));
+			else
+				link2 = NEW_NODE(&tree2, depth + 1);
+			queue[link2] = link;
+			node2 = GET_NODE(&tree2, nid2);
+			SET_NODE_LINK(&tree2, node2, linktag, link2);
+		}
+	}
+	return R_NilValue;
+}
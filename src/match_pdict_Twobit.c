@@ -194,3 +194,420 @@ void _match_Twobit(SEXP pptb, const Chars_holder *S, int fixedS,
 	return;
 }
 
+/* Walks the letters of 'S' that are between (0-based) positions 'from' and
+   'to' (excluded) i.e. a segment that contains no exceptions. 'twobit' maps
+   the 2-bit codes of the packed letters to the 2-bit codes used in the
+   signatures of the Twobit object. */
+static void walk_packed_segment(const int *twobit_sign2pos, int tb_width,
+		const int *twobit, const uint64_t *words, int from, int to,
+		TBMatchBuf *tb_matches)
+{
+	int twobit_mask, twobit_sign, nb_valid_prev_char, n, P_id;
+	uint64_t word;
+
+	if (from >= to)
+		return;
+	twobit_mask = (1 << ((tb_width - 1) * 2)) - 1;
+	twobit_sign = nb_valid_prev_char = 0;
+	word = words[from >> 5] >> ((from & 31) << 1);
+	for (n = from; n < to; n++, word >>= 2) {
+		if ((n & 31) == 0)
+			word = words[n >> 5];
+		twobit_sign = ((twobit_sign & twobit_mask) << 2) +
+			      twobit[word & 3];
+		if (++nb_valid_prev_char < tb_width)
+			continue;
+		P_id = twobit_sign2pos[twobit_sign];
+		if (P_id == NA_INTEGER)
+			continue;
+		_TBMatchBuf_report_match(tb_matches, P_id - 1, n + 1);
+	}
+	return;
+}
+
+/* Same as _match_Twobit() but on sequence 'i' of a PackedDNAStringSet
+   object, without decoding it: the signatures are computed directly from
+   the packed words and reset at each run of non-base letters. Returns -1
+   (and finds no match) if 'S' does not store 2 bits per letter or does
+   not use the same base codes as 'pptb'. */
+int _match_Twobit_packed(SEXP pptb, const PackedXStringSet_holder *S, int i,
+		int fixedS, TBMatchBuf *tb_matches)
+{
+	int tb_width, twobit[4], k, from;
+	const int *twobit_sign2pos;
+	const uint64_t *words;
+	int64_t e;
+	SEXP base_codes;
+	TwobitEncodingBuffer teb;
+
+	if (S->bits != 2)
+		return -1;
+	tb_width = _get_PreprocessedTB_width(pptb);
+	twobit_sign2pos = INTEGER(_get_Twobit_sign2pos_tag(pptb));
+	base_codes = _get_PreprocessedTB_base_codes(pptb);
+	teb = _new_TwobitEncodingBuffer(base_codes, tb_width, 0);
+	for (k = 0; k < 4; k++) {
+		twobit[k] = teb.eightbit2twobit.byte2code[
+				(unsigned char) S->base_codes[k]];
+		if (twobit[k] == NA_INTEGER)
+			return -1;
+	}
+	if (!fixedS)
+		error("cannot treat IUPAC extended letters in the subject "
+		      "as ambiguities when 'pdict' is a PDict object of "
+		      "the \"Twobit\" type");
+	words = S->words + S->word_start[i];
+	from = 0;
+	for (e = S->exc_idx[i]; e < S->exc_idx[i + 1]; e++) {
+		walk_packed_segment(twobit_sign2pos, tb_width, twobit, words,
+				    from, S->exc_start[e], tb_matches);
+		from = S->exc_start[e] + S->exc_width[e];
+	}
+	walk_packed_segment(twobit_sign2pos, tb_width, twobit, words,
+			    from, S->width[i], tb_matches);
+	return 0;
+}
+
+
+/****************************************************************************
+ *                                                                          *
+ *                      C. THE "Twobit-hash" VARIANT                        *
+ *                                                                          *
+ ****************************************************************************/
+
+/*
+ * With the "Twobit-hash" algo, the 2-bit-per-letter signatures of the
+ * oligonucleotides in the Trusted Band are stored in an open-addressing
+ * hash table (with linear probing) instead of a dense table of length
+ * 4^tb_width. The size of the table is proportional to the number of
+ * oligonucleotides so the width of the Trusted Band can go up to 32 (the
+ * signatures are 64-bit integers).
+ * The table is an integer vector with 4 ints per slot: the low and high 32
+ * bits of the signature, the 1-based position of the oligonucleotide in the
+ * Trusted Band (0 for an empty slot), and an unused int that makes the
+ * slots 16 bytes (i.e. 4 slots per cache line). The number of slots is a
+ * power of 2 that is at least twice the number of oligonucleotides.
+ * The table comes with a filter: a bitmap with 8 bits per slot where the
+ * bits of the signatures stored in the table are set. The bit of a
+ * signature is given by the same hash value as its slot (its slot is the
+ * bit index divided by 8), so an oligonucleotide of the subject that is not
+ * in the Trusted Band is rejected with 1 bit test in most cases (at least
+ * 15 times out of 16), without probing the table. This is what makes the
+ * walk fast: probing the table for each position of the subject is slowed
+ * down by branch mispredictions even when the table fits in the cache.
+ * The subject is walked by blocks of letters: the letters of a block are
+ * first encoded into 64-bit words (32 letters per word, the 1st letter in
+ * the high bits) together with the mask of the non-base letters of each
+ * word. Then the signatures of the 32 oligonucleotides that end in a word
+ * are extracted from this word and the previous one with shifts and masks
+ * only (there is no dependency between consecutive signatures). Those that
+ * pass the filter have their slot prefetched and are probed once the whole
+ * block has been filtered.
+ * The signatures are extracted and hashed with scalar code, even though the
+ * package has AVX2 kernels elsewhere (align_striped.c, match_pdict_utils.c).
+ * An AVX2 version of the filtering loop (4 signatures per vector) returned
+ * the same matches but was 10-25% slower for tb_width=25, and 65% slower
+ * for tb_width=11 where more signatures pass the filter. AVX2 has no 64-bit
+ * multiply, so the Fibonacci hash takes 3 multiplies per vector, the filter
+ * bits must be gathered, and the signatures that pass must still be stored
+ * one by one. The scalar signatures don't depend on each other, so the
+ * CPU already overlaps their hashing. With large dictionaries the walk is
+ * bound by the cache misses on the filter and the table, which SIMD doesn't
+ * reduce.
+ */
+
+#define TWOBIT_HASH_SLOT_SIZE 4
+#define TWOBIT_HASH_MAX_WIDTH 32
+#define TWOBIT_HASH_BLOCK_NWORD 128  /* 4096 letters per block */
+
+typedef struct twobit_hash {
+	int *table;
+	unsigned int *filter;
+	int nslot;
+	int shift;  /* 64 - log2(8 * nslot) */
+} TwobitHash;
+
+static TwobitHash new_TwobitHash(int *table, unsigned int *filter, int nslot)
+{
+	TwobitHash hash;
+	int n;
+
+	hash.table = table;
+	hash.filter = filter;
+	hash.nslot = nslot;
+	for (hash.shift = 61, n = nslot; n > 1; n >>= 1)
+		hash.shift--;
+	return hash;
+}
+
+/* Fibonacci hashing: the high bits of the product are the index of the bit
+   of 'sign' in the filter */
+static unsigned int hash_signature(const TwobitHash *hash, uint64_t sign)
+{
+	return (unsigned int) ((sign * 0x9E3779B97F4A7C15ULL) >> hash->shift);
+}
+
+static int filter_bit_is_set(const TwobitHash *hash, unsigned int h)
+{
+	return (hash->filter[h >> 5] >> (h & 31)) & 1U;
+}
+
+static uint64_t get_slot_signature(const int *slot)
+{
+	return (uint64_t) (unsigned int) slot[0] |
+	       ((uint64_t) (unsigned int) slot[1] << 32);
+}
+
+/* Returns the 1-based position stored in the slot of 'sign' (0 if 'sign' is
+   not in the table). 'h' must be hash_signature(hash, sign). */
+static int lookup_signature(const TwobitHash *hash, unsigned int h,
+		uint64_t sign)
+{
+	const int *slot;
+
+	for (h >>= 3; ; h = (h + 1) & (hash->nslot - 1)) {
+		slot = hash->table + (size_t) h * TWOBIT_HASH_SLOT_SIZE;
+		if (slot[2] == 0 || get_slot_signature(slot) == sign)
+			return slot[2];
+	}
+}
+
+/* Returns the 1-based position previously stored for 'sign' if any,
+   otherwise stores 'pos' and returns 0. */
+static int insert_signature(TwobitHash *hash, uint64_t sign, int pos)
+{
+	unsigned int h;
+	int *slot;
+
+	h = hash_signature(hash, sign);
+	hash->filter[h >> 5] |= 1U << (h & 31);
+	for (h >>= 3; ; h = (h + 1) & (hash->nslot - 1)) {
+		slot = hash->table + (size_t) h * TWOBIT_HASH_SLOT_SIZE;
+		if (slot[2] == 0) {
+			slot[0] = (int) (unsigned int) (sign & 0xFFFFFFFFU);
+			slot[1] = (int) (unsigned int) (sign >> 32);
+			slot[2] = pos;
+			return 0;
+		}
+		if (get_slot_signature(slot) == sign)
+			return slot[2];
+	}
+}
+
+/* Returns 1 if 'pattern' contains only base letters. */
+static int get_hash_signature(const ByteTrTable *byte2offset,
+		const Chars_holder *pattern, uint64_t *sign)
+{
+	int i, twobit;
+
+	*sign = 0;
+	for (i = 0; i < pattern->length; i++) {
+		twobit = byte2offset->byte2code[(unsigned char) pattern->ptr[i]];
+		if (twobit == NA_INTEGER)
+			return 0;
+		*sign = (*sign << 2) | (uint64_t) twobit;
+	}
+	return 1;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Same arguments as build_Twobit(). Returns an R list with the following
+ * elements:
+ *   - table: the hash table (integer vector);
+ *   - filter: the filter (integer vector of length nslot / 4);
+ *   - high2low: an integer vector containing the mapping between duplicated
+ *         and primary reads.
+ */
+SEXP build_Twobit_hash(SEXP tb, SEXP pp_exclude, SEXP base_codes)
+{
+	int tb_length, tb_width, poffset, nslot, pos0;
+	XStringSet_holder tb_holder;
+	Chars_holder pattern;
+	ByteTrTable byte2offset;
+	TwobitHash hash;
+	uint64_t sign;
+	SEXP ans, ans_names, table, filter, high2low;
+
+	tb_length = _get_XStringSet_length(tb);
+	if (tb_length > (1 << 26))
+		error("too many patterns for 'type=\"Twobit-hash\"'");
+	_init_ppdups_buf(tb_length);
+	_init_byte2offset_with_INTEGER(&byte2offset, base_codes, 1);
+	nslot = 16;
+	while (nslot < 2 * tb_length)
+		nslot *= 2;
+	PROTECT(table = NEW_INTEGER(nslot * TWOBIT_HASH_SLOT_SIZE));
+	memset(INTEGER(table), 0, sizeof(int) * LENGTH(table));
+	PROTECT(filter = NEW_INTEGER(nslot / 4));
+	memset(INTEGER(filter), 0, sizeof(int) * LENGTH(filter));
+	hash = new_TwobitHash(INTEGER(table),
+			      (unsigned int *) INTEGER(filter), nslot);
+	tb_width = -1;
+	tb_holder = _hold_XStringSet(tb);
+	for (poffset = 0; poffset < tb_length; poffset++) {
+		/* Skip duplicated patterns */
+		if (pp_exclude != R_NilValue
+		 && INTEGER(pp_exclude)[poffset] != NA_INTEGER)
+			continue;
+		pattern = _get_elt_from_XStringSet_holder(&tb_holder, poffset);
+		if (pattern.length == 0) {
+			UNPROTECT(2);
+			error("empty trusted region for pattern %d",
+			      poffset + 1);
+		}
+		if (tb_width == -1) {
+			tb_width = pattern.length;
+			if (tb_width > TWOBIT_HASH_MAX_WIDTH) {
+				UNPROTECT(2);
+				error("the width of the Trusted Band must "
+				      "be <= %d when 'type=\"Twobit-hash\"'",
+				      TWOBIT_HASH_MAX_WIDTH);
+			}
+		} else if (pattern.length != tb_width) {
+			UNPROTECT(2);
+			error("all the trusted regions must have "
+			      "the same length");
+		}
+		if (!get_hash_signature(&byte2offset, &pattern, &sign)) {
+			UNPROTECT(2);
+			error("non-base DNA letter found in Trusted Band "
+			      "for pattern %d", poffset + 1);
+		}
+		pos0 = insert_signature(&hash, sign, poffset + 1);
+		if (pos0 != 0)
+			_report_ppdup(poffset, pos0);
+	}
+	PROTECT(ans = NEW_LIST(3));
+	PROTECT(ans_names = NEW_CHARACTER(3));
+	SET_STRING_ELT(ans_names, 0, mkChar("table"));
+	SET_STRING_ELT(ans_names, 1, mkChar("filter"));
+	SET_STRING_ELT(ans_names, 2, mkChar("high2low"));
+	SET_NAMES(ans, ans_names);
+	SET_ELEMENT(ans, 0, table);
+	SET_ELEMENT(ans, 1, filter);
+	PROTECT(high2low = _get_ppdups_buf_asINTEGER());
+	SET_ELEMENT(ans, 2, high2low);
+	UNPROTECT(5);
+	return ans;
+}
+
+/* Encodes the 'nletter' letters starting at 's' into 'words' (32 letters
+   per word, the 1st letter in the high bits) and sets the bits of the
+   non-base letters in 'nonbase' (bit 31 for the 1st letter of a word).
+   The last word is padded with non-base letters. */
+static void encode_block(const ByteTrTable *byte2offset, const char *s,
+		int nletter, uint64_t *words, uint64_t *nonbase)
+{
+	int nword, j, r, twobit;
+	uint64_t word, mask;
+
+	nword = (nletter + 31) / 32;
+	for (j = 0; j < nword; j++, nletter -= 32) {
+		word = mask = 0;
+		for (r = 0; r < 32; r++) {
+			twobit = r < nletter ?
+				 byte2offset->byte2code[(unsigned char) *(s++)] :
+				 NA_INTEGER;
+			mask <<= 1;
+			if (twobit == NA_INTEGER) {
+				mask |= 1;
+				twobit = 0;
+			}
+			word = (word << 2) | (uint64_t) twobit;
+		}
+		words[j] = word;
+		nonbase[j] = mask;
+	}
+	return;
+}
+
+static void walk_subject_hash(const TwobitHash *hash, int tb_width,
+		const ByteTrTable *byte2offset, const Chars_holder *S,
+		TBMatchBuf *tb_matches)
+{
+	/* Index 0 holds the last word of the previous block */
+	uint64_t words[TWOBIT_HASH_BLOCK_NWORD + 1],
+		 nonbase[TWOBIT_HASH_BLOCK_NWORD + 1],
+		 signs[32 * TWOBIT_HASH_BLOCK_NWORD],
+		 sign_mask, width_mask, hi, lo, nb, sign;
+	unsigned int hs[32 * TWOBIT_HASH_BLOCK_NWORD], h;
+	int ends[32 * TWOBIT_HASH_BLOCK_NWORD];
+	int block_start, nletter, nword, ncand, j, r, s, P_id, k;
+
+	sign_mask = tb_width == 32 ? ~(uint64_t) 0 :
+				     ((uint64_t) 1 << (2 * tb_width)) - 1;
+	width_mask = ((uint64_t) 1 << tb_width) - 1;
+	words[0] = 0;
+	nonbase[0] = 0xFFFFFFFFU;  /* no letter before the subject */
+	for (block_start = 0;
+	     block_start < S->length;
+	     block_start += 32 * TWOBIT_HASH_BLOCK_NWORD)
+	{
+		nletter = S->length - block_start;
+		if (nletter > 32 * TWOBIT_HASH_BLOCK_NWORD)
+			nletter = 32 * TWOBIT_HASH_BLOCK_NWORD;
+		nword = (nletter + 31) / 32;
+		encode_block(byte2offset, S->ptr + block_start, nletter,
+			     words + 1, nonbase + 1);
+		/* Extract the signatures of the oligonucleotides that end in
+		   the block (and contain only base letters), keep those that
+		   pass the filter and prefetch their slots */
+		ncand = 0;
+		for (j = 1; j <= nword; j++) {
+			hi = words[j - 1];
+			lo = words[j];
+			nb = (nonbase[j - 1] << 32) | nonbase[j];
+			for (r = 0; r < 32; r++) {
+				s = 62 - 2 * r;
+				sign = ((lo >> s) | ((hi << 1) << (63 - s))) &
+				       sign_mask;
+				h = hash_signature(hash, sign);
+				if (!filter_bit_is_set(hash, h)
+				 || ((nb >> (31 - r)) & width_mask))
+					continue;
+#if defined(__GNUC__) || defined(__clang__)
+				__builtin_prefetch(hash->table +
+					(size_t) (h >> 3) *
+					TWOBIT_HASH_SLOT_SIZE);
+#endif
+				signs[ncand] = sign;
+				hs[ncand] = h;
+				ends[ncand++] = block_start + 32 * (j - 1) +
+						r + 1;
+			}
+		}
+		/* Probe the slots */
+		for (k = 0; k < ncand; k++) {
+			P_id = lookup_signature(hash, hs[k], signs[k]);
+			if (P_id != 0)
+				_TBMatchBuf_report_match(tb_matches, P_id - 1,
+							 ends[k]);
+		}
+		words[0] = words[nword];
+		nonbase[0] = nonbase[nword];
+	}
+	return;
+}
+
+void _match_Twobit_hash(SEXP pptb, const Chars_holder *S, int fixedS,
+		TBMatchBuf *tb_matches)
+{
+	int tb_width;
+	SEXP table, filter;
+	ByteTrTable byte2offset;
+	TwobitHash hash;
+
+	tb_width = _get_PreprocessedTB_width(pptb);
+	table = _get_Twobit_hash_table(pptb);
+	filter = _get_Twobit_hash_filter(pptb);
+	if (!fixedS)
+		error("cannot treat IUPAC extended letters in the subject "
+		      "as ambiguities when 'pdict' is a PDict object of "
+		      "the \"Twobit-hash\" type");
+	_init_byte2offset_with_INTEGER(&byte2offset,
+				       _get_PreprocessedTB_base_codes(pptb), 1);
+	hash = new_TwobitHash(INTEGER(table), (unsigned int *) INTEGER(filter),
+			      LENGTH(table) / TWOBIT_HASH_SLOT_SIZE);
+	walk_subject_hash(&hash, tb_width, &byte2offset, S, tb_matches);
+	return;
+}
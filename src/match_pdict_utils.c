@@ -8,7 +8,7 @@
 #include "S4Vectors_interface.h"
 #include <S.h> /* for Salloc() */
 
-#include <limits.h> /* for ULONG_MAX */
+#include <limits.h> /* for INT_MAX and ULONG_MAX */
 #include <time.h> /* for clock() and CLOCKS_PER_SEC */
 
 
@@ -185,6 +185,9 @@ static int nmismatch_in_HT(const Chars_holder *H, const Chars_holder *T,
 {
 	int nmis;
 
+	if (H->length == 0)
+		return _nmismatch_at_Pshift(T, S, Tshift,
+				max_nmis, bytewise_match_table);
 	nmis = _nmismatch_at_Pshift(H, S, Hshift,
 			max_nmis, bytewise_match_table);
 	if (nmis > max_nmis)
@@ -312,32 +315,86 @@ static void match_headtail_by_key(HeadTail *headtail,
  * worth to make it persistent. Not a trivial task!
  */
 
-#define MAX_REMAINING_KEYS 24  // >= 0 and < NBIT_PER_BITWORD
+/* The keys that don't fill a BitWord are matched one by one with
+   match_headtail_for_key() if there are no more than 'max_remaining_keys'
+   of them. Because the heads and tails are fixed, match_headtail_for_key()
+   compares their letters 8 at a time, so it beats the extra BitWord of
+   the BitMatrix for up to about 8 keys when the heads and tails are either
+   empty or at least 8 letters long (e.g. for 25-mers with max.mismatch=1
+   or 2), but not even for 4 keys when some of them are shorter. */
+#define MAX_REMAINING_KEYS 0  // >= 0 and < NBIT_PER_BITWORD
+#define MAX_REMAINING_WORDWISE_KEYS 8  // >= 0 and < NBIT_PER_BITWORD
 #define TMPMATCH_BMBUF_MAXNCOL 200
 
+/* The flanks are matched at up to TMPMATCH_BMBUF_MAXNCOL locations at a
+   time. Each BitWord of keys at each of these locations is a "lane" with
+   its own bit-sliced mismatch counter, and the AVX2 kernel updates 4 lanes
+   at once, that is, 4 locations when there are no more than 64 keys, or up
+   to 256 keys at the same location. Like in align_striped.c, the kernel is
+   compiled with the appropriate target attribute and selected at run time
+   if the CPU supports it. It needs 64-bit BitWords. */
+#define SIMD_NONE 0
+#define SIMD_AVX2 2
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(_WIN32) \
+ && (defined(__clang__) || __GNUC__ >= 5)
+#define HAVE_AVX2_KERNELS 1
+#include <immintrin.h>
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+static int get_simd_support()
+{
+#ifdef HAVE_AVX2_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return SIMD_AVX2;
+#endif
+	return SIMD_NONE;
+}
+
 static PPHeadTail new_PPHeadTail(SEXP base_codes, int bmbuf_nrow,
-		int max_Hwidth, int max_Twidth, int max_nmis)
+		int max_Hwidth, int max_Twidth, int min_HTwidth)
 {
 	PPHeadTail ppheadtail;
-	int i;
+	int HTwidth, i, j;
+	const BitWord **cols;
 
 	ppheadtail.is_init = 1;
+	ppheadtail.simd = get_simd_support();
+	ppheadtail.max_remaining_keys = min_HTwidth >= 8 ?
+					MAX_REMAINING_WORDWISE_KEYS :
+					MAX_REMAINING_KEYS;
 	if (LENGTH(base_codes) != 4)
 		error("Biostrings internal error in _new_HeadTail(): "
 			"LENGTH(base_codes) != 4");
 	_init_byte2offset_with_INTEGER(&(ppheadtail.byte2offset),
 				       base_codes, 1);
 	if (max_Hwidth > 0)
-		for (i = 0; i < 4; i++)
+		for (i = 0; i < 5; i++)
 			ppheadtail.head_bmbuf[i] = _new_BitMatrix(bmbuf_nrow,
 							max_Hwidth, 0UL);
 	if (max_Twidth > 0)
-		for (i = 0; i < 4; i++)
+		for (i = 0; i < 5; i++)
 			ppheadtail.tail_bmbuf[i] = _new_BitMatrix(bmbuf_nrow,
 							max_Twidth, 0UL);
-	ppheadtail.nmis_bmbuf = _new_BitMatrix(bmbuf_nrow, max_nmis + 1, 0UL);
+	/* 'col_buf' points to the columns of the head and tail buffers.
+	   The columns for letter offset 'i' (4 for the non-base letters)
+	   are at 'col_buf + i * HTwidth', the heads first. */
+	HTwidth = max_Hwidth + max_Twidth;
+	ppheadtail.col_buf = Salloc((long) 5 * HTwidth, const BitWord *);
+	for (i = 0, cols = ppheadtail.col_buf; i < 5; i++) {
+		for (j = 0; j < max_Hwidth; j++)
+			*(cols++) = ppheadtail.head_bmbuf[i].bitword00 +
+				    j * ppheadtail.head_bmbuf[i].nword_per_col;
+		for (j = 0; j < max_Twidth; j++)
+			*(cols++) = ppheadtail.tail_bmbuf[i].bitword00 +
+				    j * ppheadtail.tail_bmbuf[i].nword_per_col;
+	}
 	ppheadtail.tmp_match_bmbuf = _new_BitMatrix(bmbuf_nrow, TMPMATCH_BMBUF_MAXNCOL, ULONG_MAX);
 	ppheadtail.tmp_tb_end_buf = Salloc((long) TMPMATCH_BMBUF_MAXNCOL, int);
+	ppheadtail.tmp_colidx_buf = Salloc((long) TMPMATCH_BMBUF_MAXNCOL *
+					   HTwidth, int);
 	//Rprintf("new_PPHeadTail():\n");
 	//Rprintf("  nb of rows in each BitMatrix buffer=%d\n", bmbuf_nrow);
 	return ppheadtail;
@@ -350,7 +407,7 @@ HeadTail _new_HeadTail(SEXP pdict_head, SEXP pdict_tail, SEXP pptb,
 	HeadTail headtail;
 	int tb_length, max_nmis, fixedP, fixedS,
 	    key, max_Hwidth, max_Twidth, max_HTwidth, HTwidth,
-	    grouped_keys_buflength;
+	    min_HTwidth, grouped_keys_buflength;
 	SEXP low2high, dups, base_codes;
 	RoSeqs head, tail;
 	Chars_holder *H, *T;
@@ -375,6 +432,8 @@ HeadTail _new_HeadTail(SEXP pdict_head, SEXP pdict_tail, SEXP pptb,
 		tail = _new_RoSeqs_from_XStringSet(tb_length, pdict_tail);
 	}
 	max_Hwidth = max_Twidth = max_HTwidth = grouped_keys_buflength = 0;
+	/* Width of the shortest non-empty head or tail */
+	min_HTwidth = INT_MAX;
 	for (key = 0, H = head.elts, T = tail.elts;
 	     key < tb_length;
 	     key++, H++, T++)
@@ -383,6 +442,10 @@ HeadTail _new_HeadTail(SEXP pdict_head, SEXP pdict_tail, SEXP pptb,
 			max_Hwidth = H->length;
 		if (T->length > max_Twidth)
 			max_Twidth = T->length;
+		if (H->length != 0 && H->length < min_HTwidth)
+			min_HTwidth = H->length;
+		if (T->length != 0 && T->length < min_HTwidth)
+			min_HTwidth = T->length;
 		HTwidth = H->length + T->length;
 		if (HTwidth > max_HTwidth)
 			max_HTwidth = HTwidth;
@@ -404,7 +467,7 @@ HeadTail _new_HeadTail(SEXP pdict_head, SEXP pdict_tail, SEXP pptb,
 	//Rprintf("  grouped_keys_buflength=%d\n", grouped_keys_buflength);
 
 	/* The (max_nmis <= 4) and (max_Hwidth + max_Twidth <= 10 + 4 * max_nmis)
-	   criteria together with the MAX_REMAINING_KEYS value above (20)
+	   criteria together with the MAX_REMAINING_KEYS values above
 	   are optimized for the Core 2 Duo arch (64bit) */
 	if (with_ppheadtail
 	 && (max_nmis < max_HTwidth)
@@ -416,19 +479,23 @@ HeadTail _new_HeadTail(SEXP pdict_head, SEXP pdict_tail, SEXP pptb,
 		base_codes = _get_PreprocessedTB_base_codes(pptb);
 		headtail.ppheadtail = new_PPHeadTail(base_codes,
 					grouped_keys_buflength,
-					max_Hwidth, max_Twidth, max_nmis);
+					max_Hwidth, max_Twidth, min_HTwidth);
 	} else {
 		headtail.ppheadtail.is_init = 0;
 	}
 	return headtail;
 }
 
+/* Bit i of column j of 'bmbuf[offset]' is set to 0 if letter j of the head
+   (or tail) of key i is the base with this offset, or if the head (or tail)
+   has less than j + 1 letters. 'bmbuf[4]' is for the non-base letters of the
+   subject, which match no letter of the keys. */
 static void init_headortail_bmbuf(BitMatrix *bmbuf, int nrow)
 {
 	int i;
 
 	//Rprintf("init_headortail_bmbuf(): nrow=%d\n", nrow);
-	for (i = 0; i < 4; i++) {
+	for (i = 0; i < 5; i++) {
 		if (nrow > bmbuf[i].nword_per_col * NBIT_PER_BITWORD)
 			error("Biostrings internal error in init_headortail_bmbuf(): "
 			      "not enough rows in 'bmbuf[%d]'", i);
@@ -439,17 +506,6 @@ static void init_headortail_bmbuf(BitMatrix *bmbuf, int nrow)
 	return;
 }
 
-static void init_nmis_bmbuf(BitMatrix *bmbuf, int nrow)
-{
-	if (nrow > bmbuf->nword_per_col * NBIT_PER_BITWORD)
-		error("Biostrings internal error in init_nmis_bmbuf(): "
-		      "not enough rows in 'bmbuf'");
-	bmbuf->nrow = nrow;
-	/* Set all bits to 0 */
-	_BitMatrix_set_val(bmbuf, 0UL);
-	return;
-}
-
 static void preprocess_H(const Chars_holder *H,
 		const ByteTrTable *byte2offset, BitMatrix *bmbuf0, int i)
 {
@@ -466,7 +522,7 @@ static void preprocess_H(const Chars_holder *H,
 		bmbuf = bmbuf0 + offset;
 		_BitMatrix_set_bit(bmbuf, i, j, 0);
 	}
-	for (offset = 0; offset < 4; offset++) {
+	for (offset = 0; offset < 5; offset++) {
 		bmbuf = bmbuf0 + offset;
 		for (j = H->length; j < bmbuf->ncol; j++)
 			_BitMatrix_set_bit(bmbuf, i, j, 0);
@@ -490,7 +546,7 @@ static void preprocess_T(const Chars_holder *T,
 		bmbuf = bmbuf0 + offset;
 		_BitMatrix_set_bit(bmbuf, i, j, 0);
 	}
-	for (offset = 0; offset < 4; offset++) {
+	for (offset = 0; offset < 5; offset++) {
 		bmbuf = bmbuf0 + offset;
 		for (j = T->length; j < bmbuf->ncol; j++)
 			_BitMatrix_set_bit(bmbuf, i, j, 0);
@@ -526,121 +582,191 @@ static void preprocess_tail(const RoSeqs *tail, const IntAE *grouped_keys,
 	return;
 }
 
-static BitCol match_ppheadtail_for_loc(HeadTail *headtail, int tb_width,
-		const Chars_holder *S, int tb_end, int max_nmis, int min_nmis)
+static void set_colidx_for_loc(const HeadTail *headtail, int tb_width,
+		const Chars_holder *S, int tb_end, int *colidx)
 {
-	BitMatrix *nmis_bmbuf;
-	const BitMatrix *head_bmbuf, *tail_bmbuf;
-	int j1, j2, offset;
-	char s;
-	BitCol bitcol, max_nmis_bitcol, min_nmis_bitcol;
-
-	nmis_bmbuf = &(headtail->ppheadtail.nmis_bmbuf);
-	// Match the heads
-	head_bmbuf = headtail->ppheadtail.head_bmbuf;
+	int HTwidth, j1, j2, offset;
+	const int *byte2code;
+
+	HTwidth = headtail->max_Hwidth + headtail->max_Twidth;
+	byte2code = headtail->ppheadtail.byte2offset.byte2code;
+	// 'j2' should be a safe location in 'S' because we call
+	// set_colidx_for_loc() only when 'tb_end' is guaranteed not to be
+	// too close to 'S' boundaries.
 	for (j1 = 0, j2 = tb_end - tb_width - 1;
 	     j1 < headtail->max_Hwidth;
 	     j1++, j2--)
 	{
-		// 'j2' should be a safe location in 'S' because we call
-		// match_ppheadtail_for_loc() only when 'tb_end' is guaranteed
-		// not to be too close to 'S' boundaries.
-		s = S->ptr[j2];
-		offset = headtail->ppheadtail.byte2offset.byte2code[(unsigned char) s];
-		if (offset == NA_INTEGER) {
-			_BitMatrix_Rrot1(nmis_bmbuf);
-			continue;
-		}
-		bitcol = _BitMatrix_get_col(head_bmbuf + offset, j1);
-		_BitMatrix_grow1rows(nmis_bmbuf, &bitcol);
+		offset = byte2code[(unsigned char) S->ptr[j2]];
+		if (offset == NA_INTEGER)
+			offset = 4;
+		*(colidx++) = offset * HTwidth + j1;
 	}
-	// Match the tails
-	tail_bmbuf = headtail->ppheadtail.tail_bmbuf;
-	for (j1 = 0, j2 = tb_end;
-	     j1 < headtail->max_Twidth;
+	for (j1 = headtail->max_Hwidth, j2 = tb_end;
+	     j1 < HTwidth;
 	     j1++, j2++)
 	{
-		// 'j2' should be a safe location in 'S' because we call
-		// match_ppheadtail_for_loc() only when 'tb_end' is guaranteed
-		// not to be too close from 'S' boundaries.
-		s = S->ptr[j2];
-		offset = headtail->ppheadtail.byte2offset.byte2code[(unsigned char) s];
-		if (offset == NA_INTEGER) {
-			_BitMatrix_Rrot1(nmis_bmbuf);
-			continue;
-		}
-		bitcol = _BitMatrix_get_col(tail_bmbuf + offset, j1);
-		_BitMatrix_grow1rows(nmis_bmbuf, &bitcol);
-	}
-	max_nmis_bitcol = _BitMatrix_get_col(nmis_bmbuf, max_nmis);
-	if (min_nmis >= 1) {
-		min_nmis_bitcol = _BitMatrix_get_col(nmis_bmbuf, min_nmis - 1);
-		_BitCol_A_gets_BimpliesA(&max_nmis_bitcol, &min_nmis_bitcol);
+		offset = byte2code[(unsigned char) S->ptr[j2]];
+		if (offset == NA_INTEGER)
+			offset = 4;
+		*(colidx++) = offset * HTwidth + j1;
 	}
-	return max_nmis_bitcol;
+	return;
 }
 
-static void report_matches_for_loc(const BitCol *bitcol, HeadTail *headtail,
-		int tb_end, MatchPDictBuf *matchpdict_buf)
+/* Returns BitWord 'i1' of the match column for the location whose letters
+   are described by 'colidx' (see set_colidx_for_loc()). Bit i of the match
+   column is 0 if key i has between 'min_nmis' and 'max_nmis' mismatches.
+   The mismatch counter is bit-sliced: bit i of 'nmis[k]' is 1 if key i
+   has more than k mismatches. */
+static BitWord match_lane(const BitWord **col_buf, const int *colidx,
+		int HTwidth, int i1, int max_nmis, int min_nmis)
 {
-	// Note that using _BitCol_get_bit() for this would be easier but is
-	// also twice slower!
-	BitWord *bitword;
-	int i, i2;
+	BitWord nmis[5], R, ret;  // max_nmis <= 4 (see _new_HeadTail())
+	int j, k;
+
+	for (k = 0; k <= max_nmis; k++)
+		nmis[k] = 0UL;
+	for (j = 0; j < HTwidth; j++) {
+		R = col_buf[colidx[j]][i1];
+		for (k = 0; k <= max_nmis; k++) {
+			ret = nmis[k] & R; // and
+			nmis[k] |= R; // or
+			R = ret;
+		}
+	}
+	if (min_nmis >= 1)
+		return nmis[max_nmis] | ~nmis[min_nmis - 1];
+	return nmis[max_nmis];
+}
 
-	bitword = bitcol->bitword0;
-	for (i = i2 = 0; i < bitcol->nbit; i++, i2++) {
-		if (i2 >= NBIT_PER_BITWORD) {
-			i2 = 0;
-			bitword++;
+#ifdef HAVE_AVX2_KERNELS
+/* Same as calling match_lane() on each of the 'nloc * nword' lanes but
+   4 lanes at a time. */
+AVX2 static void match_lanes_avx2(const BitWord **col_buf,
+		const int *colidx_buf, int HTwidth, int nloc, int nword,
+		int max_nmis, int min_nmis, BitWord *match_buf, int nword_per_col)
+{
+	__m256i nmis[5], R, ret, match;
+	const int *colidx[4];
+	BitWord *out[4], match_words[4];
+	int nlane, lane, i1[4], j, k;
+
+	nlane = nloc * nword;
+	for (lane = 0; lane + 4 <= nlane; lane += 4) {
+		for (k = 0; k < 4; k++) {
+			colidx[k] = colidx_buf + (lane + k) / nword * HTwidth;
+			i1[k] = (lane + k) % nword;
+			out[k] = match_buf + (lane + k) / nword * nword_per_col
+				 + i1[k];
 		}
-		if (!(*bitword & 1UL)) {
-			//_MatchPDictBuf_report_match(matchpdict_buf,
-			//	headtail->grouped_keys.elts[i], tb_end);
-			int key, start, width;
-			key = headtail->grouped_keys->elts[i];
-			width = headtail->head.elts[key].length
-			      + matchpdict_buf->tb_matches.tb_width
-			      + headtail->tail.elts[key].length;
-			start = tb_end + headtail->tail.elts[key].length - width + 1;
-			_MatchPDictBuf_report_match2(matchpdict_buf, key, start, width);
+		for (k = 0; k <= max_nmis; k++)
+			nmis[k] = _mm256_setzero_si256();
+		for (j = 0; j < HTwidth; j++) {
+			R = _mm256_set_epi64x(
+				(long long) col_buf[colidx[3][j]][i1[3]],
+				(long long) col_buf[colidx[2][j]][i1[2]],
+				(long long) col_buf[colidx[1][j]][i1[1]],
+				(long long) col_buf[colidx[0][j]][i1[0]]);
+			for (k = 0; k <= max_nmis; k++) {
+				ret = _mm256_and_si256(nmis[k], R);
+				nmis[k] = _mm256_or_si256(nmis[k], R);
+				R = ret;
+			}
 		}
-		*bitword >>= 1;
+		match = nmis[max_nmis];
+		if (min_nmis >= 1)
+			match = _mm256_or_si256(match,
+				_mm256_xor_si256(nmis[min_nmis - 1],
+						 _mm256_set1_epi64x(-1LL)));
+		_mm256_storeu_si256((__m256i *) match_words, match);
+		for (k = 0; k < 4; k++)
+			*(out[k]) = match_words[k];
 	}
+	for ( ; lane < nlane; lane++)
+		match_buf[lane / nword * nword_per_col + lane % nword] =
+			match_lane(col_buf, colidx_buf + lane / nword * HTwidth,
+				   HTwidth, lane % nword, max_nmis, min_nmis);
 	return;
 }
+#endif
 
-/*
-static void flush_tmp_match_bmbuf(HeadTail *headtail, MatchPDictBuf *matchpdict_buf)
+static void report_ppheadtail_match(const HeadTail *headtail, int key,
+		int tb_end, MatchPDictBuf *matchpdict_buf)
+{
+	int start, width;
+
+	width = headtail->head.elts[key].length
+	      + matchpdict_buf->tb_matches.tb_width
+	      + headtail->tail.elts[key].length;
+	start = tb_end + headtail->tail.elts[key].length - width + 1;
+	_MatchPDictBuf_report_match2(matchpdict_buf, key, start, width);
+	return;
+}
+
+/* Matches the flanks at the locations stored in 'tmp_tb_end_buf' and reports
+   the matches (in the same order as if the locations were processed one by
+   one). */
+static void flush_tmp_match_bmbuf(HeadTail *headtail,
+		int max_nmis, int min_nmis, MatchPDictBuf *matchpdict_buf)
 {
+	PPHeadTail *ppheadtail;
 	BitMatrix *tmp_match_bmbuf;
-	const int *tmp_tb_end_buf;
-	BitWord *bitword2, *bitword, mask;
-	int i, j;
+	const int *colidx;
+	BitWord *bitword, word;
+	int HTwidth, nword, i, i1, i2, j;
 
-	tmp_match_bmbuf = &(headtail->ppheadtail.tmp_match_bmbuf);
-	tmp_tb_end_buf = headtail->ppheadtail.tmp_tb_end_buf;
-	bitword2 = tmp_match_bmbuf->bitword00;
-	mask = 1UL;
-	for (i = 0; i < tmp_match_bmbuf->nrow; i++) {
-		if (mask == 0UL) { // this means that i % NBIT_PER_BITWORD == 0
-			bitword2++;
-			mask = 1UL;
-		}
-		bitword = bitword2;
-		for (j = 0; j < tmp_match_bmbuf->ncol; j++) {
-			if (!(*bitword & mask)) {
-				_MatchPDictBuf_report_match(matchpdict_buf,
-					headtail->grouped_keys.elts[i], tmp_tb_end_buf[j]);
+	ppheadtail = &(headtail->ppheadtail);
+	tmp_match_bmbuf = &(ppheadtail->tmp_match_bmbuf);
+	if (tmp_match_bmbuf->ncol == 0)
+		return;
+	HTwidth = headtail->max_Hwidth + headtail->max_Twidth;
+	nword = (tmp_match_bmbuf->nrow + NBIT_PER_BITWORD - 1) /
+		NBIT_PER_BITWORD;
+#ifdef HAVE_AVX2_KERNELS
+	if (ppheadtail->simd == SIMD_AVX2) {
+		match_lanes_avx2(ppheadtail->col_buf,
+				 ppheadtail->tmp_colidx_buf, HTwidth,
+				 tmp_match_bmbuf->ncol, nword,
+				 max_nmis, min_nmis,
+				 tmp_match_bmbuf->bitword00,
+				 tmp_match_bmbuf->nword_per_col);
+	} else
+#endif
+	for (j = 0, colidx = ppheadtail->tmp_colidx_buf;
+	     j < tmp_match_bmbuf->ncol;
+	     j++, colidx += HTwidth)
+	{
+		bitword = tmp_match_bmbuf->bitword00 +
+			  j * tmp_match_bmbuf->nword_per_col;
+		for (i1 = 0; i1 < nword; i1++)
+			bitword[i1] = match_lane(ppheadtail->col_buf, colidx,
+					HTwidth, i1, max_nmis, min_nmis);
+	}
+	for (j = 0; j < tmp_match_bmbuf->ncol; j++) {
+		bitword = tmp_match_bmbuf->bitword00 +
+			  j * tmp_match_bmbuf->nword_per_col;
+		for (i1 = i = 0; i1 < nword; i1++) {
+			word = bitword[i1];
+			if (word == ULONG_MAX) {
+				i += NBIT_PER_BITWORD;
+				continue;
+			}
+			for (i2 = 0;
+			     i2 < NBIT_PER_BITWORD && i < tmp_match_bmbuf->nrow;
+			     i2++, i++, word >>= 1)
+			{
+				if (!(word & 1UL))
+					report_ppheadtail_match(headtail,
+						headtail->grouped_keys->elts[i],
+						ppheadtail->tmp_tb_end_buf[j],
+						matchpdict_buf);
 			}
-			bitword += tmp_match_bmbuf->nword_per_col;
 		}
-		mask <<= 1;
 	}
 	tmp_match_bmbuf->ncol = 0;
 	return;
 }
-*/
 
 static void match_ppheadtail0(HeadTail *headtail,
 		const Chars_holder *S, const IntAE *tb_end_buf,
@@ -649,9 +775,8 @@ static void match_ppheadtail0(HeadTail *headtail,
 		MatchPDictBuf *matchpdict_buf)
 {
 	BitMatrix *tmp_match_bmbuf;
-	int nelt, min_safe_tb_end, max_safe_tb_end, j, ncol;
+	int HTwidth, nelt, min_safe_tb_end, max_safe_tb_end, j, ncol;
 	const int *tb_end;
-	BitCol bitcol;
 
 	if (headtail->max_Hwidth > 0)
 		preprocess_head(&(headtail->head), headtail->grouped_keys,
@@ -665,6 +790,7 @@ static void match_ppheadtail0(HeadTail *headtail,
 	tmp_match_bmbuf->nrow = IntAE_get_nelt(headtail->grouped_keys);
 	tmp_match_bmbuf->ncol = 0;
 
+	HTwidth = headtail->max_Hwidth + headtail->max_Twidth;
 	min_safe_tb_end = headtail->max_Hwidth
 			+ matchpdict_buf->tb_matches.tb_width;
 	max_safe_tb_end = S->length - headtail->max_Twidth;
@@ -674,6 +800,10 @@ static void match_ppheadtail0(HeadTail *headtail,
 	     j++, tb_end++)
 	{
 		if (*tb_end < min_safe_tb_end || max_safe_tb_end < *tb_end) {
+			// Report the pending matches first so the matches
+			// of each key are reported in order.
+			flush_tmp_match_bmbuf(headtail, max_nmis, min_nmis,
+					      matchpdict_buf);
 			match_headtail_for_loc(headtail,
 				S, *tb_end,
 				max_nmis, min_nmis, bytewise_match_table,
@@ -682,24 +812,19 @@ static void match_ppheadtail0(HeadTail *headtail,
 		}
 		// From now 'tb_end' is guaranteed to be "safe" i.e. not too
 		// close to 'S' boundaries.
-		init_nmis_bmbuf(&(headtail->ppheadtail.nmis_bmbuf),
-				IntAE_get_nelt(headtail->grouped_keys));
-		bitcol = match_ppheadtail_for_loc(headtail,
-				matchpdict_buf->tb_matches.tb_width,
-				S, *tb_end, max_nmis, min_nmis);
-		report_matches_for_loc(&bitcol, headtail, *tb_end, matchpdict_buf);
-/*
 		ncol = tmp_match_bmbuf->ncol;
-		_BitMatrix_set_col(tmp_match_bmbuf, ncol, &bitcol);
-		tmp_match_bmbuf->ncol++;
+		set_colidx_for_loc(headtail,
+				matchpdict_buf->tb_matches.tb_width,
+				S, *tb_end,
+				headtail->ppheadtail.tmp_colidx_buf +
+					ncol * HTwidth);
 		headtail->ppheadtail.tmp_tb_end_buf[ncol] = *tb_end;
+		tmp_match_bmbuf->ncol++;
 		if (tmp_match_bmbuf->ncol == TMPMATCH_BMBUF_MAXNCOL)
-			flush_tmp_match_bmbuf(headtail, matchpdict_buf);
-*/
+			flush_tmp_match_bmbuf(headtail, max_nmis, min_nmis,
+					      matchpdict_buf);
 	}
-/*
-	flush_tmp_match_bmbuf(headtail, matchpdict_buf);
-*/
+	flush_tmp_match_bmbuf(headtail, max_nmis, min_nmis, matchpdict_buf);
 	return;
 }
 
@@ -713,7 +838,7 @@ static void match_ppheadtail(HeadTail *headtail,
 
 	nkey0 = IntAE_get_nelt(headtail->grouped_keys);
 	nkey2 = nkey0 % NBIT_PER_BITWORD;
-	if (nkey2 > MAX_REMAINING_KEYS) {
+	if (nkey2 > headtail->ppheadtail.max_remaining_keys) {
 		match_ppheadtail0(headtail,
 			S, tb_end_buf,
 			max_nmis, min_nmis, bytewise_match_table,
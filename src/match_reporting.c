@@ -6,6 +6,8 @@
 #include "IRanges_interface.h"
 #include "S4Vectors_interface.h"
 
+#include <stdlib.h>  /* for realloc() and free() */
+
 
 int _get_match_storing_code(const char *ms_mode)
 {
@@ -35,10 +37,15 @@ int _get_match_storing_code(const char *ms_mode)
  * MatchBuf manipulation.
  */
 
+/*
+ * The 'PSlink_ids' buffer is big enough to hold all the PSpair ids so
+ * reporting matches in a buffer with no 'match_starts' and 'match_widths'
+ * never allocates memory.
+ */
 MatchBuf _new_MatchBuf(int ms_code, int nPSpair)
 {
 	int count_only;
-	static MatchBuf match_buf;
+	MatchBuf match_buf;
 
 	if (ms_code != MATCHES_AS_NULL
 	 && ms_code != MATCHES_AS_WHICH
@@ -51,7 +58,7 @@ MatchBuf _new_MatchBuf(int ms_code, int nPSpair)
 	count_only = ms_code == MATCHES_AS_WHICH ||
 		     ms_code == MATCHES_AS_COUNTS;
 	match_buf.ms_code = ms_code;
-	match_buf.PSlink_ids = new_IntAE(0, 0, 0);
+	match_buf.PSlink_ids = new_IntAE(nPSpair, 0, 0);
 	match_buf.match_counts = new_IntAE(nPSpair, nPSpair, 0);
 	if (count_only) {
 		/* No match_starts and match_widths buffers in that case */
@@ -256,82 +263,222 @@ SEXP _MatchBuf_as_SEXP(const MatchBuf *match_buf, SEXP env)
 
 
 /****************************************************************************
- * Internal match buffer instance with a simple API.
+ * PlainMatchBuf manipulation.
+ *
+ * Nothing here uses the R API so these functions can be called from a
+ * worker thread.
  */
 
-static MatchBuf internal_match_buf;
-int active_PSpair_id;
-static int match_shift;
+PlainMatchBuf _new_PlainMatchBuf(int ms_code, int *match_counts)
+{
+	PlainMatchBuf plain_buf;
+
+	plain_buf.ms_code = ms_code;
+	plain_buf.match_counts = match_counts;
+	plain_buf.match_ends = NULL;
+	plain_buf.nend = plain_buf.buflength = 0;
+	plain_buf.failed = 0;
+	return plain_buf;
+}
 
-void _init_match_reporting(const char *ms_mode, int nPSpair)
+void _PlainMatchBuf_report_match(PlainMatchBuf *plain_buf,
+		int PSpair_id, int start, int width)
 {
-	int ms_code;
+	int new_buflength, *new_ends;
 
-	ms_code = _get_match_storing_code(ms_mode);
-	internal_match_buf = _new_MatchBuf(ms_code, nPSpair);
-	active_PSpair_id = 0;
-	match_shift = 0;
+	plain_buf->match_counts[PSpair_id]++;
+	if (plain_buf->ms_code != MATCHES_AS_ENDS || plain_buf->failed)
+		return;
+	if (plain_buf->nend == plain_buf->buflength) {
+		new_buflength = plain_buf->buflength == 0 ?
+				1024 : 2 * plain_buf->buflength;
+		new_ends = (int *) realloc(plain_buf->match_ends,
+					   new_buflength * sizeof(int));
+		if (new_ends == NULL) {
+			plain_buf->failed = 1;
+			return;
+		}
+		plain_buf->match_ends = new_ends;
+		plain_buf->buflength = new_buflength;
+	}
+	plain_buf->match_ends[plain_buf->nend++] = start + width - 1;
 	return;
 }
 
-void _set_active_PSpair(int PSpair_id)
+void _free_PlainMatchBuf(PlainMatchBuf *plain_buf)
 {
-	active_PSpair_id = PSpair_id;
+	if (plain_buf->match_ends != NULL)
+		free(plain_buf->match_ends);
+	plain_buf->match_ends = NULL;
+	plain_buf->nend = plain_buf->buflength = 0;
 	return;
 }
 
-void _set_match_shift(int shift)
+
+/****************************************************************************
+ * MatchReporter manipulation.
+ */
+
+/*
+ * The MatchBuf of the returned MatchReporter is made of IntAE buffers that
+ * are allocated and grown with the R API so this MatchReporter must be
+ * created and used in the main thread only. Worker threads must use a
+ * MatchReporter created with _new_plain_MatchReporter().
+ */
+MatchReporter _new_MatchReporter(const char *ms_mode, int nPSpair)
 {
-	match_shift = shift;
+	MatchReporter reporter;
+
+	reporter.match_buf = _new_MatchBuf(_get_match_storing_code(ms_mode),
+					   nPSpair);
+	reporter.PSpair_id = 0;
+	reporter.match_shift = 0;
+	reporter.plain_buf = NULL;
+	return reporter;
 }
 
-void _report_match(int start, int width)
+/*
+ * A MatchReporter that reports its matches to 'plain_buf' and can be used
+ * from a worker thread (see the PlainMatchBuf struct in
+ * Biostrings_defines.h).
+ */
+MatchReporter _new_plain_MatchReporter(PlainMatchBuf *plain_buf)
+{
+	MatchReporter reporter;
+
+	reporter.match_buf.ms_code = plain_buf->ms_code;
+	reporter.match_buf.PSlink_ids = NULL;
+	reporter.match_buf.match_counts = NULL;
+	reporter.match_buf.match_starts = NULL;
+	reporter.match_buf.match_widths = NULL;
+	reporter.PSpair_id = 0;
+	reporter.match_shift = 0;
+	reporter.plain_buf = plain_buf;
+	return reporter;
+}
+
+void _MatchReporter_set_PSpair(MatchReporter *reporter, int PSpair_id)
+{
+	reporter->PSpair_id = PSpair_id;
+	return;
+}
+
+void _MatchReporter_set_shift(MatchReporter *reporter, int shift)
+{
+	reporter->match_shift = shift;
+	return;
+}
+
+void _MatchReporter_report_match(MatchReporter *reporter,
+		int start, int width)
 {
-	start += match_shift;
-	_MatchBuf_report_match(&internal_match_buf,
-			active_PSpair_id, start, width);
+	if (reporter->plain_buf != NULL) {
+		_PlainMatchBuf_report_match(reporter->plain_buf,
+			reporter->PSpair_id,
+			start + reporter->match_shift, width);
+		return;
+	}
+	_MatchBuf_report_match(&(reporter->match_buf), reporter->PSpair_id,
+			       start + reporter->match_shift, width);
 	return;
 }
 
 /* Drops reported matches for all PSpairs! */
-void _drop_reported_matches()
+void _MatchReporter_drop_matches(MatchReporter *reporter)
 {
-	_MatchBuf_flush(&internal_match_buf);
+	_MatchBuf_flush(&(reporter->match_buf));
 	return;
 }
 
-int _get_match_count()
+int _MatchReporter_get_match_count(const MatchReporter *reporter)
 {
-	return internal_match_buf.match_counts->elts[active_PSpair_id];
+	return reporter->match_buf.match_counts->elts[reporter->PSpair_id];
 }
 
-SEXP _reported_matches_asSEXP()
+/* Returns the matches for the active PSpair only */
+SEXP _MatchReporter_matches_asSEXP(const MatchReporter *reporter)
 {
+	const MatchBuf *match_buf;
 	SEXP start, width, ans;
 
-	switch (internal_match_buf.ms_code) {
+	match_buf = &(reporter->match_buf);
+	switch (match_buf->ms_code) {
 	    case MATCHES_AS_NULL:
 		return R_NilValue;
 	    case MATCHES_AS_COUNTS:
 	    case MATCHES_AS_WHICH:
-		return ScalarInteger(_get_match_count());
+		return ScalarInteger(_MatchReporter_get_match_count(reporter));
 	    case MATCHES_AS_RANGES:
 		PROTECT(start = new_INTEGER_from_IntAE(
-		  internal_match_buf.match_starts->elts[active_PSpair_id]));
+		  match_buf->match_starts->elts[reporter->PSpair_id]));
 		PROTECT(width = new_INTEGER_from_IntAE(
-		  internal_match_buf.match_widths->elts[active_PSpair_id]));
+		  match_buf->match_widths->elts[reporter->PSpair_id]));
 		PROTECT(ans = new_IRanges("IRanges", start, width, R_NilValue));
 		UNPROTECT(3);
 		return ans;
 	}
-	error("Biostrings internal error in _reported_matches_asSEXP(): "
-	      "invalid 'internal_match_buf.ms_code' value %d",
-	      internal_match_buf.ms_code);
+	error("Biostrings internal error in _MatchReporter_matches_asSEXP(): "
+	      "invalid 'match_buf->ms_code' value %d", match_buf->ms_code);
 	return R_NilValue;
 }
 
+
+/****************************************************************************
+ * Internal MatchReporter instance with a simple API.
+ * Not re-entrant: this API is kept for the callers that go thru the
+ * callables listed in Biostrings_interface.h. Code that needs to run
+ * matchers concurrently must use its own MatchReporter objects.
+ */
+
+static MatchReporter internal_reporter;
+
+void _init_match_reporting(const char *ms_mode, int nPSpair)
+{
+	internal_reporter = _new_MatchReporter(ms_mode, nPSpair);
+	return;
+}
+
+void _set_active_PSpair(int PSpair_id)
+{
+	_MatchReporter_set_PSpair(&internal_reporter, PSpair_id);
+	return;
+}
+
+void _set_match_shift(int shift)
+{
+	_MatchReporter_set_shift(&internal_reporter, shift);
+}
+
+void _report_match(int start, int width)
+{
+	_MatchReporter_report_match(&internal_reporter, start, width);
+	return;
+}
+
+/* Drops reported matches for all PSpairs! */
+void _drop_reported_matches()
+{
+	_MatchReporter_drop_matches(&internal_reporter);
+	return;
+}
+
+int _get_match_count()
+{
+	return _MatchReporter_get_match_count(&internal_reporter);
+}
+
+SEXP _reported_matches_asSEXP()
+{
+	return _MatchReporter_matches_asSEXP(&internal_reporter);
+}
+
 MatchBuf *_get_internal_match_buf()
 {
-	return &internal_match_buf;
+	return &(internal_reporter.match_buf);
+}
+
+MatchReporter *_get_internal_match_reporter()
+{
+	return &internal_reporter;
 }
 
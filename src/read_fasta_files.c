@@ -8,10 +8,18 @@
 #include "S4Vectors_interface.h"
 
 #include <math.h>  /* for llround */
+#include <stdlib.h>  /* for malloc() */
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 #define IOBUF_SIZE 20002
 static char errmsg_buf[200];
+#ifdef _OPENMP
+/* parse_FASTA_file() is called from worker threads by read_fasta_blocks() */
+#pragma omp threadprivate(errmsg_buf)
+#endif
 
 static int has_prefix(const char *s, const char *prefix)
 {
@@ -26,35 +34,41 @@ static int has_prefix(const char *s, const char *prefix)
 	return 1;
 }
 
-static int translate(Chars_holder *x, const int *lkup, int lkup_len)
+/*
+ * Writes the letters in 'src' to 'dest' after translating them with
+ * 'byte2code' (no translation if 'byte2code' is NULL). Invalid letters
+ * (i.e. letters mapped to NA_INTEGER) are skipped. 'dest' can be 'src->ptr'
+ * (in-place translation) or NULL (the letters are only counted).
+ * Returns the nb of letters written to 'dest' and sets '*ninvalid' to the
+ * nb of invalid letters.
+ */
+static int translate_letters(char *dest, const Chars_holder *src,
+		const ByteTrTable *byte2code, int *ninvalid)
 {
-	char *dest;
-	int nbinvalid, i, j, c;
-
-	/* x->ptr is a (const char *) so we need to cast it to (char *)
-	   before we can write to it */
-	dest = (char *) x->ptr;
-	nbinvalid = j = 0;
-	for (i = 0; i < x->length; i++) {
-		c = translate_byte(x->ptr[i], lkup, lkup_len);
-		if (c == NA_INTEGER) {
-			nbinvalid++;
-			continue;
+	const unsigned char *s;
+	int i, j, code;
+
+	*ninvalid = 0;
+	if (byte2code == NULL) {
+		if (dest != NULL && dest != src->ptr)
+			memcpy(dest, src->ptr, src->length * sizeof(char));
+		return src->length;
+	}
+	s = (const unsigned char *) src->ptr;
+	if (dest == NULL) {
+		for (i = j = 0; i < src->length; i++)
+			j += byte2code->byte2code[s[i]] != NA_INTEGER;
+	} else {
+		/* 'j' never gets ahead of 'i' so 'dest' can be 'src->ptr' */
+		for (i = j = 0; i < src->length; i++) {
+			code = byte2code->byte2code[s[i]];
+			if (code == NA_INTEGER)
+				continue;
+			dest[j++] = (char) code;
 		}
-		dest[j++] = (char) c;
 	}
-	x->length = j;
-	return nbinvalid;
-}
-
-static void append_Chars_holder(Chars_holder *dest, const Chars_holder *src)
-{
-	/* dest->ptr is a (const char *) so we need to cast it to (char *)
-	   in order to write to it */
-	memcpy((char *) dest->ptr + dest->length,
-	       src->ptr, src->length * sizeof(char));
-	dest->length += src->length;
-        return;
+	*ninvalid = src->length - j;
+	return j;
 }
 
 
@@ -71,13 +85,25 @@ typedef struct fasta_loader {
 			      int recno, long long int offset,
 			      const Chars_holder *desc_line);
 	void (*new_empty_seq_hook)(struct fasta_loader *loader);
-	void (*append_seq_hook)(struct fasta_loader *loader,
-				const Chars_holder *seq_data);
-	const int *lkup;
-	int lkup_len;
+	/* Must translate the letters with 'byte2code' and return the nb of
+	   invalid letters */
+	int (*append_seq_hook)(struct fasta_loader *loader,
+			       const Chars_holder *seq_data);
+	ByteTrTable *byte2code;  /* NULL if no lookup table */
 	void *ext;  /* loader extension (optional) */
 } FASTAloader;
 
+static ByteTrTable *new_byte2code(SEXP lkup)
+{
+	ByteTrTable *byte2code;
+
+	if (lkup == R_NilValue)
+		return NULL;
+	byte2code = (ByteTrTable *) R_alloc(1, sizeof(ByteTrTable));
+	_init_ByteTrTable_with_lkup(byte2code, lkup);
+	return byte2code;
+}
+
 /*
  * The FASTA INDEX loader.
  * Used in parse_FASTA_file() to build the FASTA index only.
@@ -135,17 +161,19 @@ static void FASTA_INDEX_new_empty_seq_hook(FASTAloader *loader)
 	return;
 }
 
-static void FASTA_INDEX_append_seq_hook(FASTAloader *loader,
+/* Only counts the valid letters */
+static int FASTA_INDEX_append_seq_hook(FASTAloader *loader,
 		const Chars_holder *seq_data)
 {
 	INDEX_FASTAloaderExt *loader_ext;
 	IntAE *seqlength_buf;
+	int ninvalid;
 
 	loader_ext = loader->ext;
 	seqlength_buf = loader_ext->seqlength_buf;
 	seqlength_buf->elts[IntAE_get_nelt(seqlength_buf) - 1] +=
-		seq_data->length;
-	return;
+		translate_letters(NULL, seq_data, loader->byte2code, &ninvalid);
+	return ninvalid;
 }
 
 static FASTAloader new_FASTAloader_with_INDEX_ext(int load_descs, SEXP lkup,
@@ -156,13 +184,7 @@ static FASTAloader new_FASTAloader_with_INDEX_ext(int load_descs, SEXP lkup,
 	loader.new_desc_hook = load_descs ? &FASTA_INDEX_new_desc_hook : NULL;
 	loader.new_empty_seq_hook = &FASTA_INDEX_new_empty_seq_hook;
 	loader.append_seq_hook = &FASTA_INDEX_append_seq_hook;
-	if (lkup == R_NilValue) {
-		loader.lkup = NULL;
-		loader.lkup_len = 0;
-	} else {
-		loader.lkup = INTEGER(lkup);
-		loader.lkup_len = LENGTH(lkup);
-	}
+	loader.byte2code = new_byte2code(lkup);
 	loader.ext = loader_ext;
 	return loader;
 }
@@ -171,8 +193,12 @@ static FASTAloader new_FASTAloader_with_INDEX_ext(int load_descs, SEXP lkup,
  * The FASTA loader.
  */
 
+/* When 'seq_elts' is not NULL, it must contain the elements of the
+   XStringSet object being loaded. It's needed when the loader is used in a
+   worker thread (get_elt_from_XRawList_holder() cannot be called there). */
 typedef struct fasta_loader_ext {
 	XVectorList_holder seq_holder;
+	const Chars_holder *seq_elts;
 	int nseq;
 	Chars_holder seq_elt_holder;
 } FASTAloaderExt;
@@ -182,6 +208,7 @@ static FASTAloaderExt new_FASTAloaderExt(SEXP sequences)
 	FASTAloaderExt loader_ext;
 
 	loader_ext.seq_holder = hold_XVectorList(sequences);
+	loader_ext.seq_elts = NULL;
 	loader_ext.nseq = -1;
 	return loader_ext;
 }
@@ -194,23 +221,32 @@ static void FASTA_new_empty_seq_hook(FASTAloader *loader)
 	loader_ext = loader->ext;
 	seq_elt_holder = &(loader_ext->seq_elt_holder);
 	loader_ext->nseq++;
-	*seq_elt_holder = get_elt_from_XRawList_holder(
+	if (loader_ext->seq_elts != NULL)
+		*seq_elt_holder = loader_ext->seq_elts[loader_ext->nseq];
+	else
+		*seq_elt_holder = get_elt_from_XRawList_holder(
 					&(loader_ext->seq_holder),
 					loader_ext->nseq);
 	seq_elt_holder->length = 0;
 	return;
 }
 
-static void FASTA_append_seq_hook(FASTAloader *loader,
+/* Writes the translated letters directly to the XStringSet object */
+static int FASTA_append_seq_hook(FASTAloader *loader,
 		const Chars_holder *seq_data)
 {
 	FASTAloaderExt *loader_ext;
 	Chars_holder *seq_elt_holder;
+	int ninvalid;
 
 	loader_ext = loader->ext;
 	seq_elt_holder = &(loader_ext->seq_elt_holder);
-	append_Chars_holder(seq_elt_holder, seq_data);
-	return;
+	/* seq_elt_holder->ptr is a (const char *) so we need to cast it to
+	   (char *) in order to write to it */
+	seq_elt_holder->length += translate_letters(
+			(char *) seq_elt_holder->ptr + seq_elt_holder->length,
+			seq_data, loader->byte2code, &ninvalid);
+	return ninvalid;
 }
 
 static FASTAloader new_FASTAloader(SEXP lkup, FASTAloaderExt *loader_ext)
@@ -220,27 +256,62 @@ static FASTAloader new_FASTAloader(SEXP lkup, FASTAloaderExt *loader_ext)
 	loader.new_desc_hook = NULL;
 	loader.new_empty_seq_hook = &FASTA_new_empty_seq_hook;
 	loader.append_seq_hook = &FASTA_append_seq_hook;
-	if (lkup == R_NilValue) {
-		loader.lkup = NULL;
-		loader.lkup_len = 0;
-	} else {
-		loader.lkup = INTEGER(lkup);
-		loader.lkup_len = LENGTH(lkup);
-	}
+	loader.byte2code = new_byte2code(lkup);
 	loader.ext = loader_ext;
 	return loader;
 }
 
+/*
+ * The FASTA STREAM loader.
+ * Used in _stream_fasta_files() to pass the sequences to a SeqChunk buffer
+ * instead of loading them in an XStringSet object.
+ */
+
+static void FASTA_STREAM_new_empty_seq_hook(FASTAloader *loader)
+{
+	_SeqChunk_new_empty_seq((SeqChunk *) loader->ext);
+	return;
+}
+
+/* Translates the letters in place before appending them to the chunk */
+static int FASTA_STREAM_append_seq_hook(FASTAloader *loader,
+		const Chars_holder *seq_data)
+{
+	Chars_holder data;
+	int ninvalid;
+
+	data.ptr = seq_data->ptr;
+	data.length = translate_letters((char *) seq_data->ptr, seq_data,
+					loader->byte2code, &ninvalid);
+	_SeqChunk_append_seq((SeqChunk *) loader->ext, &data);
+	return ninvalid;
+}
+
+static FASTAloader new_FASTAloader_with_STREAM_ext(SEXP lkup,
+		SeqChunk *chunk)
+{
+	FASTAloader loader;
+
+	loader.new_desc_hook = NULL;
+	loader.new_empty_seq_hook = &FASTA_STREAM_new_empty_seq_hook;
+	loader.append_seq_hook = &FASTA_STREAM_append_seq_hook;
+	loader.byte2code = new_byte2code(lkup);
+	loader.ext = chunk;
+	return loader;
+}
+
 /* Ignore empty lines and lines starting with 'FASTA_comment_markup' like in
-   the original Pearson FASTA format. */
-static const char *parse_FASTA_file(SEXP filexp,
+   the original Pearson FASTA format.
+   Doesn't use the R API when 'reader' reads from a plain file and the loader
+   hooks don't use it either. */
+static const char *parse_FASTA_file(BlockReader *reader,
 		int nrec, int skip, int seek_first_rec,
 		FASTAloader *loader,
 		int *recno, long long int *offset, long long int *ninvalid)
 {
 	int lineno, EOL_in_buf, EOL_in_prev_buf, ret_code, nbyte_in,
 	    FASTA_desc_markup_length, dont_load, is_comment, is_desc;
-	char buf[IOBUF_SIZE];
+	const char *buf;
 	Chars_holder data;
 	long long int prev_offset;
 
@@ -252,7 +323,8 @@ static const char *parse_FASTA_file(SEXP filexp,
 		if (EOL_in_buf)
 			lineno++;
 		EOL_in_prev_buf = EOL_in_buf;
-		ret_code = filexp_gets(filexp, buf, IOBUF_SIZE, &EOL_in_buf);
+		ret_code = _BlockReader_gets(reader, &data,
+					     &nbyte_in, &EOL_in_buf);
 		if (ret_code == 0)
 			break;
 		if (ret_code == -1) {
@@ -261,12 +333,7 @@ static const char *parse_FASTA_file(SEXP filexp,
 				 "from line %d", lineno);
 			return errmsg_buf;
 		}
-		if (EOL_in_buf) {
-			nbyte_in = strlen(buf);
-			data.length = delete_trailing_LF_or_CRLF(buf, nbyte_in);
-		} else {
-			data.length = nbyte_in = IOBUF_SIZE - 1;
-		}
+		buf = data.ptr;
 		prev_offset = *offset;
 		*offset += nbyte_in;
 		if (seek_first_rec) {
@@ -277,7 +344,6 @@ static const char *parse_FASTA_file(SEXP filexp,
 				continue;
 			}
 		}
-		data.ptr = buf;
 		if (EOL_in_prev_buf) {
 			if (data.length == 0)
 				continue;  // we ignore empty lines
@@ -292,7 +358,6 @@ static const char *parse_FASTA_file(SEXP filexp,
 			if (is_comment)
 				continue;  // we ignore comment lines
 		}
-		buf[data.length] = '\0';
 		if (EOL_in_prev_buf && is_desc) {
 			if (nrec >= 0 && *recno >= skip + nrec) {
 				/* Calls to filexp_seek() are costly on
@@ -300,8 +365,11 @@ static const char *parse_FASTA_file(SEXP filexp,
 				   we advance in the file. This is not a
 				   problem when reading the entire file but
 				   becomes one when reading a compressed file
-				   by chunk. */
-				filexp_seek(filexp, prev_offset, SEEK_SET);
+				   by chunk. Only the "file external pointer"
+				   needs to be repositioned: the callers don't
+				   reuse the other readers. */
+				if (reader->filexp != NULL)
+					_BlockReader_seek(reader, prev_offset);
 				*offset = prev_offset;
 				return NULL;
 			}
@@ -326,13 +394,8 @@ static const char *parse_FASTA_file(SEXP filexp,
 		}
 		if (dont_load || loader->new_empty_seq_hook == NULL)
 			continue;
-		if (loader->append_seq_hook != NULL) {
-			if (loader->lkup != NULL)
-				*ninvalid += translate(&data,
-						       loader->lkup,
-						       loader->lkup_len);
-			loader->append_seq_hook(loader, &data);
-		}
+		if (loader->append_seq_hook != NULL)
+			*ninvalid += loader->append_seq_hook(loader, &data);
 	}
 	if (seek_first_rec) {
 		snprintf(errmsg_buf, sizeof(errmsg_buf),
@@ -343,6 +406,45 @@ static const char *parse_FASTA_file(SEXP filexp,
 }
 
 
+/* Parses 'filexp' with parse_FASTA_file() from 'offset0' (see
+   _parse_with_BlockReader()). */
+typedef struct fasta_parse_args {
+	int nrec, skip, seek_first_rec;
+	FASTAloader *loader;
+	int *recno;
+	long long int *offset, *ninvalid;
+} FASTAparseArgs;
+
+static const char *parse_FASTA_file_with_args(BlockReader *reader,
+		void *parser_data)
+{
+	FASTAparseArgs *args = (FASTAparseArgs *) parser_data;
+
+	return parse_FASTA_file(reader, args->nrec, args->skip,
+				args->seek_first_rec, args->loader,
+				args->recno, args->offset, args->ninvalid);
+}
+
+static const char *parse_FASTA_filexp(SEXP filexp, long long int offset0,
+		int nthreads,
+		int nrec, int skip, int seek_first_rec,
+		FASTAloader *loader,
+		int *recno, long long int *offset, long long int *ninvalid)
+{
+	FASTAparseArgs args;
+
+	args.nrec = nrec;
+	args.skip = skip;
+	args.seek_first_rec = seek_first_rec;
+	args.loader = loader;
+	args.recno = recno;
+	args.offset = offset;
+	args.ninvalid = ninvalid;
+	return _parse_with_BlockReader(filexp, offset0, nthreads,
+				       parse_FASTA_file_with_args, &args);
+}
+
+
 /****************************************************************************
  * read_fasta_files()
  */
@@ -370,9 +472,11 @@ static SEXP get_fasta_seqlengths(SEXP filexp_list,
 		   becomes one when reading a compressed file by chunk. */
 		offset0 = offset = filexp_tell(filexp);
 		ninvalid = 0LL;
-		errmsg = parse_FASTA_file(filexp, nrec, skip, seek_first_rec,
-					  &loader,
-					  &recno, &offset, &ninvalid);
+		/* 'filexp' is seeked back below so we can use a BGZF reader */
+		errmsg = parse_FASTA_filexp(filexp, offset0, 1,
+					    nrec, skip, seek_first_rec,
+					    &loader,
+					    &recno, &offset, &ninvalid);
 		/* Calls to filexp_seek() are costly on compressed files
 		   and the cost increases as we advance in the file.
 		   This is not a problem when reading the entire file but
@@ -413,6 +517,7 @@ SEXP read_fasta_files(SEXP filexp_list,
 	SEXP seqlengths, ans, filexp;
 	FASTAloaderExt loader_ext;
 	FASTAloader loader;
+	BlockReader reader;
 	long long int offset, ninvalid;
 
 	nrec0 = INTEGER(nrec)[0];
@@ -437,7 +542,8 @@ SEXP read_fasta_files(SEXP filexp_list,
 		   This is not a problem when reading the entire file but
 		   becomes one when reading a compressed file by chunk. */
 		offset = filexp_tell(filexp);
-		parse_FASTA_file(filexp, nrec0, skip0, seek_rec0,
+		reader = _new_filexp_BlockReader(filexp);
+		parse_FASTA_file(&reader, nrec0, skip0, seek_rec0,
 				 &loader,
 				 &recno, &offset, &ninvalid);
 	}
@@ -446,6 +552,46 @@ SEXP read_fasta_files(SEXP filexp_list,
 }
 
 
+/****************************************************************************
+ * _stream_fasta_files()
+ *
+ * Streams the sequences of the FASTA files in 'filexp_list' to 'chunk'.
+ * Only the current chunk of sequences is kept in memory.
+ */
+
+void _stream_fasta_files(SEXP filexp_list, SEXP lkup, SeqChunk *chunk)
+{
+	FASTAloader loader;
+	BlockReader reader;
+	int recno, i;
+	SEXP filexp;
+	const char *filename, *errmsg;
+	long long int offset, ninvalid;
+
+	loader = new_FASTAloader_with_STREAM_ext(lkup, chunk);
+	recno = 0;
+	for (i = 0; i < LENGTH(filexp_list); i++) {
+		filexp = VECTOR_ELT(filexp_list, i);
+		filename = CHAR(STRING_ELT(GET_NAMES(filexp_list), i));
+		offset = 0LL;
+		ninvalid = 0LL;
+		reader = _new_filexp_BlockReader(filexp);
+		errmsg = parse_FASTA_file(&reader, -1, 0, 0,
+					  &loader,
+					  &recno, &offset, &ninvalid);
+		if (errmsg != NULL)
+			error("reading FASTA file %s: %s",
+			      filename, errmsg_buf);
+		if (ninvalid != 0LL)
+			warning("reading FASTA file %s: ignored %lld "
+				"invalid one-letter sequence codes",
+				filename, ninvalid);
+	}
+	_SeqChunk_flush(chunk);
+	return;
+}
+
+
 /****************************************************************************
  * read_fasta_blocks()
  */
@@ -508,11 +654,16 @@ static SEXP make_fasta_index_data_frame(const IntAE *recno_buf,
 	return df;
 }
 
-/* --- .Call ENTRY POINT --- */
+/* --- .Call ENTRY POINT ---
+ * BGZF files are decompressed with 'nthreads' threads. The position of the
+ * "file external pointers" in 'filexp_list' is undefined after the call.
+ */
 SEXP fasta_index(SEXP filexp_list,
-		 SEXP nrec, SEXP skip, SEXP seek_first_rec, SEXP lkup)
+		 SEXP nrec, SEXP skip, SEXP seek_first_rec, SEXP lkup,
+		 SEXP nthreads)
 {
-	int nrec0, skip0, seek_rec0, i, recno, old_nrec, new_nrec, k;
+	int nrec0, skip0, seek_rec0, nthreads0, i, recno, old_nrec, new_nrec,
+	    k;
 	INDEX_FASTAloaderExt loader_ext;
 	FASTAloader loader;
 	IntAE *seqlength_buf, *fileno_buf;
@@ -523,6 +674,13 @@ SEXP fasta_index(SEXP filexp_list,
 	nrec0 = INTEGER(nrec)[0];
 	skip0 = INTEGER(skip)[0];
 	seek_rec0 = LOGICAL(seek_first_rec)[0];
+	nthreads0 = INTEGER(nthreads)[0];
+#ifdef _OPENMP
+	if (nthreads0 < 1)
+		nthreads0 = 1;
+#else
+	nthreads0 = 1;
+#endif
 	loader_ext = new_INDEX_FASTAloaderExt();
 	loader = new_FASTAloader_with_INDEX_ext(1, lkup, &loader_ext);
 	seqlength_buf = loader_ext.seqlength_buf;
@@ -531,9 +689,10 @@ SEXP fasta_index(SEXP filexp_list,
 		filexp = VECTOR_ELT(filexp_list, i);
 		offset = filexp_tell(filexp);
 		ninvalid = 0LL;
-		errmsg = parse_FASTA_file(filexp, nrec0, skip0, seek_rec0,
-					  &loader,
-					  &recno, &offset, &ninvalid);
+		errmsg = parse_FASTA_filexp(filexp, offset, nthreads0,
+					    nrec0, skip0, seek_rec0,
+					    &loader,
+					    &recno, &offset, &ninvalid);
 		if (errmsg != NULL)
 			error("reading FASTA file %s: %s",
 			      CHAR(STRING_ELT(GET_NAMES(filexp_list), i)),
@@ -555,6 +714,216 @@ SEXP fasta_index(SEXP filexp_list,
 					   seqlength_buf);
 }
 
+/*
+ * Loading the FASTA blocks in parallel.
+ * Only possible when all the files are plain (i.e. uncompressed) files: each
+ * block is then loaded by a worker thread that reads the file with its own
+ * FILE handle and block buffer (no R API involved) and writes the letters
+ * directly to the XStringSet object (the blocks don't overlap in it).
+ */
+
+typedef struct fasta_block {
+	int fileno;		/* 0-based index in 'filexp_list' */
+	int nrec;
+	long long int offset;
+	int first_seq;		/* 0-based index in the XStringSet object */
+} FASTAblock;
+
+/* Loads a block of 'nrec' records starting at 'offset' (where 'reader' must
+   be positioned). Returns an error message or NULL. Doesn't use the R API
+   when 'reader' reads from a plain file. */
+static const char *load_fasta_block(BlockReader *reader,
+		int nrec, long long int offset,
+		FASTAloader *loader, long long int *ninvalid)
+{
+	int recno;
+	const char *errmsg;
+
+	recno = 0;
+	errmsg = parse_FASTA_file(reader, nrec, 0, 0,
+				  loader,
+				  &recno, &offset, ninvalid);
+	if (errmsg == NULL && recno < nrec) {
+		snprintf(errmsg_buf, sizeof(errmsg_buf),
+			 "unexpected end of file after %d records of the "
+			 "block at offset %lld (the file may have changed "
+			 "since it was indexed)", recno, offset);
+		errmsg = errmsg_buf;
+	}
+	return errmsg;
+}
+
+/* Loads the blocks of 1 file (see _parse_with_BlockReader()). The blocks
+   are given by the 'nrec' and 'offset' vectors (1 elt per block). */
+typedef struct fasta_blocks_args {
+	SEXP nrec, offset;
+	FASTAloader *loader;
+	long long int *ninvalid;
+	const char *filename;
+} FASTAblocksArgs;
+
+static const char *load_fasta_blocks_with_args(BlockReader *reader,
+		void *parser_data)
+{
+	FASTAblocksArgs *args = (FASTAblocksArgs *) parser_data;
+	int j;
+	long long int offset_j;
+	const char *errmsg;
+
+	for (j = 0; j < LENGTH(args->nrec); j++) {
+		offset_j = llround(REAL(args->offset)[j]);
+		if (!_BlockReader_seek(reader, offset_j))
+			error("cannot seek to offset %lld in file %s",
+			      offset_j, args->filename);
+		errmsg = load_fasta_block(reader, INTEGER(args->nrec)[j],
+					  offset_j,
+					  args->loader, args->ninvalid);
+		if (errmsg != NULL)
+			return errmsg;
+	}
+	return NULL;
+}
+
+static FASTAblock *get_fasta_blocks(SEXP nrec_list, SEXP offset_list,
+		int *nblock)
+{
+	FASTAblock *blocks;
+	int i, j, k, first_seq;
+	SEXP nrec, offset;
+
+	*nblock = 0;
+	for (i = 0; i < LENGTH(nrec_list); i++)
+		*nblock += LENGTH(VECTOR_ELT(nrec_list, i));
+	blocks = (FASTAblock *) R_alloc(*nblock, sizeof(FASTAblock));
+	k = first_seq = 0;
+	for (i = 0; i < LENGTH(nrec_list); i++) {
+		nrec = VECTOR_ELT(nrec_list, i);
+		offset = VECTOR_ELT(offset_list, i);
+		for (j = 0; j < LENGTH(nrec); j++, k++) {
+			blocks[k].fileno = i;
+			blocks[k].nrec = INTEGER(nrec)[j];
+			blocks[k].offset = llround(REAL(offset)[j]);
+			blocks[k].first_seq = first_seq;
+			first_seq += blocks[k].nrec;
+		}
+	}
+	return blocks;
+}
+
+/* Returns 1 if the blocks were loaded and 0 if they must be loaded by the
+   serial code (not plain files, I/O error, or not enough blocks).
+   The nb of invalid letters found in each file is added to 'ninvalid'.
+   If a block cannot be parsed, '*err_fileno' is set to the file of the
+   first such block (in block order) and its error message is copied to
+   'errmsg_buf'. */
+static int load_fasta_blocks_in_parallel(SEXP filexp_list,
+		SEXP nrec_list, SEXP offset_list,
+		const FASTAloader *loader0, FASTAloaderExt *loader_ext0,
+		int nseq, int nthreads,
+		long long int *ninvalid, int *err_fileno)
+{
+	const char **filepaths;
+	FASTAblock *blocks;
+	Chars_holder *seq_elts;
+	char **bufs;
+	FILE **files;
+	int *filenos, nblock, i, t, k;
+	char first_errmsg[sizeof(errmsg_buf)];
+
+	blocks = get_fasta_blocks(nrec_list, offset_list, &nblock);
+	if (nblock < 2)
+		return 0;
+	filepaths = _get_plain_filepaths(filexp_list);
+	if (filepaths == NULL)
+		return 0;
+	seq_elts = (Chars_holder *) R_alloc(nseq, sizeof(Chars_holder));
+	for (i = 0; i < nseq; i++)
+		seq_elts[i] = get_elt_from_XRawList_holder(
+					&(loader_ext0->seq_holder), i);
+	bufs = (char **) R_alloc(nthreads, sizeof(char *));
+	files = (FILE **) R_alloc(nthreads, sizeof(FILE *));
+	filenos = (int *) R_alloc(nthreads, sizeof(int));
+	for (t = 0; t < nthreads; t++) {
+		bufs[t] = (char *) malloc(BLOCKREADER_BUF_SIZE + 1);
+		files[t] = NULL;
+		filenos[t] = -1;
+	}
+
+	volatile int interrupted = 0, failed = 0, err_block = nblock;
+	for (t = 0; t < nthreads; t++)
+		if (bufs[t] == NULL)
+			failed = 1;
+	#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1)
+	for (k = 0; k < nblock; k++) {
+		int thread_num;
+		const FASTAblock *block;
+		BlockReader reader;
+		FASTAloaderExt loader_ext;
+		FASTAloader loader;
+		long long int block_ninvalid;
+		const char *errmsg;
+#ifdef _OPENMP
+		thread_num = omp_get_thread_num();
+#else
+		thread_num = 0;
+#endif
+		if (interrupted || failed || k > err_block)
+			continue;
+		if (thread_num == 0 && _interrupt_is_pending()) {
+			interrupted = 1;
+			continue;
+		}
+		block = blocks + k;
+		if (filenos[thread_num] != block->fileno) {
+			if (files[thread_num] != NULL)
+				fclose(files[thread_num]);
+			filenos[thread_num] = block->fileno;
+			files[thread_num] = fopen(filepaths[block->fileno],
+						  "rb");
+			if (files[thread_num] == NULL) {
+				failed = 1;
+				continue;
+			}
+		}
+		reader = _new_file_BlockReader(files[thread_num],
+					       bufs[thread_num]);
+		if (!_BlockReader_seek(&reader, block->offset)) {
+			failed = 1;
+			continue;
+		}
+		loader_ext.seq_elts = seq_elts;
+		loader_ext.nseq = block->first_seq - 1;
+		loader = *loader0;
+		loader.ext = &loader_ext;
+		block_ninvalid = 0LL;
+		errmsg = load_fasta_block(&reader, block->nrec, block->offset,
+					  &loader, &block_ninvalid);
+		#pragma omp critical(load_fasta_blocks_report)
+		{
+			ninvalid[block->fileno] += block_ninvalid;
+			if (errmsg != NULL && k < err_block) {
+				err_block = k;
+				strcpy(first_errmsg, errmsg);
+			}
+		}
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		if (files[t] != NULL)
+			fclose(files[t]);
+		free(bufs[t]);
+	}
+	if (interrupted)
+		error("interrupted by the user");
+	if (failed)
+		return 0;
+	if (err_block < nblock) {
+		*err_fileno = blocks[err_block].fileno;
+		strcpy(errmsg_buf, first_errmsg);
+	}
+	return 1;
+}
+
 /* --- .Call ENTRY POINT ---
  * "FASTA blocks" are groups of consecutive FASTA records.
  * Args:
@@ -580,34 +949,84 @@ SEXP fasta_index(SEXP filexp_list,
  *   elementType: The elementType of the XStringSet to return (its class is
  *                inferred from this).
  *   lkup:        Lookup table for encoding the incoming sequence bytes.
+ *   nthreads:    The nb of threads to use for loading the blocks when all
+ *                the files are plain (i.e. uncompressed) files, or for
+ *                decompressing the BGZF files.
+ *   warn_invalid: TRUE or FALSE. Whether to warn about the invalid letters
+ *                found in each file. FALSE when the caller already got the
+ *                warnings by indexing the files with the same 'lkup'.
+ * Parsing errors (e.g. when a file changed since it was indexed) are raised
+ * whatever the nb of threads.
  */
 SEXP read_fasta_blocks(SEXP seqlengths,
 		SEXP filexp_list, SEXP nrec_list, SEXP offset_list,
-		SEXP elementType, SEXP lkup)
+		SEXP elementType, SEXP lkup, SEXP nthreads, SEXP warn_invalid)
 {
-	SEXP ans, filexp, nrec, offset;
+	SEXP ans, filexp;
 	FASTAloaderExt loader_ext;
 	FASTAloader loader;
-	int i, j, nrec_j, recno;
-	long long int offset_j, ninvalid;
+	FASTAblocksArgs args;
+	int nthreads0, nfile, i, err_fileno;
+	long long int *ninvalid;
+	const char *errmsg;
 
+	nthreads0 = INTEGER(nthreads)[0];
+#ifdef _OPENMP
+	if (nthreads0 < 1)
+		nthreads0 = 1;
+#else
+	nthreads0 = 1;
+#endif
 	PROTECT(ans = _alloc_XStringSet(CHAR(STRING_ELT(elementType, 0)),
 					seqlengths));
 	loader_ext = new_FASTAloaderExt(ans);
 	loader = new_FASTAloader(lkup, &loader_ext);
-	for (i = 0; i < LENGTH(filexp_list); i++) {
+	nfile = LENGTH(filexp_list);
+	ninvalid = (long long int *) R_alloc(nfile, sizeof(long long int));
+	memset(ninvalid, 0, sizeof(long long int) * nfile);
+	err_fileno = -1;
+	if (nthreads0 > 1
+	 && load_fasta_blocks_in_parallel(filexp_list, nrec_list, offset_list,
+					  &loader, &loader_ext,
+					  LENGTH(seqlengths), nthreads0,
+					  ninvalid, &err_fileno))
+	{
+		if (err_fileno != -1) {
+			UNPROTECT(1);
+			error("reading FASTA file %s: %s",
+			      CHAR(STRING_ELT(GET_NAMES(filexp_list),
+					      err_fileno)),
+			      errmsg_buf);
+		}
+		goto report_ninvalid;
+	}
+	memset(ninvalid, 0, sizeof(long long int) * nfile);
+	for (i = 0; i < nfile; i++) {
 		filexp = VECTOR_ELT(filexp_list, i);
-		nrec = VECTOR_ELT(nrec_list, i);
-		offset = VECTOR_ELT(offset_list, i);
-		for (j = 0; j < LENGTH(nrec); j++) {
-			nrec_j = INTEGER(nrec)[j];
-			offset_j = llround(REAL(offset)[j]);
-			filexp_seek(filexp, offset_j, SEEK_SET);
-			recno = 0;
-			ninvalid = 0LL;
-			parse_FASTA_file(filexp, nrec_j, 0, 0,
-					 &loader,
-					 &recno, &offset_j, &ninvalid);
+		args.nrec = VECTOR_ELT(nrec_list, i);
+		args.offset = VECTOR_ELT(offset_list, i);
+		args.loader = &loader;
+		args.ninvalid = ninvalid + i;
+		args.filename = CHAR(STRING_ELT(GET_NAMES(filexp_list), i));
+		/* Seeking a BGZF file only costs the decompression of 1 BGZF
+		   block */
+		errmsg = _parse_with_BlockReader(filexp, 0LL, nthreads0,
+					load_fasta_blocks_with_args, &args);
+		if (errmsg != NULL) {
+			UNPROTECT(1);
+			error("reading FASTA file %s: %s",
+			      args.filename, errmsg_buf);
+		}
+	}
+	report_ninvalid:
+	if (LOGICAL(warn_invalid)[0]) {
+		for (i = 0; i < nfile; i++) {
+			if (ninvalid[i] != 0LL)
+				warning("reading FASTA file %s: ignored %lld "
+					"invalid one-letter sequence codes",
+					CHAR(STRING_ELT(GET_NAMES(filexp_list),
+							i)),
+					ninvalid[i]);
 		}
 	}
 	UNPROTECT(1);
@@ -7,9 +7,18 @@
 #include "XVector_interface.h"
 #include "S4Vectors_interface.h"
 
+#include <stdlib.h>  /* for malloc() */
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 
 #define IOBUF_SIZE 20002
 static char errmsg_buf[200];
+#ifdef _OPENMP
+/* parse_FASTQ_file() is called from worker threads by read_fastq_files() */
+#pragma omp threadprivate(errmsg_buf)
+#endif
 
 static int has_prefix(const char *s, const char *prefix)
 {
@@ -24,7 +33,8 @@ static int has_prefix(const char *s, const char *prefix)
 	return 1;
 }
 
-static int translate(Chars_holder *x, const int *lkup, int lkup_len)
+/* Translates in place. Doesn't use the R API. */
+static int translate(Chars_holder *x, const ByteTrTable *byte2code)
 {
 	char *dest;
 	int nbinvalid, i, j, c;
@@ -34,7 +44,7 @@ static int translate(Chars_holder *x, const int *lkup, int lkup_len)
 	dest = (char *) x->ptr;
 	nbinvalid = j = 0;
 	for (i = 0; i < x->length; i++) {
-		c = translate_byte(x->ptr[i], lkup, lkup_len);
+		c = byte2code->byte2code[(unsigned char) x->ptr[i]];
 		if (c == NA_INTEGER) {
 			nbinvalid++;
 			continue;
@@ -73,30 +83,55 @@ typedef struct fastq_loader {
         void (*new_empty_qual_hook)(struct fastq_loader *loader);
 	const char *(*append_qual_hook)(struct fastq_loader *loader,
 					const Chars_holder *qual_data);
-	const int *lkup;
-	int lkup_len;
+	ByteTrTable *byte2code;  /* NULL if no lookup table */
 	void *ext;  /* loader extension (optional) */
 } FASTQloader;
 
+static ByteTrTable *new_byte2code(SEXP lkup)
+{
+	ByteTrTable *byte2code;
+
+	if (lkup == R_NilValue)
+		return NULL;
+	byte2code = (ByteTrTable *) R_alloc(1, sizeof(ByteTrTable));
+	_init_ByteTrTable_with_lkup(byte2code, lkup);
+	return byte2code;
+}
+
 /*
  * The FASTQ SEQLEN loader.
- * Used in parse_FASTQ_file() to load the read lengths only.
+ * Used in parse_FASTQ_file() to load the read lengths (and optionally the
+ * read ids) only.
  * Does NOT check that the read sequences are valid and completely ignores
  * the quality sequences.
  */
 
 typedef struct seqlen_fastq_loader_ext {
 	IntAE *seqlength_buf;
+	CharAEAE *seqid_buf;
 } SEQLEN_FASTQloaderExt;
 
-static SEQLEN_FASTQloaderExt new_SEQLEN_FASTQloaderExt()
+/* 'seqid_buf' can be NULL (read ids are not loaded) */
+static SEQLEN_FASTQloaderExt new_SEQLEN_FASTQloaderExt(CharAEAE *seqid_buf)
 {
 	SEQLEN_FASTQloaderExt loader_ext;
 
 	loader_ext.seqlength_buf = new_IntAE(0, 0, 0);
+	loader_ext.seqid_buf = seqid_buf;
 	return loader_ext;
 }
 
+static void FASTQ_SEQLEN_new_seqid_hook(FASTQloader *loader,
+		const Chars_holder *seqid)
+{
+	SEQLEN_FASTQloaderExt *loader_ext;
+
+	loader_ext = loader->ext;
+	// This works only because seqid->ptr is nul-terminated!
+	CharAEAE_append_string(loader_ext->seqid_buf, seqid->ptr);
+	return;
+}
+
 static void FASTQ_SEQLEN_new_empty_seq_hook(FASTQloader *loader)
 {
 	SEQLEN_FASTQloaderExt *loader_ext;
@@ -123,24 +158,19 @@ static const char *FASTQ_SEQLEN_append_seq_hook(FASTQloader *loader,
 	return NULL;
 }
 
-static FASTQloader new_FASTQloader_with_SEQLEN_ext(SEXP lkup,
+static FASTQloader new_FASTQloader_with_SEQLEN_ext(
 		SEQLEN_FASTQloaderExt *loader_ext)
 {
 	FASTQloader loader;
 
-	loader.new_seqid_hook = NULL;
+	loader.new_seqid_hook = loader_ext->seqid_buf != NULL ?
+				&FASTQ_SEQLEN_new_seqid_hook : NULL;
 	loader.new_empty_seq_hook = FASTQ_SEQLEN_new_empty_seq_hook;
 	loader.append_seq_hook = FASTQ_SEQLEN_append_seq_hook;
 	loader.new_qualid_hook = NULL;
 	loader.new_empty_qual_hook = NULL;
 	loader.append_qual_hook = NULL;
-	if (lkup == R_NilValue) {
-		loader.lkup = NULL;
-		loader.lkup_len = 0;
-	} else {
-		loader.lkup = INTEGER(lkup);
-		loader.lkup_len = LENGTH(lkup);
-	}
+	loader.byte2code = NULL;
 	loader.ext = loader_ext;
 	return loader;
 }
@@ -155,46 +185,115 @@ static FASTQloader new_FASTQloader_with_SEQLEN_ext(SEXP lkup,
  * BStringSet object where the quality sequences are copied (this object
  * is pre-allocated and its geometry always reflects the read lengths).
  * Unfortunately this is likely to cause problems downstream.
+ * The read ids are loaded by the FASTQ SEQLEN loader during the 1st pass.
+ * When 'seq_elts' (and 'qual_elts') are not NULL, they must contain the
+ * elements of the XStringSet objects being loaded. They're needed when the
+ * loader is used in a worker thread (get_elt_from_XRawList_holder() cannot
+ * be called there).
+ * When 'qual_stats' is not NULL, statistics about the quality sequences of
+ * the current file are collected while they're copied (see QualStats
+ * below).
+ */
+
+/*
+ * Quality statistics of a FASTQ file: the range of the quality bytes and
+ * the sum of the quality bytes at each position of the reads. They're
+ * collected in the loop that copies the quality bytes so the quality
+ * sequences are scanned only once. The loop is simple enough to be
+ * vectorized by the compiler (e.g. by gcc with -O3).
  */
+typedef struct qual_stats {
+	int min_qual, max_qual;     /* 255 and 0 if no quality byte was seen */
+	long long int *qual_sums;   /* 1 elt per position (up to the max read
+				       length) */
+} QualStats;
+
+static QualStats *new_QualStats(int nfile, int max_width)
+{
+	QualStats *qual_stats;
+	int i;
+
+	qual_stats = (QualStats *) R_alloc(nfile, sizeof(QualStats));
+	for (i = 0; i < nfile; i++)
+		qual_stats[i].qual_sums = (long long int *)
+			R_alloc(max_width, sizeof(long long int));
+	return qual_stats;
+}
+
+static void reset_QualStats(QualStats *qual_stats, int nfile, int max_width)
+{
+	int i;
+
+	for (i = 0; i < nfile; i++) {
+		qual_stats[i].min_qual = 255;
+		qual_stats[i].max_qual = 0;
+		memset(qual_stats[i].qual_sums, 0,
+		       sizeof(long long int) * max_width);
+	}
+	return;
+}
+
+/* Same as append_Chars_holder() but also collects the quality statistics.
+   Doesn't use the R API. */
+static void append_qual_data(Chars_holder *dest, const Chars_holder *src,
+		QualStats *qual_stats)
+{
+	const unsigned char *in;
+	unsigned char *out, c, qmin, qmax;
+	long long int *sums;
+	int n, j;
+
+	in = (const unsigned char *) src->ptr;
+	n = src->length;
+	/* dest->ptr is a (const char *) so we need to cast it to
+	   (unsigned char *) in order to write to it */
+	out = (unsigned char *) dest->ptr + dest->length;
+	sums = qual_stats->qual_sums + dest->length;
+	qmin = 255;
+	qmax = 0;
+	for (j = 0; j < n; j++) {
+		c = in[j];
+		out[j] = c;
+		sums[j] += c;
+		qmin = c < qmin ? c : qmin;
+		qmax = c > qmax ? c : qmax;
+	}
+	if (qmin < qual_stats->min_qual)
+		qual_stats->min_qual = qmin;
+	if (qmax > qual_stats->max_qual)
+		qual_stats->max_qual = qmax;
+	dest->length += n;
+	return;
+}
 
 typedef struct fastq_loader_ext {
-	CharAEAE *seqid_buf;
 	XVectorList_holder seq_holder;
+	const Chars_holder *seq_elts;
 	int nseq;
 	Chars_holder seq_elt_holder;
 	XVectorList_holder qual_holder;
+	const Chars_holder *qual_elts;
 	int nqual;
 	Chars_holder qual_elt_holder;
+	QualStats *qual_stats;
 } FASTQloaderExt;
 
 static FASTQloaderExt new_FASTQloaderExt(SEXP sequences, SEXP qualities)
 {
 	FASTQloaderExt loader_ext;
 
-	loader_ext.seqid_buf =
-		new_CharAEAE(_get_XStringSet_length(sequences), 0);
 	loader_ext.seq_holder = hold_XVectorList(sequences);
+	loader_ext.seq_elts = NULL;
 	loader_ext.nseq = -1;
 	if (qualities != R_NilValue) {
 		loader_ext.qual_holder = hold_XVectorList(qualities);
+		loader_ext.qual_elts = NULL;
 		loader_ext.nqual = -1;
 	}
+	loader_ext.qual_stats = NULL;
 	return loader_ext;
 }
 
-static void FASTQ_new_seqid_hook(FASTQloader *loader,
-				 const Chars_holder *seqid)
-{
-	FASTQloaderExt *loader_ext;
-	CharAEAE *seqid_buf;
-
-	loader_ext = loader->ext;
-	seqid_buf = loader_ext->seqid_buf;
-	// This works only because seqid->ptr is nul-terminated!
-	CharAEAE_append_string(seqid_buf, seqid->ptr);
-	return;
-}
-
 static void FASTQ_new_empty_seq_hook(FASTQloader *loader)
 {
 	FASTQloaderExt *loader_ext;
@@ -203,7 +302,10 @@ static void FASTQ_new_empty_seq_hook(FASTQloader *loader)
 	loader_ext = loader->ext;
 	seq_elt_holder = &(loader_ext->seq_elt_holder);
 	loader_ext->nseq++;
-	*seq_elt_holder = get_elt_from_XRawList_holder(
+	if (loader_ext->seq_elts != NULL)
+		*seq_elt_holder = loader_ext->seq_elts[loader_ext->nseq];
+	else
+		*seq_elt_holder = get_elt_from_XRawList_holder(
 					&(loader_ext->seq_holder),
 					loader_ext->nseq);
 	seq_elt_holder->length = 0;
@@ -221,10 +323,8 @@ static const char *FASTQ_append_seq_hook(FASTQloader *loader,
 
 	loader_ext = loader->ext;
 	seq_elt_holder = &(loader_ext->seq_elt_holder);
-	if (loader->lkup != NULL) {
-		ninvalid = translate(seq_data,
-				     loader->lkup,
-				     loader->lkup_len);
+	if (loader->byte2code != NULL) {
+		ninvalid = translate(seq_data, loader->byte2code);
 		if (ninvalid != 0)
 			return "read sequence contains invalid letters";
 	}
@@ -240,7 +340,10 @@ static void FASTQ_new_empty_qual_hook(FASTQloader *loader)
 	loader_ext = loader->ext;
 	qual_elt_holder = &(loader_ext->qual_elt_holder);
 	loader_ext->nqual++;
-	*qual_elt_holder = get_elt_from_XRawList_holder(
+	if (loader_ext->qual_elts != NULL)
+		*qual_elt_holder = loader_ext->qual_elts[loader_ext->nqual];
+	else
+		*qual_elt_holder = get_elt_from_XRawList_holder(
 					&(loader_ext->qual_holder),
 					loader_ext->nqual);
 	qual_elt_holder->length = 0;
@@ -264,16 +367,20 @@ static const char *FASTQ_append_qual_hook(FASTQloader *loader,
 	{
 		return "quality sequence is longer than read sequence";
 	}
-	append_Chars_holder(qual_elt_holder, qual_data);
+	if (loader_ext->qual_stats != NULL)
+		append_qual_data(qual_elt_holder, qual_data,
+				 loader_ext->qual_stats);
+	else
+		append_Chars_holder(qual_elt_holder, qual_data);
 	return NULL;
 }
 
-static FASTQloader new_FASTQloader(int load_seqids, int load_quals,
+static FASTQloader new_FASTQloader(int load_quals,
 		SEXP lkup, FASTQloaderExt *loader_ext)
 {
 	FASTQloader loader;
 
-	loader.new_seqid_hook = load_seqids ? &FASTQ_new_seqid_hook : NULL;
+	loader.new_seqid_hook = NULL;
 	loader.new_empty_seq_hook = FASTQ_new_empty_seq_hook;
 	loader.append_seq_hook = FASTQ_append_seq_hook;
 	if (load_quals) {
@@ -287,19 +394,59 @@ static FASTQloader new_FASTQloader(int load_seqids, int load_quals,
 		loader.new_empty_qual_hook = NULL;
 		loader.append_qual_hook = NULL;
 	}
-	if (lkup == R_NilValue) {
-		loader.lkup = NULL;
-		loader.lkup_len = 0;
-	} else {
-		loader.lkup = INTEGER(lkup);
-		loader.lkup_len = LENGTH(lkup);
-	}
+	loader.byte2code = new_byte2code(lkup);
 	loader.ext = loader_ext;
 	return loader;
 }
 
-/* Ignore empty lines. */
-static const char *parse_FASTQ_file(SEXP filexp,
+/*
+ * The FASTQ STREAM loader.
+ * Used in _stream_fastq_files() to pass the read sequences to a SeqChunk
+ * buffer instead of loading them in an XStringSet object. Like the FASTQ
+ * loader, it returns an error if a read sequence is invalid. The quality
+ * sequences are ignored.
+ */
+
+static void FASTQ_STREAM_new_empty_seq_hook(FASTQloader *loader)
+{
+	_SeqChunk_new_empty_seq((SeqChunk *) loader->ext);
+	return;
+}
+
+static const char *FASTQ_STREAM_append_seq_hook(FASTQloader *loader,
+		Chars_holder *seq_data)
+{
+	int ninvalid;
+
+	if (loader->byte2code != NULL) {
+		ninvalid = translate(seq_data, loader->byte2code);
+		if (ninvalid != 0)
+			return "read sequence contains invalid letters";
+	}
+	_SeqChunk_append_seq((SeqChunk *) loader->ext, seq_data);
+	return NULL;
+}
+
+static FASTQloader new_FASTQloader_with_STREAM_ext(SEXP lkup,
+		SeqChunk *chunk)
+{
+	FASTQloader loader;
+
+	loader.new_seqid_hook = NULL;
+	loader.new_empty_seq_hook = FASTQ_STREAM_new_empty_seq_hook;
+	loader.append_seq_hook = FASTQ_STREAM_append_seq_hook;
+	loader.new_qualid_hook = NULL;
+	loader.new_empty_qual_hook = NULL;
+	loader.append_qual_hook = NULL;
+	loader.byte2code = new_byte2code(lkup);
+	loader.ext = chunk;
+	return loader;
+}
+
+/* Ignore empty lines.
+   Doesn't use the R API when 'reader' reads from a plain file and the loader
+   hooks don't use it either. */
+static const char *parse_FASTQ_file(BlockReader *reader,
 		int nrec, int skip, int seek_first_rec,
 		FASTQloader *loader,
 		int *recno, long long int *offset)
@@ -307,7 +454,7 @@ static const char *parse_FASTQ_file(SEXP filexp,
 	int lineno, EOL_in_buf, EOL_in_prev_buf, ret_code, nbyte_in,
 	    FASTQ_line1_markup_length, FASTQ_line3_markup_length,
 	    lineinrecno, dont_load;
-	char buf[IOBUF_SIZE];
+	const char *buf;
 	Chars_holder data;
 	long long int prev_offset;
 	const char *errmsg;
@@ -321,7 +468,8 @@ static const char *parse_FASTQ_file(SEXP filexp,
 		if (EOL_in_buf)
 			lineno++;
 		EOL_in_prev_buf = EOL_in_buf;
-		ret_code = filexp_gets(filexp, buf, IOBUF_SIZE, &EOL_in_buf);
+		ret_code = _BlockReader_gets(reader, &data,
+					     &nbyte_in, &EOL_in_buf);
 		if (ret_code == 0)
 			break;
 		if (ret_code == -1) {
@@ -330,12 +478,7 @@ static const char *parse_FASTQ_file(SEXP filexp,
 				 "from line %d", lineno);
 			return errmsg_buf;
 		}
-		if (EOL_in_buf) {
-			nbyte_in = strlen(buf);
-			data.length = delete_trailing_LF_or_CRLF(buf, nbyte_in);
-		} else {
-			data.length = nbyte_in = IOBUF_SIZE - 1;
-		}
+		buf = data.ptr;
 		prev_offset = *offset;
 		*offset += nbyte_in;
 		if (seek_first_rec) {
@@ -346,7 +489,6 @@ static const char *parse_FASTQ_file(SEXP filexp,
 				continue;
 			}
 		}
-		data.ptr = buf;
 		if (EOL_in_prev_buf) {
 			if (data.length == 0)
 				continue;  // we ignore empty lines
@@ -360,7 +502,6 @@ static const char *parse_FASTQ_file(SEXP filexp,
 				 "line is too long", lineno);
 			return errmsg_buf;
 		}
-		buf[data.length] = '\0';
 		errmsg = NULL;
 		switch (lineinrecno) {
 		    case 1:
@@ -370,8 +511,11 @@ static const char *parse_FASTQ_file(SEXP filexp,
 				   we advance in the file. This is not a
 				   problem when reading the entire file but
 				   becomes one when reading a compressed file
-				   by chunk. */
-				filexp_seek(filexp, prev_offset, SEEK_SET);
+				   by chunk. Only the "file external pointer"
+				   needs to be repositioned: the callers don't
+				   reuse the other readers. */
+				if (reader->filexp != NULL)
+					_BlockReader_seek(reader, prev_offset);
 				*offset = prev_offset;
 				return NULL;
 			}
@@ -440,19 +584,48 @@ static const char *parse_FASTQ_file(SEXP filexp,
  * read_fastq_files()
  */
 
+/* Parses a file with parse_FASTQ_file() (see _parse_with_BlockReader()). */
+typedef struct fastq_parse_args {
+	int nrec, skip, seek_first_rec;
+	FASTQloader *loader;
+	int *recno;
+	long long int *offset;
+} FASTQparseArgs;
+
+static const char *parse_FASTQ_file_with_args(BlockReader *reader,
+		void *parser_data)
+{
+	FASTQparseArgs *args = (FASTQparseArgs *) parser_data;
+
+	return parse_FASTQ_file(reader, args->nrec, args->skip,
+				args->seek_first_rec, args->loader,
+				args->recno, args->offset);
+}
+
+/* 'seqid_buf' and 'file_nrec' can be NULL. When not NULL, 'seqid_buf' is
+   used to load the read ids, and 'file_nrec' to store the nb of records
+   loaded from each file. */
 static SEXP get_fastq_seqlengths(SEXP filexp_list,
-		int nrec, int skip, int seek_first_rec)
+		int nrec, int skip, int seek_first_rec,
+		CharAEAE *seqid_buf, int *file_nrec, int nthreads)
 {
 	SEQLEN_FASTQloaderExt loader_ext;
 	FASTQloader loader;
-	int recno, i;
+	FASTQparseArgs args;
+	int recno, i, nseq;
 	SEXP filexp;
 	long long int offset0, offset;
 	const char *errmsg;
 
-	loader_ext = new_SEQLEN_FASTQloaderExt();
-	loader = new_FASTQloader_with_SEQLEN_ext(R_NilValue, &loader_ext);
-	recno = 0;
+	loader_ext = new_SEQLEN_FASTQloaderExt(seqid_buf);
+	loader = new_FASTQloader_with_SEQLEN_ext(&loader_ext);
+	recno = nseq = 0;
+	args.nrec = nrec;
+	args.skip = skip;
+	args.seek_first_rec = seek_first_rec;
+	args.loader = &loader;
+	args.recno = &recno;
+	args.offset = &offset;
 	for (i = 0; i < LENGTH(filexp_list); i++) {
 		filexp = VECTOR_ELT(filexp_list, i);
 		/* Calls to filexp_tell() are costly on compressed files
@@ -460,9 +633,9 @@ static SEXP get_fastq_seqlengths(SEXP filexp_list,
 		   This is not a problem when reading the entire file but
 		   becomes one when reading a compressed file by chunk. */
 		offset0 = offset = filexp_tell(filexp);
-		errmsg = parse_FASTQ_file(filexp, nrec, skip, seek_first_rec,
-					  &loader,
-					  &recno, &offset);
+		/* 'filexp' is seeked back below so we can use a BGZF reader */
+		errmsg = _parse_with_BlockReader(filexp, offset0, nthreads,
+					parse_FASTQ_file_with_args, &args);
 		/* Calls to filexp_seek() are costly on compressed files
 		   and the cost increases as we advance in the file.
 		   This is not a problem when reading the entire file but
@@ -472,6 +645,10 @@ static SEXP get_fastq_seqlengths(SEXP filexp_list,
 			error("reading FASTQ file %s: %s",
 			      CHAR(STRING_ELT(GET_NAMES(filexp_list), i)),
 			      errmsg_buf);
+		if (file_nrec != NULL)
+			file_nrec[i] = IntAE_get_nelt(loader_ext.seqlength_buf)
+				       - nseq;
+		nseq = IntAE_get_nelt(loader_ext.seqlength_buf);
 	}
 	return new_INTEGER_from_IntAE(loader_ext.seqlength_buf);
 }
@@ -491,28 +668,204 @@ SEXP fastq_seqlengths(SEXP filexp_list,
 	nrec0 = INTEGER(nrec)[0];
 	skip0 = INTEGER(skip)[0];
 	seek_rec0 = LOGICAL(seek_first_rec)[0];
-	return get_fastq_seqlengths(filexp_list, nrec0, skip0, seek_rec0);
+	return get_fastq_seqlengths(filexp_list, nrec0, skip0, seek_rec0,
+				    NULL, NULL, 1);
+}
+
+static Chars_holder *get_elts(const XVectorList_holder *x_holder, int n)
+{
+	Chars_holder *elts;
+	int i;
+
+	elts = (Chars_holder *) R_alloc(n, sizeof(Chars_holder));
+	for (i = 0; i < n; i++)
+		elts[i] = get_elt_from_XRawList_holder(x_holder, i);
+	return elts;
+}
+
+/*
+ * 2nd pass in parallel: 1 file per task. Only possible when all the files
+ * are plain (i.e. uncompressed) files and are read entirely. Each file is
+ * read by a worker thread with its own FILE handle and block buffer (no R
+ * API involved) and the letters are written directly to the XStringSet
+ * objects (the files don't overlap in them).
+ * Returns 1 if the files were loaded and 0 if they must be loaded by the
+ * serial code (not plain files, I/O or parse error). In case of a parse
+ * error, the serial code raises the same error as when 'nthreads' is 1.
+ */
+static int load_fastq_files_in_parallel(SEXP filexp_list,
+		int seek_first_rec, const int *file_nrec,
+		const FASTQloader *loader0, FASTQloaderExt *loader_ext0,
+		int nseq, int load_quals, int nthreads)
+{
+	const char **filepaths;
+	const Chars_holder *seq_elts, *qual_elts;
+	long long int *offsets;
+	int *first_seq, nfile, i, t;
+	char **bufs;
+
+	nfile = LENGTH(filexp_list);
+	if (nfile < 2)
+		return 0;
+	filepaths = _get_plain_filepaths(filexp_list);
+	if (filepaths == NULL)
+		return 0;
+	seq_elts = get_elts(&(loader_ext0->seq_holder), nseq);
+	qual_elts = load_quals ? get_elts(&(loader_ext0->qual_holder), nseq)
+			       : NULL;
+	offsets = (long long int *) R_alloc(nfile, sizeof(long long int));
+	first_seq = (int *) R_alloc(nfile, sizeof(int));
+	for (i = 0; i < nfile; i++) {
+		offsets[i] = filexp_tell(VECTOR_ELT(filexp_list, i));
+		first_seq[i] = i == 0 ? 0 : first_seq[i - 1] + file_nrec[i - 1];
+	}
+	bufs = (char **) R_alloc(nthreads, sizeof(char *));
+	for (t = 0; t < nthreads; t++)
+		bufs[t] = (char *) malloc(BLOCKREADER_BUF_SIZE + 1);
+
+	volatile int interrupted = 0, failed = 0;
+	for (t = 0; t < nthreads; t++)
+		if (bufs[t] == NULL)
+			failed = 1;
+	#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1)
+	for (i = 0; i < nfile; i++) {
+		int thread_num, recno;
+		FILE *file;
+		BlockReader reader;
+		FASTQloaderExt loader_ext;
+		FASTQloader loader;
+		long long int offset;
+#ifdef _OPENMP
+		thread_num = omp_get_thread_num();
+#else
+		thread_num = 0;
+#endif
+		if (interrupted || failed)
+			continue;
+		if (thread_num == 0 && _interrupt_is_pending()) {
+			interrupted = 1;
+			continue;
+		}
+		file = fopen(filepaths[i], "rb");
+		if (file == NULL) {
+			failed = 1;
+			continue;
+		}
+		reader = _new_file_BlockReader(file, bufs[thread_num]);
+		loader_ext.seq_elts = seq_elts;
+		loader_ext.nseq = first_seq[i] - 1;
+		loader_ext.qual_elts = qual_elts;
+		loader_ext.nqual = first_seq[i] - 1;
+		loader_ext.qual_stats = loader_ext0->qual_stats != NULL ?
+					loader_ext0->qual_stats + i : NULL;
+		loader = *loader0;
+		loader.ext = &loader_ext;
+		recno = 0;
+		offset = offsets[i];
+		if (!_BlockReader_seek(&reader, offset)
+		 || parse_FASTQ_file(&reader, -1, 0, seek_first_rec,
+				     &loader,
+				     &recno, &offset) != NULL
+		 || recno != file_nrec[i])
+			failed = 1;
+		else
+			offsets[i] = offset;
+		fclose(file);
+	}
+
+	for (t = 0; t < nthreads; t++)
+		free(bufs[t]);
+	if (interrupted)
+		error("interrupted by the user");
+	if (failed)
+		return 0;
+	/* Leave the files where the serial code would leave them */
+	for (i = 0; i < nfile; i++)
+		filexp_seek(VECTOR_ELT(filexp_list, i), offsets[i], SEEK_SET);
+	return 1;
+}
+
+/* Returns a list with 1 element per file. Each element is a list with the
+   range of the quality bytes (NAs if the file has no quality byte), the mean
+   quality byte at each position of the reads, and the nb of reads of each
+   length (from 0 to the max read length). */
+static SEXP new_qual_stats_list(SEXP filexp_list, const QualStats *qual_stats,
+		SEXP seqlengths, const int *file_nrec, int max_width)
+{
+	SEXP ans, ans_elt, ans_elt_names, range, mean, width_counts;
+	const int *seqlength;
+	int nfile, i, k, p, *counts, nreads;
+
+	nfile = LENGTH(filexp_list);
+	seqlength = INTEGER(seqlengths);
+	PROTECT(ans = NEW_LIST(nfile));
+	PROTECT(ans_elt_names = NEW_CHARACTER(3));
+	SET_STRING_ELT(ans_elt_names, 0, mkChar("range"));
+	SET_STRING_ELT(ans_elt_names, 1, mkChar("mean"));
+	SET_STRING_ELT(ans_elt_names, 2, mkChar("width_counts"));
+	for (i = 0; i < nfile; i++) {
+		PROTECT(range = NEW_INTEGER(2));
+		if (qual_stats[i].min_qual > qual_stats[i].max_qual) {
+			INTEGER(range)[0] = INTEGER(range)[1] = NA_INTEGER;
+		} else {
+			INTEGER(range)[0] = qual_stats[i].min_qual;
+			INTEGER(range)[1] = qual_stats[i].max_qual;
+		}
+		PROTECT(width_counts = NEW_INTEGER(max_width + 1));
+		counts = INTEGER(width_counts);
+		memset(counts, 0, sizeof(int) * (max_width + 1));
+		for (k = 0; k < file_nrec[i]; k++)
+			counts[seqlength[k]]++;
+		seqlength += file_nrec[i];
+		PROTECT(mean = NEW_NUMERIC(max_width));
+		/* Nb of reads that cover position p (0-based) */
+		nreads = file_nrec[i] - counts[0];
+		for (p = 0; p < max_width; p++) {
+			REAL(mean)[p] = nreads == 0 ? NA_REAL :
+				(double) qual_stats[i].qual_sums[p] / nreads;
+			nreads -= counts[p + 1];
+		}
+		PROTECT(ans_elt = NEW_LIST(3));
+		SET_ELEMENT(ans_elt, 0, range);
+		SET_ELEMENT(ans_elt, 1, mean);
+		SET_ELEMENT(ans_elt, 2, width_counts);
+		SET_NAMES(ans_elt, ans_elt_names);
+		SET_ELEMENT(ans, i, ans_elt);
+		UNPROTECT(4);
+	}
+	SET_NAMES(ans, duplicate(GET_NAMES(filexp_list)));
+	UNPROTECT(2);
+	return ans;
 }
 
 /* --- .Call ENTRY POINT ---
  * Return an XStringSet object if 'with_qualities' is FALSE, or a list of 2
  * parallel XStringSet objects of the same shape if 'with_qualities' is TRUE.
+ * If 'with_qual_stats' is also TRUE, the list has a 3rd element: the quality
+ * statistics of each file (see new_qual_stats_list() above).
  * We use a 2-pass algo so we can pre-alloc the exact amount of memory for the
  * XStringSet object that we load with the string data during the 2nd pass.
  * Because a XStringSet object cannot be grown in-place, a 1-pass algo would
  * need to load the string data in a growing object first (e.g. CharAEAE)
  * then turn it into an XStringSet object (this would require a copy of the
  * entire string data).
+ * The 2nd pass loads the files in parallel when 'nthreads' is > 1, all the
+ * files are plain files, and they're read entirely ('nrec' is -1 and 'skip'
+ * is 0).
  */
 SEXP read_fastq_files(SEXP filexp_list, SEXP nrec, SEXP skip,
 		SEXP seek_first_rec,
 		SEXP use_names, SEXP elementType, SEXP lkup,
-		SEXP with_qualities)
+		SEXP with_qualities, SEXP with_qual_stats, SEXP nthreads)
 {
-	int nrec0, skip0, seek_rec0, load_seqids, load_quals, recno, i;
+	int nrec0, skip0, seek_rec0, load_seqids, load_quals, nthreads0,
+	    *file_nrec, recno, i, nfile, max_width;
 	SEXP filexp, seqlengths, sequences, seqids, qualities, ans;
+	QualStats *qual_stats;
+	CharAEAE *seqid_buf;
 	FASTQloaderExt loader_ext;
 	FASTQloader loader;
+	BlockReader reader;
 	long long int offset;
 	const char *errmsg;
 
@@ -521,9 +874,20 @@ SEXP read_fastq_files(SEXP filexp_list, SEXP nrec, SEXP skip,
 	seek_rec0 = LOGICAL(seek_first_rec)[0];
 	load_seqids = LOGICAL(use_names)[0];
 	load_quals = LOGICAL(with_qualities)[0];
-	/* 1st pass */
+	nthreads0 = INTEGER(nthreads)[0];
+#ifdef _OPENMP
+	if (nthreads0 < 1)
+		nthreads0 = 1;
+#else
+	nthreads0 = 1;
+#endif
+	/* 1st pass (also loads the read ids) */
+	seqid_buf = load_seqids ? new_CharAEAE(0, 0) : NULL;
+	file_nrec = (int *) R_alloc(LENGTH(filexp_list), sizeof(int));
 	PROTECT(seqlengths = get_fastq_seqlengths(filexp_list,
-						  nrec0, skip0, seek_rec0));
+						  nrec0, skip0, seek_rec0,
+						  seqid_buf, file_nrec,
+						  nthreads0));
 	/* Allocation */
 	PROTECT(sequences = _alloc_XStringSet(CHAR(STRING_ELT(elementType, 0)),
 					      seqlengths));
@@ -534,28 +898,55 @@ SEXP read_fastq_files(SEXP filexp_list, SEXP nrec, SEXP skip,
 	}
 	/* 2nd pass */
 	loader_ext = new_FASTQloaderExt(sequences, qualities);
-	loader = new_FASTQloader(load_seqids, load_quals, lkup, &loader_ext);
-	recno = 0;
-	for (i = 0; i < LENGTH(filexp_list); i++) {
-		filexp = VECTOR_ELT(filexp_list, i);
-		/* Calls to filexp_tell() are costly on compressed files
-		   and the cost increases as we advance in the file.
-		   This is not a problem when reading the entire file but
-		   becomes one when reading a compressed file by chunk. */
-		offset = filexp_tell(filexp);
-		errmsg = parse_FASTQ_file(filexp, nrec0, skip0, seek_rec0,
-					  &loader,
-					  &recno, &offset);
-		if (errmsg != NULL) {
-			UNPROTECT(load_quals ? 3 : 2);
-			error("reading FASTQ file %s: %s",
-			      CHAR(STRING_ELT(GET_NAMES(filexp_list), i)),
-			      errmsg_buf);
+	loader = new_FASTQloader(load_quals, lkup, &loader_ext);
+	nfile = LENGTH(filexp_list);
+	qual_stats = NULL;
+	max_width = 0;
+	if (load_quals && LOGICAL(with_qual_stats)[0]) {
+		for (i = 0; i < LENGTH(seqlengths); i++)
+			if (INTEGER(seqlengths)[i] > max_width)
+				max_width = INTEGER(seqlengths)[i];
+		qual_stats = new_QualStats(nfile, max_width);
+		reset_QualStats(qual_stats, nfile, max_width);
+		loader_ext.qual_stats = qual_stats;
+	}
+	if (!(nthreads0 > 1 && nrec0 < 0 && skip0 == 0
+	   && load_fastq_files_in_parallel(filexp_list, seek_rec0, file_nrec,
+					   &loader, &loader_ext,
+					   LENGTH(seqlengths), load_quals,
+					   nthreads0)))
+	{
+		/* The parallel code may have failed after collecting some
+		   statistics */
+		if (qual_stats != NULL)
+			reset_QualStats(qual_stats, nfile, max_width);
+		recno = 0;
+		for (i = 0; i < nfile; i++) {
+			filexp = VECTOR_ELT(filexp_list, i);
+			if (qual_stats != NULL)
+				loader_ext.qual_stats = qual_stats + i;
+			/* Calls to filexp_tell() are costly on compressed
+			   files and the cost increases as we advance in the
+			   file. This is not a problem when reading the entire
+			   file but becomes one when reading a compressed file
+			   by chunk. */
+			offset = filexp_tell(filexp);
+			reader = _new_filexp_BlockReader(filexp);
+			errmsg = parse_FASTQ_file(&reader,
+						  nrec0, skip0, seek_rec0,
+						  &loader,
+						  &recno, &offset);
+			if (errmsg != NULL) {
+				UNPROTECT(load_quals ? 3 : 2);
+				error("reading FASTQ file %s: %s",
+				      CHAR(STRING_ELT(GET_NAMES(filexp_list),
+						      i)),
+				      errmsg_buf);
+			}
 		}
 	}
 	if (load_seqids) {
-		PROTECT(seqids =
-			new_CHARACTER_from_CharAEAE(loader_ext.seqid_buf));
+		PROTECT(seqids = new_CHARACTER_from_CharAEAE(seqid_buf));
 		_set_XStringSet_names(sequences, seqids);
 		UNPROTECT(1);
 	}
@@ -563,14 +954,53 @@ SEXP read_fastq_files(SEXP filexp_list, SEXP nrec, SEXP skip,
 		UNPROTECT(2);
 		return sequences;
 	}
-	PROTECT(ans = NEW_LIST(2));
+	PROTECT(ans = NEW_LIST(qual_stats != NULL ? 3 : 2));
 	SET_ELEMENT(ans, 0, sequences);
 	SET_ELEMENT(ans, 1, qualities);
+	if (qual_stats != NULL)
+		SET_ELEMENT(ans, 2, new_qual_stats_list(filexp_list,
+							qual_stats, seqlengths,
+							file_nrec, max_width));
 	UNPROTECT(4);
 	return ans;
 }
 
 
+/****************************************************************************
+ * _stream_fastq_files()
+ *
+ * Streams the read sequences of the FASTQ files in 'filexp_list' to 'chunk'.
+ * Only the current chunk of sequences is kept in memory.
+ */
+
+void _stream_fastq_files(SEXP filexp_list, SEXP lkup, SeqChunk *chunk)
+{
+	FASTQloader loader;
+	BlockReader reader;
+	int recno, i;
+	SEXP filexp;
+	long long int offset;
+	const char *errmsg;
+
+	loader = new_FASTQloader_with_STREAM_ext(lkup, chunk);
+	recno = 0;
+	for (i = 0; i < LENGTH(filexp_list); i++) {
+		filexp = VECTOR_ELT(filexp_list, i);
+		offset = 0LL;
+		reader = _new_filexp_BlockReader(filexp);
+		errmsg = parse_FASTQ_file(&reader, -1, 0, 0,
+					  &loader,
+					  &recno, &offset);
+		if (errmsg != NULL)
+			error("reading FASTQ file %s: %s",
+			      CHAR(STRING_ELT(GET_NAMES(filexp_list), i)),
+			      errmsg_buf);
+	}
+	_SeqChunk_flush(chunk);
+	return;
+}
+
+
 /****************************************************************************
  * Writing FASTQ files.
  */
@@ -693,3 +1123,207 @@ SEXP write_XStringSet_to_fastq(SEXP x, SEXP filexp_list,
 	return R_NilValue;
 }
 
+
+/*
+ * Writing FASTQ files by blocks.
+ * The records are formatted in a big buffer (one batch of records at a
+ * time) and the buffer is written to a plain file or to a BGZF file with a
+ * single call. The size of each record is known in advance so the records
+ * of a batch are formatted in parallel, each of them at its own offset in
+ * the buffer. The BGZF blocks are also compressed in parallel (see BGZF.c).
+ */
+
+#define FASTQ_BATCH_SIZE_PER_THREAD 4194304  /* 4 Mb */
+#define FASTQ_BATCH_NREC_PER_THREAD 65536
+
+/* Doesn't use the R API. Returns -1 if 'seq' contains a code that is not
+   in the lookup table. */
+static int format_FASTQ_rec(const char *id, int id_len,
+		const Chars_holder *seq, const Chars_holder *qual,
+		const ByteTrTable *byte2code, char *dest)
+{
+	int j, c;
+
+	*(dest++) = FASTQ_line1_markup[0];
+	memcpy(dest, id, id_len);
+	dest += id_len;
+	*(dest++) = '\n';
+	for (j = 0; j < seq->length; j++) {
+		c = byte2code->byte2code[(unsigned char) seq->ptr[j]];
+		if (c == NA_INTEGER)
+			return -1;
+		*(dest++) = (char) c;
+	}
+	*(dest++) = '\n';
+	*(dest++) = FASTQ_line3_markup[0];
+	memcpy(dest, id, id_len);
+	dest += id_len;
+	*(dest++) = '\n';
+	if (qual != NULL) {
+		memcpy(dest, qual->ptr, seq->length);
+	} else {
+		memset(dest, ';', seq->length);
+	}
+	dest += seq->length;
+	*dest = '\n';
+	return 0;
+}
+
+static int write_FASTQ_batch(FILE *file, BGZFwriter *bgzf,
+		const char *buf, long n)
+{
+	if (bgzf != NULL)
+		return _BGZFwriter_write(bgzf, buf, n);
+	return fwrite(buf, sizeof(char), n, file) == (size_t) n ? 0 : -1;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   x:                 An XStringSet object.
+ *   filepath:          The path to the file to write.
+ *   append:            TRUE or FALSE.
+ *   qualities:         NULL or a BStringSet object parallel to 'x'.
+ *   lkup:              Lookup table for decoding the letters of 'x' (or
+ *                      NULL).
+ *   compression_level: NA for a plain file. Otherwise the file is a BGZF
+ *                      file compressed with this zlib level (-1 for the
+ *                      default level).
+ *   nthreads:          The number of threads used for formatting the
+ *                      records and for compressing the BGZF blocks.
+ */
+SEXP write_XStringSet_to_fastq_file(SEXP x, SEXP filepath, SEXP append,
+		SEXP qualities, SEXP lkup, SEXP compression_level,
+		SEXP nthreads)
+{
+	XStringSet_holder X, Q;
+	ByteTrTable byte2code;
+	int x_length, append0, level, nthreads0, max_nrec, nrec, i, k,
+	    seq_len, *id_lens;
+	long batch_size, buf_size, size, rec_size, max_rec_size, *offsets;
+	const char *path, *errmsg, **ids;
+	Chars_holder *seqs, *quals, Q_elt;
+	char *buf;
+	SEXP x_names, q_names;
+	FILE *file;
+	BGZFwriter *bgzf;
+
+	X = _hold_XStringSet(x);
+	x_length = _get_length_from_XStringSet_holder(&X);
+	if (qualities != R_NilValue) {
+		Q = _hold_XStringSet(qualities);
+		if (_get_length_from_XStringSet_holder(&Q) != x_length)
+			error("'x' and 'qualities' must have the same length");
+		q_names = get_XVectorList_names(qualities);
+	} else {
+		q_names = R_NilValue;
+	}
+	x_names = get_XVectorList_names(x);
+	/* Check all the records before we open the file. Nothing must be
+	   allocated with R_alloc() once the file is open (an allocation
+	   error would leave it open) so we also get the size of the biggest
+	   record here. */
+	max_rec_size = 0;
+	for (i = 0; i < x_length; i++) {
+		seq_len = _get_elt_from_XStringSet_holder(&X, i).length;
+		rec_size = 2 * ((long) strlen(get_FASTQ_rec_id(x_names,
+							q_names, i)) + 2) +
+			   2 * ((long) seq_len + 1);
+		if (rec_size > max_rec_size)
+			max_rec_size = rec_size;
+		if (qualities == R_NilValue)
+			continue;
+		Q_elt = _get_elt_from_XStringSet_holder(&Q, i);
+		if (Q_elt.length != seq_len)
+			error("'x' and 'quality' must have the same width");
+	}
+	if (lkup == R_NilValue) {
+		for (k = 0; k < BYTETRTABLE_LENGTH; k++)
+			byte2code.byte2code[k] = k;
+	} else {
+		_init_ByteTrTable_with_lkup(&byte2code, lkup);
+	}
+	path = CHAR(STRING_ELT(filepath, 0));
+	append0 = LOGICAL(append)[0];
+	level = INTEGER(compression_level)[0];
+	nthreads0 = INTEGER(nthreads)[0];
+#ifdef _OPENMP
+	if (nthreads0 < 1)
+		nthreads0 = 1;
+#else
+	nthreads0 = 1;
+#endif
+	batch_size = (long) nthreads0 * FASTQ_BATCH_SIZE_PER_THREAD;
+	max_nrec = nthreads0 * FASTQ_BATCH_NREC_PER_THREAD;
+	ids = (const char **) R_alloc(max_nrec, sizeof(const char *));
+	id_lens = (int *) R_alloc(max_nrec, sizeof(int));
+	offsets = (long *) R_alloc(max_nrec, sizeof(long));
+	seqs = (Chars_holder *) R_alloc(max_nrec, sizeof(Chars_holder));
+	quals = qualities != R_NilValue ?
+		(Chars_holder *) R_alloc(max_nrec, sizeof(Chars_holder)) :
+		NULL;
+	/* A single record can be bigger than the batch */
+	buf_size = max_rec_size > batch_size ? max_rec_size : batch_size;
+	buf = (char *) R_alloc(buf_size, sizeof(char));
+
+	file = NULL;
+	bgzf = NULL;
+	if (level == NA_INTEGER) {
+		file = fopen(path, append0 ? "ab" : "wb");
+	} else {
+		bgzf = _open_BGZFwriter(path, append0, level, nthreads0);
+	}
+	if (file == NULL && bgzf == NULL)
+		error("cannot open file '%s'", path);
+	errmsg = NULL;
+	for (i = 0; i < x_length && errmsg == NULL; i += nrec) {
+		if (_interrupt_is_pending()) {
+			errmsg = "interrupted by the user";
+			break;
+		}
+		/* Collect the records of the batch and compute their offsets
+		   in 'buf' */
+		size = 0;
+		for (nrec = 0; nrec < max_nrec && i + nrec < x_length; nrec++) {
+			seqs[nrec] = _get_elt_from_XStringSet_holder(&X,
+								i + nrec);
+			ids[nrec] = get_FASTQ_rec_id(x_names, q_names,
+						     i + nrec);
+			id_lens[nrec] = strlen(ids[nrec]);
+			rec_size = 2 * ((long) id_lens[nrec] + 2) +
+				   2 * ((long) seqs[nrec].length + 1);
+			if (nrec != 0 && size + rec_size > batch_size)
+				break;
+			if (quals != NULL)
+				quals[nrec] = _get_elt_from_XStringSet_holder(
+							&Q, i + nrec);
+			offsets[nrec] = size;
+			size += rec_size;
+		}
+
+		volatile int failed = 0;
+		#pragma omp parallel for num_threads(nthreads0) \
+			schedule(dynamic, 256) if (nrec > 1)
+		for (k = 0; k < nrec; k++) {
+			if (format_FASTQ_rec(ids[k], id_lens[k], seqs + k,
+					     quals != NULL ? quals + k : NULL,
+					     &byte2code, buf + offsets[k]) == -1)
+				failed = 1;
+		}
+		if (failed) {
+			errmsg = "'x' contains invalid letters";
+			break;
+		}
+		if (write_FASTQ_batch(file, bgzf, buf, size) == -1)
+			errmsg = "write error";
+	}
+	if (bgzf != NULL) {
+		if (_close_BGZFwriter(bgzf) == -1 && errmsg == NULL)
+			errmsg = "write error";
+	} else {
+		if (fclose(file) != 0 && errmsg == NULL)
+			errmsg = "write error";
+	}
+	if (errmsg != NULL)
+		error("writing FASTQ file %s: %s", path, errmsg);
+	return R_NilValue;
+}
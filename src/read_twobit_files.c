@@ -0,0 +1,405 @@
+/****************************************************************************
+ *                        Reading UCSC .2bit files                          *
+ ****************************************************************************/
+#include "Biostrings.h"
+#include "XVector_interface.h"
+#include "S4Vectors_interface.h"
+
+
+/*
+ * The .2bit format
+ * ----------------
+ *   1. Header: signature (0x1A412743), version (0, or 1 for 64-bit record
+ *      offsets), nb of sequences, reserved (4 32-bit ints).
+ *   2. Index: for each sequence, its name (1 byte for the length of the
+ *      name followed by the name) and the offset of its record (32-bit or
+ *      64-bit int).
+ *   3. Records: dnaSize, nBlockCount, nBlockStarts[], nBlockSizes[],
+ *      maskBlockCount, maskBlockStarts[], maskBlockSizes[], reserved
+ *      (32-bit ints), followed by the packed DNA (4 bases per byte, T=0,
+ *      C=1, A=2, G=3, the first base in the 2 most significant bits).
+ * The N blocks and the soft-masked blocks are sorted by start (0-based)
+ * and don't overlap. The ints are in the byte order of the machine where
+ * the file was written: the signature tells us whether they need to be
+ * swapped.
+ * The file is mapped in memory (see _new_file_region()) so only the pages
+ * that contain the index and the requested regions are actually read.
+ */
+#define TWOBIT_SIGNATURE 0x1A412743U
+#define TWOBIT_HEADER_SIZE 16
+
+typedef struct twobit_file {
+	SEXP region;
+	const unsigned char *addr;
+	int64_t length;
+	int swap;
+	int version;
+	unsigned int nseq;
+} TwobitFile;
+
+typedef struct twobit_record {
+	unsigned int dna_size;
+	unsigned int nblock_count;
+	const unsigned char *nblock_starts, *nblock_sizes;
+	unsigned int mask_count;
+	const unsigned char *mask_starts, *mask_sizes;
+	const unsigned char *packed_dna;
+} TwobitRecord;
+
+static unsigned int get_uint32(const unsigned char *p, int swap)
+{
+	uint32_t x;
+
+	memcpy(&x, p, sizeof(uint32_t));
+	if (swap)
+		x = (x >> 24) | ((x >> 8) & 0xFF00U) |
+		    ((x << 8) & 0xFF0000U) | (x << 24);
+	return x;
+}
+
+static uint64_t get_uint64(const unsigned char *p, int swap)
+{
+	uint64_t x, y;
+	int k;
+
+	memcpy(&x, p, sizeof(uint64_t));
+	if (!swap)
+		return x;
+	for (k = 0, y = 0; k < 8; k++, x >>= 8)
+		y = (y << 8) | (x & 0xFF);
+	return y;
+}
+
+/* The memory region returned in 'twobit_file->region' must be protected by
+   the caller */
+static const char *map_twobit_file(TwobitFile *twobit_file, const char *path)
+{
+	char *addr;
+	unsigned int signature;
+
+	twobit_file->region = _new_file_region(path, &addr,
+					       &twobit_file->length);
+	twobit_file->addr = (const unsigned char *) addr;
+	if (twobit_file->length < TWOBIT_HEADER_SIZE)
+		return "file is too short to be a .2bit file";
+	signature = get_uint32(twobit_file->addr, 0);
+	if (signature == TWOBIT_SIGNATURE)
+		twobit_file->swap = 0;
+	else if (get_uint32(twobit_file->addr, 1) == TWOBIT_SIGNATURE)
+		twobit_file->swap = 1;
+	else
+		return "not a .2bit file (invalid signature)";
+	twobit_file->version = get_uint32(twobit_file->addr + 4,
+					  twobit_file->swap);
+	if (twobit_file->version != 0 && twobit_file->version != 1)
+		return "unsupported .2bit version";
+	twobit_file->nseq = get_uint32(twobit_file->addr + 8,
+				       twobit_file->swap);
+	return NULL;
+}
+
+static const char *get_record(const TwobitFile *twobit_file, int64_t offset,
+		TwobitRecord *rec)
+{
+	const unsigned char *p;
+	int swap;
+	int64_t remaining;
+
+	swap = twobit_file->swap;
+	if (offset < TWOBIT_HEADER_SIZE || offset + 8 > twobit_file->length)
+		return "invalid record offset";
+	p = twobit_file->addr + offset;
+	remaining = twobit_file->length - offset;
+	rec->dna_size = get_uint32(p, swap);
+	rec->nblock_count = get_uint32(p + 4, swap);
+	if (8 + 8 * (int64_t) rec->nblock_count + 4 > remaining)
+		return "truncated record";
+	rec->nblock_starts = p + 8;
+	rec->nblock_sizes = rec->nblock_starts + 4 * rec->nblock_count;
+	p = rec->nblock_sizes + 4 * rec->nblock_count;
+	remaining = twobit_file->length - (p - twobit_file->addr);
+	rec->mask_count = get_uint32(p, swap);
+	if (4 + 8 * (int64_t) rec->mask_count + 4 > remaining)
+		return "truncated record";
+	rec->mask_starts = p + 4;
+	rec->mask_sizes = rec->mask_starts + 4 * rec->mask_count;
+	rec->packed_dna = rec->mask_sizes + 4 * rec->mask_count + 4;
+	remaining = twobit_file->length -
+		    (rec->packed_dna - twobit_file->addr);
+	if (((int64_t) rec->dna_size + 3) / 4 > remaining)
+		return "truncated record";
+	return NULL;
+}
+
+
+/****************************************************************************
+ * twobit_index()
+ */
+
+static SEXP make_twobit_data_frame(SEXP name, SEXP length, SEXP offset)
+{
+	static const char *colnames[] = {"name", "length", "offset"};
+	SEXP df, names, tmp;
+	int j;
+
+	PROTECT(df = NEW_LIST(3));
+	PROTECT(names = NEW_CHARACTER(3));
+	for (j = 0; j < 3; j++) {
+		PROTECT(tmp = mkChar(colnames[j]));
+		SET_STRING_ELT(names, j, tmp);
+		UNPROTECT(1);
+	}
+	SET_NAMES(df, names);
+	UNPROTECT(1);
+	SET_ELEMENT(df, 0, name);
+	SET_ELEMENT(df, 1, length);
+	SET_ELEMENT(df, 2, offset);
+	/* list_as_data_frame() performs IN-PLACE coercion */
+	list_as_data_frame(df, LENGTH(name));
+	UNPROTECT(1);
+	return df;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Returns the index of the .2bit file as a data frame with 1 row per
+ * sequence and columns "name", "length" (nb of bases), and "offset"
+ * (offset of the record in the file).
+ */
+SEXP twobit_index(SEXP filepath)
+{
+	const char *path, *errmsg;
+	TwobitFile twobit_file;
+	TwobitRecord rec;
+	const unsigned char *p, *end;
+	int64_t offset;
+	unsigned int i, name_size;
+	SEXP name, length, ans_offset, tmp, ans;
+
+	path = CHAR(STRING_ELT(filepath, 0));
+	errmsg = map_twobit_file(&twobit_file, path);
+	PROTECT(twobit_file.region);
+	if (errmsg != NULL) {
+		_release_file_region(twobit_file.region);
+		UNPROTECT(1);
+		error("reading .2bit file %s: %s", path, errmsg);
+	}
+	PROTECT(name = NEW_CHARACTER(twobit_file.nseq));
+	PROTECT(length = NEW_NUMERIC(twobit_file.nseq));
+	PROTECT(ans_offset = NEW_NUMERIC(twobit_file.nseq));
+	p = twobit_file.addr + TWOBIT_HEADER_SIZE;
+	end = twobit_file.addr + twobit_file.length;
+	for (i = 0; i < twobit_file.nseq && errmsg == NULL; i++) {
+		if (p >= end || end - p - 1 - (name_size = *p) <
+				(twobit_file.version == 0 ? 4 : 8)) {
+			errmsg = "truncated index";
+			break;
+		}
+		PROTECT(tmp = mkCharLen((const char *) p + 1, name_size));
+		SET_STRING_ELT(name, i, tmp);
+		UNPROTECT(1);
+		p += 1 + name_size;
+		if (twobit_file.version == 0) {
+			offset = get_uint32(p, twobit_file.swap);
+			p += 4;
+		} else {
+			offset = (int64_t) get_uint64(p, twobit_file.swap);
+			p += 8;
+		}
+		errmsg = get_record(&twobit_file, offset, &rec);
+		REAL(length)[i] = (double) rec.dna_size;
+		REAL(ans_offset)[i] = (double) offset;
+	}
+	_release_file_region(twobit_file.region);
+	if (errmsg != NULL) {
+		UNPROTECT(4);
+		error("reading .2bit file %s: %s", path, errmsg);
+	}
+	ans = make_twobit_data_frame(name, length, ans_offset);
+	UNPROTECT(4);
+	return ans;
+}
+
+
+/****************************************************************************
+ * read_twobit_regions()
+ */
+
+/* Returns the index of the 1st block that ends after 'start0' (0-based) */
+static unsigned int find_first_block(const unsigned char *starts,
+		const unsigned char *sizes, unsigned int count, int swap,
+		int64_t start0)
+{
+	unsigned int lo, hi, mid;
+
+	lo = 0;
+	hi = count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((int64_t) get_uint32(starts + 4 * mid, swap) +
+		    get_uint32(sizes + 4 * mid, swap) <= start0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* 'dec' expands 1 byte of packed DNA into 4 letters */
+static void decode_packed_dna(const unsigned char *packed_dna,
+		int64_t start0, int width, char (*dec)[4], char *dest)
+{
+	int64_t pos;
+	int j;
+
+	pos = start0;
+	for (j = 0; j < width && (pos & 3) != 0; j++, pos++)
+		dest[j] = dec[packed_dna[pos >> 2]][pos & 3];
+	for ( ; j + 4 <= width; j += 4, pos += 4)
+		memcpy(dest + j, dec[packed_dna[pos >> 2]], 4);
+	for ( ; j < width; j++, pos++)
+		dest[j] = dec[packed_dna[pos >> 2]][pos & 3];
+	return;
+}
+
+/* Sets the letters of 'dest' that are in a N block to 'N'. If 'mask_start'
+   is not NULL, also stores the soft-masked ranges that overlap with the
+   region (1-based and relative to the region) in 'mask_start' and
+   'mask_width'. */
+static void add_blocks(const TwobitRecord *rec, int swap,
+		int64_t start0, int width, char N, char *dest,
+		IntAE *mask_start, IntAE *mask_width)
+{
+	unsigned int k;
+	int64_t from, to, end0;
+
+	end0 = start0 + width;
+	k = find_first_block(rec->nblock_starts, rec->nblock_sizes,
+			     rec->nblock_count, swap, start0);
+	for ( ; k < rec->nblock_count; k++) {
+		from = get_uint32(rec->nblock_starts + 4 * k, swap);
+		if (from >= end0)
+			break;
+		to = from + get_uint32(rec->nblock_sizes + 4 * k, swap);
+		if (from < start0)
+			from = start0;
+		if (to > end0)
+			to = end0;
+		memset(dest + (from - start0), N, to - from);
+	}
+	if (mask_start == NULL)
+		return;
+	k = find_first_block(rec->mask_starts, rec->mask_sizes,
+			     rec->mask_count, swap, start0);
+	for ( ; k < rec->mask_count; k++) {
+		from = get_uint32(rec->mask_starts + 4 * k, swap);
+		if (from >= end0)
+			break;
+		to = from + get_uint32(rec->mask_sizes + 4 * k, swap);
+		if (from < start0)
+			from = start0;
+		if (to > end0)
+			to = end0;
+		IntAE_insert_at(mask_start, IntAE_get_nelt(mask_start),
+				(int) (from - start0) + 1);
+		IntAE_insert_at(mask_width, IntAE_get_nelt(mask_width),
+				(int) (to - from));
+	}
+	return;
+}
+
+static void init_dec_table(char (*dec)[4], SEXP lkup, char *N)
+{
+	static const char *twobit_bases = "TCAG";
+	ByteTrTable byte2code;
+	char codes[4];
+	int b, k;
+
+	_init_ByteTrTable_with_lkup(&byte2code, lkup);
+	for (k = 0; k < 4; k++)
+		codes[k] = (char) byte2code.byte2code[
+					(unsigned char) twobit_bases[k]];
+	*N = (char) byte2code.byte2code['N'];
+	for (b = 0; b < 256; b++)
+		for (k = 0; k < 4; k++)
+			dec[b][k] = codes[(b >> (6 - 2 * k)) & 3];
+	return;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   filepath:   The path to the .2bit file.
+ *   offset:     The offsets of the records that contain the regions (as
+ *               returned by twobit_index()).
+ *   start:      The (1-based) starts of the regions (numeric vector).
+ *   width:      The widths of the regions (integer vector). The regions
+ *               must be within the bounds of their sequence.
+ *   lkup:       Lookup table for encoding the letters.
+ *   with_masks: TRUE or FALSE.
+ * Returns a DNAStringSet object with 1 element per region if 'with_masks'
+ * is FALSE. Otherwise returns a list with the DNAStringSet object, and the
+ * starts and widths of the soft-masked ranges of each region (2 lists of
+ * integer vectors).
+ */
+SEXP read_twobit_regions(SEXP filepath, SEXP offset, SEXP start, SEXP width,
+		SEXP lkup, SEXP with_masks)
+{
+	const char *path, *errmsg;
+	TwobitFile twobit_file;
+	TwobitRecord rec;
+	XVectorList_holder ans_holder;
+	Chars_holder ans_elt_holder;
+	char dec[256][4], N;
+	int nregion, masks, i;
+	int64_t start0;
+	IntAEAE *mask_starts, *mask_widths;
+	SEXP ans, seqs;
+
+	path = CHAR(STRING_ELT(filepath, 0));
+	nregion = LENGTH(width);
+	masks = LOGICAL(with_masks)[0];
+	init_dec_table(dec, lkup, &N);
+	mask_starts = mask_widths = NULL;
+	if (masks) {
+		mask_starts = new_IntAEAE(nregion, nregion);
+		mask_widths = new_IntAEAE(nregion, nregion);
+	}
+	PROTECT(seqs = _alloc_XStringSet("DNAStringSet", width));
+	ans_holder = hold_XVectorList(seqs);
+	errmsg = map_twobit_file(&twobit_file, path);
+	PROTECT(twobit_file.region);
+	for (i = 0; i < nregion && errmsg == NULL; i++) {
+		errmsg = get_record(&twobit_file, (int64_t) REAL(offset)[i],
+				    &rec);
+		if (errmsg != NULL)
+			break;
+		start0 = (int64_t) REAL(start)[i] - 1;
+		if (start0 < 0 || start0 + INTEGER(width)[i] > rec.dna_size) {
+			errmsg = "region is out of the bounds of its sequence";
+			break;
+		}
+		ans_elt_holder = get_elt_from_XRawList_holder(&ans_holder, i);
+		/* ans_elt_holder.ptr is a (const char *) so we need to cast
+		   it to (char *) in order to write to it */
+		decode_packed_dna(rec.packed_dna, start0, INTEGER(width)[i],
+				  dec, (char *) ans_elt_holder.ptr);
+		add_blocks(&rec, twobit_file.swap, start0, INTEGER(width)[i],
+			   N, (char *) ans_elt_holder.ptr,
+			   masks ? mask_starts->elts[i] : NULL,
+			   masks ? mask_widths->elts[i] : NULL);
+	}
+	_release_file_region(twobit_file.region);
+	if (errmsg != NULL) {
+		UNPROTECT(2);
+		error("reading .2bit file %s: %s", path, errmsg);
+	}
+	if (!masks) {
+		UNPROTECT(2);
+		return seqs;
+	}
+	PROTECT(ans = NEW_LIST(3));
+	SET_ELEMENT(ans, 0, seqs);
+	SET_ELEMENT(ans, 1, new_LIST_from_IntAEAE(mask_starts, 0));
+	SET_ELEMENT(ans, 2, new_LIST_from_IntAEAE(mask_widths, 0));
+	UNPROTECT(3);
+	return ans;
+}
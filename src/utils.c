@@ -1,4 +1,5 @@
 #include "Biostrings.h"
+#include <R_ext/Utils.h>        /* R_CheckUserInterrupt */
 
 
 void _init_ByteTrTable_with_lkup(ByteTrTable *byte_tr_table, SEXP lkup)
@@ -174,3 +175,15 @@ int _get_twobit_signature_at(TwobitEncodingBuffer *teb, const Chars_holder *seq,
 	return twobit_sign;
 }
 
+static void check_interrupt_fun(void *data)
+{
+	R_CheckUserInterrupt();
+}
+
+/* Unlike R_CheckUserInterrupt(), doesn't jump out of the current (parallel)
+   region. Must be called from the main thread only. */
+int _interrupt_is_pending()
+{
+	return !R_ToplevelExec(check_interrupt_fun, NULL);
+}
+